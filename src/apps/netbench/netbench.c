@@ -0,0 +1,278 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// measures tcp/udp stack over loopback, the parent process receives and the forked child sends
+// -> socket's waiting is bound to the process which creates it
+#define LOOPBACK_IP 0x7f000001
+#define BENCH_TCP_PORT 9000
+#define BENCH_UDP_RECEIVER_PORT 9001
+#define BENCH_UDP_SENDER_PORT 9002
+
+#define DEFAULT_TCP_BYTES (4 * 1024 * 1024)
+#define DEFAULT_UDP_PACKETS 10000
+#define DEFAULT_CONNECTIONS 100
+#define TCP_CHUNK_SIZE 4096
+#define UDP_PAYLOAD_SIZE 64
+// shorter datagram marks the end of udp stream
+#define UDP_END_SIZE 1
+// datagrams per sendmmsg/recvmmsg call
+#define UDP_BATCH 32
+
+static char buffer[TCP_CHUNK_SIZE];
+static char batch_buffers[UDP_BATCH][UDP_PAYLOAD_SIZE];
+
+static uint64_t now_ms()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void loopback_addr(struct sockaddr_in *addr, uint16_t port)
+{
+	addr->sin_addr = LOOPBACK_IP;
+	addr->sin_port = port;
+}
+
+static void wait_child(int pid)
+{
+	struct infop infop;
+	waitid(P_PID, pid, &infop, WEXITED);
+}
+
+static int tcp_listener()
+{
+	struct sockaddr_in addr;
+	loopback_addr(&addr, BENCH_TCP_PORT);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	listen(fd, 16);
+	return fd;
+}
+
+static int tcp_dial()
+{
+	struct sockaddr_in addr;
+	loopback_addr(&addr, BENCH_TCP_PORT);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// bulk transfer, receiver counts bytes until sender closes the connection
+static void bench_tcp_throughput(uint32_t total)
+{
+	int lfd = tcp_listener();
+
+	int pid = fork();
+	if (pid == 0)
+	{
+		int fd = tcp_dial();
+		for (uint32_t sent = 0; fd >= 0 && sent < total;)
+		{
+			int ret = send(fd, buffer, total - sent < TCP_CHUNK_SIZE ? total - sent : TCP_CHUNK_SIZE);
+			if (ret <= 0)
+				break;
+			sent += ret;
+		}
+		close(fd);
+		exit(0);
+	}
+
+	int fd = accept(lfd, NULL, NULL);
+	uint64_t start = now_ms();
+	uint32_t received = 0;
+	int ret;
+	while ((ret = recv(fd, buffer, TCP_CHUNK_SIZE, 0)) > 0)
+		received += ret;
+	uint64_t elapsed = now_ms() - start;
+
+	close(fd);
+	close(lfd);
+	wait_child(pid);
+
+	if (!elapsed)
+		elapsed = 1;
+	printf("tcp: %u bytes in %u ms, %u KB/s\n", received, (uint32_t)elapsed, (uint32_t)((uint64_t)received * 1000 / 1024 / elapsed));
+}
+
+static int udp_socket(uint16_t local_port, uint16_t remote_port)
+{
+	struct sockaddr_in local_addr, remote_addr;
+	loopback_addr(&local_addr, local_port);
+	loopback_addr(&remote_addr, remote_port);
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	bind(fd, (struct sockaddr *)&local_addr, sizeof(local_addr));
+	connect(fd, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
+	return fd;
+}
+
+static void bench_udp_pps(uint32_t count)
+{
+	int rfd = udp_socket(BENCH_UDP_RECEIVER_PORT, BENCH_UDP_SENDER_PORT);
+
+	int pid = fork();
+	if (pid == 0)
+	{
+		int fd = udp_socket(BENCH_UDP_SENDER_PORT, BENCH_UDP_RECEIVER_PORT);
+		for (uint32_t i = 0; i < count; ++i)
+			send(fd, buffer, UDP_PAYLOAD_SIZE);
+		send(fd, buffer, UDP_END_SIZE);
+		close(fd);
+		exit(0);
+	}
+
+	uint64_t start = 0;
+	uint32_t received = 0;
+	int ret;
+	while ((ret = recv(rfd, buffer, UDP_PAYLOAD_SIZE, 0)) > UDP_END_SIZE)
+	{
+		if (!received++)
+			start = now_ms();
+	}
+	uint64_t elapsed = now_ms() - start;
+
+	close(rfd);
+	wait_child(pid);
+
+	if (!elapsed)
+		elapsed = 1;
+	printf("udp: %u/%u datagrams in %u ms, %u pps\n", received, count, (uint32_t)elapsed, (uint32_t)((uint64_t)received * 1000 / elapsed));
+}
+
+static void setup_batch(struct mmsghdr *msgvec, struct iovec *iovs, uint32_t len)
+{
+	for (int i = 0; i < UDP_BATCH; ++i)
+	{
+		iovs[i].iov_base = batch_buffers[i];
+		iovs[i].iov_len = len;
+		msgvec[i] = (struct mmsghdr){
+			.msg_hdr = {.msg_iov = &iovs[i], .msg_iovlen = 1},
+		};
+	}
+}
+
+// same as udp pps but datagrams are sent and received in batches, one kernel entry per batch
+static void bench_udp_mmsg(uint32_t count)
+{
+	struct mmsghdr msgvec[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	int rfd = udp_socket(BENCH_UDP_RECEIVER_PORT, BENCH_UDP_SENDER_PORT);
+
+	int pid = fork();
+	if (pid == 0)
+	{
+		int fd = udp_socket(BENCH_UDP_SENDER_PORT, BENCH_UDP_RECEIVER_PORT);
+		setup_batch(msgvec, iovs, UDP_PAYLOAD_SIZE);
+		for (uint32_t sent = 0; sent < count;)
+		{
+			int ret = sendmmsg(fd, msgvec, count - sent < UDP_BATCH ? count - sent : UDP_BATCH, 0);
+			if (ret <= 0)
+				break;
+			sent += ret;
+		}
+		send(fd, buffer, UDP_END_SIZE);
+		close(fd);
+		exit(0);
+	}
+
+	setup_batch(msgvec, iovs, UDP_PAYLOAD_SIZE);
+	uint64_t start = 0;
+	uint32_t received = 0;
+	uint32_t calls = 0;
+	bool end = false;
+	while (!end)
+	{
+		int ret = recvmmsg(rfd, msgvec, UDP_BATCH, MSG_WAITFORONE);
+		if (ret <= 0)
+			break;
+		if (!calls++)
+			start = now_ms();
+
+		for (int i = 0; i < ret && !end; ++i)
+		{
+			if (msgvec[i].msg_len <= UDP_END_SIZE)
+				end = true;
+			else
+				received++;
+		}
+	}
+	uint64_t elapsed = now_ms() - start;
+
+	close(rfd);
+	wait_child(pid);
+
+	if (!elapsed)
+		elapsed = 1;
+	printf("udp mmsg: %u/%u datagrams in %u ms (%u calls), %u pps\n", received, count, (uint32_t)elapsed, calls,
+		   (uint32_t)((uint64_t)received * 1000 / elapsed));
+}
+
+// each iteration is a full handshake and teardown (including time-wait of the active closer)
+static void bench_tcp_connect(uint32_t count)
+{
+	int lfd = tcp_listener();
+
+	int pid = fork();
+	if (pid == 0)
+	{
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			int fd = tcp_dial();
+			if (fd < 0)
+				break;
+			close(fd);
+		}
+		exit(0);
+	}
+
+	uint64_t start = now_ms();
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		int fd = accept(lfd, NULL, NULL);
+		if (fd < 0)
+			break;
+		close(fd);
+	}
+	uint64_t elapsed = now_ms() - start;
+
+	close(lfd);
+	wait_child(pid);
+
+	if (!elapsed)
+		elapsed = 1;
+	printf("connect: %u connections in %u ms, %u conn/s\n", count, (uint32_t)elapsed, (uint32_t)((uint64_t)count * 1000 / elapsed));
+}
+
+// netbench [tcp|udp|mmsg|connect|all] [count]
+int main(int argc, char *argv[])
+{
+	const char *test = argc > 1 ? argv[1] : "all";
+	uint32_t count = argc > 2 ? atoi(argv[2]) : 0;
+	bool all = !strcmp(test, "all");
+
+	if (all || !strcmp(test, "tcp"))
+		bench_tcp_throughput(count ? count : DEFAULT_TCP_BYTES);
+	if (all || !strcmp(test, "udp"))
+		bench_udp_pps(count ? count : DEFAULT_UDP_PACKETS);
+	if (all || !strcmp(test, "mmsg"))
+		bench_udp_mmsg(count ? count : DEFAULT_UDP_PACKETS);
+	if (all || !strcmp(test, "connect"))
+		bench_tcp_connect(count ? count : DEFAULT_CONNECTIONS);
+
+	return 0;
+}
@@ -20,23 +20,94 @@ struct window *app_win;
 struct window *container_win;
 int active_ptm;
 
-static struct terminal_line *alloc_terminal_line()
+static struct terminal_line *get_line(struct terminal_tab *tab, unsigned int index)
 {
-	struct terminal_line *line = calloc(1, sizeof(struct terminal_line));
+	return &tab->lines[(tab->first_line + index) % MAX_LINES];
+}
+
+static struct terminal_line *get_last_line(struct terminal_tab *tab)
+{
+	return get_line(tab, tab->line_count - 1);
+}
+
+static unsigned int get_first_row(struct terminal_tab *tab)
+{
+	return get_line(tab, 0)->started_row;
+}
+
+static unsigned int get_end_row(struct terminal_tab *tab)
+{
+	struct terminal_line *last_line = get_last_line(tab);
+	return last_line->started_row + last_line->rowspan;
+}
+
+// font is monospaced -> every row has the same number of characters
+static unsigned int get_columns()
+{
+	return (iterm->width - 2 * HORIZONTAL_PADDING) / get_character_width(0);
+}
+
+static unsigned int get_screen_rows()
+{
+	return (container_win->graphic.height - 2 * VERTICAL_PADDING) / get_character_height(0);
+}
+
+static unsigned int get_cursor_row(struct terminal_tab *tab)
+{
+	return get_last_line(tab)->started_row + tab->cursor_column / get_columns();
+}
+
+static void mark_dirty(struct terminal_tab *tab, unsigned int from_row, unsigned int to_row)
+{
+	if (from_row >= to_row)
+		return;
+
+	if (tab->dirty_from_row == tab->dirty_to_row)
+	{
+		tab->dirty_from_row = from_row;
+		tab->dirty_to_row = to_row;
+	}
+	else
+	{
+		tab->dirty_from_row = min_t(unsigned int, tab->dirty_from_row, from_row);
+		tab->dirty_to_row = max_t(unsigned int, tab->dirty_to_row, to_row);
+	}
+}
+
+// only the last line is changed -> no other line has to be moved
+static void update_rowspan(struct terminal_tab *tab, struct terminal_line *line, bool has_cursor)
+{
+	unsigned int columns = get_columns();
+	unsigned int rowspan = max_t(unsigned int, div_ceil(line->length, columns), 1);
+	if (has_cursor)
+		rowspan = max_t(unsigned int, rowspan, tab->cursor_column / columns + 1);
+
+	mark_dirty(tab, line->started_row + min_t(unsigned int, rowspan, line->rowspan), line->started_row + max_t(unsigned int, rowspan, line->rowspan));
+	line->rowspan = rowspan;
+}
+
+// lines are dropped from the head of ring instead of laying out the whole history again
+static struct terminal_line *push_line(struct terminal_tab *tab)
+{
+	unsigned int started_row = tab->line_count ? get_end_row(tab) : 0;
+	while (tab->line_count && (tab->line_count == MAX_LINES || started_row + 1 - get_first_row(tab) > iterm->max_rows))
+	{
+		tab->first_line = (tab->first_line + 1) % MAX_LINES;
+		tab->line_count--;
+	}
+
+	struct terminal_line *line = get_line(tab, tab->line_count++);
+	memset(line, 0, sizeof(struct terminal_line));
+	line->started_row = started_row;
 	line->rowspan = 1;
+	mark_dirty(tab, started_row, started_row + 1);
 	return line;
 }
 
 static struct terminal_tab *alloc_terminal_tab()
 {
 	struct terminal_tab *tab = calloc(1, sizeof(struct terminal_tab));
-	struct terminal_line *line = alloc_terminal_line();
-	tab->scroll_line = line;
-	tab->cursor_line = line;
-	tab->line_count = tab->row_count = 1;
-	INIT_LIST_HEAD(&tab->lines);
-	list_add_tail(&line->sibling, &tab->lines);
-
+	push_line(tab);
 	return tab;
 }
 
@@ -71,163 +142,113 @@ static void init_terminal_tab_dev(struct terminal_tab *tab)
 	}
 }
 
-static void recalculate_tab(struct terminal_tab *tab)
+// started rows are increasing -> binary search in the ring
+static unsigned int find_line_index(struct terminal_tab *tab, unsigned int row)
 {
-	int lines = 0;
-	int rows = 0;
-	struct terminal_line *iter;
-	list_for_each_entry(iter, &tab->lines, sibling)
+	unsigned int low = 0, high = tab->line_count - 1;
+	while (low < high)
 	{
-		iter->started_row = rows;
-		rows += iter->rowspan;
-		lines++;
+		unsigned int mid = (low + high + 1) / 2;
+		if (get_line(tab, mid)->started_row <= row)
+			low = mid;
+		else
+			high = mid - 1;
 	}
-	tab->line_count = lines;
-	tab->row_count = rows;
+	return low;
 }
 
-static int pixels_from_content(const char *content)
+static unsigned int get_top_row(struct terminal_tab *tab)
 {
-	int pixels = 0;
-	for (char *ch = content; *ch; ch++)
-	{
-		pixels += get_character_width(*ch);
-	}
-	return pixels;
+	unsigned int first_row = get_first_row(tab);
+	unsigned int end_row = get_end_row(tab);
+	unsigned int screen_rows = get_screen_rows();
+	if (end_row - first_row <= screen_rows)
+		return first_row;
+
+	tab->scroll_offset = min_t(unsigned int, tab->scroll_offset, end_row - first_row - screen_rows);
+	return end_row - screen_rows - tab->scroll_offset;
 }
 
-static __inline int count_rows_in_line_range(struct terminal_line *from_line, int from_row, struct terminal_line *to_line, int to_row)
+// row (absolute) of line is drawn at screen_row, line is NULL for rows after the last line
+static void draw_row(struct terminal_tab *tab, struct terminal_line *line, unsigned int row, unsigned int screen_row)
 {
-	return (to_line->started_row + to_row) - (from_line->started_row + from_row);
+	unsigned int columns = get_columns();
+	int py = screen_row * get_character_height(0) + VERTICAL_PADDING;
+	gui_draw_retangle(container_win, 0, py, container_win->graphic.width, get_character_height(0), 0);
+	if (!line)
+		return;
+
+	unsigned int from_column = (row - line->started_row) * columns;
+	if (from_column < line->length)
+		psf_nputs(line->content + from_column, min_t(unsigned int, line->length - from_column, columns),
+				  HORIZONTAL_PADDING, py,
+				  0xffffffff, 0,
+				  container_win->graphic.buf, container_win->graphic.width * 4);
+
+	if (line == get_last_line(tab) && row == get_cursor_row(tab))
+		gui_draw_retangle(container_win, (tab->cursor_column % columns) * get_character_width(0) + HORIZONTAL_PADDING, py, get_character_width(0), get_character_height(0), 0xd0d0d0ff);
 }
 
-static void draw_cursor(struct terminal_line *from_line, int from_row, struct terminal_line *to_line, int to_row)
+// rows which are still on the screen are moved, dirty rows are drawn again
+static void draw_terminal()
 {
 	struct terminal_tab *tab = iterm->active_tab;
-	struct terminal_line *cursor_line = tab->cursor_line;
-	int cursor_row = 0;
-	int cursor_x = 0;
-	int ix = 0;
-	int width = iterm->width - 2 * HORIZONTAL_PADDING;
-	for (int i = 0, length = strlen(cursor_line->content); i < length && i < (int)tab->cursor_column; ++i)
+	unsigned int screen_rows = get_screen_rows();
+	unsigned int top_row = get_top_row(tab);
+	unsigned int row_height = get_character_height(0);
+	uint32_t scanline = container_win->graphic.width * 4;
+	char *text = container_win->graphic.buf + VERTICAL_PADDING * scanline;
+	bool blitted = false;
+
+	if (!tab->drawn || max_t(unsigned int, top_row, tab->drawn_top_row) - min_t(unsigned int, top_row, tab->drawn_top_row) >= screen_rows)
+		mark_dirty(tab, top_row, top_row + screen_rows);
+	else if (top_row > tab->drawn_top_row)
 	{
-		if (ix + get_character_width(cursor_line->content[i]) >= (cursor_row + 1) * width)
-		{
-			cursor_row++;
-			cursor_x = 0;
-		}
-		else
-			cursor_x += get_character_width(cursor_line->content[i]);
-		ix += get_character_width(cursor_line->content[i]);
+		unsigned int delta = top_row - tab->drawn_top_row;
+		memmove(text, text + delta * row_height * scanline, (screen_rows - delta) * row_height * scanline);
+		mark_dirty(tab, tab->drawn_top_row + screen_rows, top_row + screen_rows);
+		blitted = true;
+	}
+	else if (top_row < tab->drawn_top_row)
+	{
+		unsigned int delta = tab->drawn_top_row - top_row;
+		memmove(text + delta * row_height * scanline, text, (screen_rows - delta) * row_height * scanline);
+		mark_dirty(tab, top_row, tab->drawn_top_row);
+		blitted = true;
 	}
 
-	int abs_from_row = from_line->started_row + from_row;
-	int abs_to_row = to_line->started_row + to_row;
-	int abs_row = cursor_line->started_row + cursor_row;
-	int relative_row = abs_row - abs_from_row;
-	int max_rows_in_ui = (container_win->graphic.height - 2 * VERTICAL_PADDING) / get_character_height(0);
-	if (abs_from_row <= abs_row &&
-		(abs_row <= abs_to_row ||
-		 // when cursor in the new row and first column of multiple span rows last line
-		 (abs_row == abs_to_row + 1 && cursor_x == 0 && relative_row <= max_rows_in_ui)))
-		gui_draw_retangle(container_win, cursor_x + HORIZONTAL_PADDING, relative_row * get_character_height(0) + VERTICAL_PADDING, get_character_width(0), get_character_height(0), 0xd0d0d0ff);
-}
-
-static void draw_terminal_line(struct terminal_line *line, int from_row, int to_row, int prow)
-{
-	int width = iterm->width - 2 * HORIZONTAL_PADDING;
-	int py = prow * get_character_height(0);
-	for (int i = 0, ix = 0, length = strlen(line->content); i < length;)
+	unsigned int from_row = max_t(unsigned int, tab->dirty_from_row, top_row);
+	unsigned int to_row = min_t(unsigned int, tab->dirty_to_row, top_row + screen_rows);
+	if (from_row < to_row)
 	{
-		if (ix + get_character_width(line->content[i]) >= from_row * width &&
-			ix + get_character_width(line->content[i]) <= (to_row + 1) * width)
-		{
-			int jx = 0;
-			while (i < length)
-			{
-				char ch = line->content[i];
-				if (jx + get_character_width(ch) > width)
-					break;
-				psf_putchar(ch,
-							jx + HORIZONTAL_PADDING, py + VERTICAL_PADDING,
-							0xffffffff, 0,
-							container_win->graphic.buf, container_win->graphic.width * 4);
-				jx += get_character_width(ch);
-				i++;
-			}
-			ix = div_ceil(ix + width, width) * width;
-			py += get_character_height(0);
-			continue;
-		}
-		else
+		unsigned int index = find_line_index(tab, from_row);
+		for (unsigned int row = from_row; row < to_row; ++row)
 		{
-			ix += get_character_width(line->content[i]);
-			i++;
+			struct terminal_line *line = index < tab->line_count ? get_line(tab, index) : NULL;
+			if (line && row >= line->started_row + line->rowspan)
+				line = ++index < tab->line_count ? get_line(tab, index) : NULL;
+			draw_row(tab, line, row, row - top_row);
 		}
 	}
+
+	if (blitted)
+		gui_render_rect(container_win, 0, VERTICAL_PADDING, container_win->graphic.width, screen_rows * row_height);
+	else if (from_row < to_row)
+		gui_render_rect(container_win, 0, (from_row - top_row) * row_height + VERTICAL_PADDING, container_win->graphic.width, (to_row - from_row) * row_height);
+
+	tab->drawn = true;
+	tab->drawn_top_row = top_row;
+	tab->dirty_from_row = tab->dirty_to_row = 0;
 }
 
-static void draw_terminal()
+static void scroll_terminal(int rows)
 {
 	struct terminal_tab *tab = iterm->active_tab;
-	struct terminal_line *last_line = list_last_entry(&tab->lines, struct terminal_line, sibling);
-	struct terminal_line *from_line, *to_line;
-	int from_row, to_row;
-	int rows = count_rows_in_line_range(tab->scroll_line, 0, last_line, last_line->rowspan - 1);
-	int max_rows_in_ui = (container_win->graphic.height - 2 * VERTICAL_PADDING) / get_character_height(0);
-	if (rows <= max_rows_in_ui)
-	{
-		int count = 0;
-		from_row = 0;
-		struct terminal_line *iter;
-		list_for_each_entry_reverse(iter, &tab->lines, sibling)
-		{
-			from_line = iter;
-			count += from_line->rowspan;
-			if (count >= max_rows_in_ui)
-			{
-				from_row = from_line->rowspan - (count - max_rows_in_ui);
-				break;
-			}
-		}
-		to_line = last_line;
-		to_row = last_line->rowspan - 1;
-	}
+	if (rows < 0 && (unsigned int)-rows > tab->scroll_offset)
+		tab->scroll_offset = 0;
 	else
-	{
-		to_line = from_line = tab->scroll_line;
-		from_row = 0;
-		to_row = to_line->rowspan - 1;
-		int count = 0;
-		struct terminal_line *iter = to_line;
-		list_for_each_entry_from(iter, &tab->lines, sibling)
-		{
-			to_line = iter;
-			count += to_line->rowspan;
-			if (count >= max_rows_in_ui)
-			{
-				to_row = to_line->rowspan - (count - max_rows_in_ui);
-				break;
-			}
-		}
-	}
-
-	struct terminal_line *iter_line = from_line;
-	int irow = 0;
-	list_for_each_entry_from(iter_line, to_line->sibling.next, sibling)
-	{
-		int ifrom = 0;
-		int ito = to_line->rowspan - 1;
-
-		if (iter_line == from_line)
-			ifrom = from_row;
-		if (iter_line == to_line)
-			ito = to_row;
-		draw_terminal_line(iter_line, ifrom, ito, irow);
-		irow += ito - ifrom + 1;
-	}
-
-	draw_cursor(from_line, from_row, to_line, to_row);
+		tab->scroll_offset += rows;
+	draw_terminal();
 }
 
 static void handle_x11_event(struct xevent *evt)
@@ -237,6 +258,13 @@ static void handle_x11_event(struct xevent *evt)
 		struct xkey_event *kevt = (struct xkey_event *)evt->data;
 		if (kevt->action == XKEY_RELEASE)
 		{
+			if (kevt->key == KEY_PAGEUP || kevt->key == KEY_PAGEDOWN)
+			{
+				int rows = get_screen_rows() / 2;
+				scroll_terminal(kevt->key == KEY_PAGEUP ? rows : -rows);
+				return;
+			}
+
 			int nbuf = 0;
 			unsigned char buf[100] = {0};
 			convert_keycode_to_ascii(kevt->key, kevt->state, buf, &nbuf);
@@ -267,9 +295,12 @@ static void handle_master_event(struct pollfd *pfds, unsigned int nfds)
 		return;
 
 	struct terminal_tab *tab = iterm->active_tab;
-	for (int i = 0, length = strlen(input); i < length; ++i)
+	// cursor is drawn again at its old and new position
+	mark_dirty(tab, get_cursor_row(tab), get_cursor_row(tab) + 1);
+	for (int i = 0; i < ret && input[i]; ++i)
 	{
 		char ch = input[i];
+		struct terminal_line *last_line = get_last_line(tab);
 
 		if (ch == '\033')
 		{
@@ -278,31 +309,19 @@ static void handle_master_event(struct pollfd *pfds, unsigned int nfds)
 		else if (ch == '\21')
 		{
 			// if ch is Device Control 1 and previous character is new line -> record timestamp
-			if (i >= 0 && input[i - 1] == '\n')
-				tab->cursor_line->seconds = time(NULL);
+			if (i > 0 && input[i - 1] == '\n')
+				last_line->seconds = time(NULL);
 		}
 		else if (ch == '\177')
 		{
-			struct terminal_line *cursor_line = tab->cursor_line;
-			struct terminal_line *last_line = list_last_entry(&tab->lines, struct terminal_line, sibling);
-
-			if (cursor_line != last_line)
+			if (!tab->cursor_column || tab->cursor_column > last_line->length)
 				continue;
 
-			int length = strlen(cursor_line->content);
-			if (length == 0 || (int)tab->cursor_column > length)
-				continue;
-
-			if (length < (int)tab->cursor_column)
-			{
-				for (int i = tab->cursor_column; i < length - 1; ++i)
-				{
-					cursor_line->content[i] = cursor_line->content[i + 1];
-				}
-				cursor_line->content[length - 1] = 0;
-			}
-			else
-				cursor_line->content[tab->cursor_column--] = 0;
+			tab->cursor_column--;
+			memmove(last_line->content + tab->cursor_column, last_line->content + tab->cursor_column + 1, last_line->length - tab->cursor_column);
+			last_line->length--;
+			mark_dirty(tab, get_cursor_row(tab), last_line->started_row + last_line->rowspan);
+			update_rowspan(tab, last_line, true);
 		}
 		else if (ch == '\r')
 		{
@@ -310,10 +329,7 @@ static void handle_master_event(struct pollfd *pfds, unsigned int nfds)
 		}
 		else if (ch == '\n')
 		{
-			struct terminal_line *first_line = list_first_entry(&tab->lines, struct terminal_line, sibling);
-			struct terminal_line *last_line = list_last_entry(&tab->lines, struct terminal_line, sibling);
-
-			if (last_line && last_line->seconds)
+			if (last_line->seconds)
 			{
 				last_line->seconds = time(NULL);
 				struct tm *now = localtime(&last_line->seconds);
@@ -321,47 +337,28 @@ static void handle_master_event(struct pollfd *pfds, unsigned int nfds)
 				free(now);
 			}
 
-			struct terminal_line *line = alloc_terminal_line();
-			list_add_tail(&line->sibling, &tab->lines);
-
-			if (tab->row_count == iterm->max_rows)
-			{
-				list_del(&first_line->sibling);
-				free(first_line);
-				recalculate_tab(tab);
-			}
-			else
-			{
-				line->started_row = last_line ? last_line->started_row + last_line->rowspan : 0;
-				tab->line_count++;
-				tab->row_count++;
-			}
-
-			if (tab->scroll_line == last_line)
-				tab->scroll_line = line;
-			if (tab->cursor_line == last_line)
-				tab->cursor_line = line;
+			tab->cursor_column = 0;
+			update_rowspan(tab, last_line, false);
+			push_line(tab);
 		}
 		// printable characters
 		else
 		{
-			struct terminal_line *cursor_line = tab->cursor_line;
-			int width = iterm->width - 2 * HORIZONTAL_PADDING;
-
-			if (tab->cursor_column > CHARACTERS_PER_LINE)
+			if (tab->cursor_column >= CHARACTERS_PER_LINE - 1)
 				continue;
 
-			cursor_line->content[tab->cursor_column++] = ch;
-
-			int pixels = pixels_from_content(cursor_line->content);
-			cursor_line->rowspan = div_ceil(pixels, width);
-			recalculate_tab(tab);
+			last_line->content[tab->cursor_column++] = ch;
+			last_line->length = max_t(unsigned int, last_line->length, tab->cursor_column);
+			unsigned int row = last_line->started_row + (tab->cursor_column - 1) / get_columns();
+			mark_dirty(tab, row, row + 1);
+			update_rowspan(tab, last_line, true);
 		}
 	}
+	mark_dirty(tab, get_cursor_row(tab), get_cursor_row(tab) + 1);
 
-	memset(container_win->graphic.buf, 0, container_win->graphic.width * container_win->graphic.height * 4);
+	// new output moves the screen back to the bottom
+	tab->scroll_offset = 0;
 	draw_terminal();
-	gui_render(app_win);
 }
 
 int main()
@@ -369,13 +366,13 @@ int main()
 	app_win = init_window(50, 50, 600, 400);
 	container_win = list_last_entry(&app_win->children, struct window, sibling);
 
-	struct terminal_tab *tab = alloc_terminal_tab();
-
 	iterm = calloc(1, sizeof(struct terminal));
 	iterm->width = app_win->graphic.width;
 	iterm->height = app_win->graphic.height;
-	iterm->active_tab = tab;
 	iterm->max_rows = MAX_ROWS;
+
+	struct terminal_tab *tab = alloc_terminal_tab();
+	iterm->active_tab = tab;
 	INIT_LIST_HEAD(&iterm->tabs);
 	list_add_tail(&iterm->active_tab->sibling, &iterm->tabs);
 	init_terminal_tab_dev(tab);
@@ -2,28 +2,37 @@
 #define TAB_H
 
 #include <list.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 #define CHARACTERS_PER_LINE 256
+// scrollback, the oldest line is dropped when either limit is reached
+#define MAX_LINES 512
 #define MAX_ROWS 400
 
 struct terminal_line
 {
-	char content[CHARACTERS_PER_LINE];	// better to use linked list for buf
+	char content[CHARACTERS_PER_LINE];
+	unsigned int length;
 	time_t seconds;
+	// absolute row, it keeps increasing when the oldest lines are dropped
 	unsigned int started_row;
 	unsigned int rowspan;
-	struct list_head sibling;
 };
 
 struct terminal_tab
 {
-	struct list_head lines;
-	struct terminal_line *scroll_line;
+	// ring of lines, the oldest one is lines[first_line], cursor is always in the last one
+	struct terminal_line lines[MAX_LINES];
+	unsigned int first_line, line_count;
 	pid_t shell_pid;
-	unsigned int line_count, row_count;
-	struct terminal_line *cursor_line;
 	unsigned int cursor_column;
+	// rows between the bottom of screen and the last row, 0 follows the output
+	unsigned int scroll_offset;
+	// top row of the last drawing, rows in [dirty_from_row, dirty_to_row) have changed since then
+	bool drawn;
+	unsigned int drawn_top_row;
+	unsigned int dirty_from_row, dirty_to_row;
 	unsigned int fd_ptm, fd_pts;
 	struct list_head sibling;
 };
@@ -4,7 +4,9 @@
 #include <libcore/hashtable/hashmap.h>
 #include <libcore/ini/ini.h>
 #include <libgui/bmp.h>
+#include <libgui/pixel.h>
 #include <libgui/psf.h>
+#include <math.h>
 #include <mqueue.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +17,11 @@
 static struct desktop *desktop;
 static char *desktop_buf;
 static uint32_t nwin = 1;
+// screen areas which have to be recomposited, merged when they overlap
+static struct rect damage[MAX_DAMAGE_RECTS];
+static uint32_t ndamage;
+
+static void render_icon(struct icon *icon);
 
 static char *get_window_name()
 {
@@ -52,6 +59,22 @@ static struct window *find_window_in_root(char *name)
 	return NULL;
 }
 
+static struct rect get_window_rect(struct window *win)
+{
+	struct rect rect = {.x = win->graphic.x, .y = win->graphic.y, .width = win->graphic.width, .height = win->graphic.height};
+	for (struct window *parent = win->parent; parent; parent = parent->parent)
+	{
+		rect.x += parent->graphic.x;
+		rect.y += parent->graphic.y;
+	}
+	return rect;
+}
+
+static struct rect get_graphic_rect(struct graphic *graphic)
+{
+	return (struct rect){.x = graphic->x, .y = graphic->y, .width = graphic->width, .height = graphic->height};
+}
+
 struct window *create_window(struct msgui_window *msgwin)
 {
 	char *window_name = get_window_name();
@@ -106,7 +129,12 @@ void remove_window(struct window *win)
 void handle_window_remove(struct msgui_close *msgclose)
 {
 	struct window *win = find_window_in_root(msgclose->sender);
+	if (!win)
+		return;
+
+	struct rect rect = get_window_rect(win);
 	remove_window(win);
+	add_damage(&rect);
 }
 
 static int icon_ini_handler(__unused void *_desktop, const char *section, const char *name,
@@ -154,6 +182,7 @@ static void init_icons()
 		char *buf = load_bmp(icon->icon_path);
 		bmp_draw(&icon->icon_graphic, buf, 0, 0);
 		free(buf);
+		render_icon(icon);
 
 		iter = hashmap_iter_next(&desktop->icons, iter);
 	}
@@ -183,7 +212,7 @@ static void init_dekstop_graphic()
 	graphic->buf = calloc(graphic->width * graphic->height * 4, sizeof(char));
 
 	char *buf = load_bmp("/usr/share/images/background.bmp");
-	bmp_draw(graphic, buf, 0, 0);
+	bmp_draw_scaled(graphic, buf);
 	free(buf);
 	desktop_buf = calloc(desktop->fb->pitch * desktop->fb->height, sizeof(char));
 }
@@ -200,134 +229,230 @@ void init_layout(struct framebuffer *fb)
 	init_mouse();
 }
 
-// TODO: MQ 2020-03-24 Handle when win is not in buf's area
-static void draw_graphic(char *buf, uint32_t scanline, char *win, int32_t x, int32_t y, uint32_t width, uint32_t height)
+static bool rect_intersect(struct rect *a, struct rect *b, struct rect *out)
+{
+	int32_t x = max(a->x, b->x);
+	int32_t y = max(a->y, b->y);
+	int32_t right = min(a->x + a->width, b->x + b->width);
+	int32_t bottom = min(a->y + a->height, b->y + b->height);
+	if (right <= x || bottom <= y)
+		return false;
+
+	*out = (struct rect){.x = x, .y = y, .width = right - x, .height = bottom - y};
+	return true;
+}
+
+// overlapping or adjacent
+static bool rect_touch(struct rect *a, struct rect *b)
 {
-	for (uint32_t i = 0; i < height; ++i)
+	return a->x <= b->x + b->width && b->x <= a->x + a->width &&
+		   a->y <= b->y + b->height && b->y <= a->y + a->height;
+}
+
+static struct rect rect_union(struct rect *a, struct rect *b)
+{
+	int32_t x = min(a->x, b->x);
+	int32_t y = min(a->y, b->y);
+	int32_t right = max(a->x + a->width, b->x + b->width);
+	int32_t bottom = max(a->y + a->height, b->y + b->height);
+	return (struct rect){.x = x, .y = y, .width = right - x, .height = bottom - y};
+}
+
+void add_damage(struct rect *area)
+{
+	struct rect screen = {.x = 0, .y = 0, .width = desktop->fb->width, .height = desktop->fb->height};
+	struct rect rect;
+	if (!rect_intersect(area, &screen, &rect))
+		return;
+
+	// merged rect can touch the ones which have been checked -> start over
+	for (uint32_t i = 0; i < ndamage;)
 	{
-		char *ibuf = buf + (y + i) * scanline + x * 4;
-		char *iwin = win + i * width * 4;
-		for (uint32_t j = 0; j < width; ++j)
+		if (rect_touch(&damage[i], &rect))
 		{
-			*(uint32_t *)ibuf = *(uint32_t *)iwin;
-			ibuf += 4;
-			iwin += 4;
+			rect = rect_union(&damage[i], &rect);
+			damage[i] = damage[--ndamage];
+			i = 0;
 		}
+		else
+			i++;
+	}
+
+	if (ndamage == MAX_DAMAGE_RECTS)
+	{
+		for (uint32_t i = 0; i < ndamage; ++i)
+			rect = rect_union(&damage[i], &rect);
+		ndamage = 0;
 	}
+	damage[ndamage++] = rect;
 }
 
-// TODO: MQ 2020-03-24 Handle when win is not in buf's area
-static void draw_alpha_graphic(char *buf, uint32_t scanline, char *win, int32_t x, int32_t y, uint32_t width, uint32_t height)
+// graphic at (x, y) is drawn only inside clip (which is inside the screen)
+static void draw_graphic(char *buf, uint32_t scanline, struct graphic *graphic, int32_t x, int32_t y, struct rect *clip)
 {
-	for (uint32_t i = 0; i < height; ++i)
+	struct rect area = {.x = x, .y = y, .width = graphic->width, .height = graphic->height};
+	struct rect rect;
+	if (!rect_intersect(&area, clip, &rect))
+		return;
+
+	for (int32_t i = 0; i < rect.height; ++i)
 	{
-		char *ibuf = buf + (y + i) * scanline + x * 4;
-		char *iwin = win + i * width * 4;
-		for (uint32_t j = 0; j < width; ++j)
-		{
-			set_pixel(ibuf, iwin[0], iwin[1], iwin[2], iwin[3]);
-			ibuf += 4;
-			iwin += 4;
-		}
+		char *ibuf = buf + (rect.y + i) * scanline + rect.x * 4;
+		char *iwin = graphic->buf + ((rect.y - y + i) * graphic->width + rect.x - x) * 4;
+		pixel_copy((uint32_t *)ibuf, (uint32_t *)iwin, rect.width);
+	}
+}
+
+static void draw_alpha_graphic(char *buf, uint32_t scanline, struct graphic *graphic, int32_t x, int32_t y, struct rect *clip)
+{
+	struct rect area = {.x = x, .y = y, .width = graphic->width, .height = graphic->height};
+	struct rect rect;
+	if (!rect_intersect(&area, clip, &rect))
+		return;
+
+	for (int32_t i = 0; i < rect.height; ++i)
+	{
+		char *ibuf = buf + (rect.y + i) * scanline + rect.x * 4;
+		char *iwin = graphic->buf + ((rect.y - y + i) * graphic->width + rect.x - x) * 4;
+		pixel_over((uint32_t *)ibuf, (uint32_t *)iwin, rect.width);
 	}
 }
 
-static void draw_desktop_icons(char *buf)
+// icon's box is prepared once its state changes, compositing only blends it
+static void render_icon(struct icon *icon)
+{
+	struct graphic *box_graphic = &icon->box_graphic;
+	struct graphic *icon_graphic = &icon->icon_graphic;
+
+	// 88x82
+	// --------- 4 --------
+	// 16 - 4 - 48 - 4 - 16
+	// --------- 4 --------
+	// --------- 2 --------
+	// 4 ------- 24 ----- 4
+	if (icon->active)
+	{
+		uint32_t color = pixel_premultiply(0xAA, 0xAA, 0xAA, 0x33);
+		for (uint32_t j = 0; j < 56; ++j)
+			pixel_fill((uint32_t *)(box_graphic->buf + j * box_graphic->width * 4 + 16 * 4), color, 56);
+	}
+	else
+		memset(box_graphic->buf, 0, box_graphic->width * box_graphic->height * 4);
+
+	uint8_t label_length = strlen(icon->label);
+	// TODO Implement multi lines label
+	if (label_length <= 10)
+	{
+		uint8_t padding = ((10 - label_length) / 2) * 8;
+		psf_puts(icon->label, 4 + padding, 58, 0xffffffff, 0x00000000, box_graphic->buf, box_graphic->width * 4);
+	}
+
+	struct rect box = {.x = 0, .y = 0, .width = box_graphic->width, .height = box_graphic->height};
+	draw_alpha_graphic(box_graphic->buf, box_graphic->width * 4, icon_graphic, icon_graphic->x, icon_graphic->y, &box);
+}
+
+static void set_icon_active(struct icon *icon, bool active)
+{
+	if (icon->active == active)
+		return;
+
+	icon->active = active;
+	render_icon(icon);
+
+	struct rect rect = get_graphic_rect(&icon->box_graphic);
+	add_damage(&rect);
+}
+
+static void draw_desktop_icons(char *buf, struct rect *clip)
 {
 	struct hashmap_iter *iter = hashmap_iter(&desktop->icons);
 	while (iter)
 	{
 		struct icon *icon = hashmap_iter_get_data(iter);
 		struct graphic *box_graphic = &icon->box_graphic;
-		struct graphic *icon_graphic = &icon->icon_graphic;
-
-		// 88x82
-		// --------- 4 --------
-		// 16 - 4 - 48 - 4 - 16
-		// --------- 4 --------
-		// --------- 2 --------
-		// 4 ------- 24 ----- 4
-		if (icon->active)
-		{
-			for (uint32_t j = 0; j < 56; ++j)
-			{
-				char *iblock = box_graphic->buf + j * box_graphic->width * 4 + 16 * 4;
-				for (uint32_t i = 0; i < 56; ++i)
-				{
-					iblock[0] = 0xAA;
-					iblock[1] = 0xAA;
-					iblock[2] = 0xAA;
-					iblock[3] = 0x33;
-					iblock += 4;
-				}
-			}
-		}
-		else
-			memset(box_graphic->buf, 0, box_graphic->width * box_graphic->height * 4);
-
-		uint8_t label_length = strlen(icon->label);
-		// TODO Implement multi lines label
-		if (label_length <= 10)
-		{
-			uint8_t padding = ((10 - label_length) / 2) * 8;
-			psf_puts(icon->label, 4 + padding, 58, 0xffffffff, 0x00000000, box_graphic->buf, box_graphic->width * 4);
-		}
-		draw_alpha_graphic(
-			box_graphic->buf, box_graphic->width * 4,
-			icon_graphic->buf, icon_graphic->x, icon_graphic->y, icon_graphic->width, icon_graphic->height);
-		draw_alpha_graphic(
-			buf, desktop->fb->pitch,
-			box_graphic->buf, box_graphic->x, box_graphic->y, box_graphic->width, box_graphic->height);
+		draw_alpha_graphic(buf, desktop->fb->pitch, box_graphic, box_graphic->x, box_graphic->y, clip);
 
 		iter = hashmap_iter_next(&desktop->icons, iter);
 	}
 }
 
-static void draw_mouse(char *buf)
+static void draw_mouse(char *buf, struct rect *clip)
 {
 	struct graphic *graphic = &desktop->mouse.graphic;
-	draw_alpha_graphic(buf, desktop->fb->pitch, graphic->buf, graphic->x, graphic->y, graphic->width, graphic->height);
+	draw_alpha_graphic(buf, desktop->fb->pitch, graphic, graphic->x, graphic->y, clip);
 }
 
-static void draw_window(char *buf, struct window *win, int32_t px, int32_t py)
+static void draw_window(char *buf, struct window *win, int32_t px, int32_t py, struct rect *clip)
 {
 	int32_t ax = px + win->graphic.x;
 	int32_t ay = py + win->graphic.y;
 
 	if (win->graphic.transparent)
-		draw_alpha_graphic(buf, desktop->fb->pitch, win->graphic.buf, ax, ay, win->graphic.width, win->graphic.height);
+		draw_alpha_graphic(buf, desktop->fb->pitch, &win->graphic, ax, ay, clip);
 	else
-		draw_graphic(buf, desktop->fb->pitch, win->graphic.buf, ax, ay, win->graphic.width, win->graphic.height);
+		draw_graphic(buf, desktop->fb->pitch, &win->graphic, ax, ay, clip);
 
 	struct window *iter_w;
 	list_for_each_entry(iter_w, &win->children, sibling)
 	{
-		draw_window(buf, iter_w, ax, ay);
+		draw_window(buf, iter_w, ax, ay, clip);
 	}
 }
 
-void draw_window_in_layout(char *name)
+// layers from bottom to top: background, icons, windows (later ones are on top) and cursor
+static void composite_rect(struct rect *clip)
 {
-	struct window *win = find_window_in_root(name);
-	draw_window(desktop_buf, win, 0, 0);
+	draw_graphic(desktop_buf, desktop->fb->pitch, &desktop->graphic, 0, 0, clip);
+	draw_desktop_icons(desktop_buf, clip);
+
+	struct window *iter_win;
+	list_for_each_entry(iter_win, &desktop->children, sibling)
+	{
+		draw_window(desktop_buf, iter_win, 0, 0, clip);
+	}
+	draw_mouse(desktop_buf, clip);
 
-	memcpy((char *)desktop->fb->addr, desktop_buf, desktop->fb->pitch * desktop->fb->height);
+	for (int32_t i = 0; i < clip->height; ++i)
+	{
+		uint32_t offset = (clip->y + i) * desktop->fb->pitch + clip->x * 4;
+		pixel_copy((uint32_t *)((char *)desktop->fb->addr + offset), (uint32_t *)(desktop_buf + offset), clip->width);
+	}
 }
 
-// TODO: MQ 2020-03-21 Improve render speed via dirty rects
-void draw_layout()
+// width or height is zero -> whole window is damaged
+void handle_window_render(struct msgui_render *msgrender)
 {
-	draw_graphic(desktop_buf, desktop->fb->pitch, desktop->graphic.buf, 0, 0, desktop->graphic.width, desktop->graphic.height);
-	draw_desktop_icons(desktop_buf);
+	struct window *win = find_window_in_root(msgrender->sender);
+	if (!win)
+		return;
 
-	struct window *iter_win;
-	list_for_each_entry(iter_win, &desktop->children, sibling)
+	struct rect rect = get_window_rect(win);
+	if (msgrender->width && msgrender->height)
 	{
-		draw_window(desktop_buf, iter_win, 0, 0);
+		struct rect area = {
+			.x = rect.x + msgrender->x,
+			.y = rect.y + msgrender->y,
+			.width = msgrender->width,
+			.height = msgrender->height,
+		};
+		if (!rect_intersect(&area, &rect, &rect))
+			return;
 	}
-	draw_mouse(desktop_buf);
+	add_damage(&rect);
+}
 
-	memcpy((char *)desktop->fb->addr, desktop_buf, desktop->fb->pitch * desktop->fb->height);
+void draw_layout()
+{
+	struct rect screen = {.x = 0, .y = 0, .width = desktop->fb->width, .height = desktop->fb->height};
+	add_damage(&screen);
+}
+
+// only damaged areas are recomposited and copied into framebuffer
+void render_layout()
+{
+	for (uint32_t i = 0; i < ndamage; ++i)
+		composite_rect(&damage[i]);
+	ndamage = 0;
 }
 
 static void mouse_change(struct mouse_event *event)
@@ -380,7 +505,16 @@ static struct icon *find_icon_from_mouse_position(int32_t px, int32_t py)
 void handle_mouse_event(struct mouse_event *mevent)
 {
 	desktop->event_state = (desktop->event_state & ~0b1110000) || mevent->state;
+
+	// cursor moves -> only its old and new box are recomposited
+	struct rect old_cursor = get_graphic_rect(&desktop->mouse.graphic);
 	mouse_change(mevent);
+	struct rect new_cursor = get_graphic_rect(&desktop->mouse.graphic);
+	if (old_cursor.x != new_cursor.x || old_cursor.y != new_cursor.y)
+	{
+		add_damage(&old_cursor);
+		add_damage(&new_cursor);
+	}
 
 	if ((mevent->buttons & BUTTON_LEFT) && !(desktop->event_state & BUTTON_LEFT_MASK))
 	{
@@ -407,18 +541,18 @@ void handle_mouse_event(struct mouse_event *mevent)
 			{
 				struct icon *i = hashmap_iter_get_data(iter);
 				if (i != icon)
-					i->active = false;
+					set_icon_active(i, false);
 				iter = hashmap_iter_next(&desktop->icons, iter);
 			}
 			if (icon)
 			{
 				if (icon->active)
 				{
-					icon->active = false;
+					set_icon_active(icon, false);
 					posix_spawn(icon->exec_path);
 				}
 				else
-					icon->active = true;
+					set_icon_active(icon, true);
 			}
 		}
 	}
@@ -440,8 +574,14 @@ void handle_keyboard_event(struct key_event *kevent)
 	}
 }
 
+// window is focused once it enters event loop, it is shown from then
 void handle_focus_event(struct msgui_focus *focus)
 {
 	struct window *win = find_window_in_root(focus->sender);
 	desktop->active_window = win;
+	if (!win)
+		return;
+
+	struct rect rect = get_window_rect(win);
+	add_damage(&rect);
 }
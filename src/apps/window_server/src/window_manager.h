@@ -5,6 +5,15 @@
 #include <libgui/layout.h>
 #include <libgui/msgui.h>
 
+// damaged areas which are tracked separately, more are merged into their bounding box
+#define MAX_DAMAGE_RECTS 16
+
+struct rect
+{
+	int32_t x, y;
+	int32_t width, height;
+};
+
 struct mouse_event
 {
 	int32_t x;
@@ -28,8 +37,10 @@ struct key_event
 
 struct window *create_window(struct msgui_window *msgwin);
 void init_layout(struct framebuffer *fb);
+void add_damage(struct rect *area);
 void draw_layout();
-void draw_window_in_layout(char *name);
+void render_layout();
+void handle_window_render(struct msgui_render *msgrender);
 void handle_mouse_event(struct mouse_event *event);
 void handle_keyboard_event(struct key_event *event);
 void handle_focus_event(struct msgui_focus *focus);
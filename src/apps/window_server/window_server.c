@@ -31,6 +31,7 @@ int main(int argc, char **argv)
 
 	init_layout(fb);
 	draw_layout();
+	render_layout();
 
 	while (true)
 	{
@@ -63,18 +64,16 @@ int main(int argc, char **argv)
 				{
 					struct msgui_focus *msgfocus = (struct msgui_focus *)ws_buf.data;
 					handle_focus_event(msgfocus);
-					draw_layout();
 				}
 				else if (ws_buf.type == MSGUI_RENDER)
 				{
 					struct msgui_render *msgrender = (struct msgui_render *)ws_buf.data;
-					draw_window_in_layout(msgrender->sender);
+					handle_window_render(msgrender);
 				}
 				else if (ws_buf.type == MSGUI_CLOSE)
 				{
 					struct msgui_close *msgclose = (struct msgui_close *)ws_buf.data;
 					handle_window_remove(msgclose);
-					draw_layout();
 				}
 			}
 			else if (pfds[i].fd == mouse_fd)
@@ -82,7 +81,6 @@ int main(int argc, char **argv)
 				memset(&mouse_event, 0, sizeof(struct mouse_event));
 				read(mouse_fd, (char *)&mouse_event, sizeof(struct mouse_event));
 				handle_mouse_event(&mouse_event);
-				draw_layout();
 			}
 			else if (pfds[i].fd == krb_fd)
 			{
@@ -90,6 +88,8 @@ int main(int argc, char **argv)
 				handle_keyboard_event(&krb_event);
 			}
 		}
+		// events of one poll round are composited together
+		render_layout();
 	}
 
 	return 0;
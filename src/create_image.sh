@@ -29,6 +29,8 @@ if [[ "$unamestr" == 'Linux' ]]; then
   cd ../..
   cd apps/host && make clean && make
   cd ../..
+  cd apps/netbench && make clean && make
+  cd ../..
   cd apps/calculator && make clean && make
   cd ../..
   cd apps/ld && rm -f ld && i386-mos-gcc -g ld.c -o ld
@@ -47,6 +49,7 @@ if [[ "$unamestr" == 'Linux' ]]; then
   sudo cp apps/shell/shell "/mnt/${DISK_NAME}/bin"
   sudo cp apps/uname/uname "/mnt/${DISK_NAME}/bin"
   sudo cp apps/host/host "/mnt/${DISK_NAME}/bin"
+  sudo cp apps/netbench/netbench "/mnt/${DISK_NAME}/bin"
   sudo cp apps/calculator/calculator "/mnt/${DISK_NAME}/bin"
   sudo cp apps/ld/ld "/mnt/${DISK_NAME}/bin"
 
@@ -85,6 +88,8 @@ elif [[ "$unamestr" == 'Darwin' ]]; then
   cd ../..
   cd apps/host && make clean && make
   cd ../..
+  cd apps/netbench && make clean && make
+  cd ../..
   cd apps/calculator && make clean && make
   cd ../..
   cd apps/ld && make clean && make
@@ -96,6 +101,7 @@ elif [[ "$unamestr" == 'Darwin' ]]; then
   cp apps/shell/shell "/Volumes/${VOLUME_NAME}/bin"
   cp apps/uname/uname "/Volumes/${VOLUME_NAME}/bin"
   cp apps/host/host "/Volumes/${VOLUME_NAME}/bin"
+  cp apps/netbench/netbench "/Volumes/${VOLUME_NAME}/bin"
   cp apps/calculator/calculator "/Volumes/${VOLUME_NAME}/bin"
   cp apps/ld/ld "/Volumes/${VOLUME_NAME}/bin"
 
@@ -0,0 +1,95 @@
+#include "fpu.h"
+
+#include <cpu/hal.h>
+#include <proc/task.h>
+#include <stdbool.h>
+#include <utils/math.h>
+#include <utils/string.h>
+
+#define CPUID_FEAT_EDX_FPU (1 << 0)
+#define CPUID_FEAT_EDX_FXSR (1 << 24)
+#define CPUID_FEAT_EDX_SSE (1 << 25)
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+static bool fxsr;
+// state after fninit, every new thread starts with it
+static uint8_t fpu_initial_state[FPU_STATE_SIZE] __attribute__((aligned(FPU_STATE_ALIGN)));
+
+static uint8_t *fpu_state_area(struct thread *th)
+{
+	return (uint8_t *)ALIGN_UP((uintptr_t)th->fpu_state, FPU_STATE_ALIGN);
+}
+
+static void fpu_save_area(uint8_t *area)
+{
+	if (fxsr)
+		__asm__ __volatile__("fxsave (%0)" ::"r"(area)
+							 : "memory");
+	else
+		__asm__ __volatile__("fnsave (%0)" ::"r"(area)
+							 : "memory");
+}
+
+static void fpu_restore_area(uint8_t *area)
+{
+	if (fxsr)
+		__asm__ __volatile__("fxrstor (%0)" ::"r"(area));
+	else
+		__asm__ __volatile__("frstor (%0)" ::"r"(area));
+}
+
+// x87, mmx and sse registers are shared by all threads -> they are saved on every context switch
+void fpu_init()
+{
+	uint32_t eax, edx;
+	cpuid(1, &eax, &edx);
+
+	uint32_t cr0;
+	__asm__ __volatile__("mov %%cr0, %0"
+						 : "=r"(cr0));
+	cr0 = (cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE;
+	__asm__ __volatile__("mov %0, %%cr0" ::"r"(cr0));
+
+	fxsr = edx & CPUID_FEAT_EDX_FXSR;
+	if (fxsr)
+	{
+		uint32_t cr4;
+		__asm__ __volatile__("mov %%cr4, %0"
+							 : "=r"(cr4));
+		cr4 |= CR4_OSFXSR;
+		if (edx & CPUID_FEAT_EDX_SSE)
+			cr4 |= CR4_OSXMMEXCPT;
+		__asm__ __volatile__("mov %0, %%cr4" ::"r"(cr4));
+	}
+
+	__asm__ __volatile__("fninit");
+	fpu_save_area(fpu_initial_state);
+}
+
+void fpu_init_state(struct thread *th)
+{
+	memcpy(fpu_state_area(th), fpu_initial_state, FPU_STATE_SIZE);
+}
+
+// called by running src thread (fork) -> its live registers are copied
+void fpu_copy_state(struct thread *dst, struct thread *src)
+{
+	fpu_save_area(fpu_state_area(src));
+	fpu_restore_area(fpu_state_area(src));
+	memcpy(fpu_state_area(dst), fpu_state_area(src), FPU_STATE_SIZE);
+}
+
+void fpu_save(struct thread *th)
+{
+	fpu_save_area(fpu_state_area(th));
+}
+
+void fpu_restore(struct thread *th)
+{
+	fpu_restore_area(fpu_state_area(th));
+}
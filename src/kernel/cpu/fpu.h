@@ -0,0 +1,18 @@
+#ifndef CPU_FPU_H
+#define CPU_FPU_H
+
+#include <stdint.h>
+
+// fxsave area, fnsave only uses the first 108 bytes
+#define FPU_STATE_SIZE 512
+#define FPU_STATE_ALIGN 16
+
+struct thread;
+
+void fpu_init();
+void fpu_init_state(struct thread *th);
+void fpu_copy_state(struct thread *dst, struct thread *src);
+void fpu_save(struct thread *th);
+void fpu_restore(struct thread *th);
+
+#endif
@@ -21,3 +21,27 @@ void cpuid(int code, uint32_t *a, uint32_t *d)
 				 : "a"(code)
 				 : "ecx", "ebx");
 }
+
+#define CPUID_FEAT_ECX_RDRAND (1 << 30)
+#define RDRAND_RETRIES 10
+
+// hardware random number, false if cpu doesn't support rdrand or it keeps failing (entropy is drained)
+bool rdrand(uint32_t *value)
+{
+	uint32_t eax, ebx, ecx, edx;
+	asm volatile("cpuid"
+				 : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+				 : "a"(1));
+	if (!(ecx & CPUID_FEAT_ECX_RDRAND))
+		return false;
+
+	for (int i = 0; i < RDRAND_RETRIES; ++i)
+	{
+		uint8_t ok;
+		asm volatile("rdrand %0; setc %1"
+					 : "=r"(*value), "=qm"(ok));
+		if (ok)
+			return true;
+	}
+	return false;
+}
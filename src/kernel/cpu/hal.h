@@ -2,6 +2,7 @@
 #define CPU_HAL_H
 
 #include <include/cdefs.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -110,7 +111,17 @@ static __inline void outportsw(uint16_t portid, const void *addr, size_t count)
 						 : "d"(portid));
 }
 
+//! time stamp counter, cpu cycles since reset
+static __inline uint64_t rdtsc()
+{
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc"
+						 : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
 void cpuid(int code, uint32_t *a, uint32_t *d);
+bool rdrand(uint32_t *value);
 const char *get_cpu_vender();
 
 #endif
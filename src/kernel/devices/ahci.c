@@ -0,0 +1,472 @@
+#include "ahci.h"
+
+#include <cpu/hal.h>
+#include <cpu/idt.h>
+#include <cpu/pic.h>
+#include <devices/block.h>
+#include <devices/pci.h>
+#include <include/errno.h>
+#include <memory/vmm.h>
+#include <proc/task.h>
+#include <utils/math.h>
+#include <utils/printf.h>
+#include <utils/string.h>
+
+// bounded busy wait for port engine and link state changes (spec allows up to 500ms)
+#define AHCI_SPIN_LIMIT 1000000
+
+static volatile struct ahci_hba_memory *hba;
+static struct ahci_device devices[AHCI_MAX_PORTS];
+static uint8_t number_of_actived_devices = 0;
+static uint32_t ahci_next_vaddr = AHCI_VADDR;
+static char *dev_names[] = {"/dev/sda", "/dev/sdb", "/dev/sdc", "/dev/sdd", "/dev/sde", "/dev/sdf", "/dev/sdg", "/dev/sdh"};
+
+struct ahci_slot_waiter
+{
+	struct thread *thread;
+	struct list_head sibling;
+};
+
+struct ahci_result
+{
+	struct thread *thread;
+	volatile bool done;
+	int err;
+};
+
+static void *ahci_map(uint32_t paddr, uint32_t size, uint32_t flags)
+{
+	uint32_t offset = paddr & (PMM_FRAME_SIZE - 1);
+	uint32_t frames = div_ceil(offset + size, PMM_FRAME_SIZE);
+	uint32_t vaddr = ahci_next_vaddr;
+
+	for (uint32_t i = 0; i < frames; ++i)
+		vmm_map_address(vmm_get_directory(), vaddr + i * PMM_FRAME_SIZE, paddr - offset + i * PMM_FRAME_SIZE, flags);
+	ahci_next_vaddr += frames * PMM_FRAME_SIZE;
+
+	return (void *)(vaddr + offset);
+}
+
+static bool ahci_spin(volatile uint32_t *reg, uint32_t mask, uint32_t value)
+{
+	for (uint32_t i = 0; i < AHCI_SPIN_LIMIT; ++i)
+		if ((*reg & mask) == value)
+			return true;
+	return false;
+}
+
+static void ahci_stop_port(volatile struct ahci_hba_port *regs)
+{
+	regs->cmd &= ~AHCI_PORT_CMD_ST;
+	ahci_spin(&regs->cmd, AHCI_PORT_CMD_CR, 0);
+	regs->cmd &= ~AHCI_PORT_CMD_FRE;
+	ahci_spin(&regs->cmd, AHCI_PORT_CMD_FR, 0);
+}
+
+static void ahci_start_port(volatile struct ahci_hba_port *regs)
+{
+	ahci_spin(&regs->cmd, AHCI_PORT_CMD_CR, 0);
+	regs->cmd |= AHCI_PORT_CMD_FRE;
+	regs->cmd |= AHCI_PORT_CMD_ST;
+}
+
+// caller holds the scheduler lock, the callback of each slot is called after the slot is freed
+// -> it can submit the next command
+static void ahci_complete_slots(struct ahci_port *port, uint32_t slots, int err)
+{
+	port->active &= ~slots;
+	while (slots)
+	{
+		uint8_t slot = __builtin_ctz(slots);
+		slots &= slots - 1;
+
+		struct ahci_slot *s = &port->slots[slot];
+		if (s->callback)
+			s->callback(err, s->arg);
+	}
+
+	struct ahci_slot_waiter *waiter;
+	list_for_each_entry(waiter, &port->slot_waiters, sibling)
+	{
+		if (waiter->thread->state == THREAD_WAITING)
+			update_thread(waiter->thread, THREAD_READY);
+	}
+}
+
+// the hba stops processing command list on a task file error
+// -> finished commands are completed, the rest fail and the port is restarted
+static void ahci_recover_port(struct ahci_port *port)
+{
+	volatile struct ahci_hba_port *regs = port->regs;
+	// both masks are taken before any callback runs, callbacks issue new commands into freed slots
+	uint32_t done = port->active & ~(regs->sact | regs->ci);
+	uint32_t failed = port->active & ~done;
+
+	ahci_stop_port(regs);
+	regs->serr = regs->serr;
+	if (regs->tfd & (AHCI_PORT_TFD_BSY | AHCI_PORT_TFD_DRQ))
+	{
+		// device is stuck -> comreset
+		regs->sctl = (regs->sctl & ~0x0F) | 1;
+		// det has to be kept at 1 for at least 1ms
+		for (volatile uint32_t i = 0; i < AHCI_SPIN_LIMIT; ++i)
+			;
+		regs->sctl &= ~0x0F;
+		ahci_spin(&regs->ssts, 0x0F, AHCI_PORT_SSTS_DET_PRESENT);
+		regs->serr = regs->serr;
+	}
+	regs->is = regs->is;
+	ahci_start_port(regs);
+
+	ahci_complete_slots(port, done, 0);
+	ahci_complete_slots(port, failed, -EIO);
+}
+
+static int32_t ahci_irq(struct interrupt_registers *regs)
+{
+	uint32_t is = hba->is;
+
+	lock_scheduler();
+	for (uint8_t i = 0; i < number_of_actived_devices; ++i)
+	{
+		struct ahci_port *port = &devices[i].port;
+		if (!(is & (1u << port->number)))
+			continue;
+
+		// port interrupt status is cleared before hba one, both by writing 1
+		uint32_t port_is = port->regs->is;
+		port->regs->is = port_is;
+		if (port_is & AHCI_PORT_IS_ERROR)
+			ahci_recover_port(port);
+		else
+			ahci_complete_slots(port, port->active & ~(port->regs->sact | port->regs->ci), 0);
+	}
+	hba->is = is;
+	unlock_scheduler();
+
+	irq_ack(regs->int_no);
+	return IRQ_HANDLER_CONTINUE;
+}
+
+// one entry per physically contiguous run of buffer, returns the number of entries including earlier ones
+static uint16_t ahci_prdt_add(struct ahci_cmd_table *table, uint16_t n_prds, void *buffer, uint32_t size)
+{
+	struct ahci_prd *prd = n_prds ? &table->prdt[n_prds - 1] : NULL;
+	for (uint32_t offset = 0; offset < size;)
+	{
+		uint32_t vaddr = (uint32_t)buffer + offset;
+		uint32_t len = min(size - offset, PMM_FRAME_SIZE - (vaddr & (PMM_FRAME_SIZE - 1)));
+		uint32_t paddr = vmm_get_physical_address(vaddr, false);
+
+		// byte count is stored as count - 1
+		if (prd && prd->dba + prd->dbc + 1 == paddr)
+			prd->dbc += len;
+		else
+		{
+			prd = &table->prdt[n_prds++];
+			prd->dba = paddr;
+			prd->dbau = 0;
+			prd->reserved = 0;
+			prd->dbc = len - 1;
+		}
+		offset += len;
+	}
+	return n_prds;
+}
+
+// bios of request are adjacent on disk, the table gathers their buffers
+static uint16_t ahci_build_prdt(struct ahci_cmd_table *table, void *buffer, uint32_t size, struct request *req)
+{
+	if (!req)
+		return ahci_prdt_add(table, 0, buffer, size);
+
+	uint16_t n_prds = 0;
+	struct bio *bio;
+	list_for_each_entry(bio, &req->bios, bi_sibling)
+	{
+		n_prds = ahci_prdt_add(table, n_prds, bio->bi_buf, bio->bi_size);
+	}
+	return n_prds;
+}
+
+static bool ahci_is_queued(uint8_t command)
+{
+	return command == AHCI_CMD_READ_FPDMA_QUEUED || command == AHCI_CMD_WRITE_FPDMA_QUEUED;
+}
+
+// data is either buffer or bios of req, returns -EBUSY if every slot is in flight, caller holds the scheduler lock
+static int ahci_issue(struct ahci_device *device, uint8_t command, uint64_t lba, uint16_t n_sectors, void *buffer,
+					  struct request *req, bool write, ahci_callback callback, void *arg)
+{
+	struct ahci_port *port = &device->port;
+	uint32_t free_slots = port->slots_mask & ~port->active;
+	if (!free_slots)
+		return -EBUSY;
+
+	uint8_t slot = __builtin_ctz(free_slots);
+	struct ahci_cmd_header *header = &port->cmd_list[slot];
+	struct ahci_cmd_table *table = port->cmd_tables[slot];
+
+	memset(table, 0, sizeof(struct ahci_cmd_table));
+	struct ahci_fis_reg_h2d *fis = (struct ahci_fis_reg_h2d *)table->cfis;
+	fis->fis_type = AHCI_FIS_TYPE_REG_H2D;
+	fis->flags = AHCI_FIS_C;
+	fis->command = command;
+	fis->device = AHCI_FIS_DEVICE_LBA;
+	fis->lba0 = (uint8_t)lba;
+	fis->lba1 = (uint8_t)(lba >> 8);
+	fis->lba2 = (uint8_t)(lba >> 16);
+	fis->lba3 = (uint8_t)(lba >> 24);
+	fis->lba4 = (uint8_t)(lba >> 32);
+	fis->lba5 = (uint8_t)(lba >> 40);
+	if (ahci_is_queued(command))
+	{
+		// queued commands carry sector count in features and tag in count
+		fis->featurel = (uint8_t)n_sectors;
+		fis->featureh = (uint8_t)(n_sectors >> 8);
+		fis->countl = slot << 3;
+		if (write)
+			fis->device |= AHCI_FIS_DEVICE_FUA;
+	}
+	else
+	{
+		fis->countl = (uint8_t)n_sectors;
+		fis->counth = (uint8_t)(n_sectors >> 8);
+	}
+
+	memset(header, 0, sizeof(struct ahci_cmd_header));
+	header->cfl = sizeof(struct ahci_fis_reg_h2d) / sizeof(uint32_t);
+	header->w = write;
+	header->prdtl = buffer || req ? ahci_build_prdt(table, buffer, n_sectors * AHCI_SECTOR_SIZE, req) : 0;
+	header->ctba = port->cmd_tables_paddr[slot];
+
+	port->slots[slot].callback = callback;
+	port->slots[slot].arg = arg;
+	port->active |= 1u << slot;
+	if (ahci_is_queued(command))
+		port->regs->sact = 1u << slot;
+	port->regs->ci = 1u << slot;
+
+	return 0;
+}
+
+static void ahci_complete_result(int err, void *arg)
+{
+	struct ahci_result *result = arg;
+	result->err = err;
+	result->done = true;
+	if (result->thread->state == THREAD_WAITING)
+		update_thread(result->thread, THREAD_READY);
+}
+
+// used before the device is registered, thread sleeps until a slot is free and again until irq completes the command
+static int ahci_execute(struct ahci_device *device, uint8_t command, uint64_t lba, uint16_t n_sectors, void *buffer, bool write)
+{
+	struct ahci_port *port = &device->port;
+	struct ahci_result result = {.thread = current_thread};
+	struct ahci_slot_waiter waiter = {.thread = current_thread};
+
+	lock_scheduler();
+	int ret;
+	while ((ret = ahci_issue(device, command, lba, n_sectors, buffer, NULL, write, ahci_complete_result, &result)) == -EBUSY)
+	{
+		list_add_tail(&waiter.sibling, &port->slot_waiters);
+		update_thread(current_thread, THREAD_WAITING);
+		unlock_scheduler();
+		schedule();
+		lock_scheduler();
+		list_del(&waiter.sibling);
+	}
+	while (!ret && !result.done)
+	{
+		update_thread(current_thread, THREAD_WAITING);
+		unlock_scheduler();
+		schedule();
+		lock_scheduler();
+	}
+	unlock_scheduler();
+
+	return ret ? ret : result.err;
+}
+
+// queued writes and writes with fua bypass the disk cache, a plain write dma ext is followed by a cache flush
+static uint8_t ahci_rw_command(struct ahci_device *device, bool write)
+{
+	if (device->port.ncq)
+		return write ? AHCI_CMD_WRITE_FPDMA_QUEUED : AHCI_CMD_READ_FPDMA_QUEUED;
+	if (write)
+		return device->port.fua ? AHCI_CMD_WRITE_DMA_FUA_EXT : AHCI_CMD_WRITE_DMA_EXT;
+	return AHCI_CMD_READ_DMA_EXT;
+}
+
+static void ahci_complete_request(int err, void *arg)
+{
+	blk_end_request(arg, err);
+}
+
+// request ends when the flush is done, it still counts as in flight while its write slot is free again
+// -> other requests use at most depth - 1 slots and the flush always gets one
+static void ahci_complete_write(int err, void *arg)
+{
+	struct request *req = arg;
+	struct ahci_device *device = req->bdev->private;
+
+	int ret = err ? err : ahci_issue(device, AHCI_CMD_CACHE_FLUSH_EXT, 0, 0, NULL, NULL, false, ahci_complete_request, req);
+	if (ret)
+		blk_end_request(req, ret);
+}
+
+static int ahci_submit_request(struct block_device *bdev, struct request *req)
+{
+	struct ahci_device *device = bdev->private;
+	bool write = req->rw == BIO_WRITE;
+	if (req->sector + req->n_sectors > device->sectors)
+		return -EINVAL;
+
+	uint8_t command = ahci_rw_command(device, write);
+	ahci_callback callback = command == AHCI_CMD_WRITE_DMA_EXT ? ahci_complete_write : ahci_complete_request;
+
+	lock_scheduler();
+	int ret = ahci_issue(device, command, req->sector, req->n_sectors, NULL, req, write, callback, req);
+	unlock_scheduler();
+	return ret;
+}
+
+static struct block_device_operations ahci_block_operations = {
+	.submit = ahci_submit_request,
+};
+
+struct ahci_device *get_ahci_device(char *dev_name)
+{
+	for (uint8_t i = 0; i < number_of_actived_devices; ++i)
+	{
+		if (strcmp(devices[i].dev_name, dev_name) == 0)
+			return &devices[i];
+	}
+	return NULL;
+}
+
+static void ahci_setup_port(struct ahci_port *port, uint8_t number, uint32_t slots_mask)
+{
+	volatile struct ahci_hba_port *regs = &hba->ports[number];
+	port->number = number;
+	port->regs = regs;
+	port->slots_mask = slots_mask;
+	INIT_LIST_HEAD(&port->slot_waiters);
+
+	ahci_stop_port(regs);
+
+	// physically contiguous pages, command list and received fis first then command tables
+	uint32_t paddr = (uint32_t)pmm_alloc_blocks(AHCI_PORT_PAGES);
+	char *vaddr = ahci_map(paddr, AHCI_PORT_PAGES * PMM_FRAME_SIZE, I86_PTE_PRESENT | I86_PTE_WRITABLE);
+	memset(vaddr, 0, AHCI_PORT_PAGES * PMM_FRAME_SIZE);
+
+	port->cmd_list = (struct ahci_cmd_header *)vaddr;
+	for (uint8_t slot = 0; slot < AHCI_MAX_SLOTS; ++slot)
+	{
+		uint32_t offset = PMM_FRAME_SIZE + slot * AHCI_CMD_TABLE_SIZE;
+		port->cmd_tables[slot] = (struct ahci_cmd_table *)(vaddr + offset);
+		port->cmd_tables_paddr[slot] = paddr + offset;
+	}
+
+	regs->clb = paddr;
+	regs->clbu = 0;
+	regs->fb = paddr + AHCI_CMD_LIST_SIZE;
+	regs->fbu = 0;
+	regs->serr = regs->serr;
+	regs->is = regs->is;
+	regs->ie = AHCI_PORT_IE_DEFAULT;
+
+	ahci_start_port(regs);
+}
+
+static bool ahci_identify(struct ahci_device *device, bool hba_ncq)
+{
+	uint16_t *buffer = kcalloc(256, sizeof(uint16_t));
+	int ret = ahci_execute(device, AHCI_CMD_IDENTIFY, 0, 1, buffer, false);
+
+	if (!ret)
+	{
+		// words 100-103: lba48 sectors
+		device->sectors = buffer[100] | ((uint64_t)buffer[101] << 16) | ((uint64_t)buffer[102] << 32) | ((uint64_t)buffer[103] << 48);
+		device->port.ncq = hba_ncq && (buffer[AHCI_IDENTIFY_SATA_CAP] & AHCI_IDENTIFY_SATA_CAP_NCQ);
+		device->port.fua = buffer[AHCI_IDENTIFY_FEATURES] & AHCI_IDENTIFY_FEATURES_FUA;
+		if (device->port.ncq)
+		{
+			uint8_t depth = (buffer[AHCI_IDENTIFY_QUEUE_DEPTH] & 0x1F) + 1;
+			if (depth < AHCI_MAX_SLOTS)
+				device->port.slots_mask &= (1u << depth) - 1;
+		}
+	}
+	kfree(buffer);
+	return !ret;
+}
+
+static void ahci_probe_port(uint8_t number, uint32_t slots_mask, bool hba_ncq)
+{
+	volatile struct ahci_hba_port *regs = &hba->ports[number];
+	uint32_t ssts = regs->ssts;
+
+	if ((ssts & 0x0F) != AHCI_PORT_SSTS_DET_PRESENT || ((ssts >> 8) & 0x0F) != AHCI_PORT_SSTS_IPM_ACTIVE)
+		return;
+	// atapi and port multipliers are not supported
+	if (regs->sig != AHCI_SIG_ATA || number_of_actived_devices >= sizeof(dev_names) / sizeof(dev_names[0]))
+		return;
+
+	struct ahci_device *device = &devices[number_of_actived_devices];
+	device->dev_name = dev_names[number_of_actived_devices];
+	ahci_setup_port(&device->port, number, slots_mask);
+
+	// irq handler only walks actived devices
+	number_of_actived_devices++;
+	if (!ahci_identify(device, hba_ncq))
+	{
+		number_of_actived_devices--;
+		ahci_stop_port(regs);
+		return;
+	}
+
+	// each slot holds one request
+	struct block_device *bdev = kcalloc(1, sizeof(struct block_device));
+	bdev->name = device->dev_name;
+	bdev->sectors = device->sectors;
+	bdev->ops = &ahci_block_operations;
+	bdev->private = device;
+	register_block_device(bdev, __builtin_popcount(device->port.slots_mask), AHCI_MAX_SECTORS, AHCI_PRDT_ENTRIES);
+
+	DEBUG &&debug_println(DEBUG_INFO, "AHCI: Identified %s on port %d, %d sectors%s",
+						  device->dev_name, number, (uint32_t)device->sectors, device->port.ncq ? ", ncq" : "");
+}
+
+void ahci_init()
+{
+	DEBUG &&debug_println(DEBUG_INFO, "AHCI: Initializing");
+
+	struct pci_device *dev = get_pci_device_by_class(PCI_CLASS_CODE_MASS_STORAGE, PCI_SUBCLASS_SATA);
+	if (!dev)
+		return;
+
+	// bar5 is abar (memory mapped registers)
+	uint32_t abar = pci_read_field(dev->address, PCI_BAR5) & ~0x0F;
+	pci_write_field(dev->address, PCI_COMMAND, pci_get_command(dev->address) | PCI_COMMAND_REG_MEMORY_SPACE | PCI_COMMAND_REG_BUS_MASTER);
+	hba = ahci_map(abar, sizeof(struct ahci_hba_memory), I86_PTE_PRESENT | I86_PTE_WRITABLE | I86_PTE_WRITETHOUGH | I86_PTE_NOT_CACHEABLE);
+	hba->ghc |= AHCI_GHC_AE;
+
+	uint32_t cap = hba->cap;
+	uint8_t n_slots = AHCI_CAP_NCS(cap);
+	uint32_t slots_mask = n_slots == AHCI_MAX_SLOTS ? 0xFFFFFFFF : (1u << n_slots) - 1;
+
+	// legacy pin interrupt, msi needs local apic which is not set up
+	uint8_t interrupt_line = pci_get_interrupt_line(dev->address);
+	register_interrupt_handler(32 + interrupt_line, ahci_irq);
+	pic_clear_mask(interrupt_line);
+	hba->is = hba->is;
+	hba->ghc |= AHCI_GHC_IE;
+
+	uint32_t pi = hba->pi;
+	for (uint8_t i = 0; i < AHCI_MAX_PORTS; ++i)
+		if (pi & (1u << i))
+			ahci_probe_port(i, slots_mask, cap & AHCI_CAP_SNCQ);
+
+	DEBUG &&debug_println(DEBUG_INFO, "AHCI: Done");
+}
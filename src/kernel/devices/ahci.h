@@ -0,0 +1,217 @@
+#ifndef DEVICE_AHCI_H
+#define DEVICE_AHCI_H
+
+#include <include/list.h>
+#include <memory/pmm.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// abar, command lists and command tables are mapped into device drivers area
+#define AHCI_VADDR 0xE8000000
+
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+// larger transfers are split by caller, a page of buffer per prd entry (buffer might not start at page boundary)
+#define AHCI_MAX_SECTORS 128
+#define AHCI_SECTOR_SIZE 512
+#define AHCI_PRDT_ENTRIES (AHCI_MAX_SECTORS * AHCI_SECTOR_SIZE / PMM_FRAME_SIZE + 1)
+// command table is 128-byte aligned, header (128 bytes) + prdt is rounded up
+#define AHCI_CMD_TABLE_SIZE 512
+#define AHCI_CMD_LIST_SIZE (AHCI_MAX_SLOTS * sizeof(struct ahci_cmd_header))
+#define AHCI_RECEIVED_FIS_SIZE 256
+// command list (1KB) + received fis (256 bytes) share the first page, command tables follow
+#define AHCI_PORT_PAGES (1 + AHCI_MAX_SLOTS * AHCI_CMD_TABLE_SIZE / PMM_FRAME_SIZE)
+
+// generic host control
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1)
+#define AHCI_CAP_SNCQ (1 << 30)
+#define AHCI_CAP_S64A (1u << 31)
+#define AHCI_GHC_HR (1 << 0)
+#define AHCI_GHC_IE (1 << 1)
+#define AHCI_GHC_AE (1u << 31)
+
+// port
+#define AHCI_PORT_CMD_ST (1 << 0)
+#define AHCI_PORT_CMD_FRE (1 << 4)
+#define AHCI_PORT_CMD_FR (1 << 14)
+#define AHCI_PORT_CMD_CR (1 << 15)
+#define AHCI_PORT_IS_DHRS (1 << 0)
+#define AHCI_PORT_IS_PSS (1 << 1)
+#define AHCI_PORT_IS_DSS (1 << 2)
+#define AHCI_PORT_IS_SDBS (1 << 3)
+#define AHCI_PORT_IS_IFS (1 << 27)
+#define AHCI_PORT_IS_HBDS (1 << 28)
+#define AHCI_PORT_IS_HBFS (1 << 29)
+#define AHCI_PORT_IS_TFES (1 << 30)
+#define AHCI_PORT_IS_ERROR (AHCI_PORT_IS_IFS | AHCI_PORT_IS_HBDS | AHCI_PORT_IS_HBFS | AHCI_PORT_IS_TFES)
+#define AHCI_PORT_IE_DEFAULT (AHCI_PORT_IS_DHRS | AHCI_PORT_IS_PSS | AHCI_PORT_IS_DSS | AHCI_PORT_IS_SDBS | AHCI_PORT_IS_ERROR)
+#define AHCI_PORT_TFD_ERR 0x01
+#define AHCI_PORT_TFD_DRQ 0x08
+#define AHCI_PORT_TFD_BSY 0x80
+#define AHCI_PORT_SSTS_DET_PRESENT 3
+#define AHCI_PORT_SSTS_IPM_ACTIVE 1
+#define AHCI_SIG_ATA 0x00000101
+
+#define AHCI_FIS_TYPE_REG_H2D 0x27
+#define AHCI_FIS_C (1 << 7)
+#define AHCI_FIS_DEVICE_LBA (1 << 6)
+#define AHCI_FIS_DEVICE_FUA (1 << 7)
+
+#define AHCI_CMD_READ_DMA_EXT 0x25
+#define AHCI_CMD_WRITE_DMA_EXT 0x35
+#define AHCI_CMD_WRITE_DMA_FUA_EXT 0x3D
+#define AHCI_CMD_READ_FPDMA_QUEUED 0x60
+#define AHCI_CMD_WRITE_FPDMA_QUEUED 0x61
+#define AHCI_CMD_CACHE_FLUSH_EXT 0xEA
+#define AHCI_CMD_IDENTIFY 0xEC
+
+// identify: word 75 is queue depth - 1, word 76 bit 8 is ncq support, word 84 bit 6 is write dma fua ext support
+#define AHCI_IDENTIFY_QUEUE_DEPTH 75
+#define AHCI_IDENTIFY_SATA_CAP 76
+#define AHCI_IDENTIFY_SATA_CAP_NCQ (1 << 8)
+#define AHCI_IDENTIFY_FEATURES 84
+#define AHCI_IDENTIFY_FEATURES_FUA (1 << 6)
+
+#define AHCI_PRD_DBC_MASK 0x3FFFFF
+#define AHCI_PRD_I (1u << 31)
+
+// registers are naturally aligned dwords -> no packing needed
+struct ahci_hba_port
+{
+	uint32_t clb;
+	uint32_t clbu;
+	uint32_t fb;
+	uint32_t fbu;
+	uint32_t is;
+	uint32_t ie;
+	uint32_t cmd;
+	uint32_t reserved0;
+	uint32_t tfd;
+	uint32_t sig;
+	uint32_t ssts;
+	uint32_t sctl;
+	uint32_t serr;
+	uint32_t sact;
+	uint32_t ci;
+	uint32_t sntf;
+	uint32_t fbs;
+	uint32_t reserved1[11];
+	uint32_t vendor[4];
+};
+
+struct ahci_hba_memory
+{
+	uint32_t cap;
+	uint32_t ghc;
+	uint32_t is;
+	uint32_t pi;
+	uint32_t vs;
+	uint32_t ccc_ctl;
+	uint32_t ccc_pts;
+	uint32_t em_loc;
+	uint32_t em_ctl;
+	uint32_t cap2;
+	uint32_t bohc;
+	uint8_t reserved[0x74];
+	uint8_t vendor[0x60];
+	struct ahci_hba_port ports[AHCI_MAX_PORTS];
+};
+
+struct __attribute__((packed)) ahci_cmd_header
+{
+	// fis length in dwords
+	uint8_t cfl : 5;
+	uint8_t a : 1;
+	// write (host to device)
+	uint8_t w : 1;
+	uint8_t p : 1;
+	uint8_t r : 1;
+	uint8_t b : 1;
+	uint8_t c : 1;
+	uint8_t reserved0 : 1;
+	uint8_t pmp : 4;
+	uint16_t prdtl;
+	// bytes transferred, updated by hba
+	volatile uint32_t prdbc;
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t reserved1[4];
+};
+
+struct __attribute__((packed)) ahci_prd
+{
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t reserved;
+	// byte count - 1 (bit 0 must be 1), highest bit asks for an interrupt
+	uint32_t dbc;
+};
+
+struct __attribute__((packed)) ahci_cmd_table
+{
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	struct ahci_prd prdt[];
+};
+
+struct __attribute__((packed)) ahci_fis_reg_h2d
+{
+	uint8_t fis_type;
+	// port multiplier (low 4 bits), command/control (highest bit)
+	uint8_t flags;
+	uint8_t command;
+	uint8_t featurel;
+	uint8_t lba0;
+	uint8_t lba1;
+	uint8_t lba2;
+	uint8_t device;
+	uint8_t lba3;
+	uint8_t lba4;
+	uint8_t lba5;
+	uint8_t featureh;
+	uint8_t countl;
+	uint8_t counth;
+	uint8_t icc;
+	uint8_t control;
+	uint8_t reserved[4];
+};
+
+// called from irq handler when the command is done, err is 0 or -EIO
+typedef void (*ahci_callback)(int err, void *arg);
+
+struct ahci_slot
+{
+	ahci_callback callback;
+	void *arg;
+};
+
+struct ahci_port
+{
+	uint8_t number;
+	volatile struct ahci_hba_port *regs;
+	struct ahci_cmd_header *cmd_list;
+	struct ahci_cmd_table *cmd_tables[AHCI_MAX_SLOTS];
+	uint32_t cmd_tables_paddr[AHCI_MAX_SLOTS];
+	// slots which can be used, limited by hba and device queue depth
+	uint32_t slots_mask;
+	// issued slots, irq handler clears them when commands complete
+	uint32_t active;
+	bool ncq;
+	bool fua;
+	struct ahci_slot slots[AHCI_MAX_SLOTS];
+	// threads which wait for a free slot
+	struct list_head slot_waiters;
+};
+
+struct ahci_device
+{
+	char *dev_name;
+	uint64_t sectors;
+	struct ahci_port port;
+};
+
+void ahci_init();
+struct ahci_device *get_ahci_device(char *dev_name);
+
+#endif
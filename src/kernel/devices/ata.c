@@ -2,8 +2,12 @@
 
 #include <cpu/hal.h>
 #include <cpu/idt.h>
+#include <devices/block.h>
+#include <devices/pci.h>
 #include <include/errno.h>
 #include <memory/vmm.h>
+#include <proc/task.h>
+#include <utils/math.h>
 #include <utils/printf.h>
 #include <utils/string.h>
 
@@ -11,7 +15,9 @@
 
 static struct ata_device devices[MAX_ATA_DEVICE];
 static uint8_t number_of_actived_devices = 0;
-static volatile bool ata_irq_called;
+static struct ata_channel channels[2];
+// inside the kernel image -> physically contiguous, 512-byte alignment keeps a table inside a 64KB boundary
+static struct ata_prd ata_prdts[2][ATA_PRD_ENTRIES] __attribute__((aligned(512)));
 
 static void ata_400ns_delays(struct ata_device *device)
 {
@@ -68,19 +74,39 @@ static uint8_t ata_polling_identify(struct ata_device *device)
 
 static int32_t ata_irq(struct interrupt_registers *regs)
 {
-	ata_irq_called = true;
+	struct ata_channel *channel = &channels[regs->int_no == IRQ14 ? 0 : 1];
+	if (channel->bmide)
+	{
+		// irq and error bits are cleared by writing 1
+		channel->bm_status = inportb(channel->bmide + ATA_BMR_STATUS);
+		outportb(channel->bmide + ATA_BMR_STATUS, channel->bm_status | ATA_BMR_STATUS_IRQ | ATA_BMR_STATUS_ERR);
+	}
+	// reading status register acknowledges the interrupt of device
+	inportb(channel->io_base + ATA_REG_STATUS);
+
+	channel->irq_called = true;
+	if (channel->waiter && channel->waiter->state == THREAD_WAITING)
+		update_thread(channel->waiter, THREAD_READY);
 	irq_ack(regs->int_no);
 
 	return IRQ_HANDLER_CONTINUE;
 }
 
-static int32_t ata_wait_irq()
+// caller clears irq_called before issuing the command -> an early irq is not lost
+static void ata_wait_irq(struct ata_channel *channel)
 {
-	while (!ata_irq_called)
-		;
-	ata_irq_called = false;
-
-	return IRQ_HANDLER_CONTINUE;
+	lock_scheduler();
+	channel->waiter = (struct thread *)current_thread;
+	while (!channel->irq_called)
+	{
+		update_thread(current_thread, THREAD_WAITING);
+		unlock_scheduler();
+		schedule();
+		lock_scheduler();
+	}
+	channel->waiter = NULL;
+	channel->irq_called = false;
+	unlock_scheduler();
 }
 
 static uint8_t ata_identify(struct ata_device *device)
@@ -92,7 +118,7 @@ static uint8_t ata_identify(struct ata_device *device)
 	outportb(device->io_base + 3, 0);
 	outportb(device->io_base + 4, 0);
 	outportb(device->io_base + 5, 0);
-	outportb(device->io_base + 7, 0xEC);
+	outportb(device->io_base + 7, ATA_CMD_IDENTIFY);
 
 	uint8_t identify_status = ata_polling_identify(device);
 	if (identify_status != ATA_IDENTIFY_SUCCESS)
@@ -104,6 +130,13 @@ static uint8_t ata_identify(struct ata_device *device)
 
 		inportsw(device->io_base, buffer, 256);
 
+		// word 83 bit 10: 48-bit address feature set, words 100-103: lba48 sectors, words 60-61: lba28 sectors
+		device->lba48 = buffer[83] & (1 << 10);
+		if (device->lba48)
+			device->sectors = buffer[100] | ((uint64_t)buffer[101] << 16) | ((uint64_t)buffer[102] << 32) | ((uint64_t)buffer[103] << 48);
+		else
+			device->sectors = buffer[60] | ((uint32_t)buffer[61] << 16);
+
 		return ATA_IDENTIFY_SUCCESS;
 	}
 	return ATA_IDENTIFY_ERR;
@@ -138,6 +171,7 @@ static struct ata_device *ata_detect(uint16_t io_addr1, uint16_t io_addr2, uint8
 	device->associated_io_base = io_addr2;
 	device->irq = irq;
 	device->is_master = is_master;
+	device->channel = &channels[io_addr1 == ATA0_IO_ADDR1 ? 0 : 1];
 
 	if (ata_identify(device) == ATA_IDENTIFY_SUCCESS)
 	{
@@ -158,17 +192,52 @@ static struct ata_device *ata_detect(uint16_t io_addr1, uint16_t io_addr2, uint8
 	return 0;
 }
 
-int8_t ata_read(struct ata_device *device, uint32_t lba, uint8_t n_sectors, uint16_t *buffer)
+static bool ata_use_lba48(struct ata_device *device, uint32_t lba, uint16_t n_sectors)
+{
+	return device->lba48 && lba + n_sectors - 1 > ATA_LBA28_MAX;
+}
+
+static void ata_select_sectors(struct ata_device *device, uint32_t lba, uint16_t n_sectors, bool lba48)
+{
+	if (lba48)
+	{
+		// high bytes are written first, each register is a two-byte fifo
+		outportb(device->io_base + ATA_REG_HDDEVSEL, device->is_master ? 0x40 : 0x50);
+		ata_400ns_delays(device);
+
+		outportb(device->io_base + ATA_REG_SECCOUNT, (uint8_t)(n_sectors >> 8));
+		outportb(device->io_base + ATA_REG_LBA0, (uint8_t)(lba >> 24));
+		outportb(device->io_base + ATA_REG_LBA1, 0);
+		outportb(device->io_base + ATA_REG_LBA2, 0);
+	}
+	else
+	{
+		outportb(device->io_base + ATA_REG_HDDEVSEL, (device->is_master ? 0xE0 : 0xF0) | ((lba >> 24) & 0x0F));
+		ata_400ns_delays(device);
+
+		outportb(device->io_base + ATA_REG_FEATURES, 0x00);
+	}
+	outportb(device->io_base + ATA_REG_SECCOUNT, (uint8_t)n_sectors);
+	outportb(device->io_base + ATA_REG_LBA0, (uint8_t)lba);
+	outportb(device->io_base + ATA_REG_LBA1, (uint8_t)(lba >> 8));
+	outportb(device->io_base + ATA_REG_LBA2, (uint8_t)(lba >> 16));
+}
+
+static int8_t ata_flush(struct ata_device *device, bool lba48)
 {
-	outportb(device->io_base + 6, (device->is_master ? 0xE0 : 0xF0) | ((lba >> 24) & 0x0F));
+	outportb(device->io_base + ATA_REG_COMMAND, lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
 	ata_400ns_delays(device);
+	while (inportb(device->io_base + ATA_REG_STATUS) & ATA_SREG_BSY)
+		;
+	return inportb(device->io_base + ATA_REG_STATUS) & (ATA_SREG_ERR | ATA_SREG_DF) ? -EIO : 0;
+}
 
-	outportb(device->io_base + 1, 0x00);
-	outportb(device->io_base + 2, n_sectors);
-	outportb(device->io_base + 3, (uint8_t)lba);
-	outportb(device->io_base + 4, (uint8_t)(lba >> 8));
-	outportb(device->io_base + 5, (uint8_t)(lba >> 16));
-	outportb(device->io_base + 7, 0x20);
+// fallback without bus master controller
+static int8_t ata_pio_read(struct ata_device *device, uint32_t lba, uint16_t n_sectors, uint16_t *buffer)
+{
+	bool lba48 = ata_use_lba48(device, lba, n_sectors);
+	ata_select_sectors(device, lba, n_sectors, lba48);
+	outportb(device->io_base + ATA_REG_COMMAND, lba48 ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO);
 
 	if (ata_polling(device) == ATA_POLLING_ERR)
 		return -ENXIO;
@@ -184,17 +253,11 @@ int8_t ata_read(struct ata_device *device, uint32_t lba, uint8_t n_sectors, uint
 	return 0;
 }
 
-int8_t ata_write(struct ata_device *device, uint32_t lba, uint8_t n_sectors, uint16_t *buffer)
+static int8_t ata_pio_write(struct ata_device *device, uint32_t lba, uint16_t n_sectors, uint16_t *buffer)
 {
-	outportb(device->io_base + 6, (device->is_master ? 0xE0 : 0xF0) | ((lba >> 24) & 0x0F));
-	ata_400ns_delays(device);
-
-	outportb(device->io_base + 1, 0x00);
-	outportb(device->io_base + 2, n_sectors);
-	outportb(device->io_base + 3, (uint8_t)lba);
-	outportb(device->io_base + 4, (uint8_t)(lba >> 8));
-	outportb(device->io_base + 5, (uint8_t)(lba >> 16));
-	outportb(device->io_base + 7, 0x30);
+	bool lba48 = ata_use_lba48(device, lba, n_sectors);
+	ata_select_sectors(device, lba, n_sectors, lba48);
+	outportb(device->io_base + ATA_REG_COMMAND, lba48 ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO);
 
 	if (ata_polling(device) == ATA_POLLING_ERR)
 		return -ENXIO;
@@ -202,19 +265,179 @@ int8_t ata_write(struct ata_device *device, uint32_t lba, uint8_t n_sectors, uin
 	for (int i = 0; i < n_sectors; ++i)
 	{
 		outportsw(device->io_base, buffer + i * 256, 256);
-		outportw(device->io_base + 7, 0xE7);
 		ata_400ns_delays(device);
 
 		if (ata_polling(device) == ATA_POLLING_ERR)
 			return -ENXIO;
 	}
+	return ata_flush(device, lba48);
+}
+
+// buffer is only virtually contiguous -> one entry per physically contiguous run (which doesn't cross 64KB)
+// returns the last entry, the next buffer is appended after it
+static struct ata_prd *ata_prdt_add(struct ata_channel *channel, struct ata_prd *prd, void *buffer, uint32_t size)
+{
+	for (uint32_t offset = 0; offset < size;)
+	{
+		uint32_t vaddr = (uint32_t)buffer + offset;
+		uint32_t len = min(size - offset, PMM_FRAME_SIZE - (vaddr & (PMM_FRAME_SIZE - 1)));
+		uint32_t paddr = vmm_get_physical_address(vaddr, false);
+		// count 0 is 64KB
+		uint32_t prd_end = prd ? prd->paddr + (prd->count ? prd->count : 0x10000) : 0;
+
+		if (prd && prd_end == paddr && (prd->paddr >> 16) == ((paddr + len - 1) >> 16))
+			prd->count += len;
+		else
+		{
+			prd = prd ? prd + 1 : channel->prdt;
+			prd->paddr = paddr;
+			prd->count = len;
+			prd->flags = 0;
+		}
+		offset += len;
+	}
+	return prd;
+}
+
+static void ata_build_prdt(struct ata_channel *channel, uint16_t *buffer, uint32_t size)
+{
+	ata_prdt_add(channel, NULL, buffer, size)->flags = ATA_PRD_EOT;
+}
+
+// bios of request are adjacent on disk, the table gathers their buffers
+static void ata_build_request_prdt(struct ata_channel *channel, struct request *req)
+{
+	struct ata_prd *prd = NULL;
+	struct bio *bio;
+	list_for_each_entry(bio, &req->bios, bi_sibling)
+	{
+		prd = ata_prdt_add(channel, prd, bio->bi_buf, bio->bi_size);
+	}
+	prd->flags = ATA_PRD_EOT;
+}
+
+// prdt is built by caller, thread sleeps until irq14/15 signals the end of transfer
+static int8_t ata_dma_transfer(struct ata_device *device, uint32_t lba, uint16_t n_sectors, bool write)
+{
+	struct ata_channel *channel = device->channel;
+	bool lba48 = ata_use_lba48(device, lba, n_sectors);
+	uint8_t direction = write ? 0 : ATA_BMR_CMD_READ;
+	uint8_t command = write ? (lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA)
+							: (lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+
+	outportb(channel->bmide + ATA_BMR_COMMAND, 0);
+	outportl(channel->bmide + ATA_BMR_PRDT, vmm_get_physical_address((uint32_t)channel->prdt, false));
+	outportb(channel->bmide + ATA_BMR_COMMAND, direction);
+	outportb(channel->bmide + ATA_BMR_STATUS, inportb(channel->bmide + ATA_BMR_STATUS) | ATA_BMR_STATUS_IRQ | ATA_BMR_STATUS_ERR);
+
+	channel->irq_called = false;
+	ata_select_sectors(device, lba, n_sectors, lba48);
+	outportb(device->io_base + ATA_REG_COMMAND, command);
+	outportb(channel->bmide + ATA_BMR_COMMAND, direction | ATA_BMR_CMD_START);
+
+	ata_wait_irq(channel);
+	outportb(channel->bmide + ATA_BMR_COMMAND, 0);
+
+	if ((channel->bm_status & ATA_BMR_STATUS_ERR) || (inportb(device->io_base + ATA_REG_STATUS) & (ATA_SREG_ERR | ATA_SREG_DF)))
+		return -EIO;
+	return write ? ata_flush(device, lba48) : 0;
+}
+
+int8_t ata_read(struct ata_device *device, uint32_t lba, uint16_t n_sectors, uint16_t *buffer)
+{
+	if (!n_sectors || n_sectors > ATA_MAX_SECTORS)
+		return -EINVAL;
+
+	struct ata_channel *channel = device->channel;
+	acquire_semaphore(&channel->lock);
+	int8_t ret;
+	if (channel->bmide)
+	{
+		ata_build_prdt(channel, buffer, n_sectors * ATA_SECTOR_SIZE);
+		ret = ata_dma_transfer(device, lba, n_sectors, false);
+	}
+	else
+		ret = ata_pio_read(device, lba, n_sectors, buffer);
+	release_semaphore(&channel->lock);
+	return ret;
+}
+
+int8_t ata_write(struct ata_device *device, uint32_t lba, uint16_t n_sectors, uint16_t *buffer)
+{
+	if (!n_sectors || n_sectors > ATA_MAX_SECTORS)
+		return -EINVAL;
+
+	struct ata_channel *channel = device->channel;
+	acquire_semaphore(&channel->lock);
+	int8_t ret;
+	if (channel->bmide)
+	{
+		ata_build_prdt(channel, buffer, n_sectors * ATA_SECTOR_SIZE);
+		ret = ata_dma_transfer(device, lba, n_sectors, true);
+	}
+	else
+		ret = ata_pio_write(device, lba, n_sectors, buffer);
+	release_semaphore(&channel->lock);
+	return ret;
+}
+
+// synchronous, the request is completed before returning
+static int ata_submit_request(struct block_device *bdev, struct request *req)
+{
+	struct ata_device *device = bdev->private;
+	struct ata_channel *channel = device->channel;
+	bool write = req->rw == BIO_WRITE;
+	int8_t ret = 0;
+
+	acquire_semaphore(&channel->lock);
+	if (channel->bmide)
+	{
+		ata_build_request_prdt(channel, req);
+		ret = ata_dma_transfer(device, req->sector, req->n_sectors, write);
+	}
+	else
+	{
+		// without bus master, each bio is a separate pio command
+		struct bio *bio;
+		sector_t sector = req->sector;
+		list_for_each_entry(bio, &req->bios, bi_sibling)
+		{
+			uint16_t n_sectors = bio->bi_size / ATA_SECTOR_SIZE;
+			ret = write ? ata_pio_write(device, sector, n_sectors, (uint16_t *)bio->bi_buf)
+						: ata_pio_read(device, sector, n_sectors, (uint16_t *)bio->bi_buf);
+			if (ret < 0)
+				break;
+			sector += n_sectors;
+		}
+	}
+	release_semaphore(&channel->lock);
+
+	blk_end_request(req, ret);
 	return 0;
 }
 
+static struct block_device_operations ata_block_operations = {
+	.submit = ata_submit_request,
+};
+
+// master and slave share the channel -> one request at a time
+static void ata_register_block_device(struct ata_device *device)
+{
+	struct block_device *bdev = kcalloc(1, sizeof(struct block_device));
+	bdev->name = device->dev_name;
+	bdev->sectors = device->sectors;
+	bdev->ops = &ata_block_operations;
+	bdev->private = device;
+	register_block_device(bdev, 1, ATA_MAX_SECTORS, ATA_PRD_ENTRIES);
+}
+
 int8_t atapi_read(struct ata_device *device, uint32_t lba, uint8_t n_sectors, uint16_t *buffer)
 {
 	uint8_t packet[12] = {0xA8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	struct ata_channel *channel = device->channel;
+	int8_t ret = 0;
 
+	acquire_semaphore(&channel->lock);
 	outportb(device->io_base + 6, device->is_master ? 0xE0 : 0xF0);
 	ata_400ns_delays(device);
 
@@ -231,9 +454,10 @@ int8_t atapi_read(struct ata_device *device, uint32_t lba, uint8_t n_sectors, ui
 	packet[4] = (lba >> 0x08) & 0xFF;
 	packet[5] = (lba >> 0x00) & 0xFF;
 
+	channel->irq_called = false;
 	outportsw(device->io_base, (uint16_t *)packet, 6);
 
-	ata_wait_irq();
+	ata_wait_irq(channel);
 	ata_polling(device);
 
 	for (int i = 0; i < n_sectors; ++i)
@@ -241,9 +465,13 @@ int8_t atapi_read(struct ata_device *device, uint32_t lba, uint8_t n_sectors, ui
 		inportsw(device->io_base, buffer + 256 * i, 256);
 
 		if (ata_polling(device) == ATA_POLLING_ERR)
-			return -ENXIO;
+		{
+			ret = -ENXIO;
+			break;
+		}
 	}
-	return 0;
+	release_semaphore(&channel->lock);
+	return ret;
 }
 
 struct ata_device *get_ata_device(char *dev_name)
@@ -260,6 +488,30 @@ uint8_t ata_init()
 {
 	DEBUG &&debug_println(DEBUG_INFO, "ATA: Initializing");
 
+	// bar4 of ide controller is the bus master base of primary channel, secondary one follows it
+	uint16_t bmide = 0;
+	struct pci_device *ide = get_pci_device_by_class(PCI_CLASS_CODE_MASS_STORAGE, PCI_SUBCLASS_IDE);
+	if (ide)
+	{
+		uint32_t bar4 = pci_read_field(ide->address, PCI_BAR4);
+		if (bar4 & 1)
+		{
+			bmide = bar4 & ~3;
+			pci_write_field(ide->address, PCI_COMMAND, pci_get_command(ide->address) | PCI_COMMAND_REG_BUS_MASTER);
+			DEBUG &&debug_println(DEBUG_INFO, "ATA: Bus master IDE at 0x%x", bmide);
+		}
+	}
+
+	uint16_t io_bases[2] = {ATA0_IO_ADDR1, ATA1_IO_ADDR1};
+	for (int i = 0; i < 2; ++i)
+	{
+		struct ata_channel *channel = &channels[i];
+		channel->io_base = io_bases[i];
+		channel->bmide = bmide ? bmide + i * 8 : 0;
+		channel->prdt = ata_prdts[i];
+		sema_init(&channel->lock, 1);
+	}
+
 	register_interrupt_handler(IRQ14, ata_irq);
 	register_interrupt_handler(IRQ15, ata_irq);
 
@@ -268,6 +520,10 @@ uint8_t ata_init()
 	ata_detect(ATA1_IO_ADDR1, ATA1_IO_ADDR2, ATA1_IRQ, true, "/dev/hdc");
 	ata_detect(ATA1_IO_ADDR1, ATA1_IO_ADDR2, ATA1_IRQ, false, "/dev/hdd");
 
+	for (uint8_t i = 0; i < number_of_actived_devices; ++i)
+		if (devices[i].is_harddisk)
+			ata_register_block_device(&devices[i]);
+
 	DEBUG &&debug_println(DEBUG_INFO, "ATA: DONE");
 	return 0;
 }
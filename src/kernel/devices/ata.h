@@ -1,6 +1,8 @@
 #ifndef DEVICE_ATA_H
 #define DEVICE_ATA_H
 
+#include <locking/semaphore.h>
+#include <memory/pmm.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -17,6 +19,48 @@
 // #define ATA3_IO_ADDR2 0x360
 // #define ATA3_IRQ 9
 
+#define ATA_REG_DATA 0
+#define ATA_REG_FEATURES 1
+#define ATA_REG_SECCOUNT 2
+#define ATA_REG_LBA0 3
+#define ATA_REG_LBA1 4
+#define ATA_REG_LBA2 5
+#define ATA_REG_HDDEVSEL 6
+#define ATA_REG_COMMAND 7
+#define ATA_REG_STATUS 7
+
+#define ATA_CMD_READ_PIO 0x20
+#define ATA_CMD_READ_PIO_EXT 0x24
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_PIO 0x30
+#define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_CACHE_FLUSH 0xE7
+#define ATA_CMD_CACHE_FLUSH_EXT 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
+
+// bus master ide registers (offset from bar4, secondary channel is at +8)
+#define ATA_BMR_COMMAND 0
+#define ATA_BMR_STATUS 2
+#define ATA_BMR_PRDT 4
+#define ATA_BMR_CMD_START 0x01
+#define ATA_BMR_CMD_READ 0x08
+#define ATA_BMR_STATUS_ACTIVE 0x01
+#define ATA_BMR_STATUS_ERR 0x02
+#define ATA_BMR_STATUS_IRQ 0x04
+
+// lba28 commands reach 128GB, lba48 is used above it if the disk supports
+#define ATA_LBA28_MAX 0x0FFFFFFF
+// sector count register of lba28 commands treats 0 as 256
+#define ATA_MAX_SECTORS 256
+#define ATA_SECTOR_SIZE 512
+// the last entry is marked by the highest bit of its count
+#define ATA_PRD_EOT 0x8000
+// a page of buffer per entry (buffer might not start at page boundary)
+#define ATA_PRD_ENTRIES (ATA_MAX_SECTORS * ATA_SECTOR_SIZE / PMM_FRAME_SIZE + 1)
+
 #define ATA_SREG_ERR 0x01
 #define ATA_SREG_DF 0x20
 #define ATA_SREG_DRQ 0x08
@@ -29,6 +73,30 @@
 #define ATA_IDENTIFY_SUCCESS 1
 #define ATA_IDENTIFY_NOT_FOUND 2
 
+struct thread;
+
+struct __attribute__((packed)) ata_prd
+{
+	uint32_t paddr;
+	// 0 means 64KB
+	uint16_t count;
+	uint16_t flags;
+};
+
+// master and slave share the channel -> only one command is in flight
+struct ata_channel
+{
+	uint16_t io_base;
+	// 0 if there is no bus master ide controller -> pio is used
+	uint16_t bmide;
+	struct semaphore lock;
+	volatile bool irq_called;
+	// bus master status when irq arrived
+	uint8_t bm_status;
+	struct thread *waiter;
+	struct ata_prd *prdt;
+};
+
 struct ata_device
 {
 	uint16_t io_base;
@@ -37,11 +105,14 @@ struct ata_device
 	char *dev_name;
 	bool is_master;
 	bool is_harddisk;
+	bool lba48;
+	uint64_t sectors;
+	struct ata_channel *channel;
 };
 
 uint8_t ata_init();
-int8_t ata_read(struct ata_device *device, uint32_t lba, uint8_t n_sectors, uint16_t *buffer);
-int8_t ata_write(struct ata_device *device, uint32_t lba, uint8_t n_sectors, uint16_t *buffer);
+int8_t ata_read(struct ata_device *device, uint32_t lba, uint16_t n_sectors, uint16_t *buffer);
+int8_t ata_write(struct ata_device *device, uint32_t lba, uint16_t n_sectors, uint16_t *buffer);
 int8_t atapi_read(struct ata_device *device, uint32_t lba, uint8_t n_sectors, uint16_t *buffer);
 struct ata_device *get_ata_device(char *dev_name);
 #endif
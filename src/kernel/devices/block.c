@@ -0,0 +1,390 @@
+#include "block.h"
+
+#include <include/errno.h>
+#include <memory/pmm.h>
+#include <memory/vmm.h>
+#include <proc/task.h>
+#include <system/time.h>
+#include <utils/math.h>
+#include <utils/printf.h>
+#include <utils/string.h>
+
+static LIST_HEAD(block_devices);
+
+struct bio_wait
+{
+	struct thread *thread;
+	volatile uint32_t pending;
+	int err;
+};
+
+static uint32_t bio_pages(struct bio *bio)
+{
+	uint32_t start = (uint32_t)bio->bi_buf / PMM_FRAME_SIZE;
+	uint32_t end = ((uint32_t)bio->bi_buf + bio->bi_size - 1) / PMM_FRAME_SIZE;
+	return end - start + 1;
+}
+
+static uint32_t bio_sectors(struct bio *bio)
+{
+	return bio->bi_size / BLOCK_SECTOR_SIZE;
+}
+
+void register_block_device(struct block_device *bdev, uint32_t depth, uint32_t max_sectors, uint32_t max_pages)
+{
+	struct request_queue *q = &bdev->queue;
+	q->depth = depth;
+	q->max_sectors = max_sectors;
+	q->max_pages = max_pages;
+	for (int rw = BIO_READ; rw <= BIO_WRITE; ++rw)
+	{
+		INIT_LIST_HEAD(&q->sorted[rw]);
+		INIT_LIST_HEAD(&q->fifo[rw]);
+	}
+	INIT_LIST_HEAD(&q->free_requests);
+
+	list_add_tail(&bdev->sibling, &block_devices);
+	DEBUG &&debug_println(DEBUG_INFO, "Block: Registered %s", bdev->name);
+}
+
+struct block_device *get_block_device(const char *name)
+{
+	struct block_device *iter;
+	list_for_each_entry(iter, &block_devices, sibling)
+	{
+		if (!strcmp(iter->name, name))
+			return iter;
+	}
+	return NULL;
+}
+
+struct bio *bio_alloc(struct block_device *bdev, sector_t sector, char *buf, uint32_t size, uint8_t rw)
+{
+	struct bio *bio = kcalloc(1, sizeof(struct bio));
+	bio->bi_bdev = bdev;
+	bio->bi_sector = sector;
+	bio->bi_buf = buf;
+	bio->bi_size = size;
+	bio->bi_rw = rw;
+	return bio;
+}
+
+void bio_free(struct bio *bio)
+{
+	kfree(bio);
+}
+
+static struct request *blk_get_request(struct request_queue *q)
+{
+	lock_scheduler();
+	struct request *req = list_first_entry_or_null(&q->free_requests, struct request, sort_sibling);
+	if (req)
+		list_del(&req->sort_sibling);
+	unlock_scheduler();
+
+	return req ? req : kcalloc(1, sizeof(struct request));
+}
+
+// keeps sorted list in lba order, caller holds the scheduler lock
+static void elv_sort_request(struct request_queue *q, struct request *req)
+{
+	struct request *iter;
+	list_for_each_entry(iter, &q->sorted[req->rw], sort_sibling)
+	{
+		if (iter->sector > req->sector)
+			break;
+	}
+	list_add_tail(&req->sort_sibling, &iter->sort_sibling);
+}
+
+// back or front merge into a pending request of the same direction, caller holds the scheduler lock
+static bool elv_merge(struct request_queue *q, struct bio *bio)
+{
+	uint32_t sectors = bio_sectors(bio);
+	uint32_t pages = bio_pages(bio);
+
+	struct request *req;
+	list_for_each_entry(req, &q->sorted[bio->bi_rw], sort_sibling)
+	{
+		if (req->n_sectors + sectors > q->max_sectors || req->n_pages + pages > q->max_pages)
+			continue;
+
+		if (req->sector + req->n_sectors == bio->bi_sector)
+			list_add_tail(&bio->bi_sibling, &req->bios);
+		else if (bio->bi_sector + sectors == req->sector)
+		{
+			list_add(&bio->bi_sibling, &req->bios);
+			req->sector = bio->bi_sector;
+			// request starts earlier now -> it might go before its previous neighbour
+			list_del(&req->sort_sibling);
+			elv_sort_request(q, req);
+		}
+		else
+			continue;
+
+		req->n_sectors += sectors;
+		req->n_pages += pages;
+		return true;
+	}
+	return false;
+}
+
+// caller holds the scheduler lock
+static void elv_add_request(struct request_queue *q, struct request *req)
+{
+	elv_sort_request(q, req);
+
+	req->deadline = get_milliseconds(NULL) + (req->rw == BIO_WRITE ? BLOCK_WRITE_EXPIRE : BLOCK_READ_EXPIRE);
+	list_add_tail(&req->fifo_sibling, &q->fifo[req->rw]);
+}
+
+static void elv_add_bio(struct request_queue *q, struct bio *bio, struct request *req)
+{
+	if (elv_merge(q, bio))
+	{
+		list_add_tail(&req->sort_sibling, &q->free_requests);
+		return;
+	}
+
+	req->bdev = bio->bi_bdev;
+	req->sector = bio->bi_sector;
+	req->n_sectors = bio_sectors(bio);
+	req->n_pages = bio_pages(bio);
+	req->rw = bio->bi_rw;
+	INIT_LIST_HEAD(&req->bios);
+	list_add_tail(&bio->bi_sibling, &req->bios);
+	elv_add_request(q, req);
+}
+
+// deadline: reads are preferred unless writes are starved, the oldest request goes first when it expires
+// otherwise the next one in lba order from the head position
+static struct request *elv_next_request(struct request_queue *q)
+{
+	bool reads = !list_empty(&q->fifo[BIO_READ]);
+	bool writes = !list_empty(&q->fifo[BIO_WRITE]);
+	if (!reads && !writes)
+		return NULL;
+
+	uint8_t rw;
+	if (reads && (!writes || q->starved < BLOCK_WRITES_STARVED))
+	{
+		rw = BIO_READ;
+		if (writes)
+			q->starved++;
+	}
+	else
+	{
+		rw = BIO_WRITE;
+		q->starved = 0;
+	}
+
+	struct request *req = list_first_entry(&q->fifo[rw], struct request, fifo_sibling);
+	if (req->deadline > get_milliseconds(NULL))
+	{
+		struct request *iter;
+		req = list_first_entry(&q->sorted[rw], struct request, sort_sibling);
+		list_for_each_entry(iter, &q->sorted[rw], sort_sibling)
+		{
+			if (iter->sector >= q->head)
+			{
+				req = iter;
+				break;
+			}
+		}
+	}
+
+	list_del(&req->sort_sibling);
+	list_del(&req->fifo_sibling);
+	q->head = req->sector + req->n_sectors;
+	return req;
+}
+
+// dispatches requests until the queue is empty or driver is full
+// synchronous drivers complete a request inside submit -> the loop is not re-entered from blk_end_request
+static void blk_run_queue(struct block_device *bdev)
+{
+	struct request_queue *q = &bdev->queue;
+
+	lock_scheduler();
+	if (q->running)
+	{
+		unlock_scheduler();
+		return;
+	}
+	q->running = true;
+
+	struct request *req;
+	while (q->in_flight < q->depth && (req = elv_next_request(q)))
+	{
+		q->in_flight++;
+		unlock_scheduler();
+
+		int ret = bdev->ops->submit(bdev, req);
+		if (ret < 0)
+			blk_end_request(req, ret);
+
+		lock_scheduler();
+	}
+	q->running = false;
+	unlock_scheduler();
+}
+
+void blk_end_request(struct request *req, int err)
+{
+	struct block_device *bdev = req->bdev;
+	struct request_queue *q = &bdev->queue;
+
+	lock_scheduler();
+	struct bio *bio, *next;
+	list_for_each_entry_safe(bio, next, &req->bios, bi_sibling)
+	{
+		list_del(&bio->bi_sibling);
+		bio->bi_error = err;
+		if (bio->bi_end_io)
+			bio->bi_end_io(bio);
+	}
+	list_add_tail(&req->sort_sibling, &q->free_requests);
+	q->in_flight--;
+	unlock_scheduler();
+
+	blk_run_queue(bdev);
+}
+
+static void blk_queue_bio(struct bio *bio)
+{
+	struct request_queue *q = &bio->bi_bdev->queue;
+	struct request *req = blk_get_request(q);
+
+	lock_scheduler();
+	elv_add_bio(q, bio, req);
+	unlock_scheduler();
+}
+
+void submit_bio(struct bio *bio)
+{
+	struct blk_plug *plug = current_thread->plug;
+	if (plug)
+	{
+		// keep plugged bios in sector order -> they are merged in fewer requests
+		struct bio *iter;
+		list_for_each_entry(iter, &plug->bios, bi_sibling)
+		{
+			if (iter->bi_bdev == bio->bi_bdev && iter->bi_sector > bio->bi_sector)
+				break;
+		}
+		list_add_tail(&bio->bi_sibling, &iter->bi_sibling);
+		return;
+	}
+
+	blk_queue_bio(bio);
+	blk_run_queue(bio->bi_bdev);
+}
+
+static void bio_wake(struct bio *bio)
+{
+	struct bio_wait *wait = bio->bi_private;
+	if (bio->bi_error)
+		wait->err = bio->bi_error;
+	if (--wait->pending == 0 && wait->thread->state == THREAD_WAITING)
+		update_thread(wait->thread, THREAD_READY);
+}
+
+static int bio_wait_pending(struct bio_wait *wait)
+{
+	// sleeping with plugged bios would wait forever
+	if (current_thread->plug)
+		blk_flush_plug(current_thread->plug);
+
+	lock_scheduler();
+	while (wait->pending)
+	{
+		update_thread(current_thread, THREAD_WAITING);
+		unlock_scheduler();
+		schedule();
+		lock_scheduler();
+	}
+	unlock_scheduler();
+
+	return wait->err;
+}
+
+int submit_bio_wait(struct bio *bio)
+{
+	struct bio_wait wait = {.thread = current_thread, .pending = 1};
+	bio->bi_private = &wait;
+	bio->bi_end_io = bio_wake;
+
+	submit_bio(bio);
+	return bio_wait_pending(&wait);
+}
+
+// bios are plugged -> adjacent ones are merged before any of them is dispatched, each bio keeps its own error
+int submit_bios_wait(struct bio *bios, uint32_t count)
+{
+	struct bio_wait wait = {.thread = current_thread, .pending = count};
+
+	struct blk_plug plug;
+	blk_start_plug(&plug);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		bios[i].bi_private = &wait;
+		bios[i].bi_end_io = bio_wake;
+		submit_bio(&bios[i]);
+	}
+	blk_finish_plug(&plug);
+
+	return bio_wait_pending(&wait);
+}
+
+// buffer is split by queue limits, all parts are in flight at the same time
+int blk_rw(struct block_device *bdev, sector_t sector, char *buf, uint32_t size, uint8_t rw)
+{
+	uint32_t chunk = bdev->queue.max_sectors * BLOCK_SECTOR_SIZE;
+	uint32_t n_bios = div_ceil(size, chunk);
+	struct bio *bios = kcalloc(n_bios, sizeof(struct bio));
+
+	for (uint32_t i = 0; i < n_bios; ++i)
+	{
+		struct bio *bio = &bios[i];
+		bio->bi_bdev = bdev;
+		bio->bi_sector = sector + i * (chunk / BLOCK_SECTOR_SIZE);
+		bio->bi_buf = buf + i * chunk;
+		bio->bi_size = min(size - i * chunk, chunk);
+		bio->bi_rw = rw;
+	}
+
+	int ret = submit_bios_wait(bios, n_bios);
+	kfree(bios);
+	return ret;
+}
+
+void blk_start_plug(struct blk_plug *plug)
+{
+	INIT_LIST_HEAD(&plug->bios);
+	if (!current_thread->plug)
+		current_thread->plug = plug;
+}
+
+void blk_flush_plug(struct blk_plug *plug)
+{
+	struct block_device *bdev = NULL;
+	struct bio *bio, *next;
+	list_for_each_entry_safe(bio, next, &plug->bios, bi_sibling)
+	{
+		list_del(&bio->bi_sibling);
+		// bios of a device are next to each other -> its queue is run when bios of another device start
+		if (bdev && bdev != bio->bi_bdev)
+			blk_run_queue(bdev);
+		bdev = bio->bi_bdev;
+		blk_queue_bio(bio);
+	}
+	if (bdev)
+		blk_run_queue(bdev);
+}
+
+void blk_finish_plug(struct blk_plug *plug)
+{
+	blk_flush_plug(plug);
+	if (current_thread->plug == plug)
+		current_thread->plug = NULL;
+}
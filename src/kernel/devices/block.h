@@ -0,0 +1,112 @@
+#ifndef DEVICE_BLOCK_H
+#define DEVICE_BLOCK_H
+
+#include <include/list.h>
+#include <include/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BLOCK_SECTOR_SIZE 512
+
+// deadline elevator: requests are dispatched in lba order (one way), unless the oldest request expires (milliseconds)
+#define BLOCK_READ_EXPIRE 500
+#define BLOCK_WRITE_EXPIRE 5000
+// reads are preferred, pending writes are dispatched after this number of read requests
+#define BLOCK_WRITES_STARVED 2
+
+#define BIO_READ 0
+#define BIO_WRITE 1
+
+struct bio;
+struct block_device;
+
+// called when the bio is done, might be from irq handler
+typedef void (*bio_end_io_t)(struct bio *bio);
+
+// a virtually contiguous buffer of whole sectors
+struct bio
+{
+	struct block_device *bi_bdev;
+	sector_t bi_sector;
+	char *bi_buf;
+	uint32_t bi_size;
+	uint8_t bi_rw;
+	int bi_error;
+	bio_end_io_t bi_end_io;
+	void *bi_private;
+	struct list_head bi_sibling;
+};
+
+// bios of adjacent sectors, in sector order, which are merged into one device command
+struct request
+{
+	struct block_device *bdev;
+	sector_t sector;
+	uint32_t n_sectors;
+	// pages spanned by bio buffers, each one is at most one scatter/gather entry
+	uint32_t n_pages;
+	uint8_t rw;
+	uint64_t deadline;
+	struct list_head bios;
+	struct list_head sort_sibling;
+	struct list_head fifo_sibling;
+};
+
+struct request_queue
+{
+	// limits of a request, set by driver
+	uint32_t max_sectors;
+	uint32_t max_pages;
+	// requests which driver can handle at the same time
+	uint32_t depth;
+	uint32_t in_flight;
+	// a thread (or irq handler) is dispatching requests
+	bool running;
+	uint32_t starved;
+	// sector after the last dispatched request
+	sector_t head;
+	struct list_head sorted[2];
+	struct list_head fifo[2];
+	// completed requests are reused, they cannot be freed in irq handler
+	struct list_head free_requests;
+};
+
+struct block_device_operations
+{
+	// starts the request, driver calls blk_end_request when it is done (from irq handler or before returning)
+	int (*submit)(struct block_device *bdev, struct request *req);
+};
+
+struct block_device
+{
+	char *name;
+	uint64_t sectors;
+	struct request_queue queue;
+	struct block_device_operations *ops;
+	void *private;
+	struct list_head sibling;
+};
+
+// bios submitted by a plugging thread are held back and go to queues together in blk_finish_plug
+// -> adjacent ones are merged before any of them is dispatched
+struct blk_plug
+{
+	struct list_head bios;
+};
+
+void register_block_device(struct block_device *bdev, uint32_t depth, uint32_t max_sectors, uint32_t max_pages);
+struct block_device *get_block_device(const char *name);
+
+struct bio *bio_alloc(struct block_device *bdev, sector_t sector, char *buf, uint32_t size, uint8_t rw);
+void bio_free(struct bio *bio);
+void submit_bio(struct bio *bio);
+int submit_bio_wait(struct bio *bio);
+int submit_bios_wait(struct bio *bios, uint32_t count);
+int blk_rw(struct block_device *bdev, sector_t sector, char *buf, uint32_t size, uint8_t rw);
+void blk_end_request(struct request *req, int err);
+
+void blk_start_plug(struct blk_plug *plug);
+void blk_flush_plug(struct blk_plug *plug);
+void blk_finish_plug(struct blk_plug *plug);
+
+#endif
@@ -107,6 +107,9 @@ static void reg_device(uint8_t bus, uint8_t device, uint8_t function)
 			dev->address = address;
 			dev->vendorID = vendorID;
 			dev->deviceID = deviceID;
+			dev->class_code = classCode;
+			dev->subclass_code = pci_get_subclass_code(address);
+			dev->prog_if = pci_get_prog_if(address);
 			dev->bar0 = pci_read_field(address, PCI_BAR0);
 
 			list_add_tail(&dev->sibling, &ldevs);
@@ -184,6 +187,17 @@ struct pci_device *get_pci_device(int32_t vendorID, int32_t deviceID)
 	return NULL;
 }
 
+struct pci_device *get_pci_device_by_class(uint8_t class_code, uint8_t subclass_code)
+{
+	struct pci_device *iter_dev;
+	list_for_each_entry(iter_dev, &ldevs, sibling)
+	{
+		if (iter_dev->class_code == class_code && iter_dev->subclass_code == subclass_code)
+			return iter_dev;
+	}
+	return NULL;
+}
+
 void pci_init()
 {
 	DEBUG &&debug_println(DEBUG_INFO, "PCI: Initializing");
@@ -42,14 +42,17 @@
 #define PCI_CLASS_CODE_BRIDGE_DEVICE 0x06
 
 #define PCI_SUBCLASS_IDE 0x01
+#define PCI_SUBCLASS_SATA 0x06
 #define PCI_SUBCLASS_PCI_TO_PCI_BRIDGE 0x04
 
+#define PCI_COMMAND_REG_MEMORY_SPACE (1 << 1)
 #define PCI_COMMAND_REG_BUS_MASTER (1 << 2)
 
 struct pci_device
 {
 	int32_t address;
 	int32_t deviceID, vendorID;
+	uint8_t class_code, subclass_code, prog_if;
 	uint32_t bar0, bar1, bar2, bar3, bar4, bar5, bar6;
 	struct list_head sibling;
 };
@@ -58,6 +61,7 @@ void pci_init();
 void pci_scan_bus(uint8_t bus);
 void pci_scan_buses();
 struct pci_device *get_pci_device(int32_t vendorID, int32_t deviceID);
+struct pci_device *get_pci_device_by_class(uint8_t class_code, uint8_t subclass_code);
 uint16_t pci_get_command(uint32_t address);
 uint32_t pci_read_field(uint32_t address, uint8_t offset);
 void pci_write_field(uint32_t address, uint8_t offset, uint32_t value);
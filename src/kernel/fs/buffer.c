@@ -1,22 +1,272 @@
 #include "buffer.h"
 
-#include <devices/ata.h>
+#include <devices/block.h>
+#include <locking/semaphore.h>
+#include <memory/pmm.h>
 #include <memory/vmm.h>
+#include <proc/task.h>
+#include <system/time.h>
 #include <utils/math.h>
+#include <utils/string.h>
 
 // FIXME: MQ 2019-07-16 Is it safe to assume 512 b/s, it's fairly safe for hard disk but CD ROM might use 2048 b/s
-#define BYTES_PER_SECTOR 512
+#define BYTES_PER_SECTOR BLOCK_SECTOR_SIZE
+#define SECTORS_PER_BUFFER (BUFFER_SIZE / BYTES_PER_SECTOR)
+#define BUFFER_HASH_SIZE 1024
+// buffers which are in flight together
+#define BUFFER_BATCH 256
+// kernel heap grows from KERNEL_HEAP_BOTTOM up to vmalloc area
+#define BUFFER_HEAP_SIZE (0xE0000000 - KERNEL_HEAP_BOTTOM)
 
-char *bread(char *dev_name, sector_t sector, uint32_t size)
+static struct list_head buffer_hashtable[BUFFER_HASH_SIZE];
+// in the order buffers became dirty -> the oldest one is first
+static LIST_HEAD(dirty_buffers);
+static uint32_t nr_dirty;
+// one thread writes back at a time -> two writes of a unit are never in flight together
+static DEFINE_SEMAPHORE(writeback_sem);
+
+static struct list_head *buffer_bucket(struct block_device *bdev, sector_t sector)
+{
+	return &buffer_hashtable[(((uint32_t)bdev >> 4) ^ (sector / SECTORS_PER_BUFFER)) % BUFFER_HASH_SIZE];
+}
+
+// caller holds the scheduler lock
+static struct buffer_head *find_buffer(struct block_device *bdev, sector_t sector)
+{
+	struct buffer_head *bh;
+	list_for_each_entry(bh, buffer_bucket(bdev, sector), b_hash)
+	{
+		if (bh->b_bdev == bdev && bh->b_sector == sector)
+			return bh;
+	}
+	return NULL;
+}
+
+static struct buffer_head *alloc_buffer(struct block_device *bdev, sector_t sector)
+{
+	struct buffer_head *bh = kcalloc(1, sizeof(struct buffer_head));
+	bh->b_bdev = bdev;
+	bh->b_sector = sector;
+	bh->b_data = kcalloc(BUFFER_SIZE, sizeof(char));
+	INIT_LIST_HEAD(&bh->b_hash);
+	INIT_LIST_HEAD(&bh->b_dirty);
+	return bh;
+}
+
+static void free_buffer(struct buffer_head *bh)
+{
+	kfree(bh->b_data);
+	kfree(bh);
+}
+
+static void put_buffer(struct buffer_head *bh)
+{
+	lock_scheduler();
+	bool unused = !--bh->b_count && list_empty(&bh->b_hash);
+	unlock_scheduler();
+
+	if (unused)
+		free_buffer(bh);
+}
+
+void buffer_init()
+{
+	for (int i = 0; i < BUFFER_HASH_SIZE; ++i)
+		INIT_LIST_HEAD(&buffer_hashtable[i]);
+}
+
+// ratio is of memory which buffers can use, they are in kernel heap which ends at vmalloc area
+bool dirty_buffers_exceeded(uint32_t ratio)
+{
+	uint64_t memory = min_t(uint64_t, (uint64_t)get_total_frames() * PMM_FRAME_SIZE, BUFFER_HEAP_SIZE);
+	return nr_dirty > memory / 100 * ratio / BUFFER_SIZE;
+}
+
+// disk content with dirty and in-flight buffers on top, size is a multiple of sector
+// buffers are pinned before the read -> one which is written back meanwhile is still copied
+int bread_to(struct block_device *bdev, sector_t sector, char *buf, uint32_t size)
 {
-	struct ata_device *device = get_ata_device(dev_name);
-	char *buf = kcalloc(div_ceil(size, BYTES_PER_SECTOR) * BYTES_PER_SECTOR, sizeof(char));
-	ata_read(device, sector, div_ceil(size, BYTES_PER_SECTOR), (uint16_t *)buf);
+	sector_t first = sector / SECTORS_PER_BUFFER * SECTORS_PER_BUFFER;
+	uint32_t n_units = div_ceil((sector - first) * BYTES_PER_SECTOR + size, BUFFER_SIZE);
+	struct buffer_head **bhs = kcalloc(n_units, sizeof(struct buffer_head *));
+	uint32_t found = 0;
+
+	lock_scheduler();
+	for (uint32_t i = 0; i < n_units; ++i)
+	{
+		bhs[i] = find_buffer(bdev, first + i * SECTORS_PER_BUFFER);
+		if (bhs[i])
+		{
+			bhs[i]->b_count++;
+			found++;
+		}
+	}
+	unlock_scheduler();
+
+	int ret = 0;
+	// a range which is completely in memory is not read from disk
+	if (found < n_units || sector != first || size % BUFFER_SIZE)
+		ret = blk_rw(bdev, sector, buf, size, BIO_READ);
+
+	uint64_t start = (uint64_t)sector * BYTES_PER_SECTOR;
+	for (uint32_t i = 0; i < n_units; ++i)
+	{
+		struct buffer_head *bh = bhs[i];
+		if (!bh)
+			continue;
+
+		uint64_t unit = (uint64_t)bh->b_sector * BYTES_PER_SECTOR;
+		uint64_t from = max_t(uint64_t, unit, start);
+		uint64_t to = min_t(uint64_t, unit + BUFFER_SIZE, start + size);
+		memcpy(buf + (from - start), bh->b_data + (from - unit), to - from);
+		put_buffer(bh);
+	}
+	kfree(bhs);
+	return ret;
+}
+
+char *bread(struct block_device *bdev, sector_t sector, uint32_t size)
+{
+	uint32_t aligned_size = div_ceil(size, BYTES_PER_SECTOR) * BYTES_PER_SECTOR;
+	char *buf = kcalloc(aligned_size, sizeof(char));
+	bread_to(bdev, sector, buf, aligned_size);
 	return buf;
 }
 
-void bwrite(char *dev_name, sector_t sector, char *buf, uint32_t size)
+// data is copied into dirty buffers and written back later, a buffer in flight is replaced by a new one
+static void do_bwrite(struct block_device *bdev, sector_t sector, char *buf, uint32_t size, uint32_t kind)
+{
+	// callers write whole buffers, anything else goes to disk right away after what is already dirty
+	if (sector % SECTORS_PER_BUFFER || size % BUFFER_SIZE)
+	{
+		sync_buffers(bdev, false);
+		blk_rw(bdev, sector, buf, div_ceil(size, BYTES_PER_SECTOR) * BYTES_PER_SECTOR, BIO_WRITE);
+		return;
+	}
+
+	for (uint32_t offset = 0; offset < size; offset += BUFFER_SIZE)
+	{
+		sector_t unit = sector + offset / BYTES_PER_SECTOR;
+		struct buffer_head *new = NULL;
+
+		lock_scheduler();
+		struct buffer_head *bh = find_buffer(bdev, unit);
+		if (!bh || bh->b_state & BH_WRITING)
+		{
+			unlock_scheduler();
+			new = alloc_buffer(bdev, unit);
+			lock_scheduler();
+
+			bh = find_buffer(bdev, unit);
+			if (!bh || bh->b_state & BH_WRITING)
+			{
+				bh = new;
+				new = NULL;
+				list_add(&bh->b_hash, buffer_bucket(bdev, unit));
+			}
+		}
+
+		memcpy(bh->b_data, buf + offset, BUFFER_SIZE);
+		bh->b_state = (bh->b_state & ~BH_DATA) | kind;
+		if (!(bh->b_state & BH_DIRTY))
+		{
+			bh->b_state |= BH_DIRTY;
+			bh->b_dirtied = get_milliseconds(NULL);
+			list_add_tail(&bh->b_dirty, &dirty_buffers);
+			nr_dirty++;
+		}
+		unlock_scheduler();
+
+		if (new)
+			free_buffer(new);
+	}
+
+	// writers which dirty memory faster than it is written back are throttled
+	if (dirty_buffers_exceeded(DIRTY_RATIO))
+		sync_buffers(bdev, false);
+}
+
+void bwrite(struct block_device *bdev, sector_t sector, char *buf, uint32_t size)
+{
+	do_bwrite(bdev, sector, buf, size, 0);
+}
+
+void bwrite_data(struct block_device *bdev, sector_t sector, char *buf, uint32_t size)
 {
-	struct ata_device *device = get_ata_device(dev_name);
-	ata_write(device, sector, div_ceil(size, BYTES_PER_SECTOR), (uint16_t *)buf);
+	do_bwrite(bdev, sector, buf, size, BH_DATA);
+}
+
+// writes back up to BUFFER_BATCH dirty buffers of a kind which became dirty before dirtied_before
+// returns the number of buffers, *err is set if one of them failed
+static uint32_t write_buffer_batch(struct block_device *bdev, uint32_t kind, uint64_t dirtied_before, int *err)
+{
+	struct buffer_head **bhs = kcalloc(BUFFER_BATCH, sizeof(struct buffer_head *));
+	uint32_t count = 0;
+
+	lock_scheduler();
+	struct buffer_head *bh, *next;
+	list_for_each_entry_safe(bh, next, &dirty_buffers, b_dirty)
+	{
+		// the ones after are younger
+		if (count == BUFFER_BATCH || bh->b_dirtied >= dirtied_before)
+			break;
+		if ((bdev && bh->b_bdev != bdev) || (bh->b_state & BH_DATA) != kind)
+			continue;
+
+		list_del_init(&bh->b_dirty);
+		nr_dirty--;
+		bh->b_state = (bh->b_state & ~BH_DIRTY) | BH_WRITING;
+		bh->b_count++;
+		bhs[count++] = bh;
+	}
+	unlock_scheduler();
+
+	if (count)
+	{
+		struct bio *bios = kcalloc(count, sizeof(struct bio));
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			bios[i].bi_bdev = bhs[i]->b_bdev;
+			bios[i].bi_sector = bhs[i]->b_sector;
+			bios[i].bi_buf = bhs[i]->b_data;
+			bios[i].bi_size = BUFFER_SIZE;
+			bios[i].bi_rw = BIO_WRITE;
+		}
+		submit_bios_wait(bios, count);
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (bios[i].bi_error)
+				*err = bios[i].bi_error;
+
+			lock_scheduler();
+			bhs[i]->b_state &= ~BH_WRITING;
+			list_del_init(&bhs[i]->b_hash);
+			unlock_scheduler();
+			put_buffer(bhs[i]);
+		}
+		kfree(bios);
+	}
+
+	kfree(bhs);
+	return count;
+}
+
+// data buffers go before metadata which points to them, buffers dirtied after the call are left for later
+// bios of a batch are sorted by sector in the plug -> adjacent buffers are merged into one request
+int sync_buffers(struct block_device *bdev, bool expired_only)
+{
+	uint64_t now = get_milliseconds(NULL);
+	uint64_t dirtied_before = now + 1;
+	if (expired_only)
+		dirtied_before = now > DIRTY_EXPIRE ? now - DIRTY_EXPIRE : 0;
+
+	int err = 0;
+	acquire_semaphore(&writeback_sem);
+	while (write_buffer_batch(bdev, BH_DATA, dirtied_before, &err))
+		;
+	while (write_buffer_batch(bdev, 0, dirtied_before, &err))
+		;
+	release_semaphore(&writeback_sem);
+	return err;
 }
@@ -1,10 +1,48 @@
 #ifndef FS_BUFFER_H
 #define FS_BUFFER_H
 
+#include <include/list.h>
 #include <include/types.h>
+#include <stdbool.h>
 #include <stdint.h>
 
-char *bread(char *dev_name, sector_t block, uint32_t size);
-void bwrite(char *dev_name, sector_t block, char *buf, uint32_t size);
+// writes are kept in memory as dirty buffers of this size (at a multiple of it on disk)
+#define BUFFER_SIZE 1024
+// dirty buffers older than this (milliseconds) are written back by the writeback thread
+#define DIRTY_EXPIRE 3000
+// percentage of memory (ram, at most kernel heap) in dirty buffers when the writeback thread writes everything back
+#define DIRTY_BACKGROUND_RATIO 10
+// percentage of memory in dirty buffers when a writer has to write back itself
+#define DIRTY_RATIO 20
+
+#define BH_DATA (1 << 0)
+#define BH_DIRTY (1 << 1)
+#define BH_WRITING (1 << 2)
+
+struct block_device;
+
+// newer buffer of a unit is in front of the hash chain, a buffer in flight is kept there until it is on disk
+// -> readers always see the latest content
+struct buffer_head
+{
+	struct block_device *b_bdev;
+	sector_t b_sector;
+	char *b_data;
+	uint32_t b_state;
+	// readers and writeback which use b_data, buffer is freed when it is unhashed and unused
+	uint32_t b_count;
+	// when the buffer became dirty
+	uint64_t b_dirtied;
+	struct list_head b_hash;
+	struct list_head b_dirty;
+};
+
+void buffer_init();
+char *bread(struct block_device *bdev, sector_t block, uint32_t size);
+int bread_to(struct block_device *bdev, sector_t sector, char *buf, uint32_t size);
+void bwrite(struct block_device *bdev, sector_t block, char *buf, uint32_t size);
+void bwrite_data(struct block_device *bdev, sector_t sector, char *buf, uint32_t size);
+int sync_buffers(struct block_device *bdev, bool expired_only);
+bool dirty_buffers_exceeded(uint32_t ratio);
 
 #endif
@@ -0,0 +1,102 @@
+#include <include/list.h>
+#include <memory/vmm.h>
+#include <utils/string.h>
+
+#include "vfs.h"
+
+// dentries are hashed by (parent, name) -> a path component is resolved without scanning siblings
+// or calling into the filesystem, names which do not exist are cached as negative dentries (no inode)
+#define DCACHE_HASH_SIZE 1024
+// negative dentries are not linked into parent's d_subdirs, the least recently used ones are freed
+#define DCACHE_MAX_NEGATIVE 512
+
+static struct list_head dentry_hashtable[DCACHE_HASH_SIZE];
+static LIST_HEAD(dentry_lru);
+static uint32_t nr_negative;
+
+// fnv-1a
+static uint32_t d_hash_name(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for (; *name; ++name)
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	return hash;
+}
+
+static struct list_head *d_hash_bucket(struct vfs_dentry *parent, uint32_t hash)
+{
+	return &dentry_hashtable[(hash ^ ((uint32_t)parent >> 4)) % DCACHE_HASH_SIZE];
+}
+
+struct vfs_dentry *d_lookup(struct vfs_dentry *parent, const char *name)
+{
+	uint32_t hash = d_hash_name(name);
+	struct vfs_dentry *iter;
+	list_for_each_entry(iter, d_hash_bucket(parent, hash), d_hash_sibling)
+	{
+		if (iter->d_parent != parent || iter->d_hash != hash || strcmp(iter->d_name, name))
+			continue;
+
+		if (!iter->d_inode)
+			list_move_tail(&iter->d_lru, &dentry_lru);
+		return iter;
+	}
+	return NULL;
+}
+
+void d_add(struct vfs_dentry *dentry)
+{
+	dentry->d_hash = d_hash_name(dentry->d_name);
+	list_add(&dentry->d_hash_sibling, d_hash_bucket(dentry->d_parent, dentry->d_hash));
+}
+
+void d_drop(struct vfs_dentry *dentry)
+{
+	list_del_init(&dentry->d_hash_sibling);
+	if (!list_empty(&dentry->d_lru))
+	{
+		list_del_init(&dentry->d_lru);
+		nr_negative--;
+	}
+}
+
+static void d_free(struct vfs_dentry *dentry)
+{
+	d_drop(dentry);
+	kfree(dentry->d_name);
+	kfree(dentry);
+}
+
+void d_alloc_negative(struct vfs_dentry *parent, char *name)
+{
+	struct vfs_dentry *dentry = alloc_dentry(parent, name);
+	d_add(dentry);
+	list_add_tail(&dentry->d_lru, &dentry_lru);
+	nr_negative++;
+
+	while (nr_negative > DCACHE_MAX_NEGATIVE)
+		d_free(list_first_entry(&dentry_lru, struct vfs_dentry, d_lru));
+}
+
+// a negative dentry becomes a child of its parent when the name is created
+void d_instantiate(struct vfs_dentry *dentry, struct vfs_inode *inode)
+{
+	list_del_init(&dentry->d_lru);
+	nr_negative--;
+	dentry->d_inode = inode;
+	list_add_tail(&dentry->d_sibling, &dentry->d_parent->d_subdirs);
+}
+
+// called before a dentry for the name is added without path_walk (mknod, mount)
+void d_prune_negative(struct vfs_dentry *parent, const char *name)
+{
+	struct vfs_dentry *dentry = d_lookup(parent, name);
+	if (dentry && !dentry->d_inode)
+		d_free(dentry);
+}
+
+void dcache_init()
+{
+	for (int i = 0; i < DCACHE_HASH_SIZE; ++i)
+		INIT_LIST_HEAD(&dentry_hashtable[i]);
+}
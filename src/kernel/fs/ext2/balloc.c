@@ -0,0 +1,198 @@
+#include <fs/vfs.h>
+#include <include/errno.h>
+#include <memory/vmm.h>
+#include <utils/math.h>
+#include <utils/string.h>
+
+#include "ext2.h"
+
+// block and inode bitmaps, searched from per-group hints
+// allocation only changes memory, bitmaps/descriptors/superblock are written back by ext2_sync_fs
+
+static bool ext2_test_bit(unsigned char *bitmap, uint32_t bit)
+{
+	return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+// first zero bit in [start, end) or end, full words and bytes are skipped at once
+static uint32_t ext2_find_zero_bit(unsigned char *bitmap, uint32_t start, uint32_t end)
+{
+	uint32_t bit = start;
+	while (bit < end)
+	{
+		if (!(bit % 32) && bit + 32 <= end && *(uint32_t *)(bitmap + bit / 8) == 0xFFFFFFFF)
+			bit += 32;
+		else if (!(bit % 8) && bit + 8 <= end && bitmap[bit / 8] == 0xFF)
+			bit += 8;
+		else if (!ext2_test_bit(bitmap, bit))
+			return bit;
+		else
+			bit++;
+	}
+	return end;
+}
+
+static uint32_t ext2_blocks_in_group(struct ext2_superblock *es, uint32_t group)
+{
+	uint32_t first = group * es->s_blocks_per_group + es->s_first_data_block;
+	return min_t(uint32_t, es->s_blocks_per_group, es->s_blocks_count - first);
+}
+
+uint32_t ext2_group_first_block(struct vfs_superblock *sb, uint32_t group)
+{
+	struct ext2_superblock *es = EXT2_SB(sb);
+	return group * es->s_blocks_per_group + es->s_first_data_block;
+}
+
+static unsigned char *ext2_block_bitmap(struct vfs_superblock *sb, uint32_t group)
+{
+	struct ext2_group_info *gi = &EXT2_SB_INFO(sb)->s_groups[group];
+	if (!gi->block_bitmap_buf)
+		gi->block_bitmap_buf = (unsigned char *)ext2_bread_block(sb, ext2_get_group_desc(sb, group)->bg_block_bitmap);
+	return gi->block_bitmap_buf;
+}
+
+static unsigned char *ext2_inode_bitmap(struct vfs_superblock *sb, uint32_t group)
+{
+	struct ext2_group_info *gi = &EXT2_SB_INFO(sb)->s_groups[group];
+	if (!gi->inode_bitmap_buf)
+		gi->inode_bitmap_buf = (unsigned char *)ext2_bread_block(sb, ext2_get_group_desc(sb, group)->bg_inode_bitmap);
+	return gi->inode_bitmap_buf;
+}
+
+// dirty flags are cleared first -> a change made while the block is in flight is written next time
+void ext2_write_bitmaps(struct vfs_superblock *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB_INFO(sb);
+	for (uint32_t group = 0; group < sbi->s_groups_count; ++group)
+	{
+		struct ext2_group_info *gi = &sbi->s_groups[group];
+		struct ext2_group_desc *gdp = ext2_get_group_desc(sb, group);
+		if (gi->block_bitmap_dirty)
+		{
+			gi->block_bitmap_dirty = false;
+			ext2_bwrite_block(sb, gdp->bg_block_bitmap, (char *)gi->block_bitmap_buf);
+		}
+		if (gi->inode_bitmap_dirty)
+		{
+			gi->inode_bitmap_dirty = false;
+			ext2_bwrite_block(sb, gdp->bg_inode_bitmap, (char *)gi->inode_bitmap_buf);
+		}
+	}
+}
+
+// allocates up to *count contiguous blocks starting at goal or the nearest free block after it,
+// the goal's group is searched first then the following groups which have free blocks
+// returns the first block and sets *count to the length of the run, 0 if the disk is full
+uint32_t ext2_new_blocks(struct vfs_superblock *sb, uint32_t goal, uint32_t *count)
+{
+	struct ext2_sb_info *sbi = EXT2_SB_INFO(sb);
+	struct ext2_superblock *es = &sbi->s_es;
+
+	if (goal < es->s_first_data_block || goal >= es->s_blocks_count)
+		goal = es->s_first_data_block;
+	uint32_t group = get_group_from_block(es, goal);
+
+	for (uint32_t i = 0; i < sbi->s_groups_count; ++i, group = (group + 1) % sbi->s_groups_count)
+	{
+		struct ext2_group_info *gi = &sbi->s_groups[group];
+		struct ext2_group_desc *gdp = ext2_get_group_desc(sb, group);
+		if (!gdp->bg_free_blocks_count)
+			continue;
+
+		unsigned char *bitmap = ext2_block_bitmap(sb, group);
+		uint32_t bits = ext2_blocks_in_group(es, group);
+		uint32_t start = max_t(uint32_t, i ? 0 : get_relative_block_in_group(es, goal), gi->block_hint);
+		uint32_t bit = ext2_find_zero_bit(bitmap, start, bits);
+		// wrap around to the part of the group before the goal
+		if (bit >= bits && start > gi->block_hint && (bit = ext2_find_zero_bit(bitmap, gi->block_hint, start)) == start)
+			bit = bits;
+		if (bit >= bits)
+			continue;
+
+		uint32_t n = 0;
+		while (n < *count && bit + n < bits && !ext2_test_bit(bitmap, bit + n))
+		{
+			bitmap[(bit + n) / 8] |= 1 << ((bit + n) % 8);
+			n++;
+		}
+		if (bit == gi->block_hint)
+			gi->block_hint = bit + n;
+		gdp->bg_free_blocks_count -= n;
+		es->s_free_blocks_count -= n;
+
+		gi->block_bitmap_dirty = true;
+		ext2_mark_group_dirty(sb, group);
+		ext2_mark_super_dirty(sb);
+
+		*count = n;
+		return ext2_group_first_block(sb, group) + bit;
+	}
+
+	*count = 0;
+	return 0;
+}
+
+// blocks of a run never cross a group (they come from ext2_new_blocks)
+void ext2_free_blocks(struct vfs_superblock *sb, uint32_t block, uint32_t count)
+{
+	struct ext2_sb_info *sbi = EXT2_SB_INFO(sb);
+	struct ext2_superblock *es = &sbi->s_es;
+	if (!count)
+		return;
+
+	uint32_t group = get_group_from_block(es, block);
+	struct ext2_group_info *gi = &sbi->s_groups[group];
+	struct ext2_group_desc *gdp = ext2_get_group_desc(sb, group);
+	unsigned char *bitmap = ext2_block_bitmap(sb, group);
+	uint32_t bit = get_relative_block_in_group(es, block);
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (!ext2_test_bit(bitmap, bit + i))
+			continue;
+		bitmap[(bit + i) / 8] &= ~(1 << ((bit + i) % 8));
+		gdp->bg_free_blocks_count++;
+		es->s_free_blocks_count++;
+	}
+	gi->block_hint = min(gi->block_hint, bit);
+
+	gi->block_bitmap_dirty = true;
+	ext2_mark_group_dirty(sb, group);
+	ext2_mark_super_dirty(sb);
+}
+
+// inodes go to the goal group (parent directory's one) or the next group which has free inodes, 0 if there is none
+ino_t ext2_new_inode(struct vfs_superblock *sb, uint32_t goal_group, bool dir)
+{
+	struct ext2_sb_info *sbi = EXT2_SB_INFO(sb);
+	struct ext2_superblock *es = &sbi->s_es;
+
+	uint32_t group = goal_group < sbi->s_groups_count ? goal_group : 0;
+	for (uint32_t i = 0; i < sbi->s_groups_count; ++i, group = (group + 1) % sbi->s_groups_count)
+	{
+		struct ext2_group_info *gi = &sbi->s_groups[group];
+		struct ext2_group_desc *gdp = ext2_get_group_desc(sb, group);
+		if (!gdp->bg_free_inodes_count)
+			continue;
+
+		unsigned char *bitmap = ext2_inode_bitmap(sb, group);
+		uint32_t bit = ext2_find_zero_bit(bitmap, gi->inode_hint, es->s_inodes_per_group);
+		if (bit >= es->s_inodes_per_group)
+			continue;
+
+		bitmap[bit / 8] |= 1 << (bit % 8);
+		gi->inode_hint = bit + 1;
+		gdp->bg_free_inodes_count--;
+		if (dir)
+			gdp->bg_used_dirs_count++;
+		es->s_free_inodes_count--;
+
+		gi->inode_bitmap_dirty = true;
+		ext2_mark_group_dirty(sb, group);
+		ext2_mark_super_dirty(sb);
+
+		return group * es->s_inodes_per_group + bit + EXT2_STARTING_INO;
+	}
+	return 0;
+}
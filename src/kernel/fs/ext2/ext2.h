@@ -2,6 +2,7 @@
 #define FS_EXT2_H
 
 #include <fs/vfs.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 /*
@@ -73,7 +74,15 @@ struct ext2_superblock
 	uint16_t s_reserved_word_pad;
 	uint32_t s_default_mount_opts;
 	uint32_t s_first_meta_bg; /* First metablock block group */
-	uint32_t s_reserved[190]; /* Padding to the end of the block */
+	uint32_t s_mkfs_time;	  /* When the filesystem was created */
+	uint32_t s_jnl_blocks[17]; /* Backup of the journal inode */
+	uint32_t s_blocks_count_hi;
+	uint32_t s_r_blocks_count_hi;
+	uint32_t s_free_blocks_count_hi;
+	uint16_t s_min_extra_isize;
+	uint16_t s_want_extra_isize;
+	uint32_t s_flags;		  /* Miscellaneous flags */
+	uint32_t s_reserved[167]; /* Padding to the end of the block */
 };
 
 struct ext2_group_desc
@@ -88,6 +97,17 @@ struct ext2_group_desc
 	uint32_t bg_reserved[3];
 };
 
+/*
+ * Constants relative to the data blocks
+ */
+#define EXT2_NDIR_BLOCKS 12
+#define EXT2_IND_BLOCK EXT2_NDIR_BLOCKS
+#define EXT2_DIND_BLOCK (EXT2_IND_BLOCK + 1)
+#define EXT2_TIND_BLOCK (EXT2_DIND_BLOCK + 1)
+#define EXT2_N_BLOCKS (EXT2_TIND_BLOCK + 1)
+// i_block + up to three levels of indirect blocks
+#define EXT2_MAX_DEPTH 4
+
 struct ext2_inode
 {
 	uint16_t i_mode;		/* File mode */
@@ -151,6 +171,13 @@ struct ext2_inode
 	} osd2; /* OS dependent 2 */
 };
 
+/*
+ * Inode flags
+ */
+#define EXT2_INDEX_FL 0x00001000 /* hash-indexed directory */
+
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
 #define EXT2_NAME_LEN 255
 
 struct ext2_dir_entry
@@ -162,6 +189,64 @@ struct ext2_dir_entry
 	char name[];
 };
 
+/*
+ * Hashed directory index (htree), the root lives in the first directory block behind "." and ".."
+ * which look like ordinary entries -> kernels without index support see an empty block
+ */
+#define DX_HASH_LEGACY 0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA 2
+#define DX_HASH_LEGACY_UNSIGNED 3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED 5
+
+#define EXT2_HTREE_EOF 0x7FFFFFFF
+#define EXT2_HTREE_LEVEL 3
+
+struct dx_entry
+{
+	uint32_t hash;
+	uint32_t block;
+};
+
+// overlaps the hash of the first entry
+struct dx_countlimit
+{
+	uint16_t limit;
+	uint16_t count;
+};
+
+struct dx_root_info
+{
+	uint32_t reserved_zero;
+	uint8_t hash_version;
+	uint8_t info_length;
+	uint8_t indirect_levels;
+	uint8_t unused_flags;
+};
+
+struct dx_root
+{
+	struct
+	{
+		uint32_t inode;
+		uint16_t rec_len;
+		uint8_t name_len;
+		uint8_t file_type;
+		char name[4];
+	} dot, dotdot;
+	struct dx_root_info info;
+};
+
+// a fake entry which spans the whole block
+struct dx_node
+{
+	uint32_t inode;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
+};
+
 enum
 {
 	EXT2_FT_UNKNOWN,
@@ -170,20 +255,74 @@ enum
 	EXT2_FT_MAX
 };
 
+// blocks reserved behind the allocated one for the next sequential writes of a regular file
+#define EXT2_PREALLOC_BLOCKS 8
+// contiguous blocks which are written by one request
+#define EXT2_WRITE_RUN_BLOCKS 32
+
+// in-memory state of a group, free counters live in its cached descriptor
+struct ext2_group_info
+{
+	// all bits below the hint are in use -> bitmap scan starts there
+	uint32_t block_hint;
+	uint32_t inode_hint;
+	// bitmaps are read on first use, changes are written back by ext2_sync_fs
+	unsigned char *block_bitmap_buf;
+	unsigned char *inode_bitmap_buf;
+	bool block_bitmap_dirty;
+	bool inode_bitmap_dirty;
+	bool desc_dirty;
+};
+
+struct ext2_sb_info
+{
+	// the on-disk superblock is the first member -> EXT2_SB keeps returning it
+	struct ext2_superblock s_es;
+	bool s_dirt;
+	uint32_t s_groups_count;
+	// descriptor blocks are read once at mount, the array has the on-disk layout
+	uint32_t s_gdb_count;
+	struct ext2_group_desc *s_group_desc;
+	struct ext2_group_info *s_groups;
+};
+
+struct ext2_inode_info
+{
+	// the on-disk inode is the first member -> EXT2_INODE keeps returning it
+	struct ext2_inode i_raw;
+	// the next sequential block is allocated right after the previous one
+	uint32_t i_last_logical;
+	uint32_t i_last_physical;
+	// free blocks reserved for this inode, released when the file is closed
+	uint32_t i_prealloc_block;
+	uint32_t i_prealloc_count;
+};
+
 static inline struct ext2_superblock *EXT2_SB(struct vfs_superblock *sb)
 {
 	return sb->s_fs_info;
 }
 
+static inline struct ext2_sb_info *EXT2_SB_INFO(struct vfs_superblock *sb)
+{
+	return sb->s_fs_info;
+}
+
 static inline struct ext2_inode *EXT2_INODE(struct vfs_inode *inode)
 {
 	return inode->i_fs_info;
 }
 
+static inline struct ext2_inode_info *EXT2_I(struct vfs_inode *inode)
+{
+	return inode->i_fs_info;
+}
+
 #define EXT2_MIN_BLOCK_SIZE 1024
 #define EXT2_MAX_BLOCK_SIZE 4096
 
 #define EXT2_BLOCK_SIZE(sb) (EXT2_MIN_BLOCK_SIZE << sb->s_log_block_size)
+#define EXT2_ADDR_PER_BLOCK(sb) ((sb)->s_blocksize / sizeof(uint32_t))
 #define EXT2_INODES_PER_BLOCK(sb) (EXT2_BLOCK_SIZE(sb) / sb->s_inode_size)
 #define EXT2_GROUPS_PER_BLOCK(sb) (EXT2_BLOCK_SIZE(sb) / sizeof(struct ext2_group_desc))
 
@@ -198,21 +337,35 @@ void init_ext2_fs();
 void exit_ext2_fs();
 char *ext2_bread_block(struct vfs_superblock *sb, uint32_t iblock);
 char *ext2_bread(struct vfs_superblock *sb, uint32_t iblock, uint32_t size);
+int ext2_bread_to(struct vfs_superblock *sb, uint32_t iblock, char *buf, uint32_t size);
 void ext2_bwrite_block(struct vfs_superblock *sb, uint32_t iblock, char *buf);
 void ext2_bwrite(struct vfs_superblock *sb, uint32_t iblock, char *buf, uint32_t size);
+void ext2_bwrite_data(struct vfs_superblock *sb, uint32_t iblock, char *buf, uint32_t size);
 struct vfs_inode *ext2_alloc_inode(struct vfs_superblock *sb);
 void ext2_read_inode(struct vfs_inode *);
 void ext2_write_inode(struct vfs_inode *);
 struct ext2_group_desc *ext2_get_group_desc(struct vfs_superblock *sb, uint32_t block_group);
-void ext2_write_group_desc(struct vfs_superblock *sb, struct ext2_group_desc *gdp);
+void ext2_mark_group_dirty(struct vfs_superblock *sb, uint32_t block_group);
+void ext2_mark_super_dirty(struct vfs_superblock *sb);
+
+// balloc.c
+uint32_t ext2_group_first_block(struct vfs_superblock *sb, uint32_t group);
+uint32_t ext2_new_blocks(struct vfs_superblock *sb, uint32_t goal, uint32_t *count);
+void ext2_free_blocks(struct vfs_superblock *sb, uint32_t block, uint32_t count);
+ino_t ext2_new_inode(struct vfs_superblock *sb, uint32_t goal_group, bool dir);
+void ext2_write_bitmaps(struct vfs_superblock *sb);
+
+// hash.c
+uint32_t ext2_dirhash(const char *name, int len, uint8_t hash_version, const uint32_t *seed);
 
 // vfs_inode.c
 extern struct vfs_inode_operations ext2_dir_inode_operations;
 extern struct vfs_inode_operations ext2_file_inode_operations;
 extern struct vfs_inode_operations ext2_special_inode_operations;
-uint32_t ext2_create_block(struct vfs_superblock *sb);
+uint32_t ext2_create_block(struct vfs_superblock *sb, uint32_t goal);
 
 // file.c
+uint32_t ext2_bmap(struct vfs_inode *inode, uint32_t iblock);
 extern struct vfs_file_operations ext2_file_operations;
 extern struct vfs_file_operations ext2_dir_operations;
 extern struct vfs_file_operations def_chr_fops;
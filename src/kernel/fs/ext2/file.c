@@ -1,5 +1,7 @@
+#include <fs/buffer.h>
 #include <fs/vfs.h>
 #include <include/errno.h>
+#include <memory/kernel_info.h>
 #include <memory/vmm.h>
 #include <proc/task.h>
 #include <system/time.h>
@@ -8,118 +10,365 @@
 
 #include "ext2.h"
 
-static void ext2_read_direct_block(struct vfs_superblock *sb, struct ext2_inode *ei, uint32_t block, char **iter_buf, loff_t ppos, uint32_t *p, size_t count)
+// table offsets from i_block down to the logical block, returns the depth (1 for direct blocks) or 0 if it is out of range
+static int ext2_block_to_path(struct vfs_superblock *sb, uint32_t iblock, uint32_t offsets[EXT2_MAX_DEPTH])
 {
-	char *block_buf = ext2_bread_block(sb, block);
-	int32_t pstart = (ppos > *p) ? ppos - *p : 0;
-	uint32_t pend = ((ppos + count) < (*p + sb->s_blocksize)) ? (*p + sb->s_blocksize - ppos - count) : 0;
-	memcpy(*iter_buf, block_buf + pstart, sb->s_blocksize - pstart - pend);
-	ext2_bwrite_block(sb, block, block_buf);
-	*p += sb->s_blocksize;
-	*iter_buf += sb->s_blocksize - pstart - pend;
-}
+	uint32_t ptrs = EXT2_ADDR_PER_BLOCK(sb);
 
-static void ext2_read_indirect_block(struct vfs_superblock *sb, struct ext2_inode *ei, uint32_t block, char **iter_buf, loff_t ppos, uint32_t *p, size_t count)
-{
-	uint32_t *block_buf = (uint32_t *)ext2_bread_block(sb, block);
-	for (uint32_t i = 0; *p < ppos + count && i < 256; ++i)
-		ext2_read_direct_block(sb, ei, block_buf[i], iter_buf, ppos, p, count);
+	if (iblock < EXT2_NDIR_BLOCKS)
+	{
+		offsets[0] = iblock;
+		return 1;
+	}
+	iblock -= EXT2_NDIR_BLOCKS;
+	if (iblock < ptrs)
+	{
+		offsets[0] = EXT2_IND_BLOCK;
+		offsets[1] = iblock;
+		return 2;
+	}
+	iblock -= ptrs;
+	if (iblock < ptrs * ptrs)
+	{
+		offsets[0] = EXT2_DIND_BLOCK;
+		offsets[1] = iblock / ptrs;
+		offsets[2] = iblock % ptrs;
+		return 3;
+	}
+	iblock -= ptrs * ptrs;
+	if (iblock / ptrs / ptrs < ptrs)
+	{
+		offsets[0] = EXT2_TIND_BLOCK;
+		offsets[1] = iblock / ptrs / ptrs;
+		offsets[2] = iblock / ptrs % ptrs;
+		offsets[3] = iblock % ptrs;
+		return 4;
+	}
+	return 0;
 }
 
-static void ext2_read_doubly_indirect_block(struct vfs_superblock *sb, struct ext2_inode *ei, uint32_t block, char **iter_buf, loff_t ppos, uint32_t *p, size_t count)
+// maps iblock to its physical block (0 is a hole) and counts how many following blocks continue the run,
+// the run stops at the end of the table -> indirect blocks are read once per run
+static uint32_t ext2_map_run(struct vfs_superblock *sb, struct ext2_inode *ei, uint32_t iblock, uint32_t max, uint32_t *pblock)
 {
-	uint32_t *block_buf = (uint32_t *)ext2_bread_block(sb, block);
-	for (uint32_t i = 0; *p < ppos + count && i < 256; ++i)
-		ext2_read_indirect_block(sb, ei, block_buf[i], iter_buf, ppos, p, count);
+	uint32_t offsets[EXT2_MAX_DEPTH];
+	int depth = ext2_block_to_path(sb, iblock, offsets);
+	*pblock = 0;
+	if (!depth)
+		return 1;
+
+	uint32_t *table = ei->i_block;
+	char *buf = NULL;
+	for (int level = 0; level < depth - 1; ++level)
+	{
+		uint32_t block = table[offsets[level]];
+		kfree(buf);
+		if (!block)
+			return 1;
+
+		buf = ext2_bread_block(sb, block);
+		table = (uint32_t *)buf;
+	}
+
+	uint32_t index = offsets[depth - 1];
+	uint32_t end = depth == 1 ? EXT2_NDIR_BLOCKS : EXT2_ADDR_PER_BLOCK(sb);
+	uint32_t run = 1;
+	*pblock = table[index];
+	while (run < max && index + run < end && table[index + run] == (*pblock ? *pblock + run : 0))
+		run++;
+
+	kfree(buf);
+	return run;
 }
 
-static void ext2_read_triply_indirect_block(struct vfs_superblock *sb, struct ext2_inode *ei, uint32_t block, char **iter_buf, loff_t ppos, uint32_t *p, size_t count)
+// physical block of iblock, 0 for a hole
+uint32_t ext2_bmap(struct vfs_inode *inode, uint32_t iblock)
 {
-	uint32_t *block_buf = (uint32_t *)ext2_bread_block(sb, block);
-	for (uint32_t i = 0; *p < ppos + count && i < 256; ++i)
-		ext2_read_triply_indirect_block(sb, ei, block_buf[i], iter_buf, ppos, p, count);
+	uint32_t pblock;
+	ext2_map_run(inode->i_sb, EXT2_INODE(inode), iblock, 1, &pblock);
+	return pblock;
 }
 
+// data is never written back on read, each run of contiguous blocks is one request
 static ssize_t ext2_read_file(struct vfs_file *file, char *buf, size_t count, loff_t ppos)
 {
 	struct vfs_inode *inode = file->f_dentry->d_inode;
 	struct ext2_inode *ei = EXT2_INODE(inode);
 	struct vfs_superblock *sb = inode->i_sb;
 
+	if (ppos >= ei->i_size)
+		return 0;
 	count = min_t(size_t, ppos + count, ei->i_size) - ppos;
-	uint32_t p = (ppos / sb->s_blocksize) * sb->s_blocksize;
+
+	uint32_t last_block = (ppos + count - 1) / sb->s_blocksize;
+	loff_t pos = ppos;
 	char *iter_buf = buf;
-	while (p < ppos + count)
+	for (uint32_t iblock = ppos / sb->s_blocksize; iblock <= last_block;)
 	{
-		uint32_t relative_block = p / sb->s_blocksize;
-		if (relative_block < 12)
-		{
-			uint32_t block = ei->i_block[relative_block];
-			ext2_read_direct_block(sb, ei, block, &iter_buf, ppos, &p, count);
-		}
-		else if (relative_block < 268)
+		uint32_t pblock;
+		uint32_t run = ext2_map_run(sb, ei, iblock, last_block - iblock + 1, &pblock);
+		loff_t run_start = (loff_t)iblock * sb->s_blocksize;
+		uint32_t run_size = run * sb->s_blocksize;
+		uint32_t offset = pos - run_start;
+		uint32_t len = min_t(loff_t, run_start + run_size, ppos + count) - pos;
+
+		if (!pblock)
+			memset(iter_buf, 0, len);
+		// whole blocks into kernel memory go straight to the caller's buffer, user pages might not be mapped yet
+		else if (!offset && len == run_size && (uint32_t)iter_buf >= KERNEL_HIGHER_HALF)
+			ext2_bread_to(sb, pblock, iter_buf, run_size);
+		else
 		{
-			uint32_t block = ei->i_block[12];
-			ext2_read_indirect_block(sb, ei, block, &iter_buf, ppos, &p, count);
+			char *run_buf = ext2_bread(sb, pblock, run_size);
+			memcpy(iter_buf, run_buf + offset, len);
+			kfree(run_buf);
 		}
-		else if (relative_block < 65804)
+
+		iblock += run;
+		pos += len;
+		iter_buf += len;
+	}
+
+	file->f_pos = ppos + count;
+	return count;
+}
+
+// leaf table of the last mapped block, kept across blocks of one write and written back once
+struct ext2_block_map
+{
+	int depth;
+	uint32_t offsets[EXT2_MAX_DEPTH - 1];
+	uint32_t leaf;
+	uint32_t *table;
+	bool dirty;
+};
+
+static void ext2_map_release(struct vfs_superblock *sb, struct ext2_block_map *map)
+{
+	if (map->leaf && map->dirty)
+		ext2_bwrite_block(sb, map->leaf, (char *)map->table);
+	kfree(map->table);
+	map->table = NULL;
+	map->leaf = 0;
+	map->dirty = false;
+}
+
+static void ext2_discard_prealloc(struct vfs_inode *inode)
+{
+	struct ext2_inode_info *info = EXT2_I(inode);
+	ext2_free_blocks(inode->i_sb, info->i_prealloc_block, info->i_prealloc_count);
+	info->i_prealloc_block = 0;
+	info->i_prealloc_count = 0;
+}
+
+// right after the previous block of a sequential write, otherwise the beginning of the inode's group
+static uint32_t ext2_find_goal(struct vfs_inode *inode, uint32_t iblock)
+{
+	struct ext2_inode_info *info = EXT2_I(inode);
+	if (info->i_last_physical && info->i_last_logical + 1 == iblock)
+		return info->i_last_physical + 1;
+	return ext2_group_first_block(inode->i_sb, get_group_from_inode(EXT2_SB(inode->i_sb), inode->i_ino));
+}
+
+// the preallocation window is used when goal is its next block, otherwise a new window is reserved
+static uint32_t ext2_alloc_block(struct vfs_inode *inode, uint32_t goal)
+{
+	struct ext2_inode_info *info = EXT2_I(inode);
+	uint32_t block;
+	if (info->i_prealloc_count && info->i_prealloc_block == goal)
+	{
+		block = info->i_prealloc_block++;
+		info->i_prealloc_count--;
+	}
+	else
+	{
+		ext2_discard_prealloc(inode);
+
+		uint32_t count = S_ISREG(inode->i_mode) ? EXT2_PREALLOC_BLOCKS + 1 : 1;
+		block = ext2_new_blocks(inode->i_sb, goal, &count);
+		if (block && count > 1)
 		{
-			uint32_t block = ei->i_block[13];
-			ext2_read_doubly_indirect_block(sb, ei, block, &iter_buf, ppos, &p, count);
+			info->i_prealloc_block = block + 1;
+			info->i_prealloc_count = count - 1;
 		}
-		else if (relative_block < 16843020)
+	}
+
+	if (block)
+		inode->i_blocks += inode->i_sb->s_blocksize / 512;
+	return block;
+}
+
+// zeroed on disk before its parent points to it
+static uint32_t ext2_alloc_table(struct vfs_inode *inode, uint32_t goal, char **buf)
+{
+	uint32_t block = ext2_alloc_block(inode, goal);
+	if (!block)
+		return 0;
+
+	*buf = kcalloc(inode->i_sb->s_blocksize, sizeof(char));
+	ext2_bwrite_block(inode->i_sb, block, *buf);
+	return block;
+}
+
+// physical block of iblock, missing indirect and data blocks are allocated (*new is set for a data block)
+// i_block changes are written by caller, returns 0 if the disk is full
+static uint32_t ext2_get_block(struct vfs_inode *inode, uint32_t iblock, struct ext2_block_map *map, bool *new)
+{
+	struct vfs_superblock *sb = inode->i_sb;
+	struct ext2_inode_info *info = EXT2_I(inode);
+	uint32_t offsets[EXT2_MAX_DEPTH];
+	int depth = ext2_block_to_path(sb, iblock, offsets);
+	if (!depth)
+		return 0;
+
+	uint32_t goal = ext2_find_goal(inode, iblock);
+	uint32_t *slot;
+	if (depth == 1)
+		slot = &info->i_raw.i_block[offsets[0]];
+	else
+	{
+		bool cached = map->leaf && map->depth == depth && !memcmp(map->offsets, offsets, (depth - 1) * sizeof(uint32_t));
+		if (!cached)
 		{
-			uint32_t block = ei->i_block[14];
-			ext2_read_triply_indirect_block(sb, ei, block, &iter_buf, ppos, &p, count);
+			ext2_map_release(sb, map);
+
+			uint32_t *table = info->i_raw.i_block;
+			uint32_t table_block = 0;
+			char *buf = NULL;
+			for (int level = 0; level < depth - 1; ++level)
+			{
+				uint32_t *entry = &table[offsets[level]];
+				char *child_buf;
+				if (*entry)
+					child_buf = ext2_bread_block(sb, *entry);
+				else
+				{
+					uint32_t block = ext2_alloc_table(inode, goal, &child_buf);
+					if (!block)
+					{
+						kfree(buf);
+						return 0;
+					}
+					goal = block + 1;
+					*entry = block;
+					if (table_block)
+						ext2_bwrite_block(sb, table_block, buf);
+				}
+
+				kfree(buf);
+				buf = child_buf;
+				table_block = *entry;
+				table = (uint32_t *)buf;
+			}
+
+			map->depth = depth;
+			memcpy(map->offsets, offsets, (depth - 1) * sizeof(uint32_t));
+			map->leaf = table_block;
+			map->table = table;
 		}
+		slot = &map->table[offsets[depth - 1]];
 	}
 
-	file->f_pos = ppos + count;
-	return count;
+	if (!*slot)
+	{
+		uint32_t block = ext2_alloc_block(inode, goal);
+		if (!block)
+			return 0;
+		*slot = block;
+		*new = true;
+		if (depth > 1)
+			map->dirty = true;
+	}
+
+	info->i_last_logical = iblock;
+	info->i_last_physical = *slot;
+	return *slot;
 }
 
+// blocks are staged in a buffer while they are physically contiguous, runs go to dirty buffers and are written back later
 static ssize_t ext2_write_file(struct vfs_file *file, const char *buf, size_t count, loff_t ppos)
 {
 	struct vfs_inode *inode = file->f_dentry->d_inode;
-	struct ext2_inode *ei = EXT2_INODE(inode);
 	struct vfs_superblock *sb = inode->i_sb;
+	if (!count)
+		return 0;
 
-	if (ppos + count > inode->i_size)
-	{
-		inode->i_size = ppos + count;
-		inode->i_blocks = div_ceil(ppos + count, 512);
-		sb->s_op->write_inode(inode);
-	}
+	uint32_t first_block = ppos / sb->s_blocksize;
+	uint32_t last_block = (ppos + count - 1) / sb->s_blocksize;
+	uint32_t run_max = min_t(uint32_t, last_block - first_block + 1, EXT2_WRITE_RUN_BLOCKS);
+	char *run_buf = kcalloc(run_max, sb->s_blocksize);
+	uint32_t run_start = 0, run_len = 0;
 
-	uint32_t p = (ppos / sb->s_blocksize) * sb->s_blocksize;
-	char *iter_buf = buf;
-	while (p < ppos + count)
+	struct ext2_block_map map = {};
+	const char *iter_buf = buf;
+	ssize_t ret = 0;
+	for (uint32_t iblock = first_block; iblock <= last_block; ++iblock)
 	{
-		uint32_t relative_block = p / sb->s_blocksize;
-		uint32_t block = 0;
-		// FIXME: MQ 2019-07-18 Only support direct blocks
-		if (relative_block < 12)
+		bool new = false;
+		uint32_t block = ext2_get_block(inode, iblock, &map, &new);
+		if (!block)
 		{
-			block = ei->i_block[relative_block];
-			if (!block)
-			{
-				block = ext2_create_block(sb);
-				ei->i_block[relative_block] = block;
-				inode->i_mtime.tv_sec = get_seconds(NULL);
-				sb->s_op->write_inode(inode);
-			}
+			ret = -ENOSPC;
+			break;
 		}
-		char *block_buf = ext2_bread_block(sb, block);
+
+		if (run_len && (block != run_start + run_len || run_len == run_max))
+		{
+			ext2_bwrite_data(sb, run_start, run_buf, run_len * sb->s_blocksize);
+			run_len = 0;
+		}
+		if (!run_len)
+			run_start = block;
+
+		loff_t p = (loff_t)iblock * sb->s_blocksize;
 		uint32_t pstart = (ppos > p) ? ppos - p : 0;
 		uint32_t pend = ((ppos + count) < (p + sb->s_blocksize)) ? (p + sb->s_blocksize - ppos - count) : 0;
-		memcpy(block_buf + pstart, iter_buf, sb->s_blocksize - pstart - pend);
-		ext2_bwrite_block(sb, block, block_buf);
-		p += sb->s_blocksize;
-		iter_buf += sb->s_blocksize - pstart - pend;
+		uint32_t len = sb->s_blocksize - pstart - pend;
+		char *block_buf = run_buf + run_len * sb->s_blocksize;
+
+		// a partially written block keeps the rest of its data, a new one is zeroed
+		if (len != sb->s_blocksize)
+		{
+			if (new)
+				memset(block_buf, 0, sb->s_blocksize);
+			else
+				ext2_bread_to(sb, block, block_buf, sb->s_blocksize);
+		}
+		memcpy(block_buf + pstart, iter_buf, len);
+		run_len++;
+		iter_buf += len;
 	}
+	if (run_len)
+		ext2_bwrite_data(sb, run_start, run_buf, run_len * sb->s_blocksize);
+	ext2_map_release(sb, &map);
+	kfree(run_buf);
 
-	file->f_pos = ppos + count;
-	return count;
+	size_t written = iter_buf - buf;
+	if (ppos + written > inode->i_size)
+		inode->i_size = ppos + written;
+	inode->i_mtime.tv_sec = get_seconds(NULL);
+	sb->s_op->write_inode(inode);
+
+	if (!written)
+		return ret;
+	file->f_pos = ppos + written;
+	return written;
+}
+
+static int ext2_release_file(struct vfs_inode *inode, struct vfs_file *file)
+{
+	ext2_discard_prealloc(inode);
+	return 0;
+}
+
+// dirty buffers are not tracked per inode -> everything dirty on the device is written, data before metadata
+// fdatasync leaves out bitmaps, descriptors and superblock which are not needed to read the data back
+static int ext2_fsync(struct vfs_file *file, int datasync)
+{
+	struct vfs_superblock *sb = file->f_dentry->d_inode->i_sb;
+	if (!datasync)
+		sb->s_op->sync_fs(sb);
+	return sync_buffers(sb->s_bdev, false);
 }
 
 int ext2_readdir(struct vfs_file *file, struct dirent *dirent, unsigned int count)
@@ -169,8 +418,11 @@ struct vfs_file_operations ext2_file_operations = {
 	.read = ext2_read_file,
 	.write = ext2_write_file,
 	.mmap = ext2_mmap_file,
+	.release = ext2_release_file,
+	.fsync = ext2_fsync,
 };
 
 struct vfs_file_operations ext2_dir_operations = {
 	.readdir = ext2_readdir,
+	.fsync = ext2_fsync,
 };
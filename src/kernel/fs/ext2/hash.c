@@ -0,0 +1,157 @@
+#include <utils/string.h>
+
+#include "ext2.h"
+
+// directory index hashes, they have to match what mke2fs/linux put into dx entries bit for bit
+
+#define TEA_DELTA 0x9E3779B9
+
+#define rol32(word, shift) (((word) << (shift)) | ((word) >> (32 - (shift))))
+
+static void tea_transform(uint32_t buf[4], const uint32_t in[4])
+{
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+	for (int n = 0; n < 16; ++n)
+	{
+		sum += TEA_DELTA;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = rol32(a, s))
+#define K1 0
+#define K2 013240474631u
+#define K3 015666365641u
+
+// md4 with fewer rounds and a truncated output
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[8])
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	ROUND(F, a, b, c, d, in[0] + K1, 3);
+	ROUND(F, d, a, b, c, in[1] + K1, 7);
+	ROUND(F, c, d, a, b, in[2] + K1, 11);
+	ROUND(F, b, c, d, a, in[3] + K1, 19);
+	ROUND(F, a, b, c, d, in[4] + K1, 3);
+	ROUND(F, d, a, b, c, in[5] + K1, 7);
+	ROUND(F, c, d, a, b, in[6] + K1, 11);
+	ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+	ROUND(G, a, b, c, d, in[1] + K2, 3);
+	ROUND(G, d, a, b, c, in[3] + K2, 5);
+	ROUND(G, c, d, a, b, in[5] + K2, 9);
+	ROUND(G, b, c, d, a, in[7] + K2, 13);
+	ROUND(G, a, b, c, d, in[0] + K2, 3);
+	ROUND(G, d, a, b, c, in[2] + K2, 5);
+	ROUND(G, c, d, a, b, in[4] + K2, 9);
+	ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+	ROUND(H, a, b, c, d, in[3] + K3, 3);
+	ROUND(H, d, a, b, c, in[7] + K3, 9);
+	ROUND(H, c, d, a, b, in[2] + K3, 11);
+	ROUND(H, b, c, d, a, in[6] + K3, 15);
+	ROUND(H, a, b, c, d, in[1] + K3, 3);
+	ROUND(H, d, a, b, c, in[5] + K3, 9);
+	ROUND(H, c, d, a, b, in[0] + K3, 11);
+	ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+// the original htree hash, signed/unsigned char variants exist because linux used plain char
+static uint32_t dx_hack_hash(const char *name, int len, bool is_unsigned)
+{
+	uint32_t hash, hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+
+	for (int i = 0; i < len; ++i)
+	{
+		int c = is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+		hash = hash1 + (hash0 ^ (c * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7FFFFFFF;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+// packs name into num words, the rest is padded with the length
+static void str2hashbuf(const char *msg, int len, uint32_t *buf, int num, bool is_unsigned)
+{
+	uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	uint32_t val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (int i = 0; i < len; ++i)
+	{
+		int c = is_unsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+		val = c + (val << 8);
+		if (i % 4 == 3)
+		{
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+uint32_t ext2_dirhash(const char *name, int len, uint8_t hash_version, const uint32_t *seed)
+{
+	uint32_t buf[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+	uint32_t in[8];
+	uint32_t hash = 0;
+
+	if (seed && (seed[0] || seed[1] || seed[2] || seed[3]))
+		memcpy(buf, seed, sizeof(buf));
+
+	switch (hash_version)
+	{
+	case DX_HASH_LEGACY:
+	case DX_HASH_LEGACY_UNSIGNED:
+		hash = dx_hack_hash(name, len, hash_version == DX_HASH_LEGACY_UNSIGNED);
+		break;
+	case DX_HASH_HALF_MD4:
+	case DX_HASH_HALF_MD4_UNSIGNED:
+		for (const char *p = name; len > 0; len -= 32, p += 32)
+		{
+			str2hashbuf(p, len, in, 8, hash_version == DX_HASH_HALF_MD4_UNSIGNED);
+			half_md4_transform(buf, in);
+		}
+		hash = buf[1];
+		break;
+	case DX_HASH_TEA:
+	case DX_HASH_TEA_UNSIGNED:
+		for (const char *p = name; len > 0; len -= 16, p += 16)
+		{
+			str2hashbuf(p, len, in, 4, hash_version == DX_HASH_TEA_UNSIGNED);
+			tea_transform(buf, in);
+		}
+		hash = buf[0];
+		break;
+	}
+
+	// the lowest bit marks hash collisions which continue in the next leaf
+	hash &= ~1;
+	if (hash == (EXT2_HTREE_EOF << 1))
+		hash = (EXT2_HTREE_EOF - 1) << 1;
+	return hash;
+}
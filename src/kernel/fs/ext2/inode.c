@@ -8,96 +8,32 @@
 
 #include "ext2.h"
 
-static uint32_t find_unused_block_number(struct vfs_superblock *sb)
+// a zeroed block near goal, used for directory data
+uint32_t ext2_create_block(struct vfs_superblock *sb, uint32_t goal)
 {
-	struct ext2_superblock *ext2_sb = EXT2_SB(sb);
-
-	uint32_t number_of_groups = div_ceil(ext2_sb->s_blocks_count, ext2_sb->s_blocks_per_group);
-	for (uint32_t group = 0; group < number_of_groups; group += 1)
-	{
-		struct ext2_group_desc *gdp = ext2_get_group_desc(sb, group);
-		unsigned char *block_bitmap = (unsigned char *)ext2_bread_block(sb, gdp->bg_block_bitmap);
-
-		for (uint32_t i = 0; i < sb->s_blocksize; ++i)
-			if (block_bitmap[i] != 0xff)
-				for (int j = 0; j < 8; ++j)
-					if (!(block_bitmap[i] & (1 << j)))
-						return group * ext2_sb->s_blocks_per_group + i * 8 + j + ext2_sb->s_first_data_block;
-	}
-	return -ENOSPC;
-}
-
-uint32_t ext2_create_block(struct vfs_superblock *sb)
-{
-	struct ext2_superblock *ext2_sb = EXT2_SB(sb);
-	uint32_t block = find_unused_block_number(sb);
-
-	// superblock
-	ext2_sb->s_free_blocks_count -= 1;
-	sb->s_op->write_super(sb);
+	uint32_t count = 1;
+	uint32_t block = ext2_new_blocks(sb, goal, &count);
+	if (!block)
+		return 0;
 
-	// group
-	struct ext2_group_desc *gdp = ext2_get_group_desc(sb, get_group_from_block(ext2_sb, block));
-	gdp->bg_free_blocks_count -= 1;
-	ext2_write_group_desc(sb, gdp);
-
-	// block bitmap
-	char *bitmap_buf = ext2_bread_block(sb, gdp->bg_block_bitmap);
-	uint32_t relative_block = get_relative_block_in_group(ext2_sb, block);
-	bitmap_buf[relative_block / 8] |= 1 << (relative_block % 8);
-	ext2_bwrite_block(sb, gdp->bg_block_bitmap, bitmap_buf);
-
-	// clear block data
 	char *data_buf = kcalloc(sb->s_blocksize, sizeof(char));
 	ext2_bwrite_block(sb, block, data_buf);
+	kfree(data_buf);
 
 	return block;
 }
 
-static uint32_t find_unused_inode_number(struct vfs_superblock *sb)
-{
-	struct ext2_superblock *ext2_sb = EXT2_SB(sb);
-
-	uint32_t number_of_groups = div_ceil(ext2_sb->s_blocks_count, ext2_sb->s_blocks_per_group);
-	for (uint32_t group = 0; group < number_of_groups; group += 1)
-	{
-		struct ext2_group_desc *gdp = ext2_get_group_desc(sb, group);
-		unsigned char *inode_bitmap = (unsigned char *)ext2_bread_block(sb, gdp->bg_inode_bitmap);
-
-		for (uint32_t i = 0; i < sb->s_blocksize; ++i)
-			if (inode_bitmap[i] != 0xff)
-				for (uint8_t j = 0; j < 8; ++j)
-					if (!(inode_bitmap[i] & (1 << j)))
-						return group * ext2_sb->s_inodes_per_group + i * 8 + j + EXT2_STARTING_INO;
-	}
-	return -ENOSPC;
-}
-
 static struct vfs_inode *ext2_create_inode(struct vfs_inode *dir, char *filename, mode_t mode)
 {
 	struct ext2_superblock *ext2_sb = EXT2_SB(dir->i_sb);
-	uint32_t ino = find_unused_inode_number(dir->i_sb);
-	struct ext2_group_desc *gdp = ext2_get_group_desc(dir->i_sb, get_group_from_inode(ext2_sb, ino));
-
-	// superblock
-	ext2_sb->s_free_inodes_count -= 1;
-	dir->i_sb->s_op->write_super(dir->i_sb);
-
-	// group descriptor
-	gdp->bg_free_inodes_count -= 1;
-	if (S_ISDIR(mode))
-		gdp->bg_used_dirs_count += 1;
-	ext2_write_group_desc(dir->i_sb, gdp);
-
-	// inode bitmap
-	char *inode_bitmap_buf = ext2_bread_block(dir->i_sb, gdp->bg_inode_bitmap);
-	uint32_t relative_inode = get_relative_inode_in_group(ext2_sb, ino);
-	inode_bitmap_buf[relative_inode / 8] |= 1 << (relative_inode % 8);
-	ext2_bwrite_block(dir->i_sb, gdp->bg_inode_bitmap, inode_bitmap_buf);
+	uint32_t dir_group = get_group_from_inode(ext2_sb, dir->i_ino);
+	ino_t ino = ext2_new_inode(dir->i_sb, dir_group, S_ISDIR(mode));
+	if (!ino)
+		return NULL;
 
 	// inode table
-	struct ext2_inode *ei_new = kcalloc(1, sizeof(struct ext2_inode));
-	ei_new->i_links_count = 1;
+	struct ext2_inode_info *ei_new = kcalloc(1, sizeof(struct ext2_inode_info));
+	ei_new->i_raw.i_links_count = 1;
 	struct vfs_inode *inode = dir->i_sb->s_op->alloc_inode(dir->i_sb);
 	inode->i_ino = ino;
 	inode->i_mode = mode;
@@ -121,7 +57,7 @@ static struct vfs_inode *ext2_create_inode(struct vfs_inode *dir, char *filename
 		inode->i_fop = &ext2_dir_operations;
 
 		struct ext2_inode *ei = EXT2_INODE(inode);
-		uint32_t block = ext2_create_block(inode->i_sb);
+		uint32_t block = ext2_create_block(inode->i_sb, ext2_group_first_block(inode->i_sb, get_group_from_inode(ext2_sb, ino)));
 		ei->i_block[0] = block;
 		inode->i_blocks += 2;
 		inode->i_size += 1024;
@@ -147,6 +83,13 @@ static struct vfs_inode *ext2_create_inode(struct vfs_inode *dir, char *filename
 	}
 	dir->i_sb->s_op->write_inode(inode);
 
+	// the entry is added without updating the index -> drop it, as kernels without htree support do
+	if (dir->i_flags & EXT2_INDEX_FL)
+	{
+		dir->i_flags &= ~EXT2_INDEX_FL;
+		ext2_write_inode(dir);
+	}
+
 	// FIXME: MQ 2019-07-16 Only support direct blocks
 	for (int i = 0; i < 11; ++i)
 	{
@@ -154,7 +97,9 @@ static struct vfs_inode *ext2_create_inode(struct vfs_inode *dir, char *filename
 		int block = ei->i_block[i];
 		if (!block)
 		{
-			block = ext2_create_block(dir->i_sb);
+			block = ext2_create_block(dir->i_sb, i ? ei->i_block[i - 1] + 1 : ext2_group_first_block(dir->i_sb, dir_group));
+			if (!block)
+				return NULL;
 			ei->i_block[i] = block;
 			dir->i_blocks += 2;
 			dir->i_size += 1024;
@@ -202,37 +147,122 @@ static struct vfs_inode *ext2_create_inode(struct vfs_inode *dir, char *filename
 	return NULL;
 }
 
-// TODO: MQ 2020-09-22 Support 2, 3 and 4 level block
-static struct vfs_inode *ext2_lookup_inode(struct vfs_inode *dir, char *filename)
+static ino_t ext2_find_entry_in_block(struct vfs_superblock *sb, char *block_buf, const char *filename, uint32_t len)
 {
-	for (int i = 0; i < 11; ++i)
+	for (uint32_t offset = 0; offset < sb->s_blocksize;)
 	{
-		struct ext2_inode *ei = EXT2_INODE(dir);
-		int block = ei->i_block[i];
-		if (!block)
-			continue;
-		char *block_buf = ext2_bread_block(dir->i_sb, block);
+		struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block_buf + offset);
+		if (entry->rec_len < EXT2_DIR_REC_LEN(0))
+			break;
+		if (entry->ino && entry->name_len == len && !memcmp(entry->name, filename, len))
+			return entry->ino;
+		offset += entry->rec_len;
+	}
+	return 0;
+}
 
-		uint32_t size = 0;
-		struct ext2_dir_entry *entry = (struct ext2_dir_entry *)block_buf;
-		while (size < dir->i_sb->s_blocksize && entry->ino != 0)
-		{
-			char *name = kcalloc(entry->name_len + 1, sizeof(char));
-			memcpy(name, entry->name, entry->name_len);
+static ino_t ext2_find_entry_in_dir_block(struct vfs_inode *dir, uint32_t iblock, const char *filename, uint32_t len)
+{
+	uint32_t block = ext2_bmap(dir, iblock);
+	if (!block)
+		return 0;
+
+	char *block_buf = ext2_bread_block(dir->i_sb, block);
+	ino_t ino = ext2_find_entry_in_block(dir->i_sb, block_buf, filename, len);
+	kfree(block_buf);
+	return ino;
+}
 
-			if (strcmp(name, filename) == 0)
-			{
-				struct vfs_inode *inode = dir->i_sb->s_op->alloc_inode(dir->i_sb);
-				inode->i_ino = entry->ino;
-				ext2_read_inode(inode);
-				return inode;
-			}
+// the last entry whose hash is not above the target, entries[0] covers everything below entries[1]
+static struct dx_entry *dx_search(struct dx_entry *entries, uint32_t hash)
+{
+	uint16_t count = ((struct dx_countlimit *)entries)->count;
+	struct dx_entry *p = entries + 1;
+	struct dx_entry *q = entries + count - 1;
+	while (p <= q)
+	{
+		struct dx_entry *m = p + (q - p) / 2;
+		if (m->hash > hash)
+			q = m - 1;
+		else
+			p = m + 1;
+	}
+	return p - 1;
+}
 
-			entry = (struct ext2_dir_entry *)((char *)entry + entry->rec_len);
-			size = size + entry->rec_len;
-		}
+// walks index blocks from the root down to the leaf whose hash range has the name
+// returns -1 if the index cannot be used -> caller falls back to linear scan
+static int64_t ext2_dx_find_entry(struct vfs_inode *dir, const char *filename, uint32_t len)
+{
+	struct vfs_superblock *sb = dir->i_sb;
+	struct ext2_superblock *ext2_sb = EXT2_SB(sb);
+	uint32_t block = ext2_bmap(dir, 0);
+	if (!block)
+		return -1;
+
+	char *buf = ext2_bread_block(sb, block);
+	struct dx_root *root = (struct dx_root *)buf;
+	uint8_t hash_version = root->info.hash_version;
+	uint8_t levels = root->info.indirect_levels;
+	if (root->info.reserved_zero || hash_version > DX_HASH_TEA || levels >= EXT2_HTREE_LEVEL)
+	{
+		kfree(buf);
+		return -1;
 	}
-	return NULL;
+	if (ext2_sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+		hash_version += DX_HASH_LEGACY_UNSIGNED;
+
+	uint32_t hash = ext2_dirhash(filename, len, hash_version, ext2_sb->s_hash_seed);
+	struct dx_entry *entries = (struct dx_entry *)((char *)&root->info + root->info.info_length);
+	struct dx_entry *at;
+	for (uint8_t level = 0;; ++level)
+	{
+		at = dx_search(entries, hash);
+		if (level == levels)
+			break;
+
+		kfree(buf);
+		if (!(block = ext2_bmap(dir, at->block & 0x0FFFFFFF)))
+			return -1;
+		buf = ext2_bread_block(sb, block);
+		entries = (struct dx_entry *)(buf + sizeof(struct dx_node));
+	}
+
+	// names with the same hash might continue in the next leaf, its index entry has the collision bit set
+	struct dx_entry *end = entries + ((struct dx_countlimit *)entries)->count;
+	ino_t ino;
+	while (true)
+	{
+		ino = ext2_find_entry_in_dir_block(dir, at->block & 0x0FFFFFFF, filename, len);
+		if (ino || ++at >= end || at->hash != (hash | 1))
+			break;
+	}
+
+	kfree(buf);
+	return ino;
+}
+
+static struct vfs_inode *ext2_lookup_inode(struct vfs_inode *dir, char *filename)
+{
+	uint32_t len = strlen(filename);
+	int64_t ino = -1;
+	if (dir->i_flags & EXT2_INDEX_FL)
+		ino = ext2_dx_find_entry(dir, filename, len);
+
+	uint32_t blocks = div_ceil(dir->i_size, dir->i_sb->s_blocksize);
+	for (uint32_t iblock = 0; ino < 0 && iblock < blocks; ++iblock)
+	{
+		ino_t found = ext2_find_entry_in_dir_block(dir, iblock, filename, len);
+		if (found)
+			ino = found;
+	}
+	if (ino <= 0)
+		return NULL;
+
+	struct vfs_inode *inode = dir->i_sb->s_op->alloc_inode(dir->i_sb);
+	inode->i_ino = ino;
+	ext2_read_inode(inode);
+	return inode;
 }
 
 static void ext2_truncate_inode(struct vfs_inode *i)
@@ -244,6 +274,8 @@ static int ext2_mknod(struct vfs_inode *dir, struct vfs_dentry *dentry, int mode
 	struct vfs_inode *inode = ext2_lookup_inode(dir, dentry->d_name);
 	if (inode == NULL)
 		inode = ext2_create_inode(dir, dentry->d_name, mode);
+	if (!inode)
+		return -ENOSPC;
 	inode->i_rdev = dev;
 	init_special_inode(inode, mode, dev);
 	ext2_write_inode(inode);
@@ -1,4 +1,4 @@
-#include <devices/ata.h>
+#include <devices/block.h>
 #include <fs/buffer.h>
 #include <fs/vfs.h>
 #include <include/errno.h>
@@ -11,27 +11,62 @@
 
 struct ext2_group_desc *ext2_get_group_desc(struct vfs_superblock *sb, uint32_t group)
 {
-	struct ext2_group_desc *gdp = kcalloc(1, sizeof(struct ext2_group_desc));
-	struct ext2_superblock *ext2_sb = EXT2_SB(sb);
-	uint32_t block = ext2_sb->s_first_data_block + 1 + group / EXT2_GROUPS_PER_BLOCK(ext2_sb);
-	char *group_block_buf = ext2_bread_block(sb, block);
-	uint32_t offset = group % EXT2_GROUPS_PER_BLOCK(ext2_sb) * sizeof(struct ext2_group_desc);
-	memcpy(gdp, group_block_buf + offset, sizeof(struct ext2_group_desc));
-	return gdp;
+	return &EXT2_SB_INFO(sb)->s_group_desc[group];
 }
 
-void ext2_write_group_desc(struct vfs_superblock *sb, struct ext2_group_desc *gdp)
+void ext2_mark_group_dirty(struct vfs_superblock *sb, uint32_t group)
 {
-	struct ext2_superblock *ext2_sb = EXT2_SB(sb);
-	uint32_t group = get_group_from_block(ext2_sb, gdp->bg_block_bitmap);
-	uint32_t block = ext2_sb->s_first_data_block + 1 + group / EXT2_GROUPS_PER_BLOCK(ext2_sb);
-	uint32_t offset = group % EXT2_GROUPS_PER_BLOCK(ext2_sb) * sizeof(struct ext2_group_desc);
-	char *group_block_buf = ext2_bread_block(sb, block);
-	memcpy(group_block_buf + offset, gdp, sizeof(struct ext2_group_desc));
-	ext2_bwrite_block(sb, block, group_block_buf);
+	EXT2_SB_INFO(sb)->s_groups[group].desc_dirty = true;
+}
+
+void ext2_mark_super_dirty(struct vfs_superblock *sb)
+{
+	EXT2_SB_INFO(sb)->s_dirt = true;
 }
 
-static struct ext2_inode *ext2_get_inode(struct vfs_superblock *sb, ino_t ino)
+static int ext2_load_group_desc(struct vfs_superblock *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB_INFO(sb);
+	struct ext2_superblock *ext2_sb = &sbi->s_es;
+
+	sbi->s_groups_count = div_ceil(ext2_sb->s_blocks_count - ext2_sb->s_first_data_block, ext2_sb->s_blocks_per_group);
+	sbi->s_gdb_count = div_ceil(sbi->s_groups_count, EXT2_GROUPS_PER_BLOCK(ext2_sb));
+	sbi->s_group_desc = (struct ext2_group_desc *)ext2_bread(sb, ext2_sb->s_first_data_block + 1, sbi->s_gdb_count * sb->s_blocksize);
+	sbi->s_groups = kcalloc(sbi->s_groups_count, sizeof(struct ext2_group_info));
+	if (!sbi->s_group_desc || !sbi->s_groups)
+		return -ENOMEM;
+	return 0;
+}
+
+// bitmaps go first, then descriptor blocks which have a dirty group, then the superblock
+static void ext2_sync_fs(struct vfs_superblock *sb)
+{
+	struct ext2_sb_info *sbi = EXT2_SB_INFO(sb);
+	struct ext2_superblock *ext2_sb = &sbi->s_es;
+	uint32_t per_block = EXT2_GROUPS_PER_BLOCK(ext2_sb);
+
+	ext2_write_bitmaps(sb);
+
+	for (uint32_t gdb = 0; gdb < sbi->s_gdb_count; ++gdb)
+	{
+		bool dirty = false;
+		for (uint32_t group = gdb * per_block; group < sbi->s_groups_count && group < (gdb + 1) * per_block; ++group)
+		{
+			dirty |= sbi->s_groups[group].desc_dirty;
+			sbi->s_groups[group].desc_dirty = false;
+		}
+		if (dirty)
+			ext2_bwrite_block(sb, ext2_sb->s_first_data_block + 1 + gdb, (char *)sbi->s_group_desc + gdb * sb->s_blocksize);
+	}
+
+	if (sbi->s_dirt)
+	{
+		sbi->s_dirt = false;
+		sb->s_op->write_super(sb);
+	}
+}
+
+static void ext2_get_inode(struct vfs_superblock *sb, ino_t ino, struct ext2_inode *raw_node)
 {
 	struct ext2_superblock *ext2_sb = EXT2_SB(sb);
 	uint32_t group = get_group_from_inode(ext2_sb, ino);
@@ -40,7 +75,8 @@ static struct ext2_inode *ext2_get_inode(struct vfs_superblock *sb, ino_t ino)
 	uint32_t offset = (get_relative_inode_in_group(ext2_sb, ino) % EXT2_INODES_PER_BLOCK(ext2_sb)) * sizeof(struct ext2_inode);
 	char *table_buf = ext2_bread_block(sb, block);
 
-	return (struct ext2_inode *)(table_buf + offset);
+	memcpy(raw_node, table_buf + offset, sizeof(struct ext2_inode));
+	kfree(table_buf);
 }
 
 struct vfs_inode *ext2_alloc_inode(struct vfs_superblock *sb)
@@ -54,7 +90,9 @@ struct vfs_inode *ext2_alloc_inode(struct vfs_superblock *sb)
 
 void ext2_read_inode(struct vfs_inode *i)
 {
-	struct ext2_inode *raw_node = ext2_get_inode(i->i_sb, i->i_ino);
+	struct ext2_inode_info *info = kcalloc(1, sizeof(struct ext2_inode_info));
+	struct ext2_inode *raw_node = &info->i_raw;
+	ext2_get_inode(i->i_sb, i->i_ino, raw_node);
 
 	i->i_mode = raw_node->i_mode;
 	i->i_gid = raw_node->i_gid;
@@ -70,7 +108,7 @@ void ext2_read_inode(struct vfs_inode *i)
 	i->i_blksize = PMM_FRAME_SIZE; /* This is the optimal IO size (for stat), not the fs block size */
 	i->i_blocks = raw_node->i_blocks;
 	i->i_flags = raw_node->i_flags;
-	i->i_fs_info = raw_node;
+	i->i_fs_info = info;
 
 	if (S_ISREG(i->i_mode))
 	{
@@ -119,12 +157,13 @@ void ext2_write_inode(struct vfs_inode *i)
 
 	memcpy(buf + offset, ei, sizeof(struct ext2_inode));
 	ext2_bwrite_block(i->i_sb, block, buf);
+	kfree(buf);
 }
 
 static void ext2_write_super(struct vfs_superblock *sb)
 {
 	struct ext2_superblock *ext2_sb = EXT2_SB(sb);
-	ext2_bwrite_block(sb, ext2_sb->s_first_data_block, (char *)ext2_sb);
+	ext2_bwrite(sb, ext2_sb->s_first_data_block, (char *)ext2_sb, sizeof(struct ext2_superblock));
 }
 
 struct vfs_super_operations ext2_super_operations = {
@@ -132,23 +171,26 @@ struct vfs_super_operations ext2_super_operations = {
 	.read_inode = ext2_read_inode,
 	.write_inode = ext2_write_inode,
 	.write_super = ext2_write_super,
+	.sync_fs = ext2_sync_fs,
 };
 
 static int ext2_fill_super(struct vfs_superblock *sb)
 {
-	struct ext2_superblock *ext2_sb = (struct ext2_superblock *)kcalloc(1, sizeof(struct ext2_superblock));
+	struct ext2_sb_info *sbi = kcalloc(1, sizeof(struct ext2_sb_info));
+	struct ext2_superblock *ext2_sb = &sbi->s_es;
 	char *buf = ext2_bread_block(sb, 1);
-	memcpy(ext2_sb, (struct ext2_superblock *)buf, sb->s_blocksize);
+	memcpy(ext2_sb, (struct ext2_superblock *)buf, sizeof(struct ext2_superblock));
+	kfree(buf);
 
 	if (ext2_sb->s_magic != EXT2_SUPER_MAGIC)
 		return -EINVAL;
 
-	sb->s_fs_info = ext2_sb;
+	sb->s_fs_info = sbi;
 	sb->s_op = &ext2_super_operations;
 	sb->s_blocksize = EXT2_BLOCK_SIZE(ext2_sb);
 	sb->s_blocksize_bits = ext2_sb->s_log_block_size;
 	sb->s_magic = EXT2_SUPER_MAGIC;
-	return 0;
+	return ext2_load_group_desc(sb);
 }
 
 static struct vfs_mount *ext2_mount(struct vfs_file_system_type *fs_type,
@@ -157,6 +199,7 @@ static struct vfs_mount *ext2_mount(struct vfs_file_system_type *fs_type,
 	struct vfs_superblock *sb = (struct vfs_superblock *)kcalloc(1, sizeof(struct vfs_superblock));
 	sb->s_blocksize = EXT2_MIN_BLOCK_SIZE;
 	sb->mnt_devname = strdup(dev_name);
+	sb->s_bdev = get_block_device(dev_name);
 	sb->s_type = fs_type;
 	ext2_fill_super(sb);
 
@@ -178,9 +221,16 @@ static struct vfs_mount *ext2_mount(struct vfs_file_system_type *fs_type,
 	return mnt;
 }
 
+static void ext2_unmount(struct vfs_superblock *sb)
+{
+	ext2_sync_fs(sb);
+	sync_buffers(sb->s_bdev, false);
+}
+
 struct vfs_file_system_type ext2_fs_type = {
 	.name = "ext2",
 	.mount = ext2_mount,
+	.unmount = ext2_unmount,
 };
 
 void init_ext2_fs()
@@ -200,7 +250,13 @@ char *ext2_bread_block(struct vfs_superblock *sb, uint32_t block)
 
 char *ext2_bread(struct vfs_superblock *sb, uint32_t block, uint32_t size)
 {
-	return bread(sb->mnt_devname, block * (sb->s_blocksize / 512), size);
+	return bread(sb->s_bdev, block * (sb->s_blocksize / 512), size);
+}
+
+// reads into caller's buffer which has to be physically addressable (not a lazily mapped user page)
+int ext2_bread_to(struct vfs_superblock *sb, uint32_t block, char *buf, uint32_t size)
+{
+	return bread_to(sb->s_bdev, block * (sb->s_blocksize / 512), buf, size);
 }
 
 void ext2_bwrite_block(struct vfs_superblock *sb, uint32_t block, char *buf)
@@ -210,5 +266,10 @@ void ext2_bwrite_block(struct vfs_superblock *sb, uint32_t block, char *buf)
 
 void ext2_bwrite(struct vfs_superblock *sb, uint32_t block, char *buf, uint32_t size)
 {
-	return bwrite(sb->mnt_devname, block * (sb->s_blocksize / 512), buf, size);
+	return bwrite(sb->s_bdev, block * (sb->s_blocksize / 512), buf, size);
+}
+
+void ext2_bwrite_data(struct vfs_superblock *sb, uint32_t block, char *buf, uint32_t size)
+{
+	return bwrite_data(sb->s_bdev, block * (sb->s_blocksize / 512), buf, size);
 }
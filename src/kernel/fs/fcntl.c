@@ -1,4 +1,5 @@
 #include <fs/vfs.h>
+#include <include/fcntl.h>
 #include <proc/task.h>
 
 int do_fcntl(int fd, int cmd, unsigned long arg)
@@ -12,6 +13,11 @@ int do_fcntl(int fd, int cmd, unsigned long arg)
 		ret = filp->f_flags;
 		break;
 
+	// only status flags can be changed, access mode and creation flags are ignored
+	case F_SETFL:
+		filp->f_flags = (filp->f_flags & ~(O_APPEND | O_NONBLOCK)) | (arg & (O_APPEND | O_NONBLOCK));
+		break;
+
 	default:
 		break;
 	}
@@ -12,6 +12,8 @@ struct vfs_dentry *alloc_dentry(struct vfs_dentry *parent, char *name)
 	d->d_name = strdup(name);
 	d->d_parent = parent;
 	INIT_LIST_HEAD(&d->d_subdirs);
+	INIT_LIST_HEAD(&d->d_hash_sibling);
+	INIT_LIST_HEAD(&d->d_lru);
 
 	if (parent)
 		d->d_sb = parent->d_sb;
@@ -31,18 +33,9 @@ int path_walk(struct nameidata *nd, const char *path, int32_t flags, mode_t mode
 		for (int j = 0; path[i] != '/' && i < length; ++i, ++j)
 			part_name[j] = path[i];
 
-		struct vfs_dentry *iter = NULL;
-		struct vfs_dentry *d_child = NULL;
-		list_for_each_entry(iter, &nd->dentry->d_subdirs, d_sibling)
-		{
-			if (!strcmp(part_name, iter->d_name))
-			{
-				d_child = iter;
-				break;
-			}
-		}
-
-		if (d_child)
+		// cached components (hits and misses) never reach the filesystem
+		struct vfs_dentry *d_child = d_lookup(nd->dentry, part_name);
+		if (d_child && d_child->d_inode)
 		{
 			nd->dentry = d_child;
 			if (i == length && flags & O_CREAT && flags & O_EXCL)
@@ -51,7 +44,7 @@ int path_walk(struct nameidata *nd, const char *path, int32_t flags, mode_t mode
 		else
 		{
 			struct vfs_inode *inode = NULL;
-			if (nd->dentry->d_inode->i_op->lookup)
+			if (!d_child && nd->dentry->d_inode->i_op->lookup)
 				inode = nd->dentry->d_inode->i_op->lookup(nd->dentry->d_inode, part_name);
 
 			if (inode == NULL)
@@ -59,14 +52,26 @@ int path_walk(struct nameidata *nd, const char *path, int32_t flags, mode_t mode
 				if (i == length && flags & O_CREAT)
 					inode = nd->dentry->d_inode->i_op->create(nd->dentry->d_inode, part_name, i == length ? mode : S_IFDIR);
 				else
+				{
+					if (!d_child)
+						d_alloc_negative(nd->dentry, part_name);
 					return -EACCES;
+				}
+				if (inode == NULL)
+					return -ENOSPC;
 			}
 			else if (i == length && flags & O_CREAT && flags & O_EXCL)
 				return -EEXIST;
 
-			d_child = alloc_dentry(nd->dentry, part_name);
-			d_child->d_inode = inode;
-			list_add_tail(&d_child->d_sibling, &nd->dentry->d_subdirs);
+			if (d_child)
+				d_instantiate(d_child, inode);
+			else
+			{
+				d_child = alloc_dentry(nd->dentry, part_name);
+				d_child->d_inode = inode;
+				list_add_tail(&d_child->d_sibling, &nd->dentry->d_subdirs);
+				d_add(d_child);
+			}
 			nd->dentry = d_child;
 		}
 
@@ -130,11 +135,14 @@ int32_t vfs_close(int32_t fd)
 
 	struct vfs_file *f = files->fd[fd];
 	atomic_dec(&f->f_count);
-	if (!atomic_read(&f->f_count) && f->f_op->release)
-		ret = f->f_op->release(f->f_dentry->d_inode, f);
+	bool last = !atomic_read(&f->f_count);
 	files->fd[fd] = NULL;
 
 	release_semaphore(&files->lock);
+
+	// release might block (socket waits for its connection to be closed) -> fd table is not held meanwhile
+	if (last && f->f_op->release)
+		ret = f->f_op->release(f->f_dentry->d_inode, f);
 	return ret;
 }
 
@@ -204,7 +212,9 @@ int vfs_mknod(const char *path, int mode, dev_t dev)
 	if (ret < 0)
 		return ret;
 
+	d_prune_negative(nd.dentry, name);
 	list_add_tail(&d_child->d_sibling, &nd.dentry->d_subdirs);
+	d_add(d_child);
 
 	return ret;
 }
@@ -17,6 +17,7 @@ static ssize_t sockfs_write_file(struct vfs_file *file, const char *buf, size_t
 // TODO: MQ 2020-06-06 Cleanup socket, sock
 static int sockfs_release_file(struct vfs_inode *inode, struct vfs_file *file)
 {
+	socket_release(SOCKET_I(inode));
 	return 0;
 }
 
@@ -30,11 +31,22 @@ int sockfs_ioctl(struct vfs_inode *inode, struct vfs_file *file, unsigned int cm
 	return 0;
 }
 
+static unsigned int sockfs_poll(struct vfs_file *file, struct poll_table *pt)
+{
+	struct socket *sock = SOCKET_I(file->f_dentry->d_inode);
+
+	if (sock->ops->poll)
+		return sock->ops->poll(sock, file, pt);
+
+	return 0;
+}
+
 struct vfs_file_operations sockfs_file_operations = {
 	.read = sockfs_read_file,
 	.write = sockfs_write_file,
 	.release = sockfs_release_file,
 	.ioctl = sockfs_ioctl,
+	.poll = sockfs_poll,
 };
 
 struct vfs_file_operations sockfs_dir_operations = {
@@ -7,31 +7,39 @@
 
 #include "tmpfs.h"
 
+// copies between buf and pages of [ppos, ppos + count), pages are looked up by index
+static void tmpfs_copy_pages(struct vfs_inode *inode, char *buf, size_t count, loff_t ppos, bool write)
+{
+	uint32_t index = ppos / PMM_FRAME_SIZE;
+	uint32_t offset = ppos % PMM_FRAME_SIZE;
+	while (count)
+	{
+		uint32_t len = min_t(size_t, count, PMM_FRAME_SIZE - offset);
+		struct page *page = radix_tree_lookup(&inode->i_data.page_tree, index);
+
+		kmap(page);
+		if (write)
+			memcpy((char *)page->virtual + offset, buf, len);
+		else
+			memcpy(buf, (char *)page->virtual + offset, len);
+		kunmap(page);
+
+		buf += len;
+		count -= len;
+		offset = 0;
+		index++;
+	}
+}
+
 static ssize_t tmpfs_read_file(struct vfs_file *file, char *buf, size_t count, loff_t ppos)
 {
 	struct vfs_inode *inode = file->f_dentry->d_inode;
-	struct vfs_superblock *sb = inode->i_sb;
 
+	if (ppos >= inode->i_size)
+		return 0;
 	count = min_t(size_t, ppos + count, inode->i_size) - ppos;
-	uint32_t p = file->f_pos;
-	struct page *iter_page;
-	char *iter_buf = buf;
-	list_for_each_entry(iter_page, &inode->i_data.pages, sibling)
-	{
-		if (p + sb->s_blocksize < ppos)
-			continue;
-		if (p >= ppos + count)
-			break;
-
-		int32_t pstart = (ppos > p) ? ppos - p : 0;
-		uint32_t pend = ((ppos + count) < (p + sb->s_blocksize)) ? (p + sb->s_blocksize - ppos - count) : 0;
-
-		kmap(iter_page);
-		memcpy(iter_buf, (char *)iter_page->virtual + pstart, sb->s_blocksize - pstart - pend);
-		kunmap(iter_page);
-		p += sb->s_blocksize;
-		iter_buf += sb->s_blocksize;
-	}
+
+	tmpfs_copy_pages(inode, buf, count, ppos, false);
 	file->f_pos = ppos + count;
 	return count;
 }
@@ -39,47 +47,34 @@ static ssize_t tmpfs_read_file(struct vfs_file *file, char *buf, size_t count, l
 static ssize_t tmpfs_write_file(struct vfs_file *file, const char *buf, size_t count, loff_t ppos)
 {
 	struct vfs_inode *inode = file->f_dentry->d_inode;
-	struct vfs_superblock *sb = inode->i_sb;
 
 	if (ppos + count > inode->i_size)
-		tmpfs_setsize(inode, ppos + count);
-
-	uint32_t p = file->f_pos;
-	struct page *iter_page;
-	char *iter_buf = buf;
-	list_for_each_entry(iter_page, &inode->i_data.pages, sibling)
 	{
-		if (p + sb->s_blocksize < ppos)
-			continue;
-		if (p >= ppos + count)
-			break;
-
-		int32_t pstart = (ppos > p) ? ppos - p : 0;
-		uint32_t pend = ((ppos + count) < (p + sb->s_blocksize)) ? (p + sb->s_blocksize - ppos - count) : 0;
-
-		kmap(iter_page);
-		memcpy((char *)iter_page->virtual + pstart, iter_buf, sb->s_blocksize - pstart - pend);
-		kunmap(iter_page);
-		p += sb->s_blocksize;
-		iter_buf += sb->s_blocksize;
+		int ret = tmpfs_setsize(inode, ppos + count);
+		if (ret < 0)
+			return ret;
 	}
+
+	tmpfs_copy_pages(inode, (char *)buf, count, ppos, true);
 	file->f_pos = ppos + count;
 	return count;
 }
 
+#define TMPFS_MMAP_BATCH 16
+
 static int tmpfs_mmap_file(struct vfs_file *file, struct vm_area_struct *new_vma)
 {
 	struct vfs_inode *inode = file->f_dentry->d_inode;
-	struct vfs_superblock *sb = inode->i_sb;
+	uint32_t npages = (new_vma->vm_end - new_vma->vm_start) / PMM_FRAME_SIZE;
 
-	struct page *iter_page;
-	uint32_t addr = new_vma->vm_start;
-	list_for_each_entry(iter_page, &inode->i_data.pages, sibling)
+	// pages are taken in index order a batch at a time, holes stay unmapped
+	struct page *pages[TMPFS_MMAP_BATCH];
+	uint32_t index = 0, found;
+	while (index < npages && (found = radix_tree_gang_lookup(&inode->i_data.page_tree, (void **)pages, index, TMPFS_MMAP_BATCH)))
 	{
-		if (addr >= new_vma->vm_end)
-			break;
-		vmm_map_address(current_process->pdir, addr, iter_page->frame, I86_PTE_PRESENT | I86_PTE_WRITABLE | I86_PTE_USER);
-		addr += sb->s_blocksize;
+		for (uint32_t i = 0; i < found && pages[i]->index < npages; ++i)
+			vmm_map_address(current_process->pdir, new_vma->vm_start + pages[i]->index * PMM_FRAME_SIZE, pages[i]->frame, I86_PTE_PRESENT | I86_PTE_WRITABLE | I86_PTE_USER);
+		index = pages[found - 1]->index + 1;
 	}
 
 	return 0;
@@ -87,7 +82,7 @@ static int tmpfs_mmap_file(struct vfs_file *file, struct vm_area_struct *new_vma
 
 static int tmpfs_release(struct vfs_inode *inode, struct vfs_file *file)
 {
-	// TODO: MQ 2020-08-22 implement release for `inode->i_data.pages`
+	// TODO: MQ 2020-08-22 implement release for `inode->i_data.page_tree`
 	return 0;
 }
 
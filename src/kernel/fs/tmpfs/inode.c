@@ -8,25 +8,26 @@
 
 int tmpfs_setsize(struct vfs_inode *inode, loff_t new_size)
 {
-	uint32_t aligned_new_size = PAGE_ALIGN(new_size);
-	uint32_t aligned_size = PAGE_ALIGN(inode->i_size);
-	if (aligned_size < aligned_new_size)
+	struct address_space *mapping = &inode->i_data;
+	uint32_t npages = PAGE_ALIGN(new_size) / PMM_FRAME_SIZE;
+	for (uint32_t index = mapping->npages; index < npages; ++index)
 	{
-		uint32_t extended_frames = (aligned_new_size - aligned_size) / PMM_FRAME_SIZE;
-		for (uint32_t i = 0; i < extended_frames; ++i)
+		struct page *p = kcalloc(1, sizeof(struct page));
+		p->frame = (uint32_t)pmm_alloc_block();
+		p->index = index;
+		if (radix_tree_insert(&mapping->page_tree, index, p) < 0)
 		{
-			struct page *p = kcalloc(1, sizeof(struct page));
-			p->frame = (uint32_t)pmm_alloc_block();
-			list_add_tail(&p->sibling, &inode->i_data.pages);
+			pmm_free_block((void *)p->frame);
+			kfree(p);
+			mapping->npages = index;
+			return -ENOMEM;
 		}
 	}
-	else if (aligned_size > aligned_new_size)
-	{
-		uint32_t shrink_frames = (aligned_size - aligned_new_size) / PMM_FRAME_SIZE;
-		for (uint32_t i = 0; i < shrink_frames; ++i)
-			list_del(inode->i_data.pages.prev);
-	}
-	inode->i_data.npages = aligned_new_size / PMM_FRAME_SIZE;
+	// frames might still be mapped by mmap -> only their descriptors are dropped
+	for (uint32_t index = npages; index < mapping->npages; ++index)
+		kfree(radix_tree_delete(&mapping->page_tree, index));
+
+	mapping->npages = npages;
 	inode->i_size = new_size;
 	return 0;
 }
@@ -6,6 +6,7 @@
 #include <utils/printf.h>
 #include <utils/string.h>
 
+#include "buffer.h"
 #include "char_dev.h"
 #include "devfs/devfs.h"
 #include "ext2/ext2.h"
@@ -113,12 +114,15 @@ struct vfs_mount *do_mount(const char *fstype, int flags, const char *path)
 		{
 			// TODO: MQ 2020-10-24 Make sure path is empty folder
 			list_del(&iter->d_sibling);
+			d_drop(iter);
 			kfree(iter);
 		}
 	}
 
 	mnt->mnt_mountpoint->d_parent = nd.dentry;
+	d_prune_negative(nd.dentry, mnt->mnt_mountpoint->d_name);
 	list_add_tail(&mnt->mnt_mountpoint->d_sibling, &nd.dentry->d_subdirs);
+	d_add(mnt->mnt_mountpoint);
 	list_add_tail(&mnt->sibling, &vfsmntlist);
 
 	return mnt;
@@ -142,6 +146,8 @@ void vfs_init(struct vfs_file_system_type *fs, char *dev_name)
 	DEBUG &&debug_println(DEBUG_INFO, "VFS: Initializing");
 
 	INIT_LIST_HEAD(&vfsmntlist);
+	dcache_init();
+	buffer_init();
 
 	DEBUG &&debug_println(DEBUG_INFO, "VFS: Mount ext2");
 	init_rootfs(fs, dev_name);
@@ -161,5 +167,8 @@ void vfs_init(struct vfs_file_system_type *fs, char *dev_name)
 	DEBUG &&debug_println(DEBUG_INFO, "VFS: Mount chrdev");
 	chrdev_init();
 
+	DEBUG &&debug_println(DEBUG_INFO, "VFS: Start writeback");
+	writeback_init();
+
 	DEBUG &&debug_println(DEBUG_INFO, "VFS: Done");
 }
@@ -10,6 +10,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <system/time.h>
+#include <utils/radix_tree.h>
 
 // mount
 #define MS_NOUSER (1 << 31)
@@ -22,12 +23,14 @@
 #define OPEN_FMODE(flag) ((flag + 1) & O_ACCMODE)
 
 struct vm_area_struct;
+struct block_device;
 struct vfs_superblock;
 
 struct address_space
 {
 	struct vm_area_struct *i_mmap;
-	struct list_head pages;
+	// struct page by page index
+	struct radix_tree_root page_tree;
 	uint32_t npages;
 };
 
@@ -113,6 +116,8 @@ struct vfs_superblock
 	unsigned long s_magic;
 	struct vfs_dentry *s_root;
 	char *mnt_devname;
+	// resolved once at mount for disk-backed filesystems
+	struct block_device *s_bdev;
 	void *s_fs_info;
 };
 
@@ -122,6 +127,8 @@ struct vfs_super_operations
 	void (*read_inode)(struct vfs_inode *);
 	void (*write_inode)(struct vfs_inode *);
 	void (*write_super)(struct vfs_superblock *);
+	// writes back metadata which is only changed in memory
+	void (*sync_fs)(struct vfs_superblock *);
 };
 
 struct vfs_inode
@@ -168,6 +175,10 @@ struct vfs_dentry
 	struct vfs_superblock *d_sb;
 	struct list_head d_subdirs;
 	struct list_head d_sibling;
+	// dcache, only negative dentries (without inode) are on the lru
+	uint32_t d_hash;
+	struct list_head d_hash_sibling;
+	struct list_head d_lru;
 };
 
 struct vfs_file
@@ -194,6 +205,7 @@ struct vfs_file_operations
 	int (*mmap)(struct vfs_file *file, struct vm_area_struct *vm);
 	int (*open)(struct vfs_inode *inode, struct vfs_file *file);
 	int (*release)(struct vfs_inode *inode, struct vfs_file *file);
+	int (*fsync)(struct vfs_file *file, int datasync);
 };
 
 struct nameidata
@@ -225,6 +237,21 @@ struct vfs_file *get_empty_filp();
 int generic_memory_readdir(struct vfs_file *file, struct dirent *dirent, unsigned int count);
 void vfs_build_path_backward(struct vfs_dentry *dentry, char *path);
 
+// dcache.c
+struct vfs_dentry *d_lookup(struct vfs_dentry *parent, const char *name);
+void d_add(struct vfs_dentry *dentry);
+void d_drop(struct vfs_dentry *dentry);
+void d_alloc_negative(struct vfs_dentry *parent, char *name);
+void d_instantiate(struct vfs_dentry *dentry, struct vfs_inode *inode);
+void d_prune_negative(struct vfs_dentry *parent, const char *name);
+void dcache_init();
+
+// writeback.c
+void sync_filesystems();
+int vfs_sync();
+int vfs_fsync(int32_t fd, int datasync);
+void writeback_init();
+
 // read_write.c
 char *vfs_read(const char *path);
 ssize_t vfs_fread(int32_t fd, char *buf, size_t count);
@@ -0,0 +1,57 @@
+#include <fs/buffer.h>
+#include <fs/vfs.h>
+#include <include/errno.h>
+#include <proc/task.h>
+
+// metadata which filesystems only change in memory is moved into dirty buffers,
+// buffers which are old enough or above the background ratio are written back
+#define WRITEBACK_INTERVAL 1000
+
+extern struct list_head vfsmntlist;
+
+void sync_filesystems()
+{
+	struct vfs_mount *mnt;
+	list_for_each_entry(mnt, &vfsmntlist, sibling)
+	{
+		struct vfs_superblock *sb = mnt->mnt_sb;
+		if (sb->s_op && sb->s_op->sync_fs)
+			sb->s_op->sync_fs(sb);
+	}
+}
+
+int vfs_sync()
+{
+	sync_filesystems();
+	return sync_buffers(NULL, false);
+}
+
+int vfs_fsync(int32_t fd, int datasync)
+{
+	struct vfs_file *file = current_process->files->fd[fd];
+	if (!file)
+		return -EBADF;
+	if (!file->f_op->fsync)
+		return -EINVAL;
+
+	return file->f_op->fsync(file, datasync);
+}
+
+static void writeback_loop()
+{
+	// explain in kernel_init#unlock_scheduler
+	unlock_scheduler();
+
+	while (true)
+	{
+		thread_sleep(WRITEBACK_INTERVAL);
+		sync_filesystems();
+		sync_buffers(NULL, !dirty_buffers_exceeded(DIRTY_BACKGROUND_RATIO));
+	}
+}
+
+void writeback_init()
+{
+	struct process *writeback_process = create_system_process("writeback", writeback_loop, 0);
+	update_thread(writeback_process->thread, THREAD_READY);
+}
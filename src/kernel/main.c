@@ -4,13 +4,16 @@
 #include <stdint.h>
 
 #include "cpu/exception.h"
+#include "cpu/fpu.h"
 #include "cpu/gdt.h"
 #include "cpu/hal.h"
 #include "cpu/idt.h"
 #include "cpu/pit.h"
 #include "cpu/rtc.h"
 #include "cpu/tss.h"
+#include "devices/ahci.h"
 #include "devices/ata.h"
+#include "devices/block.h"
 #include "devices/char/memory.h"
 #include "devices/char/tty.h"
 #include "devices/kybrd.h"
@@ -81,14 +84,27 @@ void kernel_init()
 
 	timer_init();
 
+	// kmap cache slots are shared with every process which is created from now on
+	kmap_init();
+
 	// setup random's seed
 	srand(get_seconds(NULL));
 
 	// FIXME: MQ 2019-11-19 ata_init is not called in pci_scan_buses without enabling -O2
 	pci_init();
 	ata_init();
+	ahci_init();
 
-	vfs_init(&ext2_fs_type, "/dev/hda");
+	// root is the first ide disk, the first sata disk is used on machines without ide
+	char *root_dev = get_block_device("/dev/hda") ? "/dev/hda" : "/dev/sda";
+	if (!get_block_device(root_dev))
+	{
+		DEBUG &&debug_println(DEBUG_FATAL, "VFS: No disk for root filesystem");
+		disable_interrupts();
+		for (;;)
+			halt();
+	}
+	vfs_init(&ext2_fs_type, root_dev);
 	chrdev_memory_init();
 	tty_init();
 
@@ -99,6 +115,9 @@ void kernel_init()
 	// init ipc message queue
 	mq_init();
 
+	// init network stack, only loopback is up until a network card is set up
+	net_init();
+
 	// register system apis
 	syscall_init();
 
@@ -160,6 +179,9 @@ int kernel_main(uint32_t addr, uint32_t magic)
 
 	exception_init();
 
+	// x87/sse have to be enabled before the first thread saves its state
+	fpu_init();
+
 	// timer
 	rtc_init();
 	pit_init();
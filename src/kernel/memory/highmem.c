@@ -4,8 +4,21 @@
 
 #define PKMAP_BASE 0xE0000000
 #define LAST_PKMAP 1024
+// single page mappings stay cached after kunmap, a frame which is mapped again reuses its slot
+#define KMAP_CACHE_SIZE 64
+
+struct kmap_slot
+{
+	uint32_t frame;
+	uint32_t vaddr;
+	// kmap without kunmap, the slot cannot be reused
+	uint32_t count;
+	uint32_t last_used;
+};
 
 uint32_t pkmap[LAST_PKMAP];
+static struct kmap_slot kmap_cache[KMAP_CACHE_SIZE];
+static uint32_t kmap_clock;
 
 void pkmap_bitmap_set(uint32_t block)
 {
@@ -70,8 +83,58 @@ int get_pkmaps_free(size_t size)
 	return -1;
 }
 
+// slots are taken once and their page table is created in the kernel part of the current directory
+// -> called before user processes are created, they share the table and the cached mappings
+void kmap_init()
+{
+	uint32_t block = get_pkmaps_free(KMAP_CACHE_SIZE);
+	for (uint32_t i = 0; i < KMAP_CACHE_SIZE; ++i)
+	{
+		pkmap_bitmap_set(block + i);
+		kmap_cache[i].vaddr = (block + i) * PMM_FRAME_SIZE + PKMAP_BASE;
+	}
+	vmm_create_page_table(current_process->pdir, kmap_cache[0].vaddr, I86_PTE_PRESENT | I86_PTE_WRITABLE);
+}
+
+static bool kmap_cached(uint32_t vaddr)
+{
+	return vaddr >= kmap_cache[0].vaddr && vaddr < kmap_cache[0].vaddr + KMAP_CACHE_SIZE * PMM_FRAME_SIZE;
+}
+
 void kmap(struct page *p)
 {
+	lock_scheduler();
+	struct kmap_slot *slot = NULL, *victim = NULL;
+	for (uint32_t i = 0; i < KMAP_CACHE_SIZE; ++i)
+	{
+		struct kmap_slot *iter = &kmap_cache[i];
+		if (iter->frame == p->frame)
+		{
+			slot = iter;
+			break;
+		}
+		if (!iter->count && (!victim || iter->last_used < victim->last_used))
+			victim = iter;
+	}
+
+	// least recently used slot which is not in use is remapped
+	if (!slot && victim)
+	{
+		slot = victim;
+		slot->frame = p->frame;
+		vmm_map_address(current_process->pdir, slot->vaddr, p->frame, I86_PTE_PRESENT | I86_PTE_WRITABLE);
+	}
+
+	if (slot)
+	{
+		slot->count++;
+		slot->last_used = ++kmap_clock;
+		p->virtual = slot->vaddr;
+		unlock_scheduler();
+		return;
+	}
+	unlock_scheduler();
+
 	uint32_t block = get_pkmap_free();
 	uint32_t vaddr = block * PMM_FRAME_SIZE + PKMAP_BASE;
 
@@ -98,6 +161,14 @@ void kunmap(struct page *p)
 	if (!p->virtual)
 		return;
 
+	if (kmap_cached(p->virtual))
+	{
+		lock_scheduler();
+		kmap_cache[(p->virtual - kmap_cache[0].vaddr) / PMM_FRAME_SIZE].count--;
+		unlock_scheduler();
+		return;
+	}
+
 	uint32_t block = (p->virtual - PKMAP_BASE) / PMM_FRAME_SIZE;
 	pkmap_bitmap_unset(block);
 	vmm_unmap_address(current_process->pdir, p->virtual);
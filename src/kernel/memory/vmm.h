@@ -59,7 +59,8 @@ typedef uint32_t pd_entry;
 struct page
 {
 	uint32_t frame;
-	struct list_head sibling;
+	// offset in its address space, in pages
+	uint32_t index;
 	uint32_t virtual;
 };
 
@@ -83,6 +84,7 @@ struct pdirectory
 void vmm_init();
 struct pdirectory *vmm_get_directory();
 void vmm_map_address(struct pdirectory *dir, uint32_t virt, uint32_t phys, uint32_t flags);
+void vmm_create_page_table(struct pdirectory *dir, uint32_t virt, uint32_t flags);
 void vmm_unmap_address(struct pdirectory *va_dir, uint32_t virt);
 void vmm_unmap_range(struct pdirectory *va_dir, uint32_t vm_start, uint32_t vm_end);
 void *create_kernel_stack(int32_t blocks);
@@ -107,6 +109,7 @@ int do_munmap(struct mm_struct *mm, uint32_t addr, size_t len);
 uint32_t do_brk(uint32_t addr, size_t len);
 
 // highmem.c
+void kmap_init();
 void kmap(struct page *p);
 void kmaps(struct pages *p);
 void kunmap(struct page *p);
@@ -45,7 +45,7 @@ int packet_sendmsg(struct socket *sock, void *msg, size_t msg_len)
 	return 0;
 }
 
-int packet_recvmsg(struct socket *sock, void *msg, size_t msg_len)
+int packet_recvmsg(struct socket *sock, void *msg, size_t msg_len, int flags)
 {
 	if (sock->state == SS_DISCONNECTED)
 		return -ESHUTDOWN;
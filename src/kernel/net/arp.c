@@ -3,9 +3,9 @@
 #include <include/errno.h>
 #include <include/if_ether.h>
 #include <memory/vmm.h>
+#include <net/ethernet.h>
 #include <net/net.h>
 #include <net/sk_buff.h>
-#include <system/sysapi.h>
 #include <utils/string.h>
 
 int arp_validate_packet(struct arp_packet *ap)
@@ -46,23 +46,29 @@ int arp_rcv(struct sk_buff *skb)
 	return 0;
 }
 
+// arp is built straight into sk_buff, no socket is needed (also used from neighbour thread)
 int arp_send(uint8_t *source_mac, uint32_t source_ip, uint8_t *dest_mac, uint32_t dest_ip, uint16_t type)
 {
-	uint32_t sockfd = sys_socket(PF_PACKET, SOCK_DGRAM, ETH_P_ARP);
-	struct socket *sock = sockfd_lookup(sockfd);
-	struct net_device *dev = sock->sk->dev;
+	struct net_device *dev = get_current_net_device();
 
 	if (dev->state & NETDEV_STATE_OFF)
 		return -EBUSY;
 
-	struct sockaddr_ll addr_remote;
-	addr_remote.sll_protocol = ETH_P_ARP;
-	addr_remote.sll_pkttype = PACKET_BROADCAST;
-	memcpy(addr_remote.sll_addr, dest_mac, 6);
-	sock->ops->connect(sock, (struct sockaddr *)&addr_remote, sizeof(struct sockaddr_ll));
+	struct sk_buff *skb = skb_alloc(sizeof(struct ethernet_packet), sizeof(struct arp_packet));
+	skb->dev = dev;
 
-	struct arp_packet *sarp = arp_create_packet(source_mac, source_ip, dest_mac, dest_ip, type);
-	sock->ops->sendmsg(sock, sarp, sizeof(struct arp_packet));
-	sock->ops->shutdown(sock);
+	skb_put(skb, sizeof(struct arp_packet));
+	struct arp_packet *ap = arp_create_packet(source_mac, source_ip, dest_mac, dest_ip, type);
+	memcpy(skb->data, ap, sizeof(struct arp_packet));
+	kfree(ap);
+
+	// announcement has unknown target hardware address -> broadcast
+	uint8_t *eth_dest = memcmp(dest_mac, dev->zero_addr, 6) ? dest_mac : dev->broadcast_addr;
+	skb_push(skb, sizeof(struct ethernet_packet));
+	skb->mac.eh = (struct ethernet_packet *)skb->data;
+	ethernet_build_header(skb->mac.eh, ETH_P_ARP, dev->dev_addr, eth_dest);
+
+	ethernet_sendmsg(skb);
+	skb_free(skb);
 	return 0;
 }
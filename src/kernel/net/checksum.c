@@ -0,0 +1,219 @@
+#include "checksum.h"
+
+#include <cpu/hal.h>
+#include <include/if_ether.h>
+#include <net/ip.h>
+#include <net/sk_buff.h>
+#include <proc/task.h>
+
+#define CPUID_FEAT_EDX_SSE2 (1 << 26)
+
+// saving xmm registers costs more than summing short buffers
+#define CSUM_SSE2_THRESHOLD 256
+// each 32-bit lane gets two words per 16 bytes -> lanes cannot overflow within 512KB
+#define CSUM_SSE2_MAX_BLOCKS 32768
+
+static uint32_t csum_partial_generic(const void *buff, uint32_t len, uint32_t sum);
+static uint32_t (*csum_partial_impl)(const void *buff, uint32_t len, uint32_t sum) = csum_partial_generic;
+
+static uint32_t csum_fold64(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	return sum;
+}
+
+// 32-bit words are accumulated into 64 bits, carries are folded once at the end
+// (sum of 32-bit words is congruent to sum of 16-bit words modulo 0xffff)
+static uint32_t csum_partial_generic(const void *buff, uint32_t len, uint32_t sum)
+{
+	const uint32_t *p32 = buff;
+	uint64_t acc = sum;
+
+	while (len >= 32)
+	{
+		acc += p32[0];
+		acc += p32[1];
+		acc += p32[2];
+		acc += p32[3];
+		acc += p32[4];
+		acc += p32[5];
+		acc += p32[6];
+		acc += p32[7];
+		p32 += 8;
+		len -= 32;
+	}
+	while (len >= 4)
+	{
+		acc += *p32++;
+		len -= 4;
+	}
+
+	const uint16_t *p16 = (const uint16_t *)p32;
+	if (len >= 2)
+	{
+		acc += *p16++;
+		len -= 2;
+	}
+	if (len)
+		acc += *(const uint8_t *)p16;
+
+	return csum_fold64(acc);
+}
+
+// words are zero-extended into four 32-bit lanes, 16 bytes per iteration
+// xmm registers hold the state of interrupted task -> they are saved and restored with interrupts disabled
+static uint32_t csum_sse2_blocks(const uint8_t *buff, uint32_t blocks)
+{
+	uint8_t saved[64];
+	uint32_t lanes[4];
+
+	lock_scheduler();
+	__asm__ __volatile__(
+		"movdqu %%xmm0, 0(%[saved])		\n"
+		"movdqu %%xmm1, 16(%[saved])	\n"
+		"movdqu %%xmm2, 32(%[saved])	\n"
+		"movdqu %%xmm3, 48(%[saved])	\n"
+		"pxor %%xmm0, %%xmm0			\n"
+		"pxor %%xmm3, %%xmm3			\n"
+		"1:								\n"
+		"movdqu (%[buff]), %%xmm1		\n"
+		"movdqa %%xmm1, %%xmm2			\n"
+		"punpcklwd %%xmm3, %%xmm1		\n"
+		"punpckhwd %%xmm3, %%xmm2		\n"
+		"paddd %%xmm1, %%xmm0			\n"
+		"paddd %%xmm2, %%xmm0			\n"
+		"add $16, %[buff]				\n"
+		"dec %[blocks]					\n"
+		"jnz 1b							\n"
+		"movdqu %%xmm0, (%[lanes])		\n"
+		"movdqu 0(%[saved]), %%xmm0		\n"
+		"movdqu 16(%[saved]), %%xmm1	\n"
+		"movdqu 32(%[saved]), %%xmm2	\n"
+		"movdqu 48(%[saved]), %%xmm3	\n"
+		: [buff] "+r"(buff), [blocks] "+r"(blocks)
+		: [saved] "r"(saved), [lanes] "r"(lanes)
+		: "memory", "cc");
+	unlock_scheduler();
+
+	uint64_t acc = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	return csum_fold64(acc);
+}
+
+static uint32_t csum_partial_sse2(const void *buff, uint32_t len, uint32_t sum)
+{
+	if (len < CSUM_SSE2_THRESHOLD)
+		return csum_partial_generic(buff, len, sum);
+
+	const uint8_t *p = buff;
+	while (len >= 16)
+	{
+		uint32_t blocks = len / 16;
+		if (blocks > CSUM_SSE2_MAX_BLOCKS)
+			blocks = CSUM_SSE2_MAX_BLOCKS;
+
+		sum = csum_add(sum, csum_sse2_blocks(p, blocks));
+		p += blocks * 16;
+		len -= blocks * 16;
+	}
+	// remaining bytes start at even offset
+	return csum_partial_generic(p, len, sum);
+}
+
+// sse2 variant is picked once if cpu supports it, sse is enabled by fpu_init
+void csum_init()
+{
+	uint32_t eax, edx;
+	cpuid(1, &eax, &edx);
+	if (!(edx & CPUID_FEAT_EDX_SSE2))
+		return;
+
+	csum_partial_impl = csum_partial_sse2;
+}
+
+uint32_t csum_partial(const void *buff, uint32_t len, uint32_t sum)
+{
+	return csum_partial_impl(buff, len, sum);
+}
+
+// copy and sum in one pass, data is touched only once
+uint32_t csum_partial_copy(const void *src, void *dst, uint32_t len, uint32_t sum)
+{
+	const uint32_t *s32 = src;
+	uint32_t *d32 = dst;
+	uint64_t acc = sum;
+
+	while (len >= 16)
+	{
+		uint32_t w0 = s32[0], w1 = s32[1], w2 = s32[2], w3 = s32[3];
+		d32[0] = w0;
+		d32[1] = w1;
+		d32[2] = w2;
+		d32[3] = w3;
+		acc += w0;
+		acc += w1;
+		acc += w2;
+		acc += w3;
+		s32 += 4;
+		d32 += 4;
+		len -= 16;
+	}
+	while (len >= 4)
+	{
+		uint32_t w = *s32++;
+		*d32++ = w;
+		acc += w;
+		len -= 4;
+	}
+
+	const uint16_t *s16 = (const uint16_t *)s32;
+	uint16_t *d16 = (uint16_t *)d32;
+	if (len >= 2)
+	{
+		uint16_t w = *s16++;
+		*d16++ = w;
+		acc += w;
+		len -= 2;
+	}
+	if (len)
+	{
+		uint8_t b = *(const uint8_t *)s16;
+		*(uint8_t *)d16 = b;
+		acc += b;
+	}
+
+	return csum_fold64(acc);
+}
+
+uint32_t csum_tcpudp_nofold(uint32_t source_ip, uint32_t dest_ip, uint16_t len, uint8_t protocal, uint32_t sum)
+{
+	struct ip4_pseudo_header ph = {
+		.source_ip = htonl(source_ip),
+		.dest_ip = htonl(dest_ip),
+		.zeros = 0,
+		.protocal = protocal,
+		.transport_length = htons(len),
+	};
+	return csum_add(sum, csum_partial_generic(&ph, sizeof(ph), 0));
+}
+
+// sum of [start, start + len), the part which is summed while copying into skb is not read again
+static uint32_t skb_csum_range(struct sk_buff *skb, uint8_t *start, uint32_t len)
+{
+	uint8_t *covered = skb->head + skb->csum_start;
+	uint8_t *end = start + len;
+	if (skb->ip_summed != CHECKSUM_COMPLETE || covered < start || covered > end || end > skb->tail)
+		return csum_partial(start, len, 0);
+
+	// headers before the covered part + covered part - trailing bytes (ethernet padding, fcs)
+	uint32_t sum = csum_partial(start, covered - start, 0);
+	sum = csum_block_add(sum, skb->csum, covered - start);
+	return csum_block_sub(sum, csum_partial(end, skb->tail - end, 0), len);
+}
+
+// transport checksum (checksum field is zero) when sending, 0 for a valid segment when receiving
+uint16_t skb_transport_checksum(struct sk_buff *skb, void *transport, uint16_t len, uint8_t protocal, uint32_t source_ip, uint32_t dest_ip)
+{
+	uint32_t sum = skb_csum_range(skb, transport, len);
+	return csum_fold(csum_tcpudp_nofold(source_ip, dest_ip, len, protocal, sum));
+}
@@ -0,0 +1,54 @@
+#ifndef NET_CHECKSUM_H
+#define NET_CHECKSUM_H
+
+#include <stdint.h>
+
+struct sk_buff;
+
+// partial sums are 32-bit ones' complement sums, they are folded into 16 bits only at the end (rfc1071)
+static inline uint32_t csum_add(uint32_t sum, uint32_t addend)
+{
+	sum += addend;
+	return sum + (sum < addend);
+}
+
+static inline uint32_t csum_sub(uint32_t sum, uint32_t addend)
+{
+	return csum_add(sum, ~addend);
+}
+
+// bytes of a block which starts at odd offset are summed in swapped position
+static inline uint32_t csum_block_add(uint32_t sum, uint32_t sum2, uint32_t offset)
+{
+	if (offset & 1)
+		sum2 = (sum2 >> 8) | (sum2 << 24);
+	return csum_add(sum, sum2);
+}
+
+static inline uint32_t csum_block_sub(uint32_t sum, uint32_t sum2, uint32_t offset)
+{
+	if (offset & 1)
+		sum2 = (sum2 >> 8) | (sum2 << 24);
+	return csum_sub(sum, sum2);
+}
+
+static inline uint16_t csum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum & 0xffff;
+}
+
+void csum_init();
+uint32_t csum_partial(const void *buff, uint32_t len, uint32_t sum);
+uint32_t csum_partial_copy(const void *src, void *dst, uint32_t len, uint32_t sum);
+uint32_t csum_tcpudp_nofold(uint32_t source_ip, uint32_t dest_ip, uint16_t len, uint8_t protocal, uint32_t sum);
+uint16_t skb_transport_checksum(struct sk_buff *skb, void *transport, uint16_t len, uint8_t protocal, uint32_t source_ip, uint32_t dest_ip);
+
+// user memory is directly accessible in kernel -> copying from user is a plain copy
+static inline uint32_t csum_and_copy_from_user(const void *src, void *dst, uint32_t len, uint32_t sum)
+{
+	return csum_partial_copy(src, dst, len, sum);
+}
+
+#endif
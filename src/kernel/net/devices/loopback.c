@@ -0,0 +1,40 @@
+#include "loopback.h"
+
+#include <include/if_ether.h>
+#include <memory/vmm.h>
+#include <net/net.h>
+#include <net/sk_buff.h>
+#include <proc/task.h>
+#include <utils/string.h>
+
+static struct net_device *lo_netdev;
+
+// frame is handed back to receive queue as if it had arrived from a network card
+static int loopback_xmit(struct net_device *dev, struct sk_buff *skb)
+{
+	lock_scheduler();
+	push_rx_queue(dev, (uint8_t *)skb->mac.eh, skb->len);
+	net_wakeup();
+	unlock_scheduler();
+	return 0;
+}
+
+struct net_device *get_loopback_device()
+{
+	return lo_netdev;
+}
+
+void loopback_init()
+{
+	lo_netdev = kcalloc(1, sizeof(struct net_device));
+	memcpy(lo_netdev->name, "lo", 2);
+	// there is nothing to configure via dhcp
+	lo_netdev->state = NETDEV_STATE_CONNECTED;
+	lo_netdev->flags = IFF_LOOPBACK;
+	lo_netdev->mtu = ETH_DATA_LEN;
+	lo_netdev->local_ip = LOOPBACK_IP;
+	lo_netdev->subnet_mask = LOOPBACK_SUBNET_MASK;
+	lo_netdev->xmit = loopback_xmit;
+
+	register_net_device(lo_netdev);
+}
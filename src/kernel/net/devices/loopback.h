@@ -0,0 +1,12 @@
+#ifndef NET_LOOPBACK_H
+#define NET_LOOPBACK_H
+
+#define LOOPBACK_IP 0x7f000001
+#define LOOPBACK_SUBNET_MASK 0xff000000
+
+struct net_device;
+
+void loopback_init();
+struct net_device *get_loopback_device();
+
+#endif
@@ -6,6 +6,7 @@
 #include <include/if_ether.h>
 #include <memory/vmm.h>
 #include <net/net.h>
+#include <net/sk_buff.h>
 #include <proc/task.h>
 #include <utils/printf.h>
 #include <utils/string.h>
@@ -27,6 +28,12 @@ void rtl8139_send_packet(void *payload, uint32_t size)
 	tx_counter = tx_counter >= 3 ? 0 : tx_counter + 1;
 }
 
+static int rtl8139_xmit(struct net_device *dev, struct sk_buff *skb)
+{
+	rtl8139_send_packet(skb->mac.eh, skb->len);
+	return 0;
+}
+
 void rtl8139_receive_packet(struct interrupt_registers *regs)
 {
 	while ((inportb(rtl_netdev->base_addr + RTL8139_ChipCmd) & RTL8139_RxBufEmpty) == 0)
@@ -47,7 +54,7 @@ void rtl8139_receive_packet(struct interrupt_registers *regs)
 			uint8_t *payload = kcalloc(1, rx_header->size);
 
 			memcpy(payload, buf, rx_header->size);
-			push_rx_queue(payload, rx_header->size);
+			push_rx_queue(rtl_netdev, payload, rx_header->size);
 			kfree(payload);
 		}
 		outportw(rtl_netdev->base_addr + RTL8139_RxBufPtr, rx_buf_ptr - 0x10);
@@ -135,6 +142,7 @@ void rtl8139_init()
 	memcpy(rtl_netdev->dev_addr, mac_addr, 6);
 	memcpy(rtl_netdev->broadcast_addr, broadcast_mac_addr, 6);
 	memset(rtl_netdev->zero_addr, 0, 6);
+	rtl_netdev->xmit = rtl8139_xmit;
 
 	register_net_device(rtl_netdev);
 
@@ -280,7 +280,7 @@ int dhcp_setup()
 	{
 		attempt_discovery++;
 		memset(received_eh, 0, MAX_PACKET_LEN);
-		sock->ops->recvmsg(sock, received_eh, MAX_PACKET_LEN);
+		sock->ops->recvmsg(sock, received_eh, MAX_PACKET_LEN, 0);
 
 		ret = dhcp_parse_from_eh_packet(received_eh, &dhcp_offer);
 		if (ret >= 0)
@@ -319,7 +319,7 @@ int dhcp_setup()
 	while (true)
 	{
 		memset(received_eh, 0, MAX_PACKET_LEN);
-		sock->ops->recvmsg(sock, received_eh, MAX_PACKET_LEN);
+		sock->ops->recvmsg(sock, received_eh, MAX_PACKET_LEN, 0);
 
 		ret = dhcp_parse_from_eh_packet(received_eh, &dhcp_ack);
 		if (ret < 0)
@@ -346,9 +346,13 @@ int dhcp_setup()
 
 	// ARP Probe
 	DEBUG &&debug_println(DEBUG_INFO, "DHCP: ARP for router");
-	uint8_t *router_mac = lookup_mac_addr_from_ip(router_ip);
+	ret = neighbour_resolve(dev, router_ip, dev->router_addr);
+	if (ret < 0)
+	{
+		kfree(received_eh);
+		return ret;
+	}
 
-	memcpy(dev->router_addr, router_mac, 6);
 	dev->state = NETDEV_STATE_CONNECTED;
 
 	kfree(received_eh);
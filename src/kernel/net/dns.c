@@ -1,13 +1,32 @@
 #include "dns.h"
 
+#include <include/errno.h>
 #include <memory/vmm.h>
 #include <net/net.h>
+#include <proc/task.h>
 #include <system/sysapi.h>
+#include <system/time.h>
+#include <system/timer.h>
+#include <utils/hashmap.h>
 #include <utils/math.h>
 #include <utils/printf.h>
 #include <utils/string.h>
 
-#define MAX_DNS_LEN 512
+// name -> cache entry (case insensitive)
+static struct hashmap mcache;
+static struct list_head lcache;
+static uint32_t cache_size;
+
+// name -> in-flight query
+static struct hashmap mquery;
+static struct list_head lquery;
+
+static struct thread *dns_thread;
+static struct socket *dns_sock;
+static uint32_t dns_server_ip;
+// new query is submitted or retransmission timer fires
+static bool dns_pending;
+static struct timer_list dns_timer;
 
 void dns_build_header(struct dns_packet *dns, uint16_t identifier)
 {
@@ -28,106 +47,462 @@ void dns_build_header(struct dns_packet *dns, uint16_t identifier)
 
 void dns_build_questions(struct dns_packet *dns, const char *domain, int *dns_len)
 {
-	char *iter = strdup(domain);
-	char *domain_part;
 	char *question = (char *)dns + sizeof(struct dns_packet);
-	uint8_t domain_part_len;
 
-	while ((domain_part = strsep(&iter, ".")))
+	// each label is prefixed by its length
+	while (*domain)
 	{
-		domain_part_len = strlen(domain_part);
+		const char *dot = strchr(domain, '.');
+		uint8_t domain_part_len = dot ? dot - domain : strlen(domain);
 		*question++ = domain_part_len;
-		strcpy(question, domain_part);
+		memcpy(question, domain, domain_part_len);
 		question += domain_part_len;
 		*dns_len += domain_part_len + 1;
+		domain += domain_part_len + (dot ? 1 : 0);
 	}
 
 	*question++ = 0;
 	struct dns_question_spec *question_spec = (struct dns_question_spec *)question;
-	question_spec->qtype = htons(1);
-	question_spec->qclass = htons(1);
+	question_spec->qtype = htons(DNS_A_RECORD);
+	question_spec->qclass = htons(DNS_CLASS_IN);
 
 	*dns_len += 1 + sizeof(struct dns_question_spec);
 }
 
-void dns_traverse_name(uint8_t **name)
+// decode (compressed) name at *pos into name, *pos is moved behind the name
+static int dns_read_name(uint8_t *msg, uint32_t len, uint32_t *pos, char *name)
 {
+	uint32_t p = *pos;
+	uint32_t name_len = 0;
+	bool jumped = false;
+	// pointer loops in malicious messages
+	int hops = 0;
+
 	while (true)
 	{
-		if (**name >= 64)
+		if (p >= len)
+			return -EPROTO;
+
+		uint8_t label = msg[p];
+		if ((label & 0xc0) == 0xc0)
 		{
-			*name += 2;
-			break;
+			if (p + 1 >= len || ++hops > 16)
+				return -EPROTO;
+			if (!jumped)
+				*pos = p + 2;
+			jumped = true;
+			p = ((label & 0x3f) << 8) | msg[p + 1];
+			continue;
 		}
-		else
-			*name += 1 + **name;
+		if (label & 0xc0)
+			return -EPROTO;
 
-		if (**name == 0)
-		{
-			*name += 1;
+		p++;
+		if (!label)
+			break;
+		if (p + label > len || name_len + label + 1 > DNS_MAX_NAME_LEN)
+			return -EPROTO;
+
+		if (name_len)
+			name[name_len++] = '.';
+		memcpy(name + name_len, msg + p, label);
+		name_len += label;
+		p += label;
+	}
+
+	name[name_len] = 0;
+	if (!jumped)
+		*pos = p;
+	return 0;
+}
+
+static struct dns_answer_spec *dns_read_record(uint8_t *msg, uint32_t len, uint32_t *pos, char *name)
+{
+	if (dns_read_name(msg, len, pos, name) < 0 || *pos + sizeof(struct dns_answer_spec) > len)
+		return NULL;
+
+	struct dns_answer_spec *record = (struct dns_answer_spec *)(msg + *pos);
+	*pos += sizeof(struct dns_answer_spec) + ntohs(record->rd_length);
+	return *pos <= len ? record : NULL;
+}
+
+static void dns_cache_remove(struct dns_cache_entry *entry)
+{
+	hashmap_remove(&mcache, entry->name);
+	list_del(&entry->sibling);
+	cache_size--;
+	kfree(entry->name);
+	kfree(entry);
+}
+
+static struct dns_cache_entry *dns_cache_lookup(const char *name)
+{
+	struct dns_cache_entry *entry = hashmap_get(&mcache, name);
+	if (!entry)
+		return NULL;
+
+	if (entry->expires <= get_milliseconds(NULL))
+	{
+		dns_cache_remove(entry);
+		return NULL;
+	}
+
+	list_del(&entry->sibling);
+	list_add_tail(&entry->sibling, &lcache);
+	return entry;
+}
+
+static void dns_cache_insert(const char *name, uint32_t ip, bool negative, uint32_t ttl)
+{
+	struct dns_cache_entry *entry = hashmap_get(&mcache, name);
+	if (entry)
+		dns_cache_remove(entry);
+
+	if (!ttl)
+		return;
+
+	if (cache_size >= DNS_CACHE_SIZE)
+		dns_cache_remove(list_first_entry(&lcache, struct dns_cache_entry, sibling));
+
+	entry = kcalloc(1, sizeof(struct dns_cache_entry));
+	entry->name = strdup(name);
+	entry->ip = ip;
+	entry->negative = negative;
+	entry->expires = get_milliseconds(NULL) + (uint64_t)min_t(uint32_t, ttl, DNS_MAX_TTL) * 1000;
+
+	hashmap_put(&mcache, entry->name, entry);
+	list_add_tail(&entry->sibling, &lcache);
+	cache_size++;
+}
+
+static void dns_wakeup()
+{
+	dns_pending = true;
+	if (dns_thread->state == THREAD_WAITING)
+		update_thread(dns_thread, THREAD_READY);
+}
+
+static void dns_timer_callback(struct timer_list *timer)
+{
+	del_timer(timer);
+	dns_wakeup();
+}
+
+static struct dns_query *dns_query_by_id(uint16_t id)
+{
+	struct dns_query *iter;
+	list_for_each_entry(iter, &lquery, sibling)
+	{
+		if (iter->id == id)
+			return iter;
+	}
+	return NULL;
+}
+
+// waiters are notified under scheduler lock -> callbacks must not block
+static void dns_query_complete(struct dns_query *query, uint32_t ip, int err)
+{
+	hashmap_remove(&mquery, query->name);
+	list_del(&query->sibling);
+
+	DEBUG &&debug_println(DEBUG_INFO, "DNS: %s - %d.%d.%d.%d (%d)", query->name, ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, err);
+
+	struct dns_waiter *iter, *next;
+	list_for_each_entry_safe(iter, next, &query->waiters, sibling)
+	{
+		list_del(&iter->sibling);
+		iter->callback(query->name, ip, err, iter->arg);
+		kfree(iter);
+	}
+	kfree(query->name);
+	kfree(query);
+}
+
+// ttl of negative answer is the minimum of SOA's ttl and its minimum field (rfc2308 section 5)
+static uint32_t dns_negative_ttl(uint8_t *msg, uint32_t len, uint32_t pos, uint16_t ns_count)
+{
+	char name[DNS_MAX_NAME_LEN + 1];
+	for (int i = 0; i < ns_count; ++i)
+	{
+		struct dns_answer_spec *record = dns_read_record(msg, len, &pos, name);
+		if (!record)
 			break;
+
+		uint16_t rd_length = ntohs(record->rd_length);
+		if (ntohs(record->atype) == DNS_SOA_RECORD && rd_length >= 4)
+		{
+			uint32_t minimum = ntohl(*(uint32_t *)(record->rdata + rd_length - 4));
+			return min(ntohl(record->ttl), minimum);
 		}
 	}
+	return DNS_NEGATIVE_TTL;
 }
 
-void dns_parse_answers(struct dns_packet *dns, uint32_t *remote_ip)
+static void dns_handle_response(uint8_t *msg, uint32_t len)
 {
-	uint8_t *buf = dns->payload;
-	// skip questions
-	for (int qi = 0; qi < htons(dns->qd_count); ++qi)
+	struct dns_packet *dns = (struct dns_packet *)msg;
+	if (len < sizeof(struct dns_packet) || dns->qr != DNS_FLAG_RESPONSE || ntohs(dns->qd_count) != 1)
+		return;
+
+	// answer has to match both transaction id and question (rfc5452)
+	struct dns_query *query = dns_query_by_id(ntohs(dns->id));
+	char name[DNS_MAX_NAME_LEN + 1];
+	uint32_t pos = sizeof(struct dns_packet);
+	if (!query || dns_read_name(msg, len, &pos, name) < 0 || strcasecmp(name, query->name))
+		return;
+	pos += sizeof(struct dns_question_spec);
+
+	if (dns->rcode != DNS_RCODE_NOERROR && dns->rcode != DNS_RCODE_NXDOMAIN)
 	{
-		dns_traverse_name(&buf);
-		buf += sizeof(struct dns_question_spec);
+		dns_query_complete(query, 0, -EIO);
+		return;
 	}
-	// answers
-	for (int ai = 0; ai < htons(dns->an_count); ++ai)
+
+	// cname chain is followed by the server, the first address record is used
+	// and it is cached as long as the shortest ttl in the chain
+	uint32_t ip = 0;
+	uint32_t ttl = DNS_MAX_TTL;
+	bool found = false;
+	for (int i = 0; i < ntohs(dns->an_count) && dns->rcode == DNS_RCODE_NOERROR; ++i)
 	{
-		dns_traverse_name(&buf);
-		struct dns_answer_spec *answer_spec = (struct dns_answer_spec *)buf;
-		if (htons(answer_spec->atype) == DNS_A_RECORD && htons(answer_spec->aclass) == 1)
+		struct dns_answer_spec *record = dns_read_record(msg, len, &pos, name);
+		if (!record)
+			break;
+
+		uint16_t atype = ntohs(record->atype);
+		if (atype == DNS_CNAME || atype == DNS_A_RECORD)
+			ttl = min(ttl, ntohl(record->ttl));
+		if (!found && atype == DNS_A_RECORD && ntohs(record->aclass) == DNS_CLASS_IN && ntohs(record->rd_length) == 4)
 		{
-			memcpy(remote_ip, answer_spec->rdata, 4);
-			*remote_ip = htonl(*remote_ip);
+			ip = ntohl(*(uint32_t *)record->rdata);
+			found = true;
 		}
-		buf += sizeof(struct dns_answer_spec) + htons(answer_spec->rd_length);
+	}
+
+	if (found)
+	{
+		dns_cache_insert(query->name, ip, false, ttl);
+		dns_query_complete(query, ip, 0);
+	}
+	else
+	{
+		// authority section follows answers which are skipped above
+		dns_cache_insert(query->name, 0, true, dns_negative_ttl(msg, len, pos, ntohs(dns->ns_count)));
+		dns_query_complete(query, 0, -ENOENT);
 	}
 }
 
-// NOTE: MQ 2020-06-13
-// create a udp socket
-//  -> bind to local ip/address
-//  -> connect to dns server ip/address (from dhcp)
-// build dns header
-// convert domain into question name -> build dns question
-// link dns header and dns question -> send udp + dns
-// parse response -> dns header
-// skip dns question?
-// each answer -> check A record -> IP address
-void getaddrinfo(const char *domain, uint32_t *ip)
+static void dns_send_query(struct dns_query *query)
 {
-	int fd = sys_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	struct socket *sock = sockfd_lookup(fd);
-	struct net_device *dev = get_current_net_device();
+	uint8_t msg[DNS_MAX_LEN];
+	struct dns_packet *dns = (struct dns_packet *)msg;
+	int dns_len = sizeof(struct dns_packet);
+	dns_build_header(dns, query->id);
+	dns_build_questions(dns, query->name, &dns_len);
 
-	struct sockaddr_in local_in;
-	local_in.sin_addr = dev->local_ip;
-	local_in.sin_port = 53;
-	sock->ops->bind(sock, (struct sockaddr *)&local_in, sizeof(struct sockaddr_in));
+	dns_sock->ops->sendmsg(dns_sock, dns, dns_len);
+	query->sent = true;
+	query->expires = get_milliseconds(NULL) + DNS_TIMEOUT;
+}
+
+// server is assigned by dhcp of the default device and it can change
+static int dns_connect()
+{
+	struct net_device *dev = get_current_net_device();
+	if (!dev->dns_server_ip)
+		return -ENETUNREACH;
+	if (dev->dns_server_ip == dns_server_ip)
+		return 0;
 
 	struct sockaddr_in remote_in;
 	remote_in.sin_addr = dev->dns_server_ip;
-	remote_in.sin_port = 53;
-	sock->ops->connect(sock, (struct sockaddr *)&remote_in, sizeof(struct sockaddr_in));
+	remote_in.sin_port = DNS_PORT;
+	int ret = dns_sock->ops->connect(dns_sock, (struct sockaddr *)&remote_in, sizeof(struct sockaddr_in));
+	if (ret < 0)
+		return ret;
 
-	struct dns_packet *dns = kcalloc(1, MAX_DNS_LEN);
-	int dns_len = sizeof(struct dns_packet);
-	dns_build_header(dns, rand());
-	dns_build_questions(dns, domain, &dns_len);
+	dns_server_ip = dev->dns_server_ip;
+	return 0;
+}
+
+// send new queries, retransmit or fail expired ones and arm timer for the earliest deadline
+static void dns_process_queries()
+{
+	uint64_t now = get_milliseconds(NULL);
+	uint64_t earliest = UINT64_MAX;
+	int ret = list_empty(&lquery) ? 0 : dns_connect();
+
+	struct dns_query *iter, *next;
+	list_for_each_entry_safe(iter, next, &lquery, sibling)
+	{
+		if (ret < 0)
+		{
+			dns_query_complete(iter, 0, ret);
+			continue;
+		}
+
+		if (!iter->sent)
+			dns_send_query(iter);
+		else if (iter->expires <= now)
+		{
+			if (iter->retries >= DNS_RETRIES)
+			{
+				dns_query_complete(iter, 0, -ETIMEDOUT);
+				continue;
+			}
+			iter->retries++;
+			dns_send_query(iter);
+		}
+		earliest = min(earliest, iter->expires);
+	}
+
+	if (earliest != UINT64_MAX)
+		mod_timer(&dns_timer, earliest);
+	else
+		del_timer(&dns_timer);
+}
+
+static void dns_loop()
+{
+	// explain in kernel_init#unlock_scheduler
+	unlock_scheduler();
+
+	// socket belongs to this thread -> incoming answers wake it up
+	int fd = sys_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	dns_sock = sockfd_lookup(fd);
+	uint8_t *msg = kcalloc(1, DNS_MAX_LEN);
+
+	while (true)
+	{
+		lock_scheduler();
+		while (list_empty(&dns_sock->sk->rx_queue) && !dns_pending)
+		{
+			update_thread(current_thread, THREAD_WAITING);
+			unlock_scheduler();
+			schedule();
+			lock_scheduler();
+		}
+		dns_pending = false;
+
+		// answers for several in-flight queries are handled in one pass
+		int len;
+		while ((len = dns_sock->ops->recvmsg(dns_sock, msg, DNS_MAX_LEN, MSG_DONTWAIT)) > 0)
+			dns_handle_response(msg, len);
+
+		dns_process_queries();
+		unlock_scheduler();
+	}
+}
 
-	sock->ops->sendmsg(sock, dns, dns_len);
+// labels are 1..63 bytes, only the root label after the last dot can be empty (rfc1035 section 2.3.4)
+static bool dns_valid_name(const char *name)
+{
+	while (*name)
+	{
+		const char *dot = strchr(name, '.');
+		uint32_t label_len = dot ? (uint32_t)(dot - name) : strlen(name);
+		if (!label_len || label_len > DNS_MAX_LABEL_LEN)
+			return false;
+		name += label_len + (dot ? 1 : 0);
+	}
+	return true;
+}
+
+// cached answer is passed to callback right away, otherwise the name is queried (once for concurrent lookups)
+// and callback is called from dns thread when the answer arrives or the query times out
+int dns_lookup_async(const char *name, dns_callback callback, void *arg)
+{
+	if (!name || !*name || strlen(name) > DNS_MAX_NAME_LEN || !dns_valid_name(name))
+		return -EINVAL;
+
+	lock_scheduler();
+
+	struct dns_cache_entry *entry = dns_cache_lookup(name);
+	if (entry)
+	{
+		uint32_t ip = entry->ip;
+		int err = entry->negative ? -ENOENT : 0;
+		unlock_scheduler();
+
+		callback(name, ip, err, arg);
+		return 0;
+	}
+
+	struct dns_query *query = hashmap_get(&mquery, name);
+	if (!query)
+	{
+		query = kcalloc(1, sizeof(struct dns_query));
+		query->name = strdup(name);
+		// random and unique transaction id makes spoofed answers harder to match
+		do
+		{
+			query->id = rand();
+		} while (dns_query_by_id(query->id));
+		INIT_LIST_HEAD(&query->waiters);
+
+		hashmap_put(&mquery, query->name, query);
+		list_add_tail(&query->sibling, &lquery);
+		dns_wakeup();
+	}
+
+	struct dns_waiter *waiter = kcalloc(1, sizeof(struct dns_waiter));
+	waiter->callback = callback;
+	waiter->arg = arg;
+	list_add_tail(&waiter->sibling, &query->waiters);
+
+	unlock_scheduler();
+	return 0;
+}
+
+struct dns_lookup_result
+{
+	struct thread *thread;
+	uint32_t ip;
+	int err;
+	bool done;
+};
+
+static void dns_lookup_complete(const char *name, uint32_t ip, int err, void *arg)
+{
+	struct dns_lookup_result *result = arg;
+	result->ip = ip;
+	result->err = err;
+	result->done = true;
+	if (result->thread != current_thread && result->thread->state == THREAD_WAITING)
+		update_thread(result->thread, THREAD_READY);
+}
+
+// blocking lookup, ip is in host order
+int dns_lookup(const char *name, uint32_t *ip)
+{
+	struct dns_lookup_result result = {.thread = current_thread};
+	int ret = dns_lookup_async(name, dns_lookup_complete, &result);
+	if (ret < 0)
+		return ret;
+
+	lock_scheduler();
+	while (!result.done)
+	{
+		update_thread(current_thread, THREAD_WAITING);
+		unlock_scheduler();
+		schedule();
+		lock_scheduler();
+	}
+	unlock_scheduler();
+
+	if (!result.err)
+		*ip = result.ip;
+	return result.err;
+}
+
+void dns_init()
+{
+	INIT_LIST_HEAD(&lcache);
+	INIT_LIST_HEAD(&lquery);
+	hashmap_init(&mcache, hashmap_hash_string_i, hashmap_compare_string_i, 0);
+	hashmap_init(&mquery, hashmap_hash_string_i, hashmap_compare_string_i, 0);
+	dns_timer = (struct timer_list)TIMER_INITIALIZER(dns_timer_callback, UINT64_MAX);
 
-	memset(dns, 0, MAX_DNS_LEN);
-	sock->ops->recvmsg(sock, dns, MAX_DNS_LEN);
-	dns_parse_answers(dns, ip);
-	DEBUG &&debug_println(DEBUG_INFO, "DNS: %s - %d.%d.%d.%d", domain, *ip >> 24, (*ip >> 16) & 0xff, (*ip >> 8) & 0xff, *ip & 0xff);
+	struct process *dns_process = create_system_process("dns", dns_loop, 0);
+	dns_thread = dns_process->thread;
 }
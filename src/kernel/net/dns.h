@@ -1,13 +1,34 @@
 #ifndef NET_DNS_H
 #define NET_DNS_H
 
+#include <include/list.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#define DNS_PORT 53
 #define DNS_FLAG_QUERY 0
 #define DNS_FLAG_RESPONSE 1
 #define DNS_STANDARD_QUERY 0
 #define DNS_A_RECORD 1
+#define DNS_SOA_RECORD 6
 #define DNS_CNAME 5
+#define DNS_CLASS_IN 1
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_MAX_LEN 512
+#define DNS_MAX_NAME_LEN 255
+// the top two bits of label length mark a compression pointer (rfc1035 section 4.1.4)
+#define DNS_MAX_LABEL_LEN 63
+
+// resolved names, the least recently used one is dropped when cache is full
+#define DNS_CACHE_SIZE 128
+// ttls are in seconds, negative answer without SOA record is cached for DNS_NEGATIVE_TTL (rfc2308)
+#define DNS_NEGATIVE_TTL 60
+#define DNS_MAX_TTL 86400
+// each query is retransmitted after DNS_TIMEOUT milliseconds
+#define DNS_TIMEOUT 2000
+#define DNS_RETRIES 3
 
 struct dns_packet
 {
@@ -35,13 +56,13 @@ struct dns_name
 	char name[];
 };
 
-struct dns_question_spec
+struct __attribute__((packed)) dns_question_spec
 {
 	uint16_t qtype;
 	uint16_t qclass;
 };
 
-struct dns_answer_spec
+struct __attribute__((packed)) dns_answer_spec
 {
 	uint16_t atype;
 	uint16_t aclass;
@@ -50,6 +71,41 @@ struct dns_answer_spec
 	uint8_t rdata[];
 };
 
-void getaddrinfo(const char *domain, uint32_t *ip);
+// ip is valid when err is 0, -ENOENT for a name which doesn't exist
+// called from dns thread (or from caller if the name is cached)
+typedef void (*dns_callback)(const char *name, uint32_t ip, int err, void *arg);
+
+struct dns_cache_entry
+{
+	char *name;
+	uint32_t ip;
+	bool negative;
+	uint64_t expires;
+	// most recently used is the last one
+	struct list_head sibling;
+};
+
+struct dns_waiter
+{
+	dns_callback callback;
+	void *arg;
+	struct list_head sibling;
+};
+
+// lookups of the same name share one query
+struct dns_query
+{
+	char *name;
+	uint16_t id;
+	uint8_t retries;
+	bool sent;
+	uint64_t expires;
+	struct list_head waiters;
+	struct list_head sibling;
+};
+
+void dns_init();
+int dns_lookup_async(const char *name, dns_callback callback, void *arg);
+int dns_lookup(const char *name, uint32_t *ip);
 
 #endif
@@ -2,7 +2,6 @@
 
 #include <include/if_ether.h>
 #include <memory/vmm.h>
-#include <net/devices/rtl8139.h>
 #include <net/net.h>
 #include <net/sk_buff.h>
 #include <proc/task.h>
@@ -17,7 +16,7 @@ void ethernet_build_header(struct ethernet_packet *packet, uint16_t protocal, ui
 
 void ethernet_sendmsg(struct sk_buff *skb)
 {
-	rtl8139_send_packet(skb->mac.eh, skb->len);
+	skb->dev->xmit(skb->dev, skb);
 }
 
 int ethernet_rcv(struct sk_buff *skb)
@@ -34,8 +34,7 @@ struct ip4_packet *ip4_build_header(struct ip4_packet *packet, uint16_t packet_s
 	packet->type_of_service = 0;
 	packet->total_length = htons(packet_size);
 	packet->identification = htonl(identification);
-	packet->flags = 0;
-	packet->fragment_offset = 0;
+	packet->frag_off = 0;
 	packet->time_to_live = IP4_TTL;
 	packet->protocal = protocal;
 	packet->source_ip = htonl(source_ip);
@@ -45,17 +44,24 @@ struct ip4_packet *ip4_build_header(struct ip4_packet *packet, uint16_t packet_s
 	return packet;
 }
 
-void ip4_sendmsg(struct socket *sock, struct sk_buff *skb)
+// returns -EMSGSIZE when datagram is bigger than mtu and must not be fragmented
+int ip4_sendmsg(struct socket *sock, struct sk_buff *skb)
 {
 	struct inet_sock *isk = inet_sk(sock->sk);
-	// NOTE: MQ 2020-05-21 We don't need to perform routing, only support one router
+	// outgoing device is routed when socket is connected
 	skb->dev = isk->sk.dev;
 
+	// datagram which doesn't fit into mtu is sent in fragments
+	uint32_t mtu = skb->dev->mtu ? skb->dev->mtu : ETH_DATA_LEN;
+	if (skb->len > mtu)
+		return ip4_fragment(skb, mtu, isk->dsin.sin_addr);
+
+	// destination mac is filled by neighbour when the address is resolved
 	skb_push(skb, sizeof(struct ethernet_packet));
 	skb->mac.eh = (struct ethernet_packet *)skb->data;
-	uint8_t *dest_mac = lookup_mac_addr_for_ethernet(skb->dev, isk->dsin.sin_addr);
-	ethernet_build_header(skb->mac.eh, ETH_P_IP, skb->dev->dev_addr, dest_mac);
-	ethernet_sendmsg(skb);
+	ethernet_build_header(skb->mac.eh, ETH_P_IP, skb->dev->dev_addr, skb->dev->zero_addr);
+	neighbour_output(skb, isk->dsin.sin_addr);
+	return 0;
 }
 
 // Check ip header valid, adjust skb *data
@@ -70,8 +76,3 @@ int ip4_rcv(struct sk_buff *skb)
 
 	return 0;
 }
-
-// TODO: MQ 2020-06-18
-// IP Fragmentation
-// -> Send: split payload into fragments if it doesn't fit into single ip packet
-// -> Receive: reassembly multi ip payloads if they have the same id and Flags-MF bit is enabled (except the last part)
@@ -7,6 +7,10 @@
 #define IP4_PROTOCAL_TCP 6
 #define IP4_PROTOCAL_UDP 17
 
+#define IP4_FLAG_DF 0x4000
+#define IP4_FLAG_MF 0x2000
+#define IP4_OFFSET_MASK 0x1fff
+
 struct socket;
 struct sk_buff;
 
@@ -26,8 +30,8 @@ struct __attribute__((packed)) ip4_packet
 	uint8_t type_of_service;
 	uint16_t total_length;
 	uint16_t identification;
-	uint16_t fragment_offset : 13;
-	uint8_t flags : 3;
+	// flags (3 bits) and offset in 8-byte units (13 bits), network order
+	uint16_t frag_off;
 	uint8_t time_to_live;
 	uint8_t protocal;
 	uint16_t header_checksum;
@@ -37,8 +41,14 @@ struct __attribute__((packed)) ip4_packet
 };
 
 struct ip4_packet *ip4_build_header(struct ip4_packet *packet, uint16_t packet_size, uint8_t protocal, uint32_t source_ip, uint32_t dest_ip, uint32_t identification);
-void ip4_sendmsg(struct socket *sock, struct sk_buff *skb);
+int ip4_sendmsg(struct socket *sock, struct sk_buff *skb);
 int ip4_rcv(struct sk_buff *skb);
 int ip4_validate_header(struct ip4_packet *ip, uint8_t protocal);
 
+// ip_fragment.c
+void ip4_frag_init();
+struct sk_buff *ip4_defrag(struct sk_buff *skb);
+void ip4_frag_evict_expired();
+int ip4_fragment(struct sk_buff *skb, uint32_t mtu, uint32_t dest_ip);
+
 #endif
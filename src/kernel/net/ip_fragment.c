@@ -0,0 +1,309 @@
+#include <include/errno.h>
+#include <include/if_ether.h>
+#include <memory/vmm.h>
+#include <net/checksum.h>
+#include <net/ethernet.h>
+#include <net/neighbour.h>
+#include <net/net.h>
+#include <net/sk_buff.h>
+#include <system/time.h>
+#include <system/timer.h>
+#include <utils/hashmap.h>
+#include <utils/math.h>
+#include <utils/string.h>
+
+#include "ip.h"
+
+// incomplete datagram is dropped after this time (rfc1122 section 3.3.2)
+#define IP4_FRAG_TIME 30000
+// memory of all queued fragments, the oldest datagrams are dropped above it
+#define IP4_FRAG_HIGH_THRESH (256 * 1024)
+#define IP4_FRAG_HEADER_LEN (sizeof(struct ethernet_packet) + sizeof(struct ip4_packet))
+
+struct ip4_frag_key
+{
+	uint32_t source_ip;
+	uint32_t dest_ip;
+	uint16_t id;
+	uint8_t protocal;
+	uint8_t zero;
+};
+
+struct ip4_frag_queue
+{
+	struct ip4_frag_key key;
+	// fragments sorted by offset, skb->data points to ip payload
+	struct list_head fragments;
+	struct list_head sibling;
+	struct net_device *dev;
+	// ethernet and ip header of the first fragment, reused for the reassembled datagram
+	uint8_t header[IP4_FRAG_HEADER_LEN];
+	bool has_first;
+	// total payload length, known when the last fragment arrives
+	uint32_t len;
+	uint32_t meat;
+	uint32_t mem;
+	bool expired;
+	struct timer_list timer;
+};
+
+struct ip4_frag_cb
+{
+	uint32_t offset;
+};
+
+static struct hashmap mfrag;
+// oldest queue first
+static struct list_head lfrag;
+static uint32_t frag_mem;
+
+static size_t ip4_frag_hash(const void *key)
+{
+	const struct ip4_frag_key *k = key;
+	return k->source_ip ^ (k->dest_ip * 31) ^ ((uint32_t)k->id << 8) ^ k->protocal;
+}
+
+static int ip4_frag_compare(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct ip4_frag_key));
+}
+
+// runs in interrupt context -> queue is only marked, net thread drops it
+static void ip4_frag_timer(struct timer_list *timer)
+{
+	struct ip4_frag_queue *q = from_timer(q, timer, timer);
+	del_timer(timer);
+	q->expired = true;
+	net_wakeup();
+}
+
+static struct ip4_frag_queue *ip4_frag_create(struct ip4_frag_key *key, struct net_device *dev)
+{
+	struct ip4_frag_queue *q = kcalloc(1, sizeof(struct ip4_frag_queue));
+	q->key = *key;
+	q->dev = dev;
+	q->mem = sizeof(struct ip4_frag_queue);
+	INIT_LIST_HEAD(&q->fragments);
+	q->timer = (struct timer_list)TIMER_INITIALIZER(ip4_frag_timer, get_milliseconds(NULL) + IP4_FRAG_TIME);
+	add_timer(&q->timer);
+
+	hashmap_put(&mfrag, &q->key, q);
+	list_add_tail(&q->sibling, &lfrag);
+	frag_mem += q->mem;
+	return q;
+}
+
+static void ip4_frag_destroy(struct ip4_frag_queue *q)
+{
+	del_timer(&q->timer);
+	hashmap_remove(&mfrag, &q->key);
+	list_del(&q->sibling);
+	frag_mem -= q->mem;
+
+	struct sk_buff *iter, *next;
+	list_for_each_entry_safe(iter, next, &q->fragments, sibling)
+	{
+		list_del(&iter->sibling);
+		skb_free(iter);
+	}
+	kfree(q);
+}
+
+void ip4_frag_evict_expired()
+{
+	struct ip4_frag_queue *iter, *next;
+	list_for_each_entry_safe(iter, next, &lfrag, sibling)
+	{
+		if (iter->expired)
+			ip4_frag_destroy(iter);
+	}
+}
+
+static void ip4_frag_evict_oldest(struct ip4_frag_queue *keep)
+{
+	struct ip4_frag_queue *iter, *next;
+	list_for_each_entry_safe(iter, next, &lfrag, sibling)
+	{
+		if (frag_mem <= IP4_FRAG_HIGH_THRESH)
+			break;
+		if (iter != keep)
+			ip4_frag_destroy(iter);
+	}
+}
+
+// returns false if fragment overlaps queued ones (duplicate or malicious), it is dropped
+static bool ip4_frag_insert(struct ip4_frag_queue *q, struct sk_buff *frag, uint32_t offset, uint32_t len)
+{
+	struct sk_buff *iter;
+	struct list_head *pos = &q->fragments;
+	list_for_each_entry(iter, &q->fragments, sibling)
+	{
+		uint32_t iter_offset = ((struct ip4_frag_cb *)iter->cb)->offset;
+		if (offset < iter_offset + iter->len && iter_offset < offset + len)
+			return false;
+		if (iter_offset > offset)
+		{
+			pos = &iter->sibling;
+			break;
+		}
+	}
+
+	((struct ip4_frag_cb *)frag->cb)->offset = offset;
+	list_add_tail(&frag->sibling, pos);
+	q->meat += len;
+	q->mem += frag->true_size;
+	frag_mem += frag->true_size;
+	return true;
+}
+
+// payload is summed while fragments are copied -> transport checksum doesn't read it again
+static struct sk_buff *ip4_frag_reassemble(struct ip4_frag_queue *q)
+{
+	struct sk_buff *skb = skb_alloc(0, IP4_FRAG_HEADER_LEN + q->len);
+	skb->dev = q->dev;
+	skb_put(skb, IP4_FRAG_HEADER_LEN + q->len);
+	memcpy(skb->data, q->header, IP4_FRAG_HEADER_LEN);
+
+	uint8_t *payload = skb->data + IP4_FRAG_HEADER_LEN;
+	uint32_t sum = 0;
+	struct sk_buff *iter;
+	list_for_each_entry(iter, &q->fragments, sibling)
+	{
+		uint32_t offset = ((struct ip4_frag_cb *)iter->cb)->offset;
+		sum = csum_block_add(sum, csum_partial_copy(iter->data, payload + offset, iter->len, 0), offset);
+	}
+	skb->csum = sum;
+	skb->csum_start = payload - skb->head;
+	skb->ip_summed = CHECKSUM_COMPLETE;
+
+	struct ip4_packet *iph = (struct ip4_packet *)(skb->data + sizeof(struct ethernet_packet));
+	iph->total_length = htons(sizeof(struct ip4_packet) + q->len);
+	iph->frag_off = 0;
+	iph->header_checksum = 0;
+	iph->header_checksum = singular_checksum(iph, sizeof(struct ip4_packet));
+
+	return skb;
+}
+
+// skb is a received frame (data points to ethernet header)
+// returns skb itself if it is not a fragment, the reassembled datagram when the last missing fragment arrives
+// or NULL when fragment is queued or dropped (caller keeps the ownership of skb)
+struct sk_buff *ip4_defrag(struct sk_buff *skb)
+{
+	struct ethernet_packet *eh = (struct ethernet_packet *)skb->data;
+	if (skb->len < IP4_FRAG_HEADER_LEN || eh->type != htons(ETH_P_IP))
+		return skb;
+
+	struct ip4_packet *iph = (struct ip4_packet *)(skb->data + sizeof(struct ethernet_packet));
+	uint16_t frag_off = ntohs(iph->frag_off);
+	if (!(frag_off & (IP4_FLAG_MF | IP4_OFFSET_MASK)))
+		return skb;
+
+	uint16_t total_length = ntohs(iph->total_length);
+	if (iph->version != 4 || iph->ihl != 5 || singular_checksum(iph, sizeof(struct ip4_packet)) ||
+		total_length <= sizeof(struct ip4_packet) || total_length > skb->len - sizeof(struct ethernet_packet))
+		return NULL;
+
+	uint32_t offset = (frag_off & IP4_OFFSET_MASK) * 8;
+	uint32_t len = total_length - sizeof(struct ip4_packet);
+	bool more = frag_off & IP4_FLAG_MF;
+	// every fragment except the last one carries a multiple of 8 bytes
+	if ((more && len % 8) || offset + len > UINT16_MAX)
+		return NULL;
+
+	struct ip4_frag_key key = {
+		.source_ip = ntohl(iph->source_ip),
+		.dest_ip = ntohl(iph->dest_ip),
+		.id = iph->identification,
+		.protocal = iph->protocal,
+	};
+	struct ip4_frag_queue *q = hashmap_get(&mfrag, &key);
+	if (!q)
+		q = ip4_frag_create(&key, skb->dev);
+
+	if (!more)
+	{
+		// another last fragment with different length -> datagram is corrupted
+		if ((q->len && q->len != offset + len) || q->meat > offset + len)
+		{
+			ip4_frag_destroy(q);
+			return NULL;
+		}
+		q->len = offset + len;
+	}
+	else if (q->len && offset + len > q->len)
+	{
+		ip4_frag_destroy(q);
+		return NULL;
+	}
+
+	struct sk_buff *frag = skb_alloc(0, len);
+	skb_put(frag, len);
+	memcpy(frag->data, iph->payload, len);
+	if (!ip4_frag_insert(q, frag, offset, len))
+	{
+		skb_free(frag);
+		return NULL;
+	}
+
+	if (!offset)
+	{
+		memcpy(q->header, skb->data, IP4_FRAG_HEADER_LEN);
+		q->has_first = true;
+	}
+
+	if (q->has_first && q->len && q->meat == q->len)
+	{
+		struct sk_buff *datagram = ip4_frag_reassemble(q);
+		ip4_frag_destroy(q);
+		return datagram;
+	}
+
+	ip4_frag_evict_oldest(q);
+	return NULL;
+}
+
+// skb->data points to ip header, fragments keep its identification (rfc791 section 3.2)
+// caller keeps the ownership of skb
+int ip4_fragment(struct sk_buff *skb, uint32_t mtu, uint32_t dest_ip)
+{
+	struct ip4_packet *iph = (struct ip4_packet *)skb->data;
+	if (ntohs(iph->frag_off) & IP4_FLAG_DF)
+		return -EMSGSIZE;
+
+	uint32_t payload_len = skb->len - sizeof(struct ip4_packet);
+	uint32_t max_len = (mtu - sizeof(struct ip4_packet)) & ~7;
+
+	for (uint32_t offset = 0; offset < payload_len; offset += max_len)
+	{
+		uint32_t len = min(max_len, payload_len - offset);
+		bool last = offset + len == payload_len;
+
+		struct sk_buff *frag = skb_alloc(IP4_FRAG_HEADER_LEN, len);
+		frag->dev = skb->dev;
+		frag->sk = skb->sk;
+		skb_put(frag, len);
+		memcpy(frag->data, iph->payload + offset, len);
+
+		skb_push(frag, sizeof(struct ip4_packet));
+		frag->nh.iph = (struct ip4_packet *)frag->data;
+		memcpy(frag->nh.iph, iph, sizeof(struct ip4_packet));
+		frag->nh.iph->total_length = htons(sizeof(struct ip4_packet) + len);
+		frag->nh.iph->frag_off = htons((offset / 8) | (last ? 0 : IP4_FLAG_MF));
+		frag->nh.iph->header_checksum = 0;
+		frag->nh.iph->header_checksum = singular_checksum(frag->nh.iph, sizeof(struct ip4_packet));
+
+		skb_push(frag, sizeof(struct ethernet_packet));
+		frag->mac.eh = (struct ethernet_packet *)frag->data;
+		ethernet_build_header(frag->mac.eh, ETH_P_IP, frag->dev->dev_addr, frag->dev->zero_addr);
+		neighbour_output(frag, dest_ip);
+		skb_free(frag);
+	}
+	return 0;
+}
+
+void ip4_frag_init()
+{
+	INIT_LIST_HEAD(&lfrag);
+	hashmap_init(&mfrag, ip4_frag_hash, ip4_frag_compare, 0);
+}
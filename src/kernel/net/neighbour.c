@@ -1,104 +1,312 @@
 #include "neighbour.h"
 
+#include <fs/poll.h>
+#include <include/errno.h>
 #include <include/if_ether.h>
 #include <memory/vmm.h>
 #include <net/arp.h>
+#include <net/ethernet.h>
 #include <net/net.h>
-#include <system/sysapi.h>
+#include <net/sk_buff.h>
+#include <proc/task.h>
+#include <system/time.h>
+#include <utils/hashmap.h>
 #include <utils/string.h>
 
-struct list_head lneighbour;
+// ip (host order) -> neighbour
+static struct hashmap mneighbour;
 
-uint8_t *get_mac_addr_from_ip(uint32_t ip)
+struct neighbour *neighbour_lookup(uint32_t ip)
 {
-	struct neighbour *nb;
-	list_for_each_entry(nb, &lneighbour, sibling)
+	return hashmap_get(&mneighbour, &ip);
+}
+
+static struct neighbour *neighbour_create(struct net_device *dev, uint32_t ip)
+{
+	struct neighbour *nb = kcalloc(1, sizeof(struct neighbour));
+	nb->ip = ip;
+	nb->dev = dev;
+	nb->nud_state = NUD_NONE;
+	INIT_LIST_HEAD(&nb->arp_queue);
+	INIT_LIST_HEAD(&nb->wq.list);
+
+	hashmap_put(&mneighbour, &nb->ip, nb);
+	return nb;
+}
+
+static void neighbour_destroy(struct neighbour *nb)
+{
+	struct sk_buff *iter, *next;
+	list_for_each_entry_safe(iter, next, &nb->arp_queue, sibling)
 	{
-		if (nb->ip == ip && nb->nud_state & NUD_REACHABLE)
-			return nb->dev->dev_addr;
+		list_del(&iter->sibling);
+		skb_free(iter);
 	}
-	return NULL;
+	kfree(nb);
 }
 
-uint8_t *lookup_mac_addr_from_ip(uint32_t ip)
+// outside of local network -> router forwards the packet
+static uint32_t neighbour_next_hop(struct net_device *dev, uint32_t ip)
 {
-	uint8_t *maddr = get_mac_addr_from_ip(ip);
+	if ((ip & dev->subnet_mask) != (dev->local_ip & dev->subnet_mask))
+		return dev->router_ip;
+	return ip;
+}
 
-	if (maddr)
-		return maddr;
+// broadcast request when the address is unknown, unicast request to verify a stale one
+static void neighbour_solicit(struct neighbour *nb)
+{
+	struct net_device *dev = nb->dev;
+	uint8_t *dest_mac = nb->nud_state == NUD_PROBE ? nb->ha : dev->broadcast_addr;
 
-	uint32_t sockfd = sys_socket(PF_PACKET, SOCK_DGRAM, ETH_P_ARP);
-	struct socket *sock = sockfd_lookup(sockfd);
-	struct net_device *dev = sock->sk->dev;
+	nb->probes++;
+	nb->expires = get_milliseconds(NULL) + NEIGH_RETRANS_TIME;
+	arp_send(dev->dev_addr, dev->local_ip, dest_mac, nb->ip, ARP_REQUEST);
+}
 
-	if (dev->state & NETDEV_STATE_OFF)
-		return NULL;
+static void neighbour_start_resolution(struct neighbour *nb)
+{
+	nb->nud_state = NUD_INCOMPLETE;
+	nb->probes = 0;
+	neighbour_solicit(nb);
+}
 
-	struct sockaddr_ll addr_remote;
-	addr_remote.sll_protocol = ETH_P_ARP;
-	addr_remote.sll_pkttype = PACKET_BROADCAST;
-	memcpy(addr_remote.sll_addr, dev->broadcast_addr, 6);
-	sock->ops->connect(sock, (struct sockaddr *)&addr_remote, sizeof(struct sockaddr_ll));
+// packets which wait for the address are sent once it is resolved, or dropped if resolution fails
+static void neighbour_flush_queue(struct neighbour *nb)
+{
+	struct sk_buff *iter, *next;
+	list_for_each_entry_safe(iter, next, &nb->arp_queue, sibling)
+	{
+		list_del(&iter->sibling);
+		if (nb->nud_state & NUD_VALID)
+		{
+			memcpy(iter->mac.eh->dest_mac, nb->ha, 6);
+			ethernet_sendmsg(iter);
+		}
+		skb_free(iter);
+	}
+	nb->arp_queue_len = 0;
+}
 
-	struct arp_packet *sarp = arp_create_packet(dev->dev_addr, dev->local_ip, dev->broadcast_addr, ip, ARP_REQUEST);
-	sock->ops->sendmsg(sock, sarp, sizeof(struct arp_packet));
+// skb has ethernet header, only its destination mac is filled here
+// caller keeps the ownership of skb, a copy is queued if the address is not resolved yet
+int neighbour_output(struct sk_buff *skb, uint32_t dest_ip)
+{
+	struct net_device *dev = skb->dev;
+	// there is no link layer address to resolve on loopback
+	if (dev->flags & IFF_LOOPBACK)
+	{
+		ethernet_sendmsg(skb);
+		return 0;
+	}
 
-	struct arp_packet *rarp = kcalloc(1, sizeof(struct arp_packet));
-	while (true)
+	if (dest_ip == 0xffffffff)
 	{
-		sock->ops->recvmsg(sock, rarp, sizeof(struct arp_packet));
-		if (rarp->oper == htons(ARP_REPLY) && rarp->spa == htonl(ip))
-			break;
+		memcpy(skb->mac.eh->dest_mac, dev->broadcast_addr, 6);
+		ethernet_sendmsg(skb);
+		return 0;
 	}
-	sock->ops->shutdown(sock);
-	struct neighbour *nb = kcalloc(1, sizeof(struct neighbour));
-	nb->dev = dev;
-	nb->nud_state = NUD_REACHABLE;
-	nb->ip = rarp->spa;
-	memcpy(nb->ha, rarp->sha, 6);
-	list_add_tail(&nb->sibling, &lneighbour);
 
-	kfree(rarp);
-	return nb->ha;
+	lock_scheduler();
+
+	uint32_t ip = neighbour_next_hop(dev, dest_ip);
+	struct neighbour *nb = neighbour_lookup(ip);
+	if (!nb)
+		nb = neighbour_create(dev, ip);
+	nb->used = get_milliseconds(NULL);
+
+	if (nb->nud_state & NUD_VALID)
+	{
+		// reachability is verified after a while if it is not confirmed in the meantime
+		if (nb->nud_state == NUD_STALE)
+		{
+			nb->nud_state = NUD_DELAY;
+			nb->expires = nb->used + NEIGH_DELAY_FIRST_PROBE_TIME;
+		}
+
+		memcpy(skb->mac.eh->dest_mac, nb->ha, 6);
+		unlock_scheduler();
+
+		ethernet_sendmsg(skb);
+		return 0;
+	}
+
+	if (nb->nud_state == NUD_NONE || nb->nud_state == NUD_FAILED)
+		neighbour_start_resolution(nb);
+
+	if (nb->arp_queue_len >= NEIGH_QUEUE_LEN)
+	{
+		struct sk_buff *oldest = list_first_entry(&nb->arp_queue, struct sk_buff, sibling);
+		list_del(&oldest->sibling);
+		skb_free(oldest);
+		nb->arp_queue_len--;
+	}
+	list_add_tail(&skb_clone(skb)->sibling, &nb->arp_queue);
+	nb->arp_queue_len++;
+
+	unlock_scheduler();
+	return 0;
+}
+
+// wait until the address is resolved (for callers which fill the hardware address themselves)
+int neighbour_resolve(struct net_device *dev, uint32_t dest_ip, uint8_t *ha)
+{
+	lock_scheduler();
+
+	uint32_t ip = neighbour_next_hop(dev, dest_ip);
+	struct neighbour *nb = neighbour_lookup(ip);
+	if (!nb)
+		nb = neighbour_create(dev, ip);
+	nb->used = get_milliseconds(NULL);
+
+	if (nb->nud_state == NUD_NONE || nb->nud_state == NUD_FAILED)
+		neighbour_start_resolution(nb);
+
+	// neighbour is not garbage collected while there are waiters
+	DEFINE_WAIT(wait);
+	list_add_tail(&wait.sibling, &nb->wq.list);
+	while (nb->nud_state & NUD_INCOMPLETE)
+	{
+		update_thread(current_thread, THREAD_WAITING);
+		unlock_scheduler();
+		schedule();
+		lock_scheduler();
+	}
+	list_del(&wait.sibling);
+
+	int ret = -EHOSTUNREACH;
+	if (nb->nud_state & NUD_VALID)
+	{
+		memcpy(ha, nb->ha, 6);
+		ret = 0;
+	}
+
+	unlock_scheduler();
+	return ret;
 }
 
-uint8_t *lookup_mac_addr_for_ethernet(struct net_device *dev, uint32_t ip)
+// state is NUD_REACHABLE for arp reply (confirmation), NUD_STALE for arp request or announcement
+void neighbour_update(struct net_device *dev, uint32_t ip, uint8_t *ha, uint8_t state, bool create)
 {
-	if ((dev->subnet_mask & ip) == (dev->local_ip && dev->subnet_mask))
-		return lookup_mac_addr_from_ip(ip);
+	lock_scheduler();
+
+	struct neighbour *nb = neighbour_lookup(ip);
+	if (!nb && !create)
+	{
+		unlock_scheduler();
+		return;
+	}
+	if (!nb)
+		nb = neighbour_create(dev, ip);
+
+	uint64_t now = get_milliseconds(NULL);
+	bool changed = !(nb->nud_state & NUD_VALID) || memcmp(nb->ha, ha, 6);
+	if (state == NUD_REACHABLE)
+	{
+		nb->nud_state = NUD_REACHABLE;
+		nb->confirmed = now;
+		nb->expires = now + NEIGH_REACHABLE_TIME;
+	}
+	// unsolicited information doesn't confirm reachability, only a changed address makes the entry stale
+	else if (changed)
+		nb->nud_state = NUD_STALE;
 	else
-		return dev->router_addr;
+	{
+		unlock_scheduler();
+		return;
+	}
+
+	memcpy(nb->ha, ha, 6);
+	nb->probes = 0;
+	neighbour_flush_queue(nb);
+	wake_up(&nb->wq);
+
+	unlock_scheduler();
 }
 
-void neighbour_update_mapping(uint8_t *mac_address, uint32_t ip)
+// returns true if the neighbour is garbage and can be removed
+static bool neighbour_age(struct neighbour *nb, uint64_t now)
 {
-	struct neighbour *nb_iter, *prev_nb;
-	list_for_each_entry(nb_iter, &lneighbour, sibling)
+	switch (nb->nud_state)
 	{
-		if (prev_nb)
+	case NUD_REACHABLE:
+		if (now >= nb->expires)
+			nb->nud_state = NUD_STALE;
+		break;
+
+	case NUD_STALE:
+		return now - nb->used >= NEIGH_GC_STALE_TIME && list_empty(&nb->wq.list);
+
+	case NUD_DELAY:
+		if (now >= nb->expires)
 		{
-			list_del(&prev_nb->sibling);
-			kfree(prev_nb);
-			prev_nb = NULL;
+			nb->nud_state = NUD_PROBE;
+			nb->probes = 0;
+			neighbour_solicit(nb);
 		}
-		if ((nb_iter->ip == ip || memcmp(nb_iter->ha, mac_address, 6) == 0) && nb_iter->nud_state & NUD_REACHABLE)
-			prev_nb = nb_iter;
+		break;
+
+	case NUD_INCOMPLETE:
+	case NUD_PROBE:
+		if (now < nb->expires)
+			break;
+
+		if (nb->probes < NEIGH_MAX_PROBES)
+			neighbour_solicit(nb);
+		else
+		{
+			nb->nud_state = NUD_FAILED;
+			nb->expires = now + NEIGH_GC_STALE_TIME;
+			neighbour_flush_queue(nb);
+			wake_up(&nb->wq);
+		}
+		break;
+
+	case NUD_FAILED:
+	case NUD_NONE:
+		return now >= nb->expires && list_empty(&nb->wq.list);
 	}
-	if (prev_nb)
+	return false;
+}
+
+static void neighbour_periodic_work()
+{
+	uint64_t now = get_milliseconds(NULL);
+
+	struct hashmap_iter *iter = hashmap_iter(&mneighbour);
+	while (iter)
 	{
-		list_del(&prev_nb->sibling);
-		kfree(prev_nb);
+		struct neighbour *nb = hashmap_iter_get_data(iter);
+		if (neighbour_age(nb, now))
+		{
+			iter = hashmap_iter_remove(&mneighbour, iter);
+			neighbour_destroy(nb);
+		}
+		else
+			iter = hashmap_iter_next(&mneighbour, iter);
 	}
+}
 
-	struct neighbour *nb = kcalloc(1, sizeof(struct neighbour));
-	nb->ip = ip;
-	memcpy(nb->ha, mac_address, 6);
-	nb->dev = get_current_net_device();
-	nb->nud_state = NUD_REACHABLE;
-	list_add_tail(&nb->sibling, &lneighbour);
+// timer callbacks run in interrupt context where arp requests cannot be allocated
+// -> expiry of each neighbour is checked by a system thread instead
+static void neighbour_loop()
+{
+	// explain in kernel_init#unlock_scheduler
+	unlock_scheduler();
+
+	while (true)
+	{
+		thread_sleep(NEIGH_TIMER_INTERVAL);
+
+		lock_scheduler();
+		neighbour_periodic_work();
+		unlock_scheduler();
+	}
 }
 
 void neighbour_init()
 {
-	INIT_LIST_HEAD(&lneighbour);
+	hashmap_init(&mneighbour, hashmap_hash_uint32, hashmap_compare_uint32, 0);
+	struct process *neighbour_process = create_system_process("neighbour", neighbour_loop, 0);
+	update_thread(neighbour_process->thread, THREAD_READY);
 }
@@ -2,27 +2,56 @@
 #define NET_NEIGHBOUR_H
 
 #include <include/list.h>
+#include <proc/wait.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#define NUD_NONE 0x00
 #define NUD_INCOMPLETE 0x01
 #define NUD_REACHABLE 0x02
 #define NUD_STALE 0x04
 #define NUD_DELAY 0x08
 #define NUD_PROBE 0x10
 #define NUD_FAILED 0x20
+// hardware address is known and can be used for sending
+#define NUD_VALID (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE)
+
+// timeouts are in milliseconds (rfc4861 section 10)
+#define NEIGH_RETRANS_TIME 1000
+#define NEIGH_REACHABLE_TIME 30000
+#define NEIGH_DELAY_FIRST_PROBE_TIME 5000
+#define NEIGH_GC_STALE_TIME 60000
+#define NEIGH_MAX_PROBES 3
+// packets which wait for address resolution, the oldest one is dropped
+#define NEIGH_QUEUE_LEN 3
+#define NEIGH_TIMER_INTERVAL 100
+
+struct net_device;
+struct sk_buff;
 
 struct neighbour
 {
 	uint8_t ha[6];
 	uint32_t ip;
 	uint8_t nud_state;
+	uint8_t probes;
 	struct net_device *dev;
-	struct list_head sibling;
+
+	// deadline of the current state, checked by neighbour thread
+	uint64_t expires;
+	uint64_t confirmed;
+	uint64_t used;
+
+	struct list_head arp_queue;
+	uint32_t arp_queue_len;
+	// threads which are blocked in neighbour_resolve
+	struct wait_queue_head wq;
 };
 
 void neighbour_init();
-uint8_t *lookup_mac_addr_from_ip(uint32_t ip);
-uint8_t *lookup_mac_addr_for_ethernet(struct net_device *dev, uint32_t ip);
-void neighbour_update_mapping(uint8_t *mac_address, uint32_t ip);
+struct neighbour *neighbour_lookup(uint32_t ip);
+int neighbour_output(struct sk_buff *skb, uint32_t dest_ip);
+int neighbour_resolve(struct net_device *dev, uint32_t dest_ip, uint8_t *ha);
+void neighbour_update(struct net_device *dev, uint32_t ip, uint8_t *ha, uint8_t state, bool create);
 
 #endif
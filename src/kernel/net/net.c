@@ -7,12 +7,17 @@
 #include <include/sockios.h>
 #include <memory/vmm.h>
 #include <net/arp.h>
+#include <net/checksum.h>
+#include <net/devices/loopback.h>
+#include <net/dns.h>
 #include <net/ethernet.h>
 #include <net/icmp.h>
 #include <net/ip.h>
 #include <net/neighbour.h>
 #include <net/sk_buff.h>
+#include <net/tcp.h>
 #include <proc/task.h>
+#include <utils/math.h>
 #include <utils/printf.h>
 #include <utils/string.h>
 
@@ -24,16 +29,25 @@ struct thread *net_thread;
 struct list_head lrx_skb;
 struct list_head lsocket;
 struct net_device *current_netdev;
+static LIST_HEAD(lnetdev);
+// dynamic port range (rfc6335 section 6)
+static uint16_t next_ephemeral_port = 49152;
 
 // NOTE: MQ 2020-06-04
 // network card DMA might add padding at the each packet to make it word align
 // -> size might be bigger than its actual size
-void push_rx_queue(uint8_t *data, uint32_t size)
+void push_rx_queue(struct net_device *dev, uint8_t *data, uint32_t size)
 {
 	struct sk_buff *skb = skb_alloc(0, size);
+	skb->dev = dev;
 
+	// data after ip header (without options) is summed while copying -> transport checksum doesn't read it again
+	uint32_t header_len = min_t(uint32_t, size, sizeof(struct ethernet_packet) + sizeof(struct ip4_packet));
 	skb_put(skb, size);
-	memcpy(skb->data, data, size);
+	memcpy(skb->data, data, header_len);
+	skb->csum = csum_partial_copy(data + header_len, skb->data + header_len, size - header_len, 0);
+	skb->csum_start = skb->data + header_len - skb->head;
+	skb->ip_summed = CHECKSUM_COMPLETE;
 	list_add_tail(&skb->sibling, &lrx_skb);
 }
 
@@ -46,6 +60,7 @@ void sock_setup(struct socket *sock, int32_t family)
 	sk->sock = sock;
 	INIT_LIST_HEAD(&sk->rx_queue);
 	INIT_LIST_HEAD(&sk->tx_queue);
+	INIT_LIST_HEAD(&sk->wq.list);
 
 	sock->sk = sk;
 }
@@ -74,6 +89,33 @@ void socket_setup(int32_t family, enum socket_type type, int32_t protocal, struc
 	sock_setup(sock, family);
 }
 
+// create socket file for the connection which is established by a listening socket (accept)
+// sock is moved from the temporary socket which is used during handshake
+int32_t socket_graft(struct socket *parent, struct sock *sk)
+{
+	char *path = get_next_socket_path();
+	int32_t fd = vfs_open(path, O_RDWR | O_CREAT);
+	if (fd < 0)
+		return fd;
+
+	struct vfs_file *file = current_process->files->fd[fd];
+	struct socket *sock = SOCKET_I(file->f_dentry->d_inode);
+	sock->protocol = parent->protocol;
+	sock->file = file;
+	sock->type = parent->type;
+	sock->state = SS_CONNECTED;
+	sock->ops = parent->ops;
+	sock->sk = sk;
+
+	// sk might be used by net thread and its timers -> it is moved to the new socket atomically
+	lock_scheduler();
+	sk->sock = sock;
+	sk->owner_thread = current_thread;
+	list_add_tail(&sock->sibling, &lsocket);
+	unlock_scheduler();
+	return fd;
+}
+
 int socket_shutdown(struct socket *sock)
 {
 	sock->state = SS_DISCONNECTED;
@@ -81,73 +123,178 @@ int socket_shutdown(struct socket *sock)
 	return 0;
 }
 
+// the last file which refers to socket is closed -> connection is shut down and socket doesn't receive anymore
+void socket_release(struct socket *sock)
+{
+	if (sock->state != SS_DISCONNECTED && sock->ops && sock->ops->shutdown)
+		sock->ops->shutdown(sock);
+
+	lock_scheduler();
+	socket_shutdown(sock);
+	unlock_scheduler();
+}
+
 struct socket *sockfd_lookup(uint32_t sockfd)
 {
 	struct vfs_file *file = current_process->files->fd[sockfd];
 	return SOCKET_I(file->f_dentry->d_inode);
 }
 
-uint32_t packet_checksum_start(void *packet, uint16_t size)
+static size_t iov_length(struct msghdr *msg)
+{
+	size_t len = 0;
+	for (size_t i = 0; i < msg->msg_iovlen; ++i)
+		len += msg->msg_iov[i].iov_len;
+	return len;
+}
+
+// protocols take a contiguous buffer -> scattered message goes through a bounce buffer
+static int socket_sendmsg_iov(struct socket *sock, struct msghdr *msg)
 {
-	uint32_t checksum = 0;
+	if (msg->msg_iovlen == 1)
+		return sock->ops->sendmsg(sock, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
 
-	uint16_t ibytes = size;
-	uint16_t *chunk = (uint16_t *)packet;
-	while (ibytes > 1)
+	size_t len = iov_length(msg);
+	uint8_t *buf = kcalloc(1, len);
+	uint8_t *iter = buf;
+	for (size_t i = 0; i < msg->msg_iovlen; ++i)
 	{
-		checksum += *chunk;
+		memcpy(iter, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+		iter += msg->msg_iov[i].iov_len;
+	}
 
-		ibytes -= 2;
-		chunk += 1;
+	int ret = sock->ops->sendmsg(sock, buf, len);
+	kfree(buf);
+	return ret;
+}
+
+static int socket_recvmsg_iov(struct socket *sock, struct msghdr *msg, int flags)
+{
+	int ret;
+	if (msg->msg_iovlen == 1)
+		ret = sock->ops->recvmsg(sock, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len, flags);
+	else
+	{
+		uint8_t *buf = kcalloc(1, iov_length(msg));
+		ret = sock->ops->recvmsg(sock, buf, iov_length(msg), flags);
+
+		uint8_t *iter = buf;
+		for (size_t i = 0, remain = max(ret, 0); i < msg->msg_iovlen && remain; ++i)
+		{
+			size_t len = min(remain, msg->msg_iov[i].iov_len);
+			memcpy(msg->msg_iov[i].iov_base, iter, len);
+			iter += len;
+			remain -= len;
+		}
+		kfree(buf);
 	}
-	if (ibytes == 1)
-		checksum += *(uint8_t *)chunk;
+	if (ret < 0)
+		return ret;
 
-	while (checksum > CHECKSUM_MASK)
-		checksum = (checksum & CHECKSUM_MASK) + (checksum >> 16);
+	// datagram socket only receives from its connected peer
+	if (msg->msg_name && msg->msg_namelen >= sizeof(struct sockaddr_in) && sock->ops->family == PF_INET && sock->type == SOCK_DGRAM)
+	{
+		memcpy(msg->msg_name, &inet_sk(sock->sk)->dsin, sizeof(struct sockaddr_in));
+		msg->msg_namelen = sizeof(struct sockaddr_in);
+	}
+	else
+		msg->msg_namelen = 0;
+	msg->msg_flags = 0;
+	return ret;
+}
 
-	return checksum;
+// returns number of sent messages, error only if the first one fails
+int socket_sendmmsg(struct socket *sock, struct mmsghdr *msgvec, uint32_t vlen, int flags)
+{
+	vlen = min_t(uint32_t, vlen, UIO_MAXIOV);
+
+	uint32_t i;
+	for (i = 0; i < vlen; ++i)
+	{
+		int ret = socket_sendmsg_iov(sock, &msgvec[i].msg_hdr);
+		if (ret < 0)
+			return i ? (int)i : ret;
+		msgvec[i].msg_len = ret;
+	}
+	return i;
+}
+
+// waits for all messages unless MSG_DONTWAIT or MSG_WAITFORONE (only the first message is waited for)
+int socket_recvmmsg(struct socket *sock, struct mmsghdr *msgvec, uint32_t vlen, int flags)
+{
+	vlen = min_t(uint32_t, vlen, UIO_MAXIOV);
+
+	uint32_t i;
+	for (i = 0; i < vlen; ++i)
+	{
+		int ret = socket_recvmsg_iov(sock, &msgvec[i].msg_hdr, flags & ~MSG_WAITFORONE);
+		if (ret < 0)
+			return i ? (int)i : ret;
+		msgvec[i].msg_len = ret;
+
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+	}
+	return i;
 }
 
 uint16_t singular_checksum(void *packet, uint16_t size)
 {
-	uint32_t checksum = packet_checksum_start(packet, size);
-	return ~checksum & CHECKSUM_MASK;
+	return csum_fold(csum_partial(packet, size, 0));
 }
 
 uint16_t transport_calculate_checksum(void *segment, uint16_t segment_len, uint8_t protocal, uint32_t source_ip, uint32_t dest_ip)
 {
-	struct ip4_pseudo_header *ip4_pseudo_header = kcalloc(1, sizeof(struct ip4_pseudo_header));
-	ip4_pseudo_header->source_ip = htonl(source_ip);
-	ip4_pseudo_header->dest_ip = htonl(dest_ip);
-	ip4_pseudo_header->zeros = 0;
-	ip4_pseudo_header->protocal = protocal;
-	ip4_pseudo_header->transport_length = htons(segment_len);
-
-	uint32_t ip4_checksum_start = packet_checksum_start(ip4_pseudo_header, sizeof(struct ip4_pseudo_header));
-	uint32_t udp_checksum_start = packet_checksum_start(segment, segment_len);
-	uint32_t checksum = ip4_checksum_start + udp_checksum_start;
-
-	while (checksum > CHECKSUM_MASK)
-		checksum = (checksum & CHECKSUM_MASK) + (checksum >> 16);
-
-	kfree(ip4_pseudo_header);
-	return ~checksum & CHECKSUM_MASK;
+	uint32_t sum = csum_partial(segment, segment_len, 0);
+	return csum_fold(csum_tcpudp_nofold(source_ip, dest_ip, segment_len, protocal, sum));
 }
 
+// the first hardware device is used for dhcp, dns and as default route
 void register_net_device(struct net_device *ndev)
 {
-	current_netdev = ndev;
+	list_add_tail(&ndev->sibling, &lnetdev);
+	if (!current_netdev && !(ndev->flags & IFF_LOOPBACK))
+		current_netdev = ndev;
 }
 
 struct net_device *get_current_net_device()
 {
-	return current_netdev;
+	return current_netdev ? current_netdev : get_loopback_device();
+}
+
+// 1. 127.0.0.0/8 or one of our addresses -> loopback
+// 2. destination is in subnet of a configured device -> that device
+// 3. otherwise -> default device (via its router)
+struct net_device *route_lookup(uint32_t dest_ip)
+{
+	struct net_device *dev;
+	struct net_device *lo = get_loopback_device();
+
+	if ((dest_ip & lo->subnet_mask) == (lo->local_ip & lo->subnet_mask))
+		return lo;
+
+	list_for_each_entry(dev, &lnetdev, sibling)
+	{
+		if (dev->local_ip && dev->local_ip == dest_ip)
+			return lo;
+	}
+
+	list_for_each_entry(dev, &lnetdev, sibling)
+	{
+		if (dev->flags & IFF_LOOPBACK || !(dev->state & NETDEV_STATE_CONNECTED))
+			continue;
+
+		if ((dest_ip & dev->subnet_mask) == (dev->local_ip & dev->subnet_mask))
+			return dev;
+	}
+
+	return get_current_net_device();
 }
 
 bool is_broadcast_mac_address(uint8_t *maddr)
 {
-	if (memcmp(current_netdev->broadcast_addr, maddr, 6) == 0 || memcmp(current_netdev->zero_addr, maddr, 6) == 0)
+	struct net_device *dev = get_current_net_device();
+	if (memcmp(dev->broadcast_addr, maddr, 6) == 0 || memcmp(dev->zero_addr, maddr, 6) == 0)
 		return true;
 	else
 		return false;
@@ -164,6 +311,45 @@ char *inet_ntop(uint32_t src, char *dst, uint16_t len)
 	return strcpy(dst, tmp);
 }
 
+static bool inet_port_in_use(uint16_t port)
+{
+	struct socket *sock;
+	list_for_each_entry(sock, &lsocket, sibling)
+	{
+		if (sock->ops && sock->ops->family == PF_INET && inet_sk(sock->sk)->ssin.sin_port == port)
+			return true;
+	}
+	return false;
+}
+
+// unbound socket gets source address of the outgoing device and a free ephemeral port
+int inet_autobind(struct sock *sk, uint32_t dest_ip)
+{
+	struct inet_sock *isk = inet_sk(sk);
+
+	sk->dev = route_lookup(dest_ip);
+	if (!isk->ssin.sin_addr)
+		isk->ssin.sin_addr = sk->dev->local_ip;
+	if (isk->ssin.sin_port)
+		return 0;
+
+	lock_scheduler();
+	for (uint32_t i = 0; i <= UINT16_MAX - 49152; ++i)
+	{
+		uint16_t port = next_ephemeral_port;
+		next_ephemeral_port = port == UINT16_MAX ? 49152 : port + 1;
+
+		if (!inet_port_in_use(port))
+		{
+			isk->ssin.sin_port = port;
+			unlock_scheduler();
+			return 0;
+		}
+	}
+	unlock_scheduler();
+	return -EADDRINUSE;
+}
+
 int inet_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg)
 {
 	struct ifreq *ifr = (struct ifreq *)arg;
@@ -192,6 +378,7 @@ int inet_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg)
 // 3. Check arp annoucement -> update neighbour arp
 int net_default_rx_handler(struct sk_buff *skb)
 {
+	struct net_device *dev = skb->dev;
 	int ret = ethernet_rcv(skb);
 	if (ret < 0)
 		return ret;
@@ -209,7 +396,7 @@ int net_default_rx_handler(struct sk_buff *skb)
 				return ret;
 
 			if (skb->h.icmph->code == ICMP_ECHO && skb->h.icmph->type == ICMP_REQUEST &&
-				skb->nh.iph->dest_ip == htonl(current_netdev->local_ip))
+				skb->nh.iph->dest_ip == htonl(dev->local_ip))
 			{
 				if (DEBUG)
 				{
@@ -222,7 +409,7 @@ int net_default_rx_handler(struct sk_buff *skb)
 
 				uint32_t payload_len = ntohs(skb->nh.iph->total_length) - sizeof(struct ip4_packet) - sizeof(struct icmp_packet);
 				icmp_reply(
-					current_netdev->local_ip,
+					dev->local_ip,
 					skb->mac.eh->source_mac, ntohl(skb->nh.iph->source_ip),
 					ntohl(skb->nh.iph->identification),
 					ntohl(skb->h.icmph->un.rest_of_header),
@@ -236,7 +423,7 @@ int net_default_rx_handler(struct sk_buff *skb)
 		if (ret < 0)
 			return ret;
 
-		if (skb->nh.arph->tpa == htonl(current_netdev->local_ip))
+		if (skb->nh.arph->tpa == htonl(dev->local_ip))
 		{
 			if (DEBUG)
 			{
@@ -247,11 +434,18 @@ int net_default_rx_handler(struct sk_buff *skb)
 				debug_println(DEBUG_INFO,
 							  "ARP: %s at %x:%x:%x:%x:%x:%x, tell %s",
 							  dest_ip_text,
-							  current_netdev->dev_addr[0], current_netdev->dev_addr[1], current_netdev->dev_addr[2], current_netdev->dev_addr[3], current_netdev->dev_addr[4], current_netdev->dev_addr[5],
+							  dev->dev_addr[0], dev->dev_addr[1], dev->dev_addr[2], dev->dev_addr[3], dev->dev_addr[4], dev->dev_addr[5],
 							  source_ip_text);
 			}
 
-			arp_send(current_netdev->dev_addr, current_netdev->local_ip, skb->nh.arph->sha, ntohl(skb->nh.arph->spa), ARP_REPLY);
+			// reply confirms our request, request means the sender is going to talk to us (rfc826 packet reception)
+			if (skb->nh.arph->oper == htons(ARP_REPLY))
+				neighbour_update(dev, ntohl(skb->nh.arph->spa), skb->nh.arph->sha, NUD_REACHABLE, false);
+			else
+			{
+				neighbour_update(dev, ntohl(skb->nh.arph->spa), skb->nh.arph->sha, NUD_STALE, true);
+				arp_send(dev->dev_addr, dev->local_ip, skb->nh.arph->sha, ntohl(skb->nh.arph->spa), ARP_REPLY);
+			}
 		}
 		else if (skb->nh.arph->tpa == skb->nh.arph->spa && is_broadcast_mac_address(skb->nh.arph->tha))
 		{
@@ -262,15 +456,30 @@ int net_default_rx_handler(struct sk_buff *skb)
 				debug_println(DEBUG_INFO,
 							  "ARP: %s at %x:%x:%x:%x:%x:%x",
 							  source_ip_text,
-							  current_netdev->dev_addr[0], current_netdev->dev_addr[1], current_netdev->dev_addr[2], current_netdev->dev_addr[3], current_netdev->dev_addr[4], current_netdev->dev_addr[5]);
+							  dev->dev_addr[0], dev->dev_addr[1], dev->dev_addr[2], dev->dev_addr[3], dev->dev_addr[4], dev->dev_addr[5]);
 			}
 
-			neighbour_update_mapping(skb->nh.arph->sha, skb->nh.arph->spa);
+			neighbour_update(dev, ntohl(skb->nh.arph->spa), skb->nh.arph->sha, NUD_STALE, false);
 		}
 	}
 	return 0;
 }
 
+static void net_rx_dispatch(struct sk_buff *skb)
+{
+	struct socket *sock;
+	list_for_each_entry(sock, &lsocket, sibling)
+	{
+		struct sk_buff *skb_new = skb_clone(skb);
+		int ret = sock->ops->handler(sock, skb_new);
+		if (ret < 0)
+			skb_free(skb_new);
+	}
+	// arp is handled before dhcp is done (router's address is resolved during setup)
+	if (skb->dev->state & (NETDEV_STATE_UP | NETDEV_STATE_CONNECTED))
+		net_default_rx_handler(skb);
+}
+
 void net_rx_loop()
 {
 	// explain in kernel_init#unlock_scheduler
@@ -280,6 +489,13 @@ void net_rx_loop()
 	{
 		lock_scheduler();
 
+		// fragment queues expired by their timers are dropped here, not in interrupt context
+		ip4_frag_evict_expired();
+		// segments held back by pacing are sent here for the same reason
+		tcp_pacing_flush();
+		// as well as half-open connections which are given up by their retransmit timer
+		tcp_reap_children();
+
 		struct sk_buff *skb;
 		struct sk_buff *prev_skb = NULL;
 		list_for_each_entry(skb, &lrx_skb, sibling)
@@ -290,16 +506,14 @@ void net_rx_loop()
 				skb_free(prev_skb);
 			}
 
-			struct socket *sock;
-			list_for_each_entry(sock, &lsocket, sibling)
+			// sockets only see whole datagrams
+			struct sk_buff *datagram = ip4_defrag(skb);
+			if (datagram)
 			{
-				struct sk_buff *skb_new = skb_clone(skb);
-				int ret = sock->ops->handler(sock, skb_new);
-				if (ret < 0)
-					skb_free(skb_new);
+				net_rx_dispatch(datagram);
+				if (datagram != skb)
+					skb_free(datagram);
 			}
-			if (current_netdev->state & NETDEV_STATE_CONNECTED)
-				net_default_rx_handler(skb);
 
 			prev_skb = skb;
 		}
@@ -331,14 +545,30 @@ void net_switch()
 		update_thread(net_thread, THREAD_READY);
 }
 
+// software devices don't raise interrupts -> net thread is woken up without switching to it
+void net_wakeup()
+{
+	if (net_thread->state == THREAD_WAITING)
+		update_thread(net_thread, THREAD_READY);
+}
+
 void net_init()
 {
 	INIT_LIST_HEAD(&lsocket);
 	INIT_LIST_HEAD(&lrx_skb);
 
+	csum_init();
+	ip4_frag_init();
+
+	DEBUG &&debug_println(DEBUG_INFO, "Net: Setup loopback");
+	loopback_init();
+
 	DEBUG &&debug_println(DEBUG_INFO, "Net: Setup neighbour");
 	neighbour_init();
 
+	DEBUG &&debug_println(DEBUG_INFO, "Net: Setup dns");
+	dns_init();
+
 	DEBUG &&debug_println(DEBUG_INFO, "Net: Setup net process");
 	net_process = create_system_process("net", net_rx_loop, 0);
 	net_thread = net_process->thread;
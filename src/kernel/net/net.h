@@ -16,8 +16,45 @@
 
 #define CHECKSUM_MASK 0xFFFF
 
+/* Setsockoptions(2) level. */
+#define SOL_SOCKET 1
+#define SOL_TCP 6
+
+/* For setsockopt(2) */
+#define SO_MAX_PACING_RATE 47
+
+/* Flags we can use with send/ and recv. */
+#define MSG_PEEK 0x02
+#define MSG_DONTWAIT 0x40 /* Nonblocking io		 */
+#define MSG_WAITALL 0x100 /* Wait for a full request */
+#define MSG_WAITFORONE 0x10000 /* recvmmsg(): block until 1+ packets avail */
+
+// datagrams which are handled by one sendmmsg/recvmmsg call
+#define UIO_MAXIOV 1024
+
 struct sk_buff;
 
+struct iovec
+{
+	void *iov_base;
+	size_t iov_len;
+};
+
+struct msghdr
+{
+	void *msg_name;	 /* optional address */
+	uint32_t msg_namelen;
+	struct iovec *msg_iov; /* scatter/gather array */
+	size_t msg_iovlen;
+	int msg_flags;
+};
+
+struct mmsghdr
+{
+	struct msghdr msg_hdr;
+	uint32_t msg_len; /* number of bytes transmitted */
+};
+
 /* Standard well-defined IP protocols.  */
 enum
 {
@@ -131,9 +168,10 @@ struct sock
 	struct net_device *dev;
 	struct thread *owner_thread;
 	struct list_head rx_queue;
-	uint32_t rx_length;
 	struct list_head tx_queue;
 	struct list_head *send_head;
+	// threads which poll the socket
+	struct wait_queue_head wq;
 };
 
 struct inet_sock
@@ -165,7 +203,7 @@ struct proto_ops
 	int obj_size;
 	int (*bind)(struct socket *sock, struct sockaddr *myaddr, int sockaddr_len);
 	int (*connect)(struct socket *sock, struct sockaddr *vaddr, int sockaddr_len);
-	int (*accept)(struct socket *sock, struct sockaddr *addr, int sockaddr_len);
+	int (*accept)(struct socket *sock, struct sockaddr *addr, int *sockaddr_len);
 	int (*ioctl)(struct socket *sock, unsigned int cmd, unsigned long arg);
 	int (*listen)(struct socket *sock, int backlog);
 	int (*shutdown)(struct socket *sock);
@@ -174,7 +212,10 @@ struct proto_ops
 	// At the beging CONNECTED -> READY
 	// At the end READ -> CONNECTED
 	// To make sure each called recvmsg -> only one message
-	int (*recvmsg)(struct socket *sock, void *msg, size_t msg_len);
+	int (*recvmsg)(struct socket *sock, void *msg, size_t msg_len, int flags);
+	int (*setsockopt)(struct socket *sock, int level, int optname, void *optval, uint32_t optlen);
+	int (*getsockopt)(struct socket *sock, int level, int optname, void *optval, uint32_t *optlen);
+	unsigned int (*poll)(struct socket *sock, struct vfs_file *file, struct poll_table *pt);
 	// NOTE: MQ 2020-05-24 Handling incoming messages to match and process further
 	int (*handler)(struct socket *sock, struct sk_buff *skb);
 };
@@ -202,6 +243,8 @@ enum netdev_state
 	NETDEV_STATE_CONNECTED = 1 << 2,  // interface connects and gets config (dhcp -> ip) from router
 };
 
+#define IFF_LOOPBACK 0x8
+
 struct net_device
 {
 	uint32_t base_addr;
@@ -209,6 +252,7 @@ struct net_device
 
 	char name[16];
 	enum netdev_state state;
+	uint32_t flags;
 	struct list_head sibling;
 
 	// ip & mac address
@@ -223,23 +267,32 @@ struct net_device
 	uint32_t local_ip;
 	uint32_t subnet_mask;
 	uint32_t lease_time;
+
+	// skb contains ethernet frame
+	int (*xmit)(struct net_device *dev, struct sk_buff *skb);
 };
 
 void net_init();
 void net_rx_loop();
 void net_switch();
-void push_rx_queue(uint8_t *data, uint32_t size);
+void net_wakeup();
+void push_rx_queue(struct net_device *dev, uint8_t *data, uint32_t size);
 void socket_setup(int32_t family, enum socket_type type, int32_t protocal, struct vfs_file *file);
+int32_t socket_graft(struct socket *parent, struct sock *sk);
 int socket_shutdown(struct socket *sock);
+void socket_release(struct socket *sock);
 struct socket *sockfd_lookup(uint32_t fd);
+int socket_sendmmsg(struct socket *sock, struct mmsghdr *msgvec, uint32_t vlen, int flags);
+int socket_recvmmsg(struct socket *sock, struct mmsghdr *msgvec, uint32_t vlen, int flags);
 uint16_t singular_checksum(void *packet, uint16_t size);
-uint32_t packet_checksum_start(void *packet, uint16_t size);
 uint16_t transport_calculate_checksum(void *segment, uint16_t segment_len, uint8_t protocal, uint32_t source_ip, uint32_t dest_ip);
 char *inet_ntop(uint32_t src, char *dst, uint16_t len);
 int inet_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg);
+int inet_autobind(struct sock *sk, uint32_t dest_ip);
 
 void register_net_device(struct net_device *);
 struct net_device *get_current_net_device();
+struct net_device *route_lookup(uint32_t dest_ip);
 
 // tcp.c
 extern struct proto_ops tcp_proto_ops;
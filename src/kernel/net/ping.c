@@ -88,11 +88,11 @@ void ping(uint32_t dest_ip)
 	if (dev->state != NETDEV_STATE_CONNECTED)
 		return;
 
-	struct ip4_packet *received_ip = kcalloc(1, PING_SIZE);
-
 	struct sockaddr_ll remote_sin;
-	uint8_t *remote_mac_addr = lookup_mac_addr_for_ethernet(dev, dest_ip);
-	memcpy(remote_sin.sll_addr, remote_mac_addr, 6);
+	if (neighbour_resolve(dev, dest_ip, remote_sin.sll_addr) < 0)
+		return;
+
+	struct ip4_packet *received_ip = kcalloc(1, PING_SIZE);
 	sock->ops->connect(sock, (struct sockaddr *)&remote_sin, sizeof(struct sockaddr_ll));
 
 	char dest_ip_text[sizeof "255.255.255.255"];
@@ -114,7 +114,7 @@ void ping(uint32_t dest_ip)
 		while (true)
 		{
 			memset(received_ip, 0, PING_SIZE);
-			sock->ops->recvmsg(sock, received_ip, PING_SIZE);
+			sock->ops->recvmsg(sock, received_ip, PING_SIZE, 0);
 			int ret = ping_parse_from_ip_packet(received_ip, &icmp);
 			if (ret >= 0)
 				break;
@@ -50,11 +50,10 @@ int raw_sendmsg(struct socket *sock, void *msg, size_t msg_len)
 	skb->nh.iph = (struct ip4_packet *)skb->data;
 	ip4_build_header(skb->nh.iph, skb->len, sock->protocol, isk->ssin.sin_addr, isk->dsin.sin_addr, 0);
 
-	ip4_sendmsg(sock, skb);
-	return 0;
+	return ip4_sendmsg(sock, skb);
 }
 
-int raw_recvmsg(struct socket *sock, void *msg, size_t msg_len)
+int raw_recvmsg(struct socket *sock, void *msg, size_t msg_len, int flags)
 {
 	if (sock->state == SS_DISCONNECTED)
 		return -ESHUTDOWN;
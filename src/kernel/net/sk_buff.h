@@ -11,6 +11,13 @@ struct ip4_packet;
 struct arp_packet;
 struct ethernet_packet;
 
+enum skb_ip_summed
+{
+	CHECKSUM_NONE,
+	// csum is the sum of [head + csum_start, tail), it is computed while data is copied into skb
+	CHECKSUM_COMPLETE,
+};
+
 struct sk_buff
 {
 	struct sock *sk;
@@ -41,6 +48,10 @@ struct sk_buff
 
 	char cb[40];
 
+	uint32_t csum;
+	uint16_t csum_start;
+	uint8_t ip_summed;
+
 	uint8_t *head;
 	uint8_t *data;
 	uint8_t *tail;
@@ -1,7 +1,10 @@
 #include "tcp.h"
 
+#include <fs/poll.h>
 #include <include/errno.h>
+#include <include/fcntl.h>
 #include <memory/vmm.h>
+#include <net/checksum.h>
 #include <proc/task.h>
 #include <system/time.h>
 #include <utils/math.h>
@@ -9,19 +12,12 @@
 
 extern volatile struct thread *current_thread;
 
-uint16_t tcp_calculate_checksum(struct tcp_packet *tcp, uint16_t tcp_len, uint32_t source_ip, uint32_t dest_ip)
+// skb->data points to tcp header, the sum including checksum field is zero for a valid segment
+int tcp_validate_header(struct sk_buff *skb, uint16_t tcp_len)
 {
-	tcp->checksum = 0;
-	return transport_calculate_checksum(tcp, tcp_len, IP4_PROTOCAL_TCP, source_ip, dest_ip);
-}
-
-int tcp_validate_header(struct tcp_packet *tcp, uint16_t tcp_len, uint32_t source_ip, uint32_t dest_ip)
-{
-	uint16_t received_checksum = tcp->checksum;
-	uint16_t packet_checksum = tcp_calculate_checksum(tcp, tcp_len, source_ip, dest_ip);
-	tcp->checksum = received_checksum;
-
-	return packet_checksum != received_checksum ? -EPROTO : 0;
+	uint16_t checksum = skb_transport_checksum(skb, skb->data, tcp_len, IP4_PROTOCAL_TCP,
+											   ntohl(skb->nh.iph->source_ip), ntohl(skb->nh.iph->dest_ip));
+	return checksum ? -EPROTO : 0;
 }
 
 uint8_t *tcp_set_option_value(uint8_t *options, uint8_t code, uint8_t len, void *value)
@@ -40,8 +36,13 @@ void tcp_build_syn_options(struct socket *sock, uint8_t **options, uint32_t *len
 	*options = kcalloc(1, MAX_OPTION_LEN);
 	uint8_t *iter = *options;
 
-	iter = tcp_set_option_value(iter, 2, 2, &(uint16_t[]){htons(tsk->snd_mss)});
-	iter = tcp_set_option_value(iter, 3, 1, &(uint8_t[]){0});
+	// syn-ack of passive open only contains options which the peer's syn has
+	bool passive = tsk->state == TCP_SYN_RECV;
+	iter = tcp_set_option_value(iter, TCPOPT_MSS, 2, &(uint16_t[]){htons(tsk->snd_mss)});
+	if (!passive || tsk->wscale_ok)
+		iter = tcp_set_option_value(iter, TCPOPT_WINDOW, 1, &tsk->rcv_wds);
+	if (!passive || tsk->sack_ok)
+		iter = tcp_set_option_value(iter, TCPOPT_SACK_PERM, 0, NULL);
 
 	*len = WORD_ALIGN(iter - *options);
 }
@@ -71,8 +72,6 @@ void tcp_build_header(struct tcp_packet *tcp,
 	tcp->checksum = 0;
 	tcp->urgent_pointer = 0;
 	memcpy(tcp->payload, options, option_len);
-	// NOTE: MQ 2020-07-05 tcp data has to be filled to be able to calculate checksum
-	tcp->checksum = tcp_calculate_checksum(tcp, packet_len, source_ip, dest_ip);
 }
 
 void tcp_create_tcb(struct tcp_sock *tsk)
@@ -94,12 +93,35 @@ void tcp_create_tcb(struct tcp_sock *tsk)
 	tsk->rcv_mss = tsk->snd_mss;
 	tsk->rcv_irs = 0;
 	tsk->rcv_nxt = 0;
-	tsk->rcv_wnd = ETH_MAX_MTU;
+	tsk->sack_ok = false;
+	tsk->wscale_ok = false;
+	// the smallest scale which can advertise the whole receive buffer
+	tsk->rcv_wds = 0;
+	while ((TCP_RCVBUF_MAX >> tsk->rcv_wds) > ETH_MAX_MTU && tsk->rcv_wds < TCP_MAX_WSCALE)
+		tsk->rcv_wds++;
+
+	tsk->copied_seq = 0;
+	tsk->rcvbuf_len = 0;
+	tsk->rcvbuf_size = TCP_RCVBUF_SIZE;
+	tsk->rcv_wnd = min_t(uint32_t, tsk->rcvbuf_size, ETH_MAX_MTU);
+	tsk->rcvq_space = tsk->rcvbuf_size / 2;
+	tsk->rcvq_seq = 0;
+	tsk->rcvq_time = 0;
+	INIT_LIST_HEAD(&tsk->ofo_queue);
 
 	tsk->ssthresh = ETH_MAX_MTU;
 	tsk->cwnd = tsk->snd_mss;
 	tsk->flight_size = 0;
 	tsk->number_of_dup_acks = 0;
+	tsk->in_recovery = false;
+	tsk->recover = 0;
+	// congestion control which is chosen via setsockopt before connecting is kept
+	tcp_set_congestion_control(tsk, tsk->ca_ops ? tsk->ca_ops : &tcp_reno);
+
+	INIT_LIST_HEAD(&tsk->write_queue);
+	tsk->write_seq = tsk->snd_nxt;
+	tsk->sndbuf_len = 0;
+	tsk->sndbuf_size = TCP_SNDBUF_SIZE;
 
 	// NOTE: MQ 2020-07-09
 	// retransmit and probe timers are embedded (not pointers)
@@ -110,10 +132,15 @@ void tcp_create_tcb(struct tcp_sock *tsk)
 	tsk->retransmit_timer = (struct timer_list)TIMER_INITIALIZER(tcp_retransmit_timer, UINT32_MAX);
 	tsk->persist_backoff = 1000;
 	tsk->persist_timer = (struct timer_list)TIMER_INITIALIZER(tcp_persist_timer, UINT32_MAX);
+	list_del(&tsk->pacing_timer.sibling);
+	tsk->pacing_next = 0;
+	tsk->pacing_timer = (struct timer_list)TIMER_INITIALIZER(tcp_pacing_timer, UINT32_MAX);
+	list_del_init(&tsk->pacing_sibling);
 
 	tsk->rtt_end_seq = 0;
 	tsk->rtt_time = 0;
 	tsk->syn_retries = 0;
+	tsk->expired = false;
 }
 
 void tcp_delete_tcb(struct socket *sock)
@@ -126,6 +153,8 @@ void tcp_delete_tcb(struct socket *sock)
 	del_timer(&tsk->retransmit_timer);
 	tsk->persist_backoff = 1000;
 	del_timer(&tsk->persist_timer);
+	del_timer(&tsk->pacing_timer);
+	list_del_init(&tsk->pacing_sibling);
 
 	tsk->rtt_end_seq = 0;
 	tsk->rtt_time = 0;
@@ -150,6 +179,7 @@ void tcp_flush_tx(struct socket *sock)
 		skb_free(iter);
 	}
 	sock->sk->send_head = NULL;
+	tcp_flush_sndbuf(sock);
 }
 
 void tcp_flush_rx(struct socket *sock)
@@ -160,6 +190,19 @@ void tcp_flush_rx(struct socket *sock)
 		list_del(&iter->sibling);
 		skb_free(iter);
 	}
+	tcp_sk(sock->sk)->rcvbuf_len = 0;
+	tcp_flush_ofo(sock);
+}
+
+void tcp_flush_ofo(struct socket *sock)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	struct sk_buff *iter, *next;
+	list_for_each_entry_safe(iter, next, &tsk->ofo_queue, sibling)
+	{
+		list_del(&iter->sibling);
+		skb_free(iter);
+	}
 }
 
 void tcp_state_transition(struct socket *sock, uint8_t flags)
@@ -240,17 +283,32 @@ void tcp_calculate_rto(struct socket *sock, uint32_t rtt)
 	tsk->rto = max_t(uint32_t, tsk->srtt + max_t(uint32_t, G, K * tsk->rttvar), 1000);
 }
 
+// receiver side silly window avoidance (rfc1122 section 4.2.3.3)
+// the right edge of window only moves forward when the window can be opened by min(rcvbuf_size / 2, mss)
+void tcp_update_rcv_wnd(struct tcp_sock *tsk)
+{
+	uint32_t space = tcp_rcvbuf_space(tsk);
+	// scaled window loses the lower bits -> round down to not offer more than we have
+	space &= ~((1 << tsk->rcv_wds) - 1);
+
+	if (space < tsk->rcv_wnd || space - tsk->rcv_wnd >= min(tsk->rcvbuf_size / 2, tsk->snd_mss))
+		tsk->rcv_wnd = space;
+}
+
+// the window field in SYN segment is never scaled (rfc7323 section 2.2)
+uint16_t tcp_select_window(struct tcp_sock *tsk, uint16_t flags)
+{
+	if (flags & TCPCB_FLAG_SYN)
+		return min_t(uint32_t, tsk->rcv_wnd, ETH_MAX_MTU);
+	return min_t(uint32_t, tsk->rcv_wnd >> tsk->rcv_wds, ETH_MAX_MTU);
+}
+
 void tcp_calculate_congestion(struct socket *sock, uint32_t seg_ack)
 {
 	struct tcp_sock *tsk = tcp_sk(sock->sk);
 
-	if (tsk->cwnd <= tsk->ssthresh)
-		tsk->cwnd += min(seg_ack - tsk->snd_una, tsk->snd_mss);
-	else
-		tsk->cwnd += tsk->snd_mss * tsk->snd_mss / tsk->cwnd;
-
-	// assume that cwnd never exceed maximum mtu
-	tsk->cwnd = min_t(uint32_t, tsk->cwnd, ETH_MAX_MTU);
+	tsk->ca_ops->on_ack(tsk, seg_ack - tsk->snd_una);
+	tsk->cwnd = min_t(uint32_t, tsk->cwnd, TCP_MAX_CWND);
 }
 
 int tcp_bind(struct socket *sock, struct sockaddr *myaddr, int sockaddr_len)
@@ -264,21 +322,76 @@ int tcp_bind(struct socket *sock, struct sockaddr *myaddr, int sockaddr_len)
 int tcp_listen(struct socket *sock, int backlog)
 {
 	struct tcp_sock *tsk = tcp_sk(sock->sk);
-	tcp_create_tcb(tsk);
-
-	// TODO: MQ 2020-07-09
-	assert(false);
+	if (!tsk->inet.ssin.sin_port)
+		return -EDESTADDRREQ;
 
-	tsk->state = TCP_LISTEN;
+	if (tsk->state != TCP_LISTEN)
+	{
+		tcp_create_tcb(tsk);
+		INIT_LIST_HEAD(&tsk->syn_queue);
+		INIT_LIST_HEAD(&tsk->accept_queue);
+		tsk->syn_queue_len = 0;
+		tsk->accept_queue_len = 0;
+		tsk->state = TCP_LISTEN;
+	}
+	// calling listen again only changes the backlog
+	tsk->backlog = max(min(backlog, TCP_MAX_BACKLOG), 1);
 	return 0;
 }
 
-int tcp_accept(struct socket *sock, struct sockaddr *addr, int sockaddr_len)
+int tcp_accept(struct socket *sock, struct sockaddr *addr, int *sockaddr_len)
 {
-	// TODO: MQ 2020-07-09
-	assert(false);
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	if (tsk->state != TCP_LISTEN)
+		return -EINVAL;
+
+	bool nonblock = sock->file && (sock->file->f_flags & O_NONBLOCK);
+	lock_scheduler();
+	// listening socket might be shared with forked processes -> wait via queue instead of its owner
+	DEFINE_WAIT(wait);
+	list_add_tail(&wait.sibling, &sock->sk->wq.list);
+	while (list_empty(&tsk->accept_queue))
+	{
+		if (nonblock)
+		{
+			list_del(&wait.sibling);
+			unlock_scheduler();
+			return -EAGAIN;
+		}
 
-	return 0;
+		update_thread(current_thread, THREAD_WAITING);
+		unlock_scheduler();
+		schedule();
+		lock_scheduler();
+	}
+	list_del(&wait.sibling);
+
+	struct tcp_sock *child = list_first_entry(&tsk->accept_queue, struct tcp_sock, child_sibling);
+	list_del(&child->child_sibling);
+	tsk->accept_queue_len--;
+	unlock_scheduler();
+
+	// connection is moved from temporary socket to its own socket file
+	// child is off accept queue -> file is created without the scheduler lock (vfs_open takes semaphores)
+	struct socket *child_sock = child->inet.sk.sock;
+	int32_t fd = socket_graft(sock, &child->inet.sk);
+	lock_scheduler();
+	if (fd < 0)
+		tcp_destroy_child(child);
+	else
+		child->parent = NULL;
+	unlock_scheduler();
+
+	if (fd < 0)
+		return fd;
+	kfree(child_sock);
+
+	if (addr && sockaddr_len)
+	{
+		memcpy(addr, &child->inet.dsin, min_t(uint32_t, *sockaddr_len, sizeof(struct sockaddr_in)));
+		*sockaddr_len = sizeof(struct sockaddr_in);
+	}
+	return fd;
 }
 
 int tcp_connect(struct socket *sock, struct sockaddr *vaddr, int sockaddr_len)
@@ -288,9 +401,17 @@ int tcp_connect(struct socket *sock, struct sockaddr *vaddr, int sockaddr_len)
 	struct tcp_sock *tsk = tcp_sk(sock->sk);
 	memcpy(&tsk->inet.dsin, vaddr, sockaddr_len);
 
+	int ret = inet_autobind(sock->sk, tsk->inet.dsin.sin_addr);
+	if (ret < 0)
+	{
+		sock->state = SS_UNCONNECTED;
+		return ret;
+	}
+
 	tcp_create_tcb(tsk);
 	uint32_t sequence_number = rand();
 	tsk->snd_iss = sequence_number;
+	tsk->recover = sequence_number;
 
 	uint8_t *options;
 	uint32_t option_len;
@@ -309,97 +430,152 @@ int tcp_sendmsg(struct socket *sock, void *msg, size_t msg_len)
 		return -ESHUTDOWN;
 
 	struct tcp_sock *tsk = tcp_sk(sock->sk);
-	uint32_t mmss = min(tsk->snd_mss, tsk->rcv_mss);
+	bool nonblock = sock->file && (sock->file->f_flags & O_NONBLOCK);
 	size_t msg_sent_len = 0;
-	for (uint32_t starting_nxt = tsk->snd_nxt; msg_sent_len < msg_len && tsk->state == TCP_ESTABLISHED;)
+	while (msg_sent_len < msg_len)
 	{
-		uint32_t mwnd = min(min(tsk->cwnd, tcp_sender_available_window(tsk)), msg_len - msg_sent_len);
-		// if mwnd==0 <- cwnd canot be zero, msg_len - msg_sent_len cannot be zero
-		// -> the only case mwnd=0 is snd.wnd=0
-		if (mwnd == 0)
+		if (tsk->state != TCP_ESTABLISHED && tsk->state != TCP_CLOSE_WAIT)
+			break;
+
+		// only copy into send buffer, segments are built and sent lazily in tcp_push
+		msg_sent_len += tcp_sndbuf_append(sock, (uint8_t *)msg + msg_sent_len, msg_len - msg_sent_len);
+		tcp_push(sock);
+
+		if (msg_sent_len == msg_len)
+			break;
+		if (nonblock)
+			return msg_sent_len ? (int)msg_sent_len : -EAGAIN;
+
+		// send buffer is full -> wait until incoming acks make room
+		lock_scheduler();
+		if (!tcp_sndbuf_space(tsk) && (tsk->state == TCP_ESTABLISHED || tsk->state == TCP_CLOSE_WAIT))
 		{
-			assert(tsk->snd_una == tsk->snd_nxt);
-			assert(!tsk->snd_wnd);
-			uint16_t flags = msg_sent_len + 1 == msg_len ? TCPCB_FLAG_PSH : 0;
-			struct sk_buff *skb = tcp_create_skb(sock,
-												 tsk->snd_nxt, tsk->rcv_nxt,
-												 flags | TCPCB_FLAG_ACK,
-												 NULL, 0,
-												 (uint8_t *)msg + msg_sent_len, 1);
-
-			mod_timer(&tsk->persist_timer, get_milliseconds(NULL) + 1000);
-			tcp_transmit_skb(sock, skb);
-			del_timer(&tsk->persist_timer);
+			update_thread(current_thread, THREAD_WAITING);
+			unlock_scheduler();
+			schedule();
 		}
+		else
+			unlock_scheduler();
+	}
 
-		for (uint32_t iwnd = 0; iwnd < mwnd;)
+	if (tsk->state == TCP_CLOSE_WAIT)
+		return msg_sent_len;
+	return tcp_return_code(sock, msg_sent_len);
+}
+
+// peer's fin is not received yet -> more data can come
+static bool tcp_can_receive(struct tcp_sock *tsk)
+{
+	return tsk->state == TCP_ESTABLISHED || tsk->state == TCP_FIN_WAIT1 || tsk->state == TCP_FIN_WAIT2;
+}
+
+// copy from payload of in-order segments straight into user buffer, segments are freed once they are read entirely
+static uint32_t tcp_rcvbuf_copy(struct socket *sock, uint8_t *msg, uint32_t len, bool peek)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	uint32_t seq = tsk->copied_seq;
+	uint32_t copied = 0;
+
+	struct sk_buff *iter, *next;
+	list_for_each_entry_safe(iter, next, &sock->sk->rx_queue, sibling)
+	{
+		if (copied == len)
+			break;
+
+		// segments in rx queue are contiguous, the first one might be read partially
+		uint32_t offset = seq - tcp_skb_seq(iter);
+		uint32_t chunk_len = min(len - copied, tcp_payload_lenth(iter) - offset);
+		memcpy(msg + copied, tcp_payload(iter) + offset, chunk_len);
+		copied += chunk_len;
+		seq += chunk_len;
+
+		if (!peek && seq == tcp_skb_end_seq(iter))
 		{
-			uint32_t advertised_window = min(min(mmss, mwnd), msg_len - msg_sent_len);
-			uint16_t flags = msg_sent_len + advertised_window == msg_len ? TCPCB_FLAG_PSH : 0;
-			assert(msg_sent_len + advertised_window <= msg_len);
-			struct sk_buff *skb = tcp_create_skb(sock,
-												 starting_nxt + msg_sent_len, tsk->rcv_nxt,
-												 TCPCB_FLAG_ACK | flags,
-												 NULL, 0,
-												 (uint8_t *)msg + msg_sent_len, advertised_window);
-			tcp_tx_queue_add_skb(sock, skb);
-			iwnd += advertised_window;
-			msg_sent_len += advertised_window;
+			list_del(&iter->sibling);
+			skb_free(iter);
 		}
+	}
 
-		tcp_transmit(sock);
+	if (!peek)
+	{
+		tsk->copied_seq = seq;
+		tsk->rcvbuf_len -= copied;
 	}
+	return copied;
+}
 
-	return tcp_return_code(sock, msg_sent_len);
+// dynamic right-sizing, receive buffer grows to twice the amount the application reads in one rtt
+// -> advertised window keeps up with the bandwidth-delay product instead of being capped
+static void tcp_rcv_space_adjust(struct tcp_sock *tsk)
+{
+	uint64_t now = get_milliseconds(NULL);
+	uint32_t rtt = tsk->srtt ? tsk->srtt : TCP_RCV_RTT_DEFAULT;
+	if (now - tsk->rcvq_time < rtt)
+		return;
+
+	uint32_t copied = tsk->copied_seq - tsk->rcvq_seq;
+	if (copied > tsk->rcvq_space)
+	{
+		uint32_t rcvbuf_max = tsk->wscale_ok ? TCP_RCVBUF_MAX : ETH_MAX_MTU;
+		tsk->rcvq_space = copied;
+		tsk->rcvbuf_size = min(max(tsk->rcvbuf_size, 2 * copied), rcvbuf_max);
+	}
+	tsk->rcvq_seq = tsk->copied_seq;
+	tsk->rcvq_time = now;
 }
 
-int tcp_recvmsg(struct socket *sock, void *msg, size_t msg_len)
+int tcp_recvmsg(struct socket *sock, void *msg, size_t msg_len, int flags)
 {
 	if (sock->state == SS_DISCONNECTED)
 		return -ESHUTDOWN;
 
 	struct tcp_sock *tsk = tcp_sk(sock->sk);
-	sock->sk->rx_length = msg_len;
-
-	struct sk_buff *last_skb = NULL;
-	while (tsk->state == TCP_ESTABLISHED || tsk->state == TCP_FIN_WAIT1)
+	bool nonblock = (flags & MSG_DONTWAIT) || (sock->file && (sock->file->f_flags & O_NONBLOCK));
+	bool peek = flags & MSG_PEEK;
+	// return whatever is available, only MSG_WAITALL waits for the whole buffer
+	uint32_t target = flags & MSG_WAITALL ? msg_len : min_t(uint32_t, msg_len, 1);
+	uint32_t copied = 0;
+
+	lock_scheduler();
+	while (copied < target)
 	{
-		uint16_t received_len = 0;
-		struct sk_buff *iter;
-		list_for_each_entry(iter, &sock->sk->rx_queue, sibling)
+		// peek doesn't consume data -> copy only once when enough data is available
+		if (peek && (tsk->rcvbuf_len >= target || !tcp_can_receive(tsk)))
 		{
-			received_len += tcp_payload_lenth(iter);
-			assert(received_len <= msg_len);
-
-			if (msg_len == received_len || iter->h.tcph->push)
-			{
-				last_skb = iter;
-				break;
-			}
+			copied = tcp_rcvbuf_copy(sock, msg, msg_len, true);
+			break;
 		}
-		if (last_skb)
+		else if (!peek && tsk->rcvbuf_len)
+		{
+			copied += tcp_rcvbuf_copy(sock, (uint8_t *)msg + copied, msg_len - copied, false);
+			continue;
+		}
+
+		// fin or reset is received -> nothing more to wait for
+		if (!tcp_can_receive(tsk) || nonblock)
 			break;
 
 		update_thread(current_thread, THREAD_WAITING);
+		unlock_scheduler();
 		schedule();
+		lock_scheduler();
 	}
 
-	uint32_t received_len = 0;
-	struct sk_buff *iter, *next;
-	list_for_each_entry_safe(iter, next, &sock->sk->rx_queue, sibling)
+	if (!peek && copied)
 	{
-		list_del(&iter->sibling);
+		uint32_t prev_rcv_wnd = tsk->rcv_wnd;
+		tcp_rcv_space_adjust(tsk);
+		tcp_update_rcv_wnd(tsk);
 
-		uint16_t payload_len = tcp_payload_lenth(iter);
-		memcpy(msg + received_len, tcp_payload(iter), payload_len);
-		received_len += payload_len;
-
-		if (iter == last_skb)
-			break;
+		// sender might be stalled by the small window -> announce it once the window is doubled
+		if (tcp_can_receive(tsk) && tsk->rcv_wnd > prev_rcv_wnd && tsk->rcv_wnd >= 2 * prev_rcv_wnd)
+			tcp_send_ack(sock);
 	}
+	unlock_scheduler();
 
-	sock->sk->rx_length = 0;
-	return tcp_return_code(sock, received_len);
+	if (!copied && nonblock && tcp_can_receive(tsk))
+		return -EAGAIN;
+	return copied;
 }
 
 int tcp_shutdown(struct socket *sock)
@@ -408,22 +584,193 @@ int tcp_shutdown(struct socket *sock)
 		return -ESHUTDOWN;
 
 	struct tcp_sock *tsk = tcp_sk(sock->sk);
-	struct sk_buff *skb = tcp_create_skb(sock,
-										 tsk->snd_nxt, tsk->rcv_nxt,
-										 TCPCB_FLAG_ACK | TCPCB_FLAG_FIN,
-										 NULL, 0,
-										 NULL, 0);
-	tcp_transmit_skb(sock, skb);
 
+	// pending connections of listening socket are dropped (peers get reset when they send more)
+	if (tsk->state == TCP_LISTEN)
+	{
+		lock_scheduler();
+		struct tcp_sock *iter, *next;
+		list_for_each_entry_safe(iter, next, &tsk->syn_queue, child_sibling)
+		{
+			tcp_destroy_child(iter);
+		}
+		list_for_each_entry_safe(iter, next, &tsk->accept_queue, child_sibling)
+		{
+			tcp_destroy_child(iter);
+		}
+		tsk->syn_queue_len = 0;
+		tsk->accept_queue_len = 0;
+		tsk->state = TCP_CLOSE;
+		unlock_scheduler();
+		return 0;
+	}
+
+	// connection has never been established -> there is nothing to close
+	if (tsk->state == TCP_CLOSE || tsk->state == TCP_SYN_SENT)
+		return 0;
+
+	// peer might close first (CLOSE_WAIT, step eighth in tcp_handler_established) -> its fin is only acked, ours is sent here
+	if (tsk->state == TCP_ESTABLISHED || tsk->state == TCP_CLOSE_WAIT)
+	{
+		// data in send buffer has to be sent before fin
+		tsk->nonagle &= ~TCP_NAGLE_CORK;
+		tsk->nonagle |= TCP_NAGLE_OFF;
+		tcp_push(sock);
+		lock_scheduler();
+		while (tsk->sndbuf_len && (tsk->state == TCP_ESTABLISHED || tsk->state == TCP_CLOSE_WAIT))
+		{
+			update_thread(current_thread, THREAD_WAITING);
+			unlock_scheduler();
+			schedule();
+			lock_scheduler();
+		}
+		unlock_scheduler();
+
+		struct sk_buff *skb = tcp_create_skb(sock,
+											 tsk->write_seq, tsk->rcv_nxt,
+											 TCPCB_FLAG_ACK | TCPCB_FLAG_FIN,
+											 NULL, 0,
+											 NULL, 0);
+		tsk->write_seq++;
+		tcp_transmit_skb(sock, skb);
+	}
+
+	lock_scheduler();
 	while (tsk->state != TCP_CLOSE)
 	{
 		update_thread(current_thread, THREAD_WAITING);
+		unlock_scheduler();
 		schedule();
+		lock_scheduler();
+	}
+	unlock_scheduler();
+
+	return 0;
+}
+
+int tcp_setsockopt(struct socket *sock, int level, int optname, void *optval, uint32_t optlen)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+
+	if (level == SOL_TCP && optname == TCP_CONGESTION)
+	{
+		char name[TCP_CA_NAME_MAX] = {0};
+		strncpy(name, optval, min_t(uint32_t, optlen, TCP_CA_NAME_MAX - 1));
+
+		struct tcp_congestion_ops *ca_ops = tcp_ca_find(name);
+		if (!ca_ops)
+			return -ENOENT;
+
+		lock_scheduler();
+		tcp_set_congestion_control(tsk, ca_ops);
+		unlock_scheduler();
+		return 0;
+	}
+
+	if (level != SOL_TCP && level != SOL_SOCKET)
+		return -ENOPROTOOPT;
+	if (optlen < sizeof(int))
+		return -EINVAL;
+
+	int value = *(int *)optval;
+	if (level == SOL_SOCKET)
+	{
+		if (optname != SO_MAX_PACING_RATE)
+			return -ENOPROTOOPT;
+
+		// pacing is disabled by default, any non-zero rate enables pacing timer
+		tsk->max_pacing_rate = value;
+		return 0;
+	}
+
+	switch (optname)
+	{
+	case TCP_NODELAY:
+		if (value)
+			tsk->nonagle |= TCP_NAGLE_OFF;
+		else
+			tsk->nonagle &= ~TCP_NAGLE_OFF;
+		break;
+	case TCP_CORK:
+		if (value)
+			tsk->nonagle |= TCP_NAGLE_CORK;
+		else
+			tsk->nonagle &= ~TCP_NAGLE_CORK;
+		break;
+	default:
+		return -ENOPROTOOPT;
 	}
 
+	// uncork or disable nagle -> pending partial segment can be sent right away
+	if (!value && optname == TCP_CORK)
+		tcp_push(sock);
+	else if (value && optname == TCP_NODELAY)
+		tcp_push(sock);
 	return 0;
 }
 
+int tcp_getsockopt(struct socket *sock, int level, int optname, void *optval, uint32_t *optlen)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+
+	if (level == SOL_TCP && optname == TCP_CONGESTION)
+	{
+		struct tcp_congestion_ops *ca_ops = tsk->ca_ops ? tsk->ca_ops : &tcp_reno;
+		uint32_t len = min_t(uint32_t, *optlen, TCP_CA_NAME_MAX);
+		strncpy(optval, ca_ops->name, len);
+		*optlen = len;
+		return 0;
+	}
+
+	if (level != SOL_TCP && level != SOL_SOCKET)
+		return -ENOPROTOOPT;
+	if (*optlen < sizeof(int))
+		return -EINVAL;
+
+	if (level == SOL_SOCKET)
+	{
+		if (optname != SO_MAX_PACING_RATE)
+			return -ENOPROTOOPT;
+
+		*(int *)optval = tsk->max_pacing_rate;
+		*optlen = sizeof(int);
+		return 0;
+	}
+
+	switch (optname)
+	{
+	case TCP_NODELAY:
+		*(int *)optval = (tsk->nonagle & TCP_NAGLE_OFF) != 0;
+		break;
+	case TCP_CORK:
+		*(int *)optval = (tsk->nonagle & TCP_NAGLE_CORK) != 0;
+		break;
+	default:
+		return -ENOPROTOOPT;
+	}
+	*optlen = sizeof(int);
+	return 0;
+}
+
+unsigned int tcp_poll(struct socket *sock, struct vfs_file *file, struct poll_table *pt)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	poll_wait(file, &sock->sk->wq, pt);
+
+	if (tsk->state == TCP_LISTEN)
+		return !list_empty(&tsk->accept_queue) ? POLLIN : 0;
+
+	unsigned int mask = 0;
+	// reading at the end of stream doesn't block either
+	if (tsk->rcvbuf_len || (tsk->state != TCP_SYN_SENT && !tcp_can_receive(tsk)))
+		mask |= POLLIN;
+	if ((tsk->state == TCP_ESTABLISHED || tsk->state == TCP_CLOSE_WAIT) && tcp_sndbuf_space(tsk))
+		mask |= POLLOUT;
+	if (tsk->state == TCP_CLOSE)
+		mask |= POLLHUP;
+	return mask;
+}
+
 int tcp_handler(struct socket *sock, struct sk_buff *skb)
 {
 	if (sock->state == SS_DISCONNECTED)
@@ -443,10 +790,21 @@ int tcp_handler(struct socket *sock, struct sk_buff *skb)
 
 	struct tcp_packet *tcp = (struct tcp_packet *)skb->data;
 	int tcp_len = ntohs(skb->nh.iph->total_length) - sizeof(struct ip4_packet);
-	ret = tcp_validate_header(tcp, tcp_len, ntohl(skb->nh.iph->source_ip), ntohl(skb->nh.iph->dest_ip));
+	ret = tcp_validate_header(skb, tcp_len);
 	if (ret < 0)
 		return ret;
 
+	// listening socket accepts segments of any peer
+	if (tsk->state == TCP_LISTEN)
+	{
+		if ((tsk->inet.ssin.sin_addr && tsk->inet.ssin.sin_addr != ntohl(skb->nh.iph->dest_ip)) ||
+			tsk->inet.ssin.sin_port != ntohs(tcp->dest_port))
+			return -EINVAL;
+
+		skb->h.tcph = (struct tcp_packet *)skb->data;
+		return tcp_handler_listen(sock, skb);
+	}
+
 	if (tsk->inet.ssin.sin_addr == ntohl(skb->nh.iph->dest_ip) && tsk->inet.ssin.sin_port == ntohs(tcp->dest_port) &&
 		tsk->inet.dsin.sin_addr == ntohl(skb->nh.iph->source_ip) && tsk->inet.dsin.sin_port == ntohs(tcp->source_port))
 	{
@@ -472,6 +830,7 @@ int tcp_handler(struct socket *sock, struct sk_buff *skb)
 			tcp_handler_established(sock, skb);
 			break;
 		}
+		wake_up(&sock->sk->wq);
 	}
 	return 0;
 }
@@ -487,5 +846,8 @@ struct proto_ops tcp_proto_ops = {
 	.sendmsg = tcp_sendmsg,
 	.recvmsg = tcp_recvmsg,
 	.shutdown = tcp_shutdown,
+	.setsockopt = tcp_setsockopt,
+	.getsockopt = tcp_getsockopt,
+	.poll = tcp_poll,
 	.handler = tcp_handler,
 };
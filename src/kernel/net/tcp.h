@@ -1,17 +1,49 @@
 #ifndef NET_TCP_H
 #define NET_TCP_H
 
+#include <memory/pmm.h>
 #include <net/ethernet.h>
 #include <net/ip.h>
 #include <net/net.h>
 #include <net/sk_buff.h>
 #include <stdint.h>
 #include <system/timer.h>
+#include <utils/math.h>
 #include <utils/printf.h>
 
 #define MAX_OPTION_LEN 40
 #define MAX_TCP_HEADER (sizeof(struct ethernet_packet) + sizeof(struct ip4_packet) + sizeof(struct tcp_packet))
 #define MAX_SEGMENT_LIFETIME 15
+#define MAX_SACK_BLOCKS 4
+// user data is appended into send buffer chunks, segmented lazily when the window allows
+#define TCP_SNDBUF_CHUNK (4 * PMM_FRAME_SIZE)
+#define TCP_SNDBUF_SIZE (16 * PMM_FRAME_SIZE)
+// receive buffer starts small and grows up to TCP_RCVBUF_MAX with the application's drain rate
+#define TCP_RCVBUF_SIZE (16 * PMM_FRAME_SIZE)
+#define TCP_RCVBUF_MAX (256 * PMM_FRAME_SIZE)
+#define TCP_MAX_WSCALE 14
+// used to measure drain rate if no rtt sample is available (we only sent acks)
+#define TCP_RCV_RTT_DEFAULT 100
+#define TCP_MAX_CWND (256 * PMM_FRAME_SIZE)
+#define TCP_MAX_BACKLOG 128
+// half-open connection is dropped after SYN-ACK is retransmitted this many times
+#define TCP_SYNACK_RETRIES 5
+#define TCP_CA_NAME_MAX 16
+
+// socket options (level IPPROTO_TCP)
+#define TCP_NODELAY 1 /* Turn off Nagle's algorithm. */
+#define TCP_CORK 3	  /* Never send partially complete segments */
+#define TCP_CONGESTION 13 /* Congestion control algorithm */
+
+#define TCP_NAGLE_OFF 1	 /* Nagle's algo is disabled */
+#define TCP_NAGLE_CORK 2 /* Socket is corked	    */
+
+#define TCPOPT_EOL 0
+#define TCPOPT_NOP 1
+#define TCPOPT_MSS 2
+#define TCPOPT_WINDOW 3
+#define TCPOPT_SACK_PERM 4
+#define TCPOPT_SACK 5
 
 #define TCPCB_FLAG_FIN 0x01
 #define TCPCB_FLAG_SYN 0x02
@@ -42,16 +74,49 @@ struct tcp_skb_cb
 	uint32_t seq;
 	uint32_t end_seq;
 	uint16_t flags;
+	bool sacked;  // covered by a sack block from the receiver
 	uint64_t expires;
 	uint64_t when;
 };
 
+struct tcp_sock;
+
+enum tcp_ca_event
+{
+	CA_EVENT_TX_START,	   /* first transmit when no packets in flight */
+	CA_EVENT_COMPLETE_CWR, /* end of congestion recovery */
+	CA_EVENT_LOSS,		   /* loss timeout */
+};
+
+struct tcp_congestion_ops
+{
+	char name[TCP_CA_NAME_MAX];
+	void (*init)(struct tcp_sock *tsk);
+	// new data is acknowledged outside of fast recovery -> grow cwnd
+	void (*on_ack)(struct tcp_sock *tsk, uint32_t acked);
+	// fast retransmit or retransmission timeout -> return new ssthresh
+	uint32_t (*on_loss)(struct tcp_sock *tsk);
+	void (*cwnd_event)(struct tcp_sock *tsk, enum tcp_ca_event event);
+	// optional, bytes per second, default is derived from cwnd and srtt
+	uint32_t (*pacing_rate)(struct tcp_sock *tsk);
+};
+
 struct tcp_sock
 {
 	struct inet_sock inet;
 	enum tcp_state state;
 	struct timer_list msl_timer;
 
+	// listening socket, children in SYN_RECV are in syn_queue, established ones wait in accept_queue
+	struct list_head syn_queue;
+	struct list_head accept_queue;
+	uint32_t syn_queue_len;
+	uint32_t accept_queue_len;
+	uint32_t backlog;
+	// child which is not accepted yet
+	struct tcp_sock *parent;
+	struct list_head child_sibling;
+
 	// sender sequence variables
 	uint32_t snd_mss;
 	uint32_t snd_iss;
@@ -60,13 +125,36 @@ struct tcp_sock
 	uint32_t snd_wnd;
 	uint32_t snd_wl1;
 	uint32_t snd_wl2;
-	uint8_t snd_wds;  // window scale, only support incomming
+	uint8_t snd_wds;  // window scale of incoming window
+	bool sack_ok;	  // both sides send SACK-permitted in SYN
+	uint8_t nonagle;  // TCP_NAGLE_OFF | TCP_NAGLE_CORK
+
+	// send buffer, data is not segmented yet
+	struct list_head write_queue;
+	uint32_t write_seq;	 // sequence number of the first byte in send buffer
+	uint32_t sndbuf_len;
+	uint32_t sndbuf_size;
 
 	// receiver sequence variables
 	uint32_t rcv_mss;
 	uint32_t rcv_irs;
 	uint32_t rcv_nxt;
 	uint32_t rcv_wnd;
+	uint8_t rcv_wds;  // window scale of outgoing window
+	bool wscale_ok;	  // both sides send window scale in SYN
+
+	// receive buffer, in-order segments in rx_queue which are not read yet
+	uint32_t copied_seq;  // the next sequence number to be read by the application
+	uint32_t rcvbuf_len;
+	uint32_t rcvbuf_size;
+	// dynamic right-sizing, bytes read by the application in the last measured rtt
+	uint32_t rcvq_space;
+	uint32_t rcvq_seq;
+	uint64_t rcvq_time;
+
+	// segments beyond rcv_nxt, sorted by sequence number
+	struct list_head ofo_queue;
+	uint32_t ofo_last_seq;	// the most recent out-of-order segment, reported in the first sack block
 
 	// congestion
 	uint32_t ssthresh;
@@ -76,6 +164,18 @@ struct tcp_sock
 	uint32_t cwnd;
 	uint8_t number_of_dup_acks;
 	uint32_t flight_size;
+	// NewReno (rfc6582), recover is the highest sequence number sent when entering fast recovery
+	bool in_recovery;
+	uint32_t recover;
+	struct tcp_congestion_ops *ca_ops;
+	uint64_t ca_priv[4];  // private state of congestion control
+
+	// pacing is off until max_pacing_rate is set, pacing_next is in microseconds
+	uint32_t max_pacing_rate;
+	uint64_t pacing_next;
+	struct timer_list pacing_timer;
+	// pacing timer expired, held back segments are sent by net thread
+	struct list_head pacing_sibling;
 
 	// timer
 	uint32_t rto;  // millisecon is the calculation unit
@@ -90,6 +190,8 @@ struct tcp_sock
 	uint32_t rtt_end_seq;
 	uint64_t rtt_time;
 	uint8_t syn_retries;
+	// half-open child which is given up by retransmit timer
+	bool expired;
 };
 
 struct __attribute__((packed)) tcp_packet
@@ -117,6 +219,23 @@ struct __attribute__((packed)) tcp_packet
 
 #define TCP_SKB_CB(__skb) ((struct tcp_skb_cb *)&((__skb)->cb[0]))
 
+struct tcp_sack_block
+{
+	uint32_t start_seq;
+	uint32_t end_seq;
+};
+
+// sequence numbers are compared in modulo 2^32 (rfc793 section 3.3)
+static inline bool before(uint32_t seq1, uint32_t seq2)
+{
+	return (int32_t)(seq1 - seq2) < 0;
+}
+
+static inline bool after(uint32_t seq1, uint32_t seq2)
+{
+	return (int32_t)(seq2 - seq1) < 0;
+}
+
 static inline struct tcp_sock *tcp_sk(struct sock *sk)
 {
 	return (struct tcp_sock *)sk;
@@ -144,9 +263,38 @@ static inline uint16_t tcp_payload_lenth(struct sk_buff *skb)
 	return (uint16_t)payload_len;
 }
 
+static inline uint32_t tcp_skb_seq(struct sk_buff *skb)
+{
+	return ntohl(skb->h.tcph->sequence_number);
+}
+
+// the first sequence number after segment's payload
+static inline uint32_t tcp_skb_end_seq(struct sk_buff *skb)
+{
+	return tcp_skb_seq(skb) + tcp_payload_lenth(skb);
+}
+
+// usable window is limited by both receiver window and congestion window (rfc5681 section 3.1)
 static inline uint32_t tcp_sender_available_window(struct tcp_sock *tsk)
 {
-	return tsk->snd_una + tsk->snd_wnd - tsk->snd_nxt;
+	uint32_t window = min(tsk->snd_wnd, tsk->cwnd);
+	uint32_t outstanding = tsk->snd_nxt - tsk->snd_una;
+	return window > outstanding ? window - outstanding : 0;
+}
+
+static inline void *tcp_ca(struct tcp_sock *tsk)
+{
+	return tsk->ca_priv;
+}
+
+static inline uint32_t tcp_rcvbuf_space(struct tcp_sock *tsk)
+{
+	return tsk->rcvbuf_size > tsk->rcvbuf_len ? tsk->rcvbuf_size - tsk->rcvbuf_len : 0;
+}
+
+static inline uint32_t tcp_sndbuf_space(struct tcp_sock *tsk)
+{
+	return tsk->sndbuf_size > tsk->sndbuf_len ? tsk->sndbuf_size - tsk->sndbuf_len : 0;
 }
 
 void tcp_build_header(struct tcp_packet *tcp,
@@ -162,22 +310,61 @@ struct sk_buff *tcp_create_skb(struct socket *sock,
 							   uint16_t flags,
 							   void *options, uint16_t option_len,
 							   void *payload, uint16_t payload_len);
+void tcp_build_skb_headers(struct socket *sock, struct sk_buff *skb,
+						   uint32_t sequence_number, uint32_t ack_number,
+						   uint16_t flags,
+						   void *options, uint16_t option_len);
+void tcp_push(struct socket *sock);
 void tcp_transmit(struct socket *sock);
+uint32_t tcp_sndbuf_append(struct socket *sock, void *msg, uint32_t len);
+void tcp_flush_sndbuf(struct socket *sock);
 void tcp_transmit_skb(struct socket *sock, struct sk_buff *skb);
 void tcp_tx_queue_add_skb(struct socket *sock, struct sk_buff *skb);
 void tcp_send_skb(struct socket *sock, struct sk_buff *skb, bool is_retransmitted);
+void tcp_send_ack(struct socket *sock);
+void tcp_build_sack_options(struct socket *sock, uint8_t *options, uint32_t *len);
 void tcp_handler_close(struct socket *sock, struct sk_buff *skb);
 void tcp_handler_sync(struct socket *sock, struct sk_buff *skb);
 void tcp_handler_established(struct socket *sock, struct sk_buff *skb);
+int tcp_handler_listen(struct socket *sock, struct sk_buff *skb);
+void tcp_destroy_child(struct tcp_sock *child);
+void tcp_init_from_syn(struct tcp_sock *tsk, struct sk_buff *skb);
+void tcp_build_syn_options(struct socket *sock, uint8_t **options, uint32_t *len);
+uint8_t *tcp_set_option_value(uint8_t *options, uint8_t code, uint8_t len, void *value);
 void tcp_msl_timer(struct timer_list *timer);
 void tcp_retransmit_timer(struct timer_list *timer);
 void tcp_persist_timer(struct timer_list *timer);
+void tcp_reap_children();
 void tcp_enter_close_state(struct socket *sock);
+void tcp_create_tcb(struct tcp_sock *tsk);
 void tcp_delete_tcb(struct socket *sock);
 void tcp_state_transition(struct socket *sock, uint8_t flags);
 void tcp_flush_tx(struct socket *sock);
 void tcp_flush_rx(struct socket *sock);
+void tcp_flush_ofo(struct socket *sock);
+void tcp_update_rcv_wnd(struct tcp_sock *tsk);
+uint16_t tcp_select_window(struct tcp_sock *tsk, uint16_t flags);
 void tcp_calculate_rto(struct socket *sock, uint32_t rtt);
 void tcp_calculate_congestion(struct socket *sock, uint32_t seg_ack);
+void tcp_pacing_timer(struct timer_list *timer);
+void tcp_pacing_flush();
+void tcp_transmit_head(struct socket *sock);
+bool tcp_pacing_check(struct tcp_sock *tsk);
+
+// tcp_syncookies.c
+uint32_t tcp_cookie_make(struct sk_buff *skb, uint16_t *mss);
+bool tcp_cookie_check(struct sk_buff *skb, uint32_t cookie, uint16_t *mss);
+
+// tcp_cong.c
+extern struct tcp_congestion_ops tcp_reno;
+extern struct tcp_congestion_ops tcp_cubic;
+struct tcp_congestion_ops *tcp_ca_find(const char *name);
+void tcp_set_congestion_control(struct tcp_sock *tsk, struct tcp_congestion_ops *ca_ops);
+uint32_t tcp_ca_on_loss(struct tcp_sock *tsk);
+void tcp_ca_event(struct tcp_sock *tsk, enum tcp_ca_event event);
+uint32_t tcp_pacing_rate(struct tcp_sock *tsk);
+void tcp_retransmit_lost(struct socket *sock);
+void tcp_enter_recovery(struct socket *sock);
+bool tcp_recovery_ack(struct socket *sock, uint32_t seg_ack);
 
 #endif
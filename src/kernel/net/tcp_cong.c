@@ -0,0 +1,76 @@
+#include <system/time.h>
+#include <utils/math.h>
+#include <utils/string.h>
+
+#include "tcp.h"
+
+static struct tcp_congestion_ops *tcp_ca_list[] = {
+	&tcp_reno,
+	&tcp_cubic,
+};
+
+struct tcp_congestion_ops *tcp_ca_find(const char *name)
+{
+	for (uint32_t i = 0; i < sizeof(tcp_ca_list) / sizeof(tcp_ca_list[0]); ++i)
+	{
+		if (!strncmp(tcp_ca_list[i]->name, name, TCP_CA_NAME_MAX))
+			return tcp_ca_list[i];
+	}
+	return NULL;
+}
+
+void tcp_set_congestion_control(struct tcp_sock *tsk, struct tcp_congestion_ops *ca_ops)
+{
+	tsk->ca_ops = ca_ops;
+	memset(tsk->ca_priv, 0, sizeof(tsk->ca_priv));
+	if (ca_ops->init)
+		ca_ops->init(tsk);
+}
+
+uint32_t tcp_ca_on_loss(struct tcp_sock *tsk)
+{
+	return tsk->ca_ops->on_loss(tsk);
+}
+
+void tcp_ca_event(struct tcp_sock *tsk, enum tcp_ca_event event)
+{
+	if (tsk->ca_ops->cwnd_event)
+		tsk->ca_ops->cwnd_event(tsk, event);
+}
+
+// pacing rate is 200% of cwnd / srtt in slow start (cwnd doubles every rtt) and 120% in congestion avoidance
+// -> segments of a window are spread across rtt and pacing never limits the growth of cwnd
+uint32_t tcp_pacing_rate(struct tcp_sock *tsk)
+{
+	uint32_t rate;
+	if (tsk->ca_ops->pacing_rate)
+		rate = tsk->ca_ops->pacing_rate(tsk);
+	else if (!tsk->srtt)
+		return 0;
+	else
+	{
+		uint32_t ratio = tsk->cwnd < tsk->ssthresh ? 200 : 120;
+		rate = (uint64_t)tsk->cwnd * 1000 * ratio / 100 / tsk->srtt;
+	}
+	return min(rate, tsk->max_pacing_rate);
+}
+
+// rfc5681 section 3.1
+static void tcp_reno_on_ack(struct tcp_sock *tsk, uint32_t acked)
+{
+	if (tsk->cwnd <= tsk->ssthresh)
+		tsk->cwnd += min(acked, tsk->snd_mss);
+	else
+		tsk->cwnd += max_t(uint32_t, tsk->snd_mss * tsk->snd_mss / tsk->cwnd, 1);
+}
+
+static uint32_t tcp_reno_on_loss(struct tcp_sock *tsk)
+{
+	return max(tsk->flight_size / 2, 2 * tsk->snd_mss);
+}
+
+struct tcp_congestion_ops tcp_reno = {
+	.name = "reno",
+	.on_ack = tcp_reno_on_ack,
+	.on_loss = tcp_reno_on_loss,
+};
@@ -0,0 +1,134 @@
+#include <system/time.h>
+#include <utils/math.h>
+
+#include "tcp.h"
+
+// CUBIC (rfc8312), cwnd is kept in bytes, time in milliseconds
+// C = 0.4 and beta_cubic = 0.7 are scaled by 10
+#define CUBIC_C 4
+#define CUBIC_BETA 7
+#define CUBIC_SCALE 10
+// (t - K)^3 overflows for longer epochs, cwnd is far beyond TCP_MAX_CWND anyway
+#define CUBIC_MAX_DELTA 30000
+
+struct cubic
+{
+	uint32_t last_max_cwnd;	 // W_max, cwnd right before the last reduction
+	uint32_t origin_point;	 // cwnd at the plateau of cubic function
+	uint32_t k;				 // time to reach origin point
+	uint64_t epoch_start;	 // beginning of the current congestion avoidance period
+};
+
+_Static_assert(sizeof(struct cubic) <= sizeof(((struct tcp_sock *)0)->ca_priv), "cubic state doesn't fit into ca_priv");
+
+static uint32_t cubic_root(uint64_t a)
+{
+	// cbrt(2^64 - 1) = 2642245
+	uint32_t lo = 0, hi = 2642245;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo + 1) / 2;
+		if ((uint64_t)mid * mid * mid <= a)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+static void cubic_reset(struct cubic *ca)
+{
+	ca->epoch_start = 0;
+}
+
+static void cubic_init(struct tcp_sock *tsk)
+{
+	struct cubic *ca = tcp_ca(tsk);
+	ca->last_max_cwnd = 0;
+	cubic_reset(ca);
+}
+
+// W_cubic(t) = C * (t - K)^3 + W_max
+static uint32_t cubic_target(struct tcp_sock *tsk, struct cubic *ca, uint32_t t)
+{
+	int32_t delta = (int32_t)t - (int32_t)ca->k;
+	uint64_t abs_delta = min(abs(delta), CUBIC_MAX_DELTA);
+	// C * delta^3 segments with delta in milliseconds -> divided by 1000^3
+	uint64_t offset = abs_delta * abs_delta * abs_delta * CUBIC_C * tsk->snd_mss / CUBIC_SCALE / 1000000000ULL;
+
+	if (delta >= 0)
+		return min_t(uint64_t, ca->origin_point + offset, TCP_MAX_CWND);
+	return ca->origin_point > offset + tsk->snd_mss ? ca->origin_point - offset : tsk->snd_mss;
+}
+
+static void cubic_on_ack(struct tcp_sock *tsk, uint32_t acked)
+{
+	struct cubic *ca = tcp_ca(tsk);
+
+	if (tsk->cwnd <= tsk->ssthresh)
+	{
+		tsk->cwnd += min(acked, tsk->snd_mss);
+		return;
+	}
+
+	uint64_t now = get_milliseconds(NULL);
+	uint32_t rtt = tsk->srtt ? tsk->srtt : TCP_RCV_RTT_DEFAULT;
+	if (!ca->epoch_start)
+	{
+		ca->epoch_start = now;
+		// K = cbrt(W_max * (1 - beta) / C) -> time to grow back from current cwnd to W_max
+		if (ca->last_max_cwnd > tsk->cwnd)
+		{
+			uint64_t diff = (uint64_t)(ca->last_max_cwnd - tsk->cwnd) * CUBIC_SCALE * 1000000000ULL;
+			ca->k = cubic_root(diff / CUBIC_C / tsk->snd_mss);
+			ca->origin_point = ca->last_max_cwnd;
+		}
+		else
+		{
+			ca->k = 0;
+			ca->origin_point = tsk->cwnd;
+		}
+	}
+
+	uint32_t t = now - ca->epoch_start;
+	// the target is where cwnd should be after one more rtt
+	uint32_t target = cubic_target(tsk, ca, t + rtt);
+
+	// tcp-friendly region (rfc8312 section 4.2), W_est = W_max * beta + 3 * (1 - beta) / (1 + beta) * t / rtt
+	uint32_t w_est = ca->origin_point * CUBIC_BETA / CUBIC_SCALE + (uint64_t)9 * t * tsk->snd_mss / (17 * rtt);
+	target = max(target, w_est);
+
+	if (target > tsk->cwnd)
+		tsk->cwnd += max_t(uint32_t, (uint64_t)(target - tsk->cwnd) * acked / tsk->cwnd, 1);
+	else
+		tsk->cwnd += max_t(uint32_t, acked * tsk->snd_mss / (100 * tsk->cwnd), 1);
+}
+
+static uint32_t cubic_on_loss(struct tcp_sock *tsk)
+{
+	struct cubic *ca = tcp_ca(tsk);
+	cubic_reset(ca);
+
+	// fast convergence (rfc8312 section 4.6), release bandwidth for new flows
+	if (tsk->cwnd < ca->last_max_cwnd)
+		ca->last_max_cwnd = tsk->cwnd * (CUBIC_SCALE + CUBIC_BETA) / (2 * CUBIC_SCALE);
+	else
+		ca->last_max_cwnd = tsk->cwnd;
+
+	return max(tsk->cwnd * CUBIC_BETA / CUBIC_SCALE, 2 * tsk->snd_mss);
+}
+
+static void cubic_cwnd_event(struct tcp_sock *tsk, enum tcp_ca_event event)
+{
+	// after an idle period or timeout, cubic function starts over from the current cwnd
+	if (event == CA_EVENT_TX_START || event == CA_EVENT_LOSS)
+		cubic_reset(tcp_ca(tsk));
+}
+
+struct tcp_congestion_ops tcp_cubic = {
+	.name = "cubic",
+	.init = cubic_init,
+	.on_ack = cubic_on_ack,
+	.on_loss = cubic_on_loss,
+	.cwnd_event = cubic_cwnd_event,
+};
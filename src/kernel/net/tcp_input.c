@@ -1,10 +1,13 @@
 #include <include/errno.h>
+#include <net/neighbour.h>
 #include <proc/task.h>
 #include <system/time.h>
 #include <utils/math.h>
 
 #include "tcp.h"
 
+extern struct list_head lsocket;
+
 uint32_t tcp_get_option_value(uint8_t *options, void *value, uint8_t len)
 {
 	if (len == 1)
@@ -19,28 +22,179 @@ uint32_t tcp_get_option_value(uint8_t *options, void *value, uint8_t len)
 	return 0;
 }
 
-void tcp_parse_syn_options(uint8_t *options, uint32_t len, uint32_t *rmms, uint8_t *window_scale)
+void tcp_parse_syn_options(uint8_t *options, uint32_t len, uint32_t *rmms, uint8_t *window_scale, bool *window_scale_ok, bool *sack_permitted)
 {
-	uint32_t opt_rmms;
-	uint8_t opt_window_scale;
+	*window_scale_ok = false;
+	*sack_permitted = false;
 
 	for (uint32_t i = 0; i < len;)
 	{
-		if (options[i] == 0 || options[i] == 1)
+		if (options[i] == TCPOPT_EOL)
+			break;
+		else if (options[i] == TCPOPT_NOP)
 		{
 			i += 1;
 			continue;
 		}
-		else if (options[i] == 2)
+
+		// malformed option, the rest cannot be trusted
+		if (i + 1 >= len || options[i + 1] < 2)
+			break;
+
+		if (options[i] == TCPOPT_MSS)
+		{
+			uint16_t opt_rmms;
 			tcp_get_option_value(&options[i + 2], &opt_rmms, 2);
-		else if (options[i] == 3)
-			tcp_get_option_value(&options[i + 2], &opt_window_scale, 1);
+			*rmms = ntohs(opt_rmms);
+		}
+		else if (options[i] == TCPOPT_WINDOW)
+		{
+			tcp_get_option_value(&options[i + 2], window_scale, 1);
+			*window_scale_ok = true;
+		}
+		else if (options[i] == TCPOPT_SACK_PERM)
+			*sack_permitted = true;
 
 		i += options[i + 1];
 	}
+}
+
+// mark outstanding segments which are covered by sack blocks (rfc2018)
+static void tcp_parse_sack_options(struct socket *sock, uint8_t *options, uint32_t len)
+{
+	for (uint32_t i = 0; i < len;)
+	{
+		if (options[i] == TCPOPT_EOL)
+			break;
+		else if (options[i] == TCPOPT_NOP)
+		{
+			i += 1;
+			continue;
+		}
+
+		if (i + 1 >= len || options[i + 1] < 2)
+			break;
+
+		if (options[i] == TCPOPT_SACK)
+		{
+			uint8_t nblocks = (options[i + 1] - 2) / sizeof(struct tcp_sack_block);
+			for (uint8_t j = 0; j < nblocks; ++j)
+			{
+				uint32_t start_seq, end_seq;
+				tcp_get_option_value(&options[i + 2 + j * sizeof(struct tcp_sack_block)], &start_seq, 4);
+				tcp_get_option_value(&options[i + 6 + j * sizeof(struct tcp_sack_block)], &end_seq, 4);
+				start_seq = ntohl(start_seq);
+				end_seq = ntohl(end_seq);
+
+				struct sk_buff *iter;
+				list_for_each_entry(iter, &sock->sk->tx_queue, sibling)
+				{
+					if (&iter->sibling == sock->sk->send_head)
+						break;
+
+					struct tcp_skb_cb *cb = TCP_SKB_CB(iter);
+					if (!before(cb->seq, start_seq) && !after(cb->end_seq + 1, end_seq))
+						cb->sacked = true;
+				}
+			}
+		}
+
+		i += options[i + 1];
+	}
+}
+
+// drop the first len bytes of payload, the segment then starts at seq + len
+static void tcp_trim_head(struct sk_buff *skb, uint16_t len)
+{
+	uint8_t *payload = tcp_payload(skb);
+	uint16_t payload_len = tcp_payload_lenth(skb);
+
+	memmove(payload, payload + len, payload_len - len);
+	skb->nh.iph->total_length = htons(ntohs(skb->nh.iph->total_length) - len);
+	skb->h.tcph->sequence_number = htonl(ntohl(skb->h.tcph->sequence_number) + len);
+}
+
+// drop the last len bytes of payload, fin is beyond the window as well
+static void tcp_trim_tail(struct sk_buff *skb, uint16_t len)
+{
+	skb->nh.iph->total_length = htons(ntohs(skb->nh.iph->total_length) - len);
+	skb->h.tcph->fin = 0;
+}
+
+// keep out-of-order segment in order of sequence number, segments which are entirely covered are dropped
+static void tcp_ofo_queue_add(struct socket *sock, struct sk_buff *skb)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	uint32_t seg_seq = tcp_skb_seq(skb);
+	uint32_t seg_end = tcp_skb_end_seq(skb);
+
+	struct sk_buff *iter, *next;
+	struct list_head *position = &tsk->ofo_queue;
+	list_for_each_entry(iter, &tsk->ofo_queue, sibling)
+	{
+		if (!after(tcp_skb_seq(iter), seg_seq) && !before(tcp_skb_end_seq(iter), seg_end))
+		{
+			skb_free(skb);
+			return;
+		}
+		if (after(tcp_skb_seq(iter), seg_seq))
+		{
+			position = &iter->sibling;
+			break;
+		}
+	}
+	list_add_tail(&skb->sibling, position);
+
+	iter = list_next_entry(skb, sibling);
+	list_for_each_entry_safe_from(iter, next, &tsk->ofo_queue, sibling)
+	{
+		if (after(tcp_skb_end_seq(iter), seg_end))
+			break;
 
-	*rmms = ntohs(opt_rmms);
-	*window_scale = opt_window_scale;
+		list_del(&iter->sibling);
+		skb_free(iter);
+	}
+
+	tsk->ofo_last_seq = seg_seq;
+}
+
+// move segments which are now in order into rx queue, return true if one of them carries fin
+static bool tcp_ofo_queue_drain(struct socket *sock)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	bool fin = false;
+
+	struct sk_buff *iter, *next;
+	list_for_each_entry_safe(iter, next, &tsk->ofo_queue, sibling)
+	{
+		uint32_t seq = tcp_skb_seq(iter);
+		if (after(seq, tsk->rcv_nxt))
+			break;
+
+		list_del(&iter->sibling);
+
+		uint32_t end_seq = tcp_skb_end_seq(iter);
+		if (after(end_seq, tsk->rcv_nxt))
+		{
+			if (before(seq, tsk->rcv_nxt))
+				tcp_trim_head(iter, tsk->rcv_nxt - seq);
+
+			tsk->rcv_nxt = end_seq;
+			fin = iter->h.tcph->fin;
+			list_add_tail(&iter->sibling, &sock->sk->rx_queue);
+		}
+		else
+		{
+			// payload is already received, only fin is new
+			fin = end_seq == tsk->rcv_nxt && iter->h.tcph->fin;
+			skb_free(iter);
+		}
+
+		if (fin)
+			break;
+	}
+
+	return fin;
 }
 
 void tcp_accept_ack(struct socket *sock, uint32_t ack_number, bool is_acked_all)
@@ -70,6 +224,7 @@ void tcp_accept_ack(struct socket *sock, uint32_t ack_number, bool is_acked_all)
 		{
 			assert(sock->sk->send_head != &iter->sibling);
 			list_del(&iter->sibling);
+			skb_free(iter);
 		}
 	}
 
@@ -90,6 +245,65 @@ void tcp_accept_ack(struct socket *sock, uint32_t ack_number, bool is_acked_all)
 	}
 }
 
+// retransmit the first outstanding segment which is not sacked by the receiver
+void tcp_retransmit_lost(struct socket *sock)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	struct sk_buff *iter, *lost = NULL;
+	list_for_each_entry(iter, &sock->sk->tx_queue, sibling)
+	{
+		if (&iter->sibling == sock->sk->send_head)
+			break;
+
+		if (!TCP_SKB_CB(iter)->sacked)
+		{
+			lost = iter;
+			break;
+		}
+	}
+	if (!lost)
+		return;
+
+	// according to Karn's algorthim, retransmitted segment is not included in RTT measurement
+	if (tsk->rtt_time && TCP_SKB_CB(lost)->end_seq == tsk->rtt_end_seq)
+		tsk->rtt_time = 0;
+
+	tcp_send_skb(sock, lost, true);
+}
+
+// fast retransmit and enter fast recovery (rfc5681 section 3.2, rfc6582 section 3.2)
+void tcp_enter_recovery(struct socket *sock)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+
+	tsk->ssthresh = tcp_ca_on_loss(tsk);
+	tsk->cwnd = tsk->ssthresh + 3 * tsk->snd_mss;
+	tsk->recover = tsk->snd_nxt - 1;
+	tsk->in_recovery = true;
+
+	tcp_retransmit_lost(sock);
+}
+
+// process new ack in fast recovery, return true if it is a partial ack
+bool tcp_recovery_ack(struct socket *sock, uint32_t seg_ack)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+
+	// full acknowledgment -> deflate the window
+	if (after(seg_ack, tsk->recover))
+	{
+		tsk->cwnd = min(tsk->ssthresh, max(tsk->snd_nxt - seg_ack, tsk->snd_mss) + tsk->snd_mss);
+		tsk->in_recovery = false;
+		tcp_ca_event(tsk, CA_EVENT_COMPLETE_CWR);
+		return false;
+	}
+
+	// partial acknowledgment -> deflate by the amount of acked data, add back one mss
+	uint32_t acked = seg_ack - tsk->snd_una;
+	tsk->cwnd = (tsk->cwnd > acked ? tsk->cwnd - acked : 0) + tsk->snd_mss;
+	return true;
+}
+
 bool tcp_is_fin_acked(struct socket *sock)
 {
 	struct sk_buff *iter;
@@ -125,6 +339,36 @@ void tcp_handler_close(struct socket *sock, struct sk_buff *skb)
 								  NULL, 0,
 								  NULL, 0);
 	tcp_send_skb(sock, sent_skb, false);
+	skb_free(sent_skb);
+}
+
+// initial window (rfc3390 section 1)
+static uint32_t tcp_initial_window(struct tcp_sock *tsk)
+{
+	return (tsk->snd_mss > 2190 ? 2 : (tsk->snd_mss > 1095 ? 3 : 4)) * tsk->snd_mss;
+}
+
+// receiver variables and options which are negotiated from peer's SYN (active or passive open)
+void tcp_init_from_syn(struct tcp_sock *tsk, struct sk_buff *skb)
+{
+	uint32_t option_len = tcp_option_length(skb);
+	if (option_len > 0)
+		tcp_parse_syn_options(skb->h.tcph->payload, option_len, &tsk->rcv_mss, &tsk->snd_wds, &tsk->wscale_ok, &tsk->sack_ok);
+
+	// window scaling is only used if both sides send the option (rfc7323 section 2.2)
+	if (!tsk->wscale_ok)
+	{
+		tsk->snd_wds = 0;
+		tsk->rcv_wds = 0;
+	}
+	else
+		tsk->snd_wds = min_t(uint8_t, tsk->snd_wds, TCP_MAX_WSCALE);
+
+	tsk->rcv_irs = ntohl(skb->h.tcph->sequence_number);
+	tsk->rcv_nxt = tsk->rcv_irs + 1;
+	tsk->copied_seq = tsk->rcv_nxt;
+	tsk->rcvq_seq = tsk->rcv_nxt;
+	tsk->rcvq_time = get_milliseconds(NULL);
 }
 
 void tcp_handler_sync(struct socket *sock, struct sk_buff *skb)
@@ -141,6 +385,7 @@ void tcp_handler_sync(struct socket *sock, struct sk_buff *skb)
 			{
 				struct sk_buff *skb = tcp_create_skb(sock, ack_number, 0, TCPCB_FLAG_RST, NULL, 0, NULL, 0);
 				tcp_send_skb(sock, skb, false);
+				skb_free(skb);
 
 				update_thread(sock->sk->owner_thread, THREAD_READY);
 			}
@@ -159,25 +404,22 @@ void tcp_handler_sync(struct socket *sock, struct sk_buff *skb)
 	}
 	if (skb->h.tcph->syn && acceptable_ack)
 	{
-		uint32_t option_len = tcp_option_length(skb);
-		if (option_len > 0)
-			tcp_parse_syn_options(skb->h.tcph->payload, option_len, &tsk->rcv_mss, &tsk->snd_wds);
-
-		tsk->rcv_irs = ntohl(skb->h.tcph->sequence_number);
-		tsk->rcv_nxt = tsk->rcv_irs + 1;
+		tcp_init_from_syn(tsk, skb);
 
 		tsk->snd_nxt = ack_number;
+		tsk->write_seq = ack_number;
 		// according to RFC1323, the window field in SYN (<SYN> or <SYN, ACK>) segment itself is never scaled
 		tsk->snd_wnd = ntohs(skb->h.tcph->window);
 		tcp_accept_ack(sock, ack_number, false);
 
 		if (tsk->snd_una > tsk->snd_iss)
 		{
-			tsk->cwnd = (tsk->snd_mss > 2190 ? 2 : (tsk->snd_mss > 1095 ? 3 : 4)) * tsk->snd_mss;
+			tsk->cwnd = tcp_initial_window(tsk);
 			tsk->ssthresh = ntohs(skb->h.tcph->window);
 
 			struct sk_buff *skb = tcp_create_skb(sock, tsk->snd_nxt, tsk->rcv_nxt, TCPCB_FLAG_ACK, NULL, 0, NULL, 0);
 			tcp_send_skb(sock, skb, false);
+			skb_free(skb);
 
 			update_thread(sock->sk->owner_thread, THREAD_READY);
 		}
@@ -185,6 +427,7 @@ void tcp_handler_sync(struct socket *sock, struct sk_buff *skb)
 		{
 			struct sk_buff *skb = tcp_create_skb(sock, tsk->snd_iss, tsk->rcv_nxt, TCPCB_FLAG_ACK | TCPCB_FLAG_SYN, NULL, 0, NULL, 0);
 			tcp_send_skb(sock, skb, false);
+			skb_free(skb);
 		}
 	}
 }
@@ -201,12 +444,25 @@ void tcp_handler_established(struct socket *sock, struct sk_buff *skb)
 	// step one
 	if (tsk->rcv_wnd)
 	{
+		uint32_t rcv_end = tsk->rcv_nxt + tsk->rcv_wnd;
 		if (payload_len > 0)
-			// TODO: MQ 2020-07-06 trimming of any portions that lie outside the window
-			acceptable_segment = (tsk->rcv_nxt <= seg_seq && seg_seq < tsk->rcv_nxt + tsk->rcv_wnd) ||
-								 (tsk->rcv_nxt <= seg_seq + payload_len && seg_seq + payload_len < tsk->rcv_nxt + tsk->rcv_wnd);
+			acceptable_segment = (!before(seg_seq, tsk->rcv_nxt) && before(seg_seq, rcv_end)) ||
+								 (!before(seg_seq + payload_len - 1, tsk->rcv_nxt) && before(seg_seq + payload_len - 1, rcv_end));
 		else
-			acceptable_segment = tsk->rcv_nxt <= seg_seq && seg_seq < tsk->rcv_nxt + tsk->rcv_wnd;
+			acceptable_segment = !before(seg_seq, tsk->rcv_nxt) && before(seg_seq, rcv_end);
+
+		// trimming of any portions that lie outside the window
+		if (acceptable_segment && payload_len > 0)
+		{
+			if (before(seg_seq, tsk->rcv_nxt))
+			{
+				tcp_trim_head(skb, tsk->rcv_nxt - seg_seq);
+				seg_seq = tsk->rcv_nxt;
+			}
+			if (after(tcp_skb_end_seq(skb), rcv_end))
+				tcp_trim_tail(skb, tcp_skb_end_seq(skb) - rcv_end);
+			payload_len = tcp_payload_lenth(skb);
+		}
 	}
 	else
 	{
@@ -222,6 +478,7 @@ void tcp_handler_established(struct socket *sock, struct sk_buff *skb)
 		{
 			struct sk_buff *snd_skb = tcp_create_skb(sock, tsk->snd_nxt, tsk->rcv_nxt, TCPCB_FLAG_ACK, NULL, 0, NULL, 0);
 			tcp_send_skb(sock, snd_skb, false);
+			skb_free(snd_skb);
 		}
 		update_thread(sock->sk->owner_thread, THREAD_READY);
 		return;
@@ -232,9 +489,7 @@ void tcp_handler_established(struct socket *sock, struct sk_buff *skb)
 	{
 		if (tsk->state == TCP_SYN_RECV)
 		{
-			// NOTE: MQ 2020-07-08
-			// According to RFC793, we have to handle passive and active OPEN
-			// -> to simplify we assume that all cases are active OPEN
+			// passive open -> listening socket drops the child when it is closed
 			tcp_accept_ack(sock, 0, true);
 			tcp_enter_close_state(sock);
 			update_thread(sock->sk->owner_thread, THREAD_READY);
@@ -265,6 +520,7 @@ void tcp_handler_established(struct socket *sock, struct sk_buff *skb)
 	{
 		struct sk_buff *snd_skb = tcp_create_skb(sock, seg_ack, tsk->rcv_nxt, TCPCB_FLAG_RST, NULL, 0, NULL, 0);
 		tcp_send_skb(sock, snd_skb, false);
+		skb_free(snd_skb);
 
 		tcp_flush_tx(sock);
 		tcp_flush_rx(sock);
@@ -279,23 +535,47 @@ void tcp_handler_established(struct socket *sock, struct sk_buff *skb)
 
 	if (tsk->state == TCP_SYN_RECV)
 	{
-		if (tsk->snd_una < seg_ack && seg_ack <= tsk->snd_nxt)
+		// our syn is acknowledged -> handshake of passive open is completed
+		if (after(seg_ack, tsk->snd_una) && !after(seg_ack, tsk->snd_nxt))
+		{
 			tsk->state = TCP_ESTABLISHED;
-		else if (!acceptable_segment)
+			tcp_accept_ack(sock, seg_ack, false);
+			// our syn-ack was retransmitted -> initial window is one segment (rfc5681 section 3.1)
+			tsk->cwnd = tsk->syn_retries ? tsk->snd_mss : tcp_initial_window(tsk);
+			tsk->ssthresh = seg_wnd;
+			tsk->snd_wnd = seg_wnd;
+			tsk->snd_wl1 = seg_seq;
+			tsk->snd_wl2 = seg_ack;
+		}
+		else
 		{
-			struct sk_buff *snd_skb = tcp_create_skb(sock, tsk->snd_nxt, tsk->rcv_nxt, TCPCB_FLAG_RST, NULL, 0, NULL, 0);
+			struct sk_buff *snd_skb = tcp_create_skb(sock, seg_ack, 0, TCPCB_FLAG_RST, NULL, 0, NULL, 0);
 			tcp_send_skb(sock, snd_skb, false);
+			skb_free(snd_skb);
+			return;
 		}
 	}
 	else if (tsk->state == TCP_ESTABLISHED || tsk->state == TCP_CLOSE_WAIT ||
 			 tsk->state == TCP_FIN_WAIT1 || tsk->state == TCP_FIN_WAIT2 ||
 			 tsk->state == TCP_CLOSING)
 	{
-		if (tsk->snd_una < seg_ack && seg_ack <= tsk->snd_nxt)
+		uint32_t option_len = tcp_option_length(skb);
+		if (tsk->sack_ok && option_len > 0)
+			tcp_parse_sack_options(sock, skb->h.tcph->payload, option_len);
+
+		if (after(seg_ack, tsk->snd_una) && !after(seg_ack, tsk->snd_nxt))
 		{
-			tcp_calculate_congestion(sock, seg_ack);
+			bool partial_ack = false;
+			if (tsk->in_recovery)
+				partial_ack = tcp_recovery_ack(sock, seg_ack);
+			else
+				tcp_calculate_congestion(sock, seg_ack);
 			tcp_accept_ack(sock, seg_ack, false);
 
+			// rfc6582, partial ack -> the first unacknowledged segment is lost as well
+			if (partial_ack)
+				tcp_retransmit_lost(sock);
+
 			if (tsk->snd_wl1 < seg_seq || (tsk->snd_wl1 == seg_seq && tsk->snd_wl2 <= seg_ack))
 			{
 				tsk->snd_wnd = seg_wnd;
@@ -314,42 +594,40 @@ void tcp_handler_established(struct socket *sock, struct sk_buff *skb)
 			// -> we receive window update after sending zero window probe segment
 			// -> tx queue length has to be 1
 			// ZeroWindowProbe segment is accepted and throwed away on the other side
-			// -> we flush tx queue and start from pending in sending without changing msg_sent_len
+			// -> rewind send head so the probe byte is sent again as normal data
 			if (tsk->snd_wnd == 0 && seg_wnd != 0)
-				tcp_flush_tx(sock);
+			{
+				del_timer(&tsk->persist_timer);
+				tsk->persist_backoff = 1000;
+				sock->sk->send_head = sock->sk->tx_queue.next != &sock->sk->tx_queue ? sock->sk->tx_queue.next : NULL;
+			}
 
 			tsk->snd_wnd = seg_wnd;
 		}
 		// fast retransmit and fast recovery
+		// duplicate ack is defined in rfc5681 section 2 (no data, no window change, outstanding data)
 		else if (tsk->flight_size > 0 &&
 				 !skb->h.tcph->syn && !skb->h.tcph->fin &&
 				 tsk->snd_una == seg_ack &&
-				 seg_wnd > 0)
+				 payload_len == 0 && seg_wnd == tsk->snd_wnd)
 		{
-			// should be combined with above, but I am skeptical
-			if (payload_len != 0 || tsk->snd_wnd != seg_wnd)
-				debug_println(DEBUG_WARNING, "fast retransmit: duplicated ack is in wrong state");
-
 			tsk->number_of_dup_acks++;
 
-			if (tsk->number_of_dup_acks == 3)
-			{
-				tsk->ssthresh = max(tsk->flight_size / 2, 2 * tsk->snd_mss);
-				tsk->cwnd = tsk->ssthresh + 3 * tsk->snd_mss;
-
-				struct sk_buff *skb = list_first_entry_or_null(&sock->sk->tx_queue, struct sk_buff, sibling);
-				assert(skb);
-				tcp_send_skb(sock, skb, true);
-			}
-			else if (tsk->number_of_dup_acks > 3)
+			// each additional duplicate ack means one more segment has left the network
+			if (tsk->in_recovery)
 				tsk->cwnd += tsk->snd_mss;
+			// avoid multiple fast retransmits caused by retransmissions of old segments (rfc6582 section 3.2)
+			else if (tsk->number_of_dup_acks == 3 && after(seg_ack, tsk->recover))
+				tcp_enter_recovery(sock);
 		}
-		else if (seg_ack > tsk->snd_nxt)
+		else if (after(seg_ack, tsk->snd_nxt))
 		{
-			struct sk_buff *snd_skb = tcp_create_skb(sock, tsk->snd_nxt, tsk->rcv_nxt, TCPCB_FLAG_ACK, NULL, 0, NULL, 0);
-			tcp_send_skb(sock, snd_skb, false);
+			tcp_send_ack(sock);
 			return;
 		}
+
+		// acks open the window -> clock out data which is waiting in send buffer
+		tcp_push(sock);
 	}
 	if (tsk->state == TCP_FIN_WAIT1)
 	{
@@ -374,27 +652,48 @@ void tcp_handler_established(struct socket *sock, struct sk_buff *skb)
 	{
 		struct sk_buff *snd_skb = tcp_create_skb(sock, tsk->snd_nxt, tsk->rcv_nxt, TCPCB_FLAG_ACK, NULL, 0, NULL, 0);
 		tcp_send_skb(sock, snd_skb, false);
+		skb_free(snd_skb);
 	}
 
 	// step seventh
 	bool is_sent_ack = false;
+	bool fin = skb->h.tcph->fin;
 	if (tsk->state == TCP_ESTABLISHED || tsk->state == TCP_FIN_WAIT1 || tsk->state == TCP_FIN_WAIT2)
 	{
-		if (payload_len > 0 || skb->h.tcph->push)
-			list_add_tail(&skb->sibling, &sock->sk->rx_queue);
+		// there is a hole before this segment -> keep it aside and send duplicate ack immediately
+		if ((payload_len > 0 || fin) && after(seg_seq, tsk->rcv_nxt))
+		{
+			tcp_ofo_queue_add(sock, skb);
+			tcp_send_ack(sock);
+			return;
+		}
 
 		if (payload_len > 0)
 		{
+			uint32_t prev_rcv_nxt = tsk->rcv_nxt;
+			list_add_tail(&skb->sibling, &sock->sk->rx_queue);
 			tsk->rcv_nxt += payload_len;
+			// the segment might fill the hole -> out-of-order segments are in order now
+			if (!list_empty(&tsk->ofo_queue))
+				fin = tcp_ofo_queue_drain(sock) || fin;
+
+			// received data moves the left edge of window, the right edge stays
+			uint32_t received = tsk->rcv_nxt - prev_rcv_nxt;
+			tsk->rcvbuf_len += received;
+			tsk->rcv_wnd -= min(received, tsk->rcv_wnd);
+			tcp_update_rcv_wnd(tsk);
+
 			// TODO: MQ 2020-07-06 congestion and timer
-			struct sk_buff *snd_skb = tcp_create_skb(sock, tsk->snd_nxt, tsk->rcv_nxt, TCPCB_FLAG_ACK, NULL, 0, NULL, 0);
-			tcp_send_skb(sock, snd_skb, false);
-			is_sent_ack = true;
+			if (!fin)
+			{
+				tcp_send_ack(sock);
+				is_sent_ack = true;
+			}
 		}
 	}
 
 	// step eighth
-	if (skb->h.tcph->fin)
+	if (fin)
 	{
 		if (tsk->state == TCP_CLOSE || tsk->state == TCP_LISTEN || tsk->state == TCP_SYN_SENT)
 			return;
@@ -426,17 +725,252 @@ void tcp_handler_established(struct socket *sock, struct sk_buff *skb)
 		if (!is_sent_ack)
 		{
 			tsk->rcv_nxt += 1;
+			// in CLOSE_WAIT, our fin is sent by tcp_shutdown after the rest of send buffer when the application closes
+			tcp_send_ack(sock);
+		}
+	}
 
-			uint8_t flags = 0;
-			// assume that we don't have to handle any incoming data (wait for app close)
-			// -> send fin back right away
-			if (tsk->state == TCP_CLOSE_WAIT)
-				flags = TCPCB_FLAG_FIN;
+	update_thread(sock->sk->owner_thread, THREAD_READY);
+}
 
-			struct sk_buff *snd_skb = tcp_create_skb(sock, tsk->snd_nxt, tsk->rcv_nxt, flags | TCPCB_FLAG_ACK, NULL, 0, NULL, 0);
-			tcp_send_skb(sock, snd_skb, false);
+static bool tcp_match_connection(struct tcp_sock *tsk, struct sk_buff *skb)
+{
+	return tsk->inet.ssin.sin_addr == ntohl(skb->nh.iph->dest_ip) && tsk->inet.ssin.sin_port == ntohs(skb->h.tcph->dest_port) &&
+		   tsk->inet.dsin.sin_addr == ntohl(skb->nh.iph->source_ip) && tsk->inet.dsin.sin_port == ntohs(skb->h.tcph->source_port);
+}
+
+// reply to a segment which doesn't belong to any connection (reset or syn-ack with cookie)
+static void tcp_send_stateless(struct socket *sock, struct sk_buff *skb,
+							   uint32_t seq, uint32_t ack, uint16_t flags,
+							   void *options, uint32_t option_len)
+{
+	struct tcp_sock tsk = {0};
+	struct socket req = {
+		.protocol = sock->protocol,
+		.type = sock->type,
+		.ops = sock->ops,
+		.sk = &tsk.inet.sk,
+	};
+	tsk.inet.sk.sock = &req;
+	// reply goes out of the device which the segment arrives on
+	tsk.inet.sk.dev = skb->dev;
+	tsk.inet.ssin.sin_addr = ntohl(skb->nh.iph->dest_ip);
+	tsk.inet.ssin.sin_port = ntohs(skb->h.tcph->dest_port);
+	tsk.inet.dsin.sin_addr = ntohl(skb->nh.iph->source_ip);
+	tsk.inet.dsin.sin_port = ntohs(skb->h.tcph->source_port);
+	tsk.rcv_wnd = tcp_sk(sock->sk)->rcv_wnd;
+
+	struct sk_buff *snd_skb = tcp_create_skb(&req, seq, ack, flags, options, option_len, NULL, 0);
+	neighbour_output(snd_skb, tsk.inet.dsin.sin_addr);
+	skb_free(snd_skb);
+}
+
+// child uses a temporary socket until it is accepted, sk is moved to the socket file in tcp_accept
+static struct tcp_sock *tcp_create_child(struct socket *sock, struct sk_buff *skb)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+
+	struct socket *child_sock = kcalloc(1, sizeof(struct socket));
+	child_sock->protocol = sock->protocol;
+	child_sock->type = sock->type;
+	child_sock->state = SS_CONNECTING;
+	child_sock->ops = sock->ops;
+
+	struct tcp_sock *child = kcalloc(1, sizeof(struct tcp_sock));
+	struct sock *sk = &child->inet.sk;
+	sk->sock = child_sock;
+	sk->dev = skb->dev;
+	sk->owner_thread = sock->sk->owner_thread;
+	INIT_LIST_HEAD(&sk->rx_queue);
+	INIT_LIST_HEAD(&sk->tx_queue);
+	INIT_LIST_HEAD(&sk->wq.list);
+	child_sock->sk = sk;
+
+	child->inet.ssin.sin_addr = ntohl(skb->nh.iph->dest_ip);
+	child->inet.ssin.sin_port = ntohs(skb->h.tcph->dest_port);
+	child->inet.dsin.sin_addr = ntohl(skb->nh.iph->source_ip);
+	child->inet.dsin.sin_port = ntohs(skb->h.tcph->source_port);
+
+	// options which are set on the listening socket are inherited
+	child->ca_ops = tsk->ca_ops;
+	child->nonagle = tsk->nonagle;
+	child->max_pacing_rate = tsk->max_pacing_rate;
+	tcp_create_tcb(child);
+	child->parent = tsk;
+	INIT_LIST_HEAD(&child->syn_queue);
+	INIT_LIST_HEAD(&child->accept_queue);
+
+	return child;
+}
+
+void tcp_destroy_child(struct tcp_sock *child)
+{
+	struct socket *child_sock = child->inet.sk.sock;
+
+	list_del(&child->child_sibling);
+	tcp_delete_tcb(child_sock);
+	tcp_flush_tx(child_sock);
+	tcp_flush_rx(child_sock);
+	tcp_flush_ofo(child_sock);
+	kfree(child_sock);
+	kfree(child);
+}
+
+static struct tcp_sock *tcp_lookup_child(struct list_head *queue, struct sk_buff *skb)
+{
+	struct tcp_sock *iter;
+	list_for_each_entry(iter, queue, child_sibling)
+	{
+		if (tcp_match_connection(iter, skb))
+			return iter;
+	}
+	return NULL;
+}
+
+// accepted connection has its own socket file which receives the segment
+static bool tcp_is_accepted(struct sk_buff *skb)
+{
+	struct socket *iter;
+	list_for_each_entry(iter, &lsocket, sibling)
+	{
+		if (iter->ops == &tcp_proto_ops && tcp_sk(iter->sk)->state != TCP_LISTEN && tcp_match_connection(tcp_sk(iter->sk), skb))
+			return true;
+	}
+	return false;
+}
+
+static void tcp_wake_listener(struct socket *sock)
+{
+	wake_up(&sock->sk->wq);
+	if (sock->sk->owner_thread->state == THREAD_WAITING)
+		update_thread(sock->sk->owner_thread, THREAD_READY);
+}
+
+// half-open connection finishes handshake -> move it from syn queue to accept queue
+static void tcp_child_update(struct socket *sock, struct tcp_sock *child)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+
+	if (child->state == TCP_CLOSE)
+	{
+		tsk->syn_queue_len--;
+		tcp_destroy_child(child);
+	}
+	else if (child->state != TCP_SYN_RECV)
+	{
+		list_del(&child->child_sibling);
+		tsk->syn_queue_len--;
+		list_add_tail(&child->child_sibling, &tsk->accept_queue);
+		tsk->accept_queue_len++;
+		tcp_wake_listener(sock);
+	}
+}
+
+// rfc793 section 3.9 (LISTEN STATE), rfc4987 section 3.6 (SYN cookies)
+int tcp_handler_listen(struct socket *sock, struct sk_buff *skb)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	uint32_t seg_seq = ntohl(skb->h.tcph->sequence_number);
+	uint32_t seg_ack = ntohl(skb->h.tcph->ack_number);
+
+	struct tcp_sock *child = tcp_lookup_child(&tsk->syn_queue, skb);
+	if (child)
+	{
+		tcp_handler_established(child->inet.sk.sock, skb);
+		tcp_child_update(sock, child);
+		return 0;
+	}
+
+	// established connection which is not accepted yet
+	child = tcp_lookup_child(&tsk->accept_queue, skb);
+	if (child)
+	{
+		tcp_handler_established(child->inet.sk.sock, skb);
+		tcp_wake_listener(sock);
+		return 0;
+	}
+
+	if (skb->h.tcph->rst || tcp_is_accepted(skb))
+		return -EINVAL;
+
+	uint16_t mss;
+	if (skb->h.tcph->ack)
+	{
+		if (!skb->h.tcph->syn && tsk->accept_queue_len < tsk->backlog && tcp_cookie_check(skb, seg_ack - 1, &mss))
+		{
+			// final ack of handshake which is answered with cookie -> connection is rebuilt without window scale and sack
+			child = tcp_create_child(sock, skb);
+			child->snd_mss = min_t(uint32_t, child->snd_mss, mss);
+			child->rcv_irs = seg_seq - 1;
+			child->rcv_nxt = seg_seq;
+			child->copied_seq = seg_seq;
+			child->rcvq_seq = seg_seq;
+			child->rcvq_time = get_milliseconds(NULL);
+			child->rcv_wds = 0;
+			child->snd_iss = seg_ack - 1;
+			child->snd_una = child->snd_iss;
+			child->snd_nxt = seg_ack;
+			child->write_seq = seg_ack;
+			child->recover = child->snd_iss;
+			child->state = TCP_SYN_RECV;
+
+			list_add_tail(&child->child_sibling, &tsk->syn_queue);
+			tsk->syn_queue_len++;
+			tcp_handler_established(child->inet.sk.sock, skb);
+			tcp_child_update(sock, child);
+			return 0;
 		}
+
+		tcp_send_stateless(sock, skb, seg_ack, 0, TCPCB_FLAG_RST, NULL, 0);
+		return -EINVAL;
 	}
 
-	update_thread(sock->sk->owner_thread, THREAD_READY);
+	if (!skb->h.tcph->syn || tsk->accept_queue_len >= tsk->backlog)
+		return -EINVAL;
+
+	// syn flood -> no state is kept, syn-ack carries a cookie as initial sequence number
+	if (tsk->syn_queue_len >= tsk->backlog)
+	{
+		uint32_t rcv_mss = tsk->snd_mss;
+		uint32_t option_len = tcp_option_length(skb);
+		uint8_t window_scale;
+		bool window_scale_ok, sack_ok;
+		if (option_len > 0)
+			tcp_parse_syn_options(skb->h.tcph->payload, option_len, &rcv_mss, &window_scale, &window_scale_ok, &sack_ok);
+
+		mss = min(rcv_mss, tsk->snd_mss);
+		uint32_t cookie = tcp_cookie_make(skb, &mss);
+
+		uint8_t options[4];
+		tcp_set_option_value(options, TCPOPT_MSS, 2, &(uint16_t[]){htons(mss)});
+		tcp_send_stateless(sock, skb, cookie, seg_seq + 1, TCPCB_FLAG_SYN | TCPCB_FLAG_ACK, options, sizeof(options));
+		return -EINVAL;
+	}
+
+	child = tcp_create_child(sock, skb);
+	tcp_init_from_syn(child, skb);
+
+	uint32_t iss = rand();
+	child->snd_iss = iss;
+	child->snd_una = iss;
+	child->snd_nxt = iss;
+	child->write_seq = iss + 1;
+	child->recover = iss;
+	// according to RFC1323, the window field in SYN segment itself is never scaled
+	child->snd_wnd = ntohs(skb->h.tcph->window);
+	child->state = TCP_SYN_RECV;
+
+	list_add_tail(&child->child_sibling, &tsk->syn_queue);
+	tsk->syn_queue_len++;
+
+	struct socket *child_sock = child->inet.sk.sock;
+	uint8_t *options;
+	uint32_t option_len;
+	tcp_build_syn_options(child_sock, &options, &option_len);
+	struct sk_buff *snd_skb = tcp_create_skb(child_sock, iss, child->rcv_nxt, TCPCB_FLAG_SYN | TCPCB_FLAG_ACK, options, option_len, NULL, 0);
+	kfree(options);
+
+	tcp_tx_queue_add_skb(child_sock, snd_skb);
+	tcp_push(child_sock);
+	return -EINVAL;
 }
@@ -1,3 +1,4 @@
+#include <net/checksum.h>
 #include <net/neighbour.h>
 #include <proc/task.h>
 #include <system/time.h>
@@ -8,19 +9,15 @@
 
 extern volatile struct thread *current_thread;
 
-struct sk_buff *tcp_create_skb(struct socket *sock,
-							   uint32_t sequence_number, uint32_t ack_number,
-							   uint16_t flags,
-							   void *options, uint16_t option_len,
-							   void *payload, uint16_t payload_len)
+void tcp_build_skb_headers(struct socket *sock, struct sk_buff *skb,
+						   uint32_t sequence_number, uint32_t ack_number,
+						   uint16_t flags,
+						   void *options, uint16_t option_len)
 {
 	struct tcp_sock *tsk = tcp_sk(sock->sk);
-	struct sk_buff *skb = skb_alloc(MAX_TCP_HEADER + option_len, payload_len);
+	uint16_t payload_len = skb->len;
 	skb->dev = tsk->inet.sk.dev;
 
-	skb_put(skb, payload_len);
-	memcpy(skb->data, payload, payload_len);
-
 	skb_push(skb, sizeof(struct tcp_packet) + option_len);
 	skb->h.tcph = (struct tcp_packet *)skb->data;
 	tcp_build_header(skb->h.tcph,
@@ -29,9 +26,12 @@ struct sk_buff *tcp_create_skb(struct socket *sock,
 					 sequence_number,
 					 ack_number,
 					 flags,
-					 tsk->rcv_wnd,
+					 tcp_select_window(tsk, flags),
 					 options, option_len,
 					 skb->len);
+	// payload is already summed while it is copied into skb
+	skb->h.tcph->checksum = skb_transport_checksum(skb, skb->h.tcph, skb->len, IP4_PROTOCAL_TCP,
+												   tsk->inet.ssin.sin_addr, tsk->inet.dsin.sin_addr);
 
 	skb_push(skb, sizeof(struct ip4_packet));
 	skb->nh.iph = (struct ip4_packet *)skb->data;
@@ -39,15 +39,30 @@ struct sk_buff *tcp_create_skb(struct socket *sock,
 
 	skb_push(skb, sizeof(struct ethernet_packet));
 	skb->mac.eh = (struct ethernet_packet *)skb->data;
-	uint8_t *dest_mac = lookup_mac_addr_for_ethernet(skb->dev, tsk->inet.dsin.sin_addr);
-	ethernet_build_header(skb->mac.eh, ETH_P_IP, skb->dev->dev_addr, dest_mac);
+	// destination mac is filled by neighbour when the segment is sent (it might change between retransmissions)
+	ethernet_build_header(skb->mac.eh, ETH_P_IP, skb->dev->dev_addr, skb->dev->zero_addr);
 
 	struct tcp_skb_cb *cb = (struct tcp_skb_cb *)skb->cb;
 	cb->seq = sequence_number;
 	// payload_len counts both lower and upper boundary
 	cb->end_seq = sequence_number + max(0, (int)payload_len - 1);
 	cb->flags = flags;
+}
+
+struct sk_buff *tcp_create_skb(struct socket *sock,
+							   uint32_t sequence_number, uint32_t ack_number,
+							   uint16_t flags,
+							   void *options, uint16_t option_len,
+							   void *payload, uint16_t payload_len)
+{
+	struct sk_buff *skb = skb_alloc(MAX_TCP_HEADER + option_len, payload_len);
+
+	skb_put(skb, payload_len);
+	skb->csum = csum_partial_copy(payload, skb->data, payload_len, 0);
+	skb->csum_start = skb->data - skb->head;
+	skb->ip_summed = CHECKSUM_COMPLETE;
 
+	tcp_build_skb_headers(sock, skb, sequence_number, ack_number, flags, options, option_len);
 	return skb;
 }
 
@@ -58,7 +73,9 @@ void tcp_send_skb(struct socket *sock, struct sk_buff *skb, bool is_retransmitte
 	uint16_t payload_len = tcp_payload_lenth(skb);
 	bool is_actived_send = !is_retransmitted && (payload_len > 0 || skb->h.tcph->syn || skb->h.tcph->fin);
 
-	tsk->flight_size += payload_len;
+	// retransmission (timeout or window probe again) is already in flight
+	if (!is_retransmitted)
+		tsk->flight_size += payload_len;
 	// we increase snd nxt only if data, syn, fin (ghost segment) and not retransmitted segment
 	if (is_actived_send)
 		tsk->snd_nxt = cb->end_seq + 1;
@@ -76,55 +93,297 @@ void tcp_send_skb(struct socket *sock, struct sk_buff *skb, bool is_retransmitte
 	if (!is_actived_timer(&tsk->retransmit_timer) && is_actived_send)
 		mod_timer(&tsk->retransmit_timer, cb->expires);
 
-	ethernet_sendmsg(skb);
+	neighbour_output(skb, tsk->inet.dsin.sin_addr);
 }
 
-void tcp_transmit(struct socket *sock)
+// sack blocks describe received out-of-order data, the first one contains the most recent segment (rfc2018 section 4)
+void tcp_build_sack_options(struct socket *sock, uint8_t *options, uint32_t *len)
 {
 	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	struct tcp_sack_block blocks[MAX_SACK_BLOCKS];
+	uint8_t nblocks = 0;
+	uint8_t first_block = 0;
 
-	while (!list_empty(&sock->sk->tx_queue))
+	struct sk_buff *iter;
+	list_for_each_entry(iter, &tsk->ofo_queue, sibling)
+	{
+		uint32_t seq = tcp_skb_seq(iter);
+		uint32_t end_seq = tcp_skb_end_seq(iter);
+
+		if (nblocks > 0 && !after(seq, blocks[nblocks - 1].end_seq))
+		{
+			if (after(end_seq, blocks[nblocks - 1].end_seq))
+				blocks[nblocks - 1].end_seq = end_seq;
+		}
+		else if (nblocks < MAX_SACK_BLOCKS)
+		{
+			blocks[nblocks].start_seq = seq;
+			blocks[nblocks].end_seq = end_seq;
+			nblocks++;
+		}
+		else
+			break;
+
+		if (!before(tsk->ofo_last_seq, blocks[nblocks - 1].start_seq) && before(tsk->ofo_last_seq, blocks[nblocks - 1].end_seq))
+			first_block = nblocks - 1;
+	}
+
+	uint8_t *iter_option = options;
+	*iter_option++ = TCPOPT_NOP;
+	*iter_option++ = TCPOPT_NOP;
+	*iter_option++ = TCPOPT_SACK;
+	*iter_option++ = 2 + nblocks * sizeof(struct tcp_sack_block);
+	for (uint8_t i = 0; i < nblocks; ++i)
+	{
+		struct tcp_sack_block *block = &blocks[i == 0 ? first_block : (i <= first_block ? i - 1 : i)];
+		uint32_t start_seq = htonl(block->start_seq);
+		uint32_t end_seq = htonl(block->end_seq);
+		memcpy(iter_option, &start_seq, sizeof(uint32_t));
+		memcpy(iter_option + 4, &end_seq, sizeof(uint32_t));
+		iter_option += sizeof(struct tcp_sack_block);
+	}
+
+	*len = iter_option - options;
+}
+
+void tcp_send_ack(struct socket *sock)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	uint8_t options[MAX_OPTION_LEN];
+	uint32_t option_len = 0;
+
+	if (tsk->sack_ok && !list_empty(&tsk->ofo_queue))
+		tcp_build_sack_options(sock, options, &option_len);
+
+	struct sk_buff *skb = tcp_create_skb(sock, tsk->snd_nxt, tsk->rcv_nxt, TCPCB_FLAG_ACK, options, option_len, NULL, 0);
+	tcp_send_skb(sock, skb, false);
+	skb_free(skb);
+}
+
+uint32_t tcp_sndbuf_append(struct socket *sock, void *msg, uint32_t len)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	uint32_t copied = 0;
+
+	lock_scheduler();
+	len = min(len, tcp_sndbuf_space(tsk));
+	while (copied < len)
+	{
+		struct sk_buff *chunk = list_last_entry_or_null(&tsk->write_queue, struct sk_buff, sibling);
+		if (!chunk || chunk->tail == chunk->end)
+		{
+			chunk = skb_alloc(0, TCP_SNDBUF_CHUNK);
+			// skb_alloc pads the end with one word, chunk has exactly TCP_SNDBUF_CHUNK bytes
+			chunk->end = chunk->tail + TCP_SNDBUF_CHUNK;
+			list_add_tail(&chunk->sibling, &tsk->write_queue);
+		}
+
+		uint32_t chunk_len = min_t(uint32_t, len - copied, chunk->end - chunk->tail);
+		memcpy(chunk->tail, (uint8_t *)msg + copied, chunk_len);
+		skb_put(chunk, chunk_len);
+		copied += chunk_len;
+	}
+	tsk->sndbuf_len += copied;
+	unlock_scheduler();
+
+	return copied;
+}
+
+// consume len bytes from the beginning of send buffer, returns the sum of copied bytes
+static uint32_t tcp_sndbuf_copy(struct socket *sock, uint8_t *dest, uint32_t len)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	uint32_t copied = 0;
+	uint32_t sum = 0;
+
+	struct sk_buff *chunk, *next;
+	list_for_each_entry_safe(chunk, next, &tsk->write_queue, sibling)
+	{
+		if (copied == len)
+			break;
+
+		uint32_t chunk_len = min(len - copied, chunk->len);
+		sum = csum_block_add(sum, csum_partial_copy(chunk->data, dest + copied, chunk_len, 0), copied);
+		skb_pull(chunk, chunk_len);
+		copied += chunk_len;
+
+		if (!chunk->len && chunk->tail == chunk->end)
+		{
+			list_del(&chunk->sibling);
+			skb_free(chunk);
+		}
+	}
+	tsk->sndbuf_len -= copied;
+	return sum;
+}
+
+void tcp_flush_sndbuf(struct socket *sock)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	struct sk_buff *iter, *next;
+	list_for_each_entry_safe(iter, next, &tsk->write_queue, sibling)
+	{
+		list_del(&iter->sibling);
+		skb_free(iter);
+	}
+	tsk->sndbuf_len = 0;
+}
+
+// pacing spreads segments of a window across rtt instead of sending them in one burst
+// return false and arm pacing timer if the next segment is not due yet
+bool tcp_pacing_check(struct tcp_sock *tsk)
+{
+	if (!tsk->max_pacing_rate)
+		return true;
+
+	uint64_t now = get_milliseconds(NULL) * 1000;
+	if (now >= tsk->pacing_next)
+		return true;
+
+	if (!is_actived_timer(&tsk->pacing_timer))
+		mod_timer(&tsk->pacing_timer, tsk->pacing_next / 1000 + 1);
+	return false;
+}
+
+static void tcp_pacing_update(struct tcp_sock *tsk, uint32_t len)
+{
+	uint32_t rate = tcp_pacing_rate(tsk);
+	if (!rate)
+		return;
+
+	// no credit is accumulated while being idle
+	uint64_t now = get_milliseconds(NULL) * 1000;
+	tsk->pacing_next = max(tsk->pacing_next, now) + (uint64_t)len * 1000000 / rate;
+}
+
+void tcp_transmit_head(struct socket *sock)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	struct sk_buff *skb = list_entry(sock->sk->send_head, struct sk_buff, sibling);
+	tcp_send_skb(sock, skb, false);
+
+	sock->sk->send_head = sock->sk->send_head->next;
+	if (sock->sk->send_head == &sock->sk->tx_queue)
+		sock->sk->send_head = NULL;
+
+	if (tsk->max_pacing_rate)
+		tcp_pacing_update(tsk, skb->len);
+
+	// according to rfc6298, kick off only one RTT measurement at the time
+	if (!tsk->rtt_time)
+	{
+		struct tcp_skb_cb *cb = TCP_SKB_CB(skb);
+		tsk->rtt_end_seq = cb->end_seq;
+		tsk->rtt_time = cb->when;
+	}
+}
+
+// Nagle's algorithm (rfc896, rfc1122 section 4.2.3.4), small segment is only sent if nothing is outstanding
+static bool tcp_nagle_check(struct tcp_sock *tsk, uint32_t seg_len)
+{
+	if (seg_len >= tsk->snd_mss)
+		return true;
+	if (tsk->nonagle & TCP_NAGLE_CORK)
+		return false;
+	return (tsk->nonagle & TCP_NAGLE_OFF) || tsk->snd_una == tsk->snd_nxt;
+}
+
+// segment data from send buffer and transmit as many segments as the window allows
+// scheduler is only locked while a single segment is built and sent
+// -> acks, which are processed in between, can clock out more segments
+void tcp_push(struct socket *sock)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+	bool consumed = false;
+
+	while (true)
 	{
-		// NOTE: MQ 2020-07-20
-		// we lock scheduler (interrupt) until sending all pending packets (on queue not yet sent)
-		// -> tx_queue now only contains outstanding packets
-		// measure sending with 65535 avaliable window takes ~ 2ms (which less than average RTT for each packet)
-		// the reason is prevent interrupting the sending flow which causes unexpected behaviors
-		// for example
-		// case 1
-		// - send -> tx_queue = 1 2 3 4 5 6 (interrupt at 6)
-		// - receive ack 7 -> tx => empty
-		// case 2
-		// - send -> tx_queue = 1 2 3 4 5 6 (interrupt at 5)
-		// - receive ack 5 -> tx = 5 6
-		// case 3
-		// - send all segments but get interrutped when just out of loop and haven't updated/scheduled yet
-		// - receive ack for all segments -> back to interrupted point above
-		// -> schedule again which don't have anything to wait -> thread is waiting forever
 		lock_scheduler();
-		while (tcp_sender_available_window(tsk) > 0 && sock->sk->send_head)
+
+		// segments which are already built (after retransmission timeout, held back by pacing, or syn/fin) go first
+		if (sock->sk->send_head)
 		{
-			struct sk_buff *skb = list_entry(sock->sk->send_head, struct sk_buff, sibling);
-			tcp_send_skb(sock, skb, false);
-
-			sock->sk->send_head = sock->sk->send_head->next;
-			if (sock->sk->send_head == &sock->sk->tx_queue)
-				sock->sk->send_head = NULL;
-
-			// according to rfc6298, kick off only one RTT measurement at the time
-			// the segment has to be at the beginning of tx_queue
-			if (!tsk->rtt_time)
-			{
-				assert(&skb->sibling == sock->sk->tx_queue.next);
-				struct tcp_skb_cb *cb = TCP_SKB_CB(skb);
-				tsk->rtt_end_seq = cb->end_seq;
-				tsk->rtt_time = cb->when;
-			}
+			if (!tcp_sender_available_window(tsk) || !tcp_pacing_check(tsk))
+				break;
+
+			tcp_transmit_head(sock);
+			unlock_scheduler();
+			continue;
 		}
+
+		if (!tsk->sndbuf_len || (tsk->state != TCP_ESTABLISHED && tsk->state != TCP_CLOSE_WAIT))
+			break;
+
+		uint32_t seg_len = min(tsk->snd_mss, tsk->sndbuf_len);
+		uint32_t window = tcp_sender_available_window(tsk);
+		bool probe = false;
+
+		// zero window -> send one byte to probe it, repeat with persist timer until window is opened
+		if (!tsk->snd_wnd && tsk->snd_una == tsk->snd_nxt)
+		{
+			seg_len = 1;
+			probe = true;
+			mod_timer(&tsk->persist_timer, get_milliseconds(NULL) + tsk->persist_backoff);
+		}
+		// sender silly window avoidance, wait for ack to open the window
+		// unless nothing is outstanding which means no ack is coming
+		else if (window < seg_len)
+		{
+			if (!window || tsk->snd_una != tsk->snd_nxt)
+				break;
+			seg_len = window;
+		}
+		else if (!tcp_nagle_check(tsk, seg_len))
+			break;
+
+		// nothing is in flight -> congestion control might restart from idle
+		if (tsk->snd_una == tsk->snd_nxt)
+			tcp_ca_event(tsk, CA_EVENT_TX_START);
+
+		struct sk_buff *skb = skb_alloc(MAX_TCP_HEADER, seg_len);
+		skb_put(skb, seg_len);
+		skb->csum = tcp_sndbuf_copy(sock, skb->data, seg_len);
+		skb->csum_start = skb->data - skb->head;
+		skb->ip_summed = CHECKSUM_COMPLETE;
+
+		uint16_t flags = tsk->sndbuf_len ? 0 : TCPCB_FLAG_PSH;
+		tcp_build_skb_headers(sock, skb, tsk->write_seq, tsk->rcv_nxt, TCPCB_FLAG_ACK | flags, NULL, 0);
+		tsk->write_seq += seg_len;
+		consumed = true;
+
+		// the segment is sent by the branch above (or pacing timer when it is not due yet)
+		// except window probe which is sent regardless of the window
+		tcp_tx_queue_add_skb(sock, skb);
+		if (probe)
+			tcp_transmit_head(sock);
+		unlock_scheduler();
+	}
+	unlock_scheduler();
+
+	// segments are cut from send buffer -> wake up the sender which waits for space
+	if (consumed && tcp_sndbuf_space(tsk) && sock->sk->owner_thread->state == THREAD_WAITING)
+		update_thread(sock->sk->owner_thread, THREAD_READY);
+}
+
+// transmit and wait until all segments in tx queue are acknowledged (used for syn and fin)
+void tcp_transmit(struct socket *sock)
+{
+	struct tcp_sock *tsk = tcp_sk(sock->sk);
+
+	tcp_push(sock);
+
+	// NOTE: MQ 2020-07-20
+	// scheduler is locked between checking tx_queue and sleeping
+	// otherwise the ack can arrive in the middle and the thread is waiting forever
+	lock_scheduler();
+	while (!list_empty(&sock->sk->tx_queue) && tsk->state != TCP_CLOSE)
+	{
 		update_thread(current_thread, THREAD_WAITING);
 		unlock_scheduler();
 		schedule();
+		lock_scheduler();
 	}
+	unlock_scheduler();
 };
 
 void tcp_tx_queue_add_skb(struct socket *sock, struct sk_buff *skb)
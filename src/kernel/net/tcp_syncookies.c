@@ -0,0 +1,100 @@
+#include <cpu/hal.h>
+#include <system/time.h>
+#include <utils/math.h>
+
+#include "tcp.h"
+
+// NOTE: SYN cookie is used as initial sequence number of SYN-ACK when syn queue is full
+// -> no state is kept for the half-open connection, it is rebuilt from the final ack
+// | counter (5 bits) | mss index (2 bits) | hash (25 bits) |
+// window scale and sack cannot be encoded without timestamps -> connections via cookie use neither
+#define COOKIE_PERIOD 64000
+#define COOKIE_COUNTER_SHIFT 27
+#define COOKIE_MSS_SHIFT 25
+#define COOKIE_HASH_MASK ((1 << COOKIE_MSS_SHIFT) - 1)
+#define COOKIE_MAX_AGE 2
+
+static const uint16_t tcp_cookie_mss[] = {536, 1300, 1440, 1460};
+static uint32_t tcp_cookie_secret;
+
+// rand() is seeded by boot time which is easy to guess -> secret is mixed with rdrand and tsc at the first syn cookie
+// NOTE: without rdrand, tsc is the only part which is hard to predict (cpu speed and time since boot)
+static uint32_t tcp_cookie_make_secret()
+{
+	uint64_t tsc = rdtsc();
+	uint32_t secret = rand() ^ (uint32_t)tsc ^ (uint32_t)(tsc >> 32);
+
+	uint32_t hw;
+	if (rdrand(&hw))
+		secret ^= hw;
+	return secret | 1;
+}
+
+// jenkins one-at-a-time hash over the connection tuple, peer's isn and counter
+static uint32_t tcp_cookie_hash(struct sk_buff *skb, uint32_t isn, uint32_t counter)
+{
+	if (!tcp_cookie_secret)
+		tcp_cookie_secret = tcp_cookie_make_secret();
+
+	uint32_t words[] = {
+		skb->nh.iph->source_ip,
+		skb->nh.iph->dest_ip,
+		(skb->h.tcph->source_port << 16) | skb->h.tcph->dest_port,
+		isn,
+		counter,
+		tcp_cookie_secret,
+	};
+
+	uint32_t hash = 0;
+	uint8_t *bytes = (uint8_t *)words;
+	for (uint32_t i = 0; i < sizeof(words); ++i)
+	{
+		hash += bytes[i];
+		hash += hash << 10;
+		hash ^= hash >> 6;
+	}
+	hash += hash << 3;
+	hash ^= hash >> 11;
+	hash += hash << 15;
+	return hash;
+}
+
+static uint32_t tcp_cookie_counter()
+{
+	return (get_milliseconds(NULL) / COOKIE_PERIOD) & ((1 << (32 - COOKIE_COUNTER_SHIFT)) - 1);
+}
+
+// skb is the incoming SYN, mss is rounded down to the closest value which can be encoded
+uint32_t tcp_cookie_make(struct sk_buff *skb, uint16_t *mss)
+{
+	uint32_t isn = ntohl(skb->h.tcph->sequence_number);
+	uint32_t counter = tcp_cookie_counter();
+
+	uint32_t mss_index = 0;
+	for (uint32_t i = 0; i < sizeof(tcp_cookie_mss) / sizeof(tcp_cookie_mss[0]); ++i)
+	{
+		if (tcp_cookie_mss[i] <= *mss)
+			mss_index = i;
+	}
+	*mss = tcp_cookie_mss[mss_index];
+
+	return (counter << COOKIE_COUNTER_SHIFT) |
+		   (mss_index << COOKIE_MSS_SHIFT) |
+		   (tcp_cookie_hash(skb, isn, counter) & COOKIE_HASH_MASK);
+}
+
+// skb is the final ack of handshake, cookie is its ack number - 1
+bool tcp_cookie_check(struct sk_buff *skb, uint32_t cookie, uint16_t *mss)
+{
+	uint32_t isn = ntohl(skb->h.tcph->sequence_number) - 1;
+	uint32_t counter = cookie >> COOKIE_COUNTER_SHIFT;
+	uint32_t age = (tcp_cookie_counter() - counter) & ((1 << (32 - COOKIE_COUNTER_SHIFT)) - 1);
+	if (age > COOKIE_MAX_AGE)
+		return false;
+
+	if ((tcp_cookie_hash(skb, isn, counter) & COOKIE_HASH_MASK) != (cookie & COOKIE_HASH_MASK))
+		return false;
+
+	*mss = tcp_cookie_mss[(cookie >> COOKIE_MSS_SHIFT) & 0x3];
+	return true;
+}
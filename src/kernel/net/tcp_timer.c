@@ -4,11 +4,27 @@
 
 #include "tcp.h"
 
+extern struct list_head lsocket;
+
+// a half-open child ran out of syn-ack retries, it is destroyed by net thread
+static bool tcp_child_expired;
+
 void tcp_retransmit_timer(struct timer_list *timer)
 {
 	struct tcp_sock *tsk = from_timer(tsk, timer, retransmit_timer);
 	struct socket *sock = tsk->inet.sk.sock;
 
+	// half-open child whose syn-ack is never acknowledged gives its syn_queue slot back
+	// runs in interrupt context where the child cannot be freed -> it is only marked for net thread
+	if (tsk->state == TCP_SYN_RECV && tsk->parent && tsk->syn_retries >= TCP_SYNACK_RETRIES)
+	{
+		del_timer(timer);
+		tsk->expired = true;
+		tcp_child_expired = true;
+		net_wakeup();
+		return;
+	}
+
 	tsk->rto *= 2;
 	mod_timer(timer, get_milliseconds(NULL) + tsk->rto);
 
@@ -21,14 +37,24 @@ void tcp_retransmit_timer(struct timer_list *timer)
 	// -> `send_head` cannot be at the beginning of tx queue (otherwise that segment isn't sent yet)
 	if (sock->sk->send_head != &skb->sibling)
 	{
-		tsk->ssthresh = max(tsk->flight_size / 2, 2 * tsk->snd_mss);
+		tsk->ssthresh = tcp_ca_on_loss(tsk);
 		// begin slow start again
 		tsk->cwnd = tsk->snd_mss;
+		tcp_ca_event(tsk, CA_EVENT_LOSS);
 	}
 
 	// move send head back to begining of tx queue
 	sock->sk->send_head = &skb->sibling;
 
+	// leave fast recovery, the receiver might renege sacked segments (rfc2018 section 8)
+	tsk->in_recovery = false;
+	tsk->recover = tsk->snd_nxt - 1;
+	struct sk_buff *iter;
+	list_for_each_entry(iter, &sock->sk->tx_queue, sibling)
+	{
+		TCP_SKB_CB(iter)->sacked = false;
+	}
+
 	// count retried syn to re-initialize rto=3
 	if (skb->h.tcph->syn)
 		tsk->syn_retries++;
@@ -49,6 +75,32 @@ void tcp_retransmit_timer(struct timer_list *timer)
 	}
 }
 
+// called by net thread which holds the scheduler lock
+void tcp_reap_children()
+{
+	if (!tcp_child_expired)
+		return;
+	tcp_child_expired = false;
+
+	struct socket *sock;
+	list_for_each_entry(sock, &lsocket, sibling)
+	{
+		if (sock->ops != &tcp_proto_ops || tcp_sk(sock->sk)->state != TCP_LISTEN)
+			continue;
+
+		struct tcp_sock *tsk = tcp_sk(sock->sk);
+		struct tcp_sock *child, *next;
+		list_for_each_entry_safe(child, next, &tsk->syn_queue, child_sibling)
+		{
+			if (!child->expired)
+				continue;
+
+			tsk->syn_queue_len--;
+			tcp_destroy_child(child);
+		}
+	}
+}
+
 void tcp_persist_timer(struct timer_list *timer)
 {
 	struct tcp_sock *tsk = from_timer(tsk, timer, persist_timer);
@@ -82,3 +134,31 @@ void tcp_msl_timer(struct timer_list *timer)
 
 	update_thread(sock->sk->owner_thread, THREAD_READY);
 }
+
+// sockets whose pacing timer expired
+static LIST_HEAD(tcp_pacing_list);
+
+// runs in interrupt context where segments cannot be sent (neighbour might allocate) -> socket is only queued
+void tcp_pacing_timer(struct timer_list *timer)
+{
+	struct tcp_sock *tsk = from_timer(tsk, timer, pacing_timer);
+
+	del_timer(timer);
+	if (list_empty(&tsk->pacing_sibling))
+		list_add_tail(&tsk->pacing_sibling, &tcp_pacing_list);
+	net_wakeup();
+}
+
+// transmit segments which are held back by pacing, segments are already built in tcp_push
+// called by net thread which holds the scheduler lock
+void tcp_pacing_flush()
+{
+	struct tcp_sock *tsk, *next;
+	list_for_each_entry_safe(tsk, next, &tcp_pacing_list, pacing_sibling)
+	{
+		struct socket *sock = tsk->inet.sk.sock;
+		list_del_init(&tsk->pacing_sibling);
+		while (sock->sk->send_head && tcp_sender_available_window(tsk) && tcp_pacing_check(tsk))
+			tcp_transmit_head(sock);
+	}
+}
@@ -1,7 +1,10 @@
 #include "udp.h"
 
+#include <fs/poll.h>
 #include <include/errno.h>
+#include <include/fcntl.h>
 #include <memory/vmm.h>
+#include <net/checksum.h>
 #include <net/ethernet.h>
 #include <net/ip.h>
 #include <net/net.h>
@@ -30,11 +33,17 @@ int udp_validate_header(struct udp_packet *udp, uint32_t source_ip, uint32_t des
 	return packet_checksum != received_checksum ? -EPROTO : 0;
 }
 
-void udp_build_header(struct udp_packet *udp, uint16_t packet_len, uint32_t source_ip, uint16_t source_port, uint32_t dest_ip, uint16_t dest_port)
+static void udp_fill_header(struct udp_packet *udp, uint16_t packet_len, uint16_t source_port, uint16_t dest_port)
 {
 	udp->source_port = htons(source_port);
 	udp->dest_port = htons(dest_port);
 	udp->length = htons(packet_len);
+	udp->checksum = 0;
+}
+
+void udp_build_header(struct udp_packet *udp, uint16_t packet_len, uint32_t source_ip, uint16_t source_port, uint32_t dest_ip, uint16_t dest_port)
+{
+	udp_fill_header(udp, packet_len, source_port, dest_port);
 	udp->checksum = udp_calculate_checksum(udp, packet_len, source_ip, dest_ip);
 }
 
@@ -45,12 +54,15 @@ int udp_bind(struct socket *sock, struct sockaddr *myaddr, int sockaddr_len)
 	return 0;
 }
 
-// NOTE: MQ 2020-05-21 We don't need to perform routing, only supporting one router
 int udp_connect(struct socket *sock, struct sockaddr *vaddr, int sockaddr_len)
 {
 	struct inet_sock *isk = inet_sk(sock->sk);
 	memcpy(&isk->dsin, vaddr, sockaddr_len);
 
+	int ret = inet_autobind(sock->sk, isk->dsin.sin_addr);
+	if (ret < 0)
+		return ret;
+
 	sock->state = SS_CONNECTED;
 	return 0;
 }
@@ -65,51 +77,98 @@ int udp_sendmsg(struct socket *sock, void *msg, size_t msg_len)
 	skb->sk = sock->sk;
 	skb->dev = isk->sk.dev;
 
-	// increase tail -> copy msg into data-tail space
+	// increase tail -> copy msg into data-tail space (and sum it in the same pass)
 	skb_put(skb, msg_len);
-	memcpy(skb->data, msg, msg_len);
+	skb->csum = csum_and_copy_from_user(msg, skb->data, msg_len, 0);
+	skb->csum_start = skb->data - skb->head;
+	skb->ip_summed = CHECKSUM_COMPLETE;
 
 	// decrease data -> copy udp header into new expanding newdata-olddata
 	skb_push(skb, sizeof(struct udp_packet));
 	skb->h.udph = (struct udp_packet *)skb->data;
-	udp_build_header(skb->h.udph, skb->len, isk->ssin.sin_addr, isk->ssin.sin_port, isk->dsin.sin_addr, isk->dsin.sin_port);
+	udp_fill_header(skb->h.udph, skb->len, isk->ssin.sin_port, isk->dsin.sin_port);
+	uint16_t checksum = skb_transport_checksum(skb, skb->h.udph, skb->len, IP4_PROTOCAL_UDP, isk->ssin.sin_addr, isk->dsin.sin_addr);
+	// zero means that checksum is not used (rfc768)
+	skb->h.udph->checksum = checksum ? checksum : 0xffff;
 
 	// decrease data -> copy ip4 header into new expending newdata-olddata
 	skb_push(skb, sizeof(struct ip4_packet));
 	skb->nh.iph = (struct ip4_packet *)skb->data;
 	ip4_build_header(skb->nh.iph, skb->len, IP4_PROTOCAL_UDP, isk->ssin.sin_addr, isk->dsin.sin_addr, rand());
 
-	ip4_sendmsg(sock, skb);
-	return 0;
+	// frame is copied by the device or queued as a clone until the neighbour is resolved
+	int ret = ip4_sendmsg(sock, skb);
+	skb_free(skb);
+	return ret < 0 ? ret : (int)msg_len;
+}
+
+// rest of datagram which doesn't fit into the buffer is discarded
+static uint32_t udp_copy_payload(struct sk_buff *skb, void *msg, size_t msg_len)
+{
+	uint32_t payload_len = min(msg_len, htons(skb->h.udph->length) - sizeof(struct udp_packet));
+	memcpy(msg, (uint8_t *)skb->h.udph + sizeof(struct udp_packet), payload_len);
+	return payload_len;
 }
 
-int udp_recvmsg(struct socket *sock, void *msg, size_t msg_len)
+int udp_recvmsg(struct socket *sock, void *msg, size_t msg_len, int flags)
 {
 	if (sock->state == SS_DISCONNECTED)
 		return -ESHUTDOWN;
 
 	struct sock *sk = sock->sk;
+	bool nonblock = (flags & MSG_DONTWAIT) || (sock->file && (sock->file->f_flags & O_NONBLOCK));
+	bool peek = flags & MSG_PEEK;
 	struct sk_buff *skb = NULL;
 
-	while (!skb)
+	lock_scheduler();
+	// receiver might not be the owner (forked process) -> wait via queue which udp_handler wakes up
+	DEFINE_WAIT(wait);
+	list_add_tail(&wait.sibling, &sk->wq.list);
+	while (!(skb = list_first_entry_or_null(&sk->rx_queue, struct sk_buff, sibling)))
 	{
-		skb = list_first_entry_or_null(&sk->rx_queue, struct sk_buff, sibling);
-		if (!skb)
+		if (nonblock)
 		{
-			update_thread(sk->owner_thread, THREAD_WAITING);
-			schedule();
+			list_del(&wait.sibling);
+			unlock_scheduler();
+			return -EAGAIN;
 		}
-	}
 
+		update_thread(current_thread, THREAD_WAITING);
+		unlock_scheduler();
+		schedule();
+		lock_scheduler();
+	}
+	list_del(&wait.sibling);
+	// peeked datagram stays in the queue where another receiver might take and free it -> it is copied under the lock
+	if (peek)
+	{
+		uint32_t payload_len = udp_copy_payload(skb, msg, msg_len);
+		unlock_scheduler();
+		return payload_len;
+	}
 	list_del(&skb->sibling);
+	unlock_scheduler();
 
-	uint32_t payload_len = min(msg_len, htons(skb->h.udph->length) - sizeof(struct udp_packet));
-	memcpy(msg, (uint8_t *)skb->h.udph + sizeof(struct udp_packet), payload_len);
-
+	uint32_t payload_len = udp_copy_payload(skb, msg, msg_len);
 	skb_free(skb);
 	return payload_len;
 }
 
+unsigned int udp_poll(struct socket *sock, struct vfs_file *file, struct poll_table *pt)
+{
+	poll_wait(file, &sock->sk->wq, pt);
+
+	unsigned int mask = 0;
+	if (!list_empty(&sock->sk->rx_queue))
+		mask |= POLLIN;
+	// datagrams are sent right away, there is no send buffer to fill up
+	if (sock->state == SS_CONNECTED)
+		mask |= POLLOUT;
+	if (sock->state == SS_DISCONNECTED)
+		mask |= POLLHUP;
+	return mask;
+}
+
 int udp_handler(struct socket *sock, struct sk_buff *skb)
 {
 	if (sock->state == SS_DISCONNECTED)
@@ -128,9 +187,9 @@ int udp_handler(struct socket *sock, struct sk_buff *skb)
 		return -EPROTO;
 
 	struct udp_packet *udp = (struct udp_packet *)skb->data;
-	ret = udp_validate_header(udp, ntohl(skb->nh.iph->source_ip), ntohl(skb->nh.iph->dest_ip));
-	if (ret < 0)
-		return ret;
+	if (udp->checksum && skb_transport_checksum(skb, udp, ntohs(udp->length), IP4_PROTOCAL_UDP,
+												ntohl(skb->nh.iph->source_ip), ntohl(skb->nh.iph->dest_ip)))
+		return -EPROTO;
 
 	if (htonl(skb->nh.iph->dest_ip) == isk->ssin.sin_addr && htons(udp->dest_port) == isk->ssin.sin_port &&
 		htonl(skb->nh.iph->source_ip) == isk->dsin.sin_addr && htons(udp->source_port) == isk->dsin.sin_port)
@@ -138,9 +197,13 @@ int udp_handler(struct socket *sock, struct sk_buff *skb)
 		skb->h.udph = udp;
 
 		list_add_tail(&skb->sibling, &sock->sk->rx_queue);
-		update_thread(sock->sk->owner_thread, THREAD_READY);
+		wake_up(&sock->sk->wq);
+		if (sock->sk->owner_thread->state == THREAD_WAITING)
+			update_thread(sock->sk->owner_thread, THREAD_READY);
+		return 0;
 	}
-	return 0;
+	// datagram belongs to another socket -> clone is freed by caller
+	return -EINVAL;
 }
 
 struct proto_ops udp_proto_ops = {
@@ -151,6 +214,7 @@ struct proto_ops udp_proto_ops = {
 	.connect = udp_connect,
 	.sendmsg = udp_sendmsg,
 	.recvmsg = udp_recvmsg,
+	.poll = udp_poll,
 	.shutdown = socket_shutdown,
 	.handler = udp_handler,
 };
@@ -1,3 +1,4 @@
+#include <cpu/fpu.h>
 #include <cpu/hal.h>
 #include <cpu/idt.h>
 #include <cpu/pic.h>
@@ -150,6 +151,8 @@ static void switch_thread(struct thread *nt)
 
 	uint32_t paddr_cr3 = vmm_get_physical_address((uint32_t)current_thread->parent->pdir, true);
 	tss_set_stack(0x10, current_thread->kernel_stack);
+	fpu_save(pt);
+	fpu_restore(current_thread);
 	do_switch(&pt->esp, current_thread->esp, paddr_cr3);
 }
 
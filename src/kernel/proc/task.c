@@ -1,5 +1,6 @@
 #include "task.h"
 
+#include <cpu/fpu.h>
 #include <cpu/hal.h>
 #include <cpu/idt.h>
 #include <cpu/pic.h>
@@ -106,6 +107,7 @@ struct thread *create_thread(struct process *parent, uint32_t eip, enum thread_s
 	th->esp = th->kernel_stack - sizeof(struct trap_frame);
 	plist_node_init(&th->sched_sibling, priority);
 	th->sleep_timer = (struct timer_list)TIMER_INITIALIZER(thread_sleep_timer, UINT32_MAX);
+	fpu_init_state(th);
 
 	struct trap_frame *frame = (struct trap_frame *)th->esp;
 	memset(frame, 0, sizeof(struct trap_frame));
@@ -248,6 +250,7 @@ struct thread *create_user_thread(struct process *parent, const char *path, enum
 	th->esp = th->kernel_stack - sizeof(struct trap_frame);
 	plist_node_init(&th->sched_sibling, priority);
 	th->sleep_timer = (struct timer_list)TIMER_INITIALIZER(thread_sleep_timer, UINT32_MAX);
+	fpu_init_state(th);
 
 	struct trap_frame *frame = (struct trap_frame *)th->esp;
 	memset(frame, 0, sizeof(struct trap_frame));
@@ -338,6 +341,7 @@ struct process *process_fork(struct process *parent)
 
 	memcpy(&th->uregs, &parent_thread->uregs, sizeof(struct interrupt_registers));
 	th->uregs.eax = 0;
+	fpu_copy_state(th, parent_thread);
 
 	struct trap_frame *frame = (struct trap_frame *)th->esp;
 	frame->parameter1 = (uint32_t)th;
@@ -1,6 +1,7 @@
 #ifndef PROC_TASK_H
 #define PROC_TASK_H
 
+#include <cpu/fpu.h>
 #include <cpu/idt.h>
 #include <include/list.h>
 #include <ipc/signal.h>
@@ -32,6 +33,7 @@
 #define SIGNAL_TERMINATED 0x04
 #define EXIT_TERMINATED 0x08
 
+struct blk_plug;
 struct vfs_file;
 struct vfs_dentry;
 struct vfs_mount;
@@ -110,6 +112,8 @@ struct thread
 	uint32_t kernel_stack;
 	uint32_t user_stack;
 	struct interrupt_registers uregs;
+	// x87/mmx/sse registers, aligned up to FPU_STATE_ALIGN inside
+	uint8_t fpu_state[FPU_STATE_SIZE + FPU_STATE_ALIGN];
 
 	sigset_t pending;
 	sigset_t blocked;
@@ -119,6 +123,9 @@ struct thread
 
 	struct plist_node sched_sibling;
 	struct timer_list sleep_timer;
+
+	// bios are held back until the plug is finished
+	struct blk_plug *plug;
 };
 
 struct process
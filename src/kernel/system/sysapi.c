@@ -10,6 +10,7 @@
 #include <include/limits.h>
 #include <ipc/message_queue.h>
 #include <ipc/signal.h>
+#include <net/dns.h>
 #include <net/net.h>
 #include <proc/elf.h>
 #include <proc/task.h>
@@ -106,7 +107,7 @@ static int32_t sys_gettimeofday(struct timeval *restrict tp, void *restrict tzp)
 {
 	uint64_t ms = get_milliseconds_since_epoch();
 	tp->tv_sec = ms / 1000;
-	tp->tv_usec = ms * 1000;
+	tp->tv_usec = (ms % 1000) * 1000;
 
 	return 0;
 }
@@ -148,6 +149,21 @@ static int32_t sys_ftruncate(uint32_t fd, int32_t length)
 	return vfs_ftruncate(fd, length);
 }
 
+static int32_t sys_sync()
+{
+	return vfs_sync();
+}
+
+static int32_t sys_fsync(uint32_t fd)
+{
+	return vfs_fsync(fd, false);
+}
+
+static int32_t sys_fdatasync(uint32_t fd)
+{
+	return vfs_fsync(fd, true);
+}
+
 static int32_t sys_access(const char *path, int amode)
 {
 	if (amode & ~(R_OK || W_OK || X_OK || F_OK))
@@ -373,16 +389,65 @@ static int32_t sys_connect(int32_t sockfd, struct sockaddr *addr, uint32_t addrl
 	return sock->ops->connect(sock, addr, addrlen);
 }
 
+static int32_t sys_listen(int32_t sockfd, int32_t backlog)
+{
+	struct socket *sock = sockfd_lookup(sockfd);
+	if (!sock->ops->listen)
+		return -EOPNOTSUPP;
+	return sock->ops->listen(sock, backlog);
+}
+
+static int32_t sys_accept(int32_t sockfd, struct sockaddr *addr, int32_t *addrlen)
+{
+	struct socket *sock = sockfd_lookup(sockfd);
+	if (!sock->ops->accept)
+		return -EOPNOTSUPP;
+	return sock->ops->accept(sock, addr, addrlen);
+}
+
 static int32_t sys_send(int32_t sockfd, void *msg, size_t len)
 {
 	struct socket *sock = sockfd_lookup(sockfd);
 	return sock->ops->sendmsg(sock, msg, len);
 }
 
-static int32_t sys_recv(int32_t sockfd, void *msg, size_t len)
+static int32_t sys_recv(int32_t sockfd, void *msg, size_t len, int32_t flags)
+{
+	struct socket *sock = sockfd_lookup(sockfd);
+	return sock->ops->recvmsg(sock, msg, len, flags);
+}
+
+static int32_t sys_sendmmsg(int32_t sockfd, struct mmsghdr *msgvec, uint32_t vlen, int32_t flags)
+{
+	struct socket *sock = sockfd_lookup(sockfd);
+	return socket_sendmmsg(sock, msgvec, vlen, flags);
+}
+
+static int32_t sys_recvmmsg(int32_t sockfd, struct mmsghdr *msgvec, uint32_t vlen, int32_t flags)
+{
+	struct socket *sock = sockfd_lookup(sockfd);
+	return socket_recvmmsg(sock, msgvec, vlen, flags);
+}
+
+static int32_t sys_dns_lookup(const char *name, uint32_t *ip)
+{
+	return dns_lookup(name, ip);
+}
+
+static int32_t sys_setsockopt(int32_t sockfd, int32_t level, int32_t optname, void *optval, uint32_t optlen)
+{
+	struct socket *sock = sockfd_lookup(sockfd);
+	if (!sock->ops->setsockopt)
+		return -ENOPROTOOPT;
+	return sock->ops->setsockopt(sock, level, optname, optval, optlen);
+}
+
+static int32_t sys_getsockopt(int32_t sockfd, int32_t level, int32_t optname, void *optval, uint32_t *optlen)
 {
 	struct socket *sock = sockfd_lookup(sockfd);
-	return sock->ops->recvmsg(sock, msg, len);
+	if (!sock->ops->getsockopt)
+		return -ENOPROTOOPT;
+	return sock->ops->getsockopt(sock, level, optname, optval, optlen);
 }
 
 // NOTE: MQ 2020-08-26 we only support millisecond precision
@@ -496,6 +561,7 @@ static int32_t sys_debug_println(enum debug_level level, const char *out)
 #define __NR_getuid 24
 #define __NR_alarm 27
 #define __NR_access 33
+#define __NR_sync 36
 #define __NR_kill 37
 #define __NR_dup 41
 #define __NR_pipe 42
@@ -530,11 +596,13 @@ static int32_t sys_debug_println(enum debug_level level, const char *out)
 #define __NR_listen 105
 #define __NR_stat 106
 #define __NR_fstat 108
+#define __NR_fsync 118
 #define __NR_sigprocmask 126
 #define __NR_fchdir 133
 #define __NR_getpgid 132
 #define __NR_getdents 141
 #define __NR_getsid 147
+#define __NR_fdatasync 148
 #define __NR_nanosleep 162
 #define __NR_poll 168
 #define __NR_clock_gettime 265
@@ -546,6 +614,10 @@ static int32_t sys_debug_println(enum debug_level level, const char *out)
 #define __NR_waitid 284
 #define __NR_unlinkat 301
 #define __NR_faccessat 307
+#define __NR_recvmmsg 337
+#define __NR_sendmmsg 345
+#define __NR_getsockopt 365
+#define __NR_setsockopt 366
 #define __NR_sendto 369
 // TODO: MQ 2020-09-05 Use ioctl-FIODGNAME to get pts name
 #define __NR_getptsname 370
@@ -553,6 +625,7 @@ static int32_t sys_debug_println(enum debug_level level, const char *out)
 #define __NR_dprintf 512
 #define __NR_dprintln 513
 #define __NR_posix_spawn 514
+#define __NR_dns_lookup 515
 
 static void *syscalls[] = {
 	[__NR_exit] = sys_exit,
@@ -601,11 +674,21 @@ static void *syscalls[] = {
 	[__NR_munmap] = sys_munmap,
 	[__NR_truncate] = sys_truncate,
 	[__NR_ftruncate] = sys_ftruncate,
+	[__NR_sync] = sys_sync,
+	[__NR_fsync] = sys_fsync,
+	[__NR_fdatasync] = sys_fdatasync,
 	[__NR_socket] = sys_socket,
 	[__NR_connect] = sys_connect,
 	[__NR_bind] = sys_bind,
+	[__NR_listen] = sys_listen,
+	[__NR_accept] = sys_accept,
 	[__NR_send] = sys_send,
 	[__NR_recv] = sys_recv,
+	[__NR_sendmmsg] = sys_sendmmsg,
+	[__NR_recvmmsg] = sys_recvmmsg,
+	[__NR_dns_lookup] = sys_dns_lookup,
+	[__NR_setsockopt] = sys_setsockopt,
+	[__NR_getsockopt] = sys_getsockopt,
 	[__NR_nanosleep] = sys_nanosleep,
 	[__NR_poll] = sys_poll,
 	[__NR_mq_open] = sys_mq_open,
@@ -0,0 +1,156 @@
+#include "radix_tree.h"
+
+#include <include/errno.h>
+#include <memory/vmm.h>
+#include <stddef.h>
+
+static uint32_t radix_tree_maxindex(uint32_t height)
+{
+	uint32_t bits = height * RADIX_TREE_MAP_SHIFT;
+	return bits >= 32 ? UINT32_MAX : (1u << bits) - 1;
+}
+
+static uint32_t radix_tree_offset(uint32_t index, uint32_t height)
+{
+	uint32_t shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+	return (index >> shift) & RADIX_TREE_MAP_MASK;
+}
+
+void radix_tree_init(struct radix_tree_root *root)
+{
+	root->height = 0;
+	root->rnode = NULL;
+}
+
+// adds levels on top until index fits, the old root becomes the first slot of the new one
+static int radix_tree_extend(struct radix_tree_root *root, uint32_t index)
+{
+	uint32_t height = root->height + 1;
+	while (index > radix_tree_maxindex(height))
+		height++;
+
+	if (!root->rnode)
+	{
+		root->height = height;
+		return 0;
+	}
+
+	while (root->height < height)
+	{
+		struct radix_tree_node *node = kcalloc(1, sizeof(struct radix_tree_node));
+		if (!node)
+			return -ENOMEM;
+		node->slots[0] = root->rnode;
+		node->count = 1;
+		root->rnode = node;
+		root->height++;
+	}
+	return 0;
+}
+
+int radix_tree_insert(struct radix_tree_root *root, uint32_t index, void *item)
+{
+	if (!root->height || index > radix_tree_maxindex(root->height))
+	{
+		int ret = radix_tree_extend(root, index);
+		if (ret < 0)
+			return ret;
+	}
+
+	void **slot = (void **)&root->rnode;
+	struct radix_tree_node *parent = NULL;
+	for (uint32_t height = root->height; height > 0; --height)
+	{
+		if (!*slot)
+		{
+			*slot = kcalloc(1, sizeof(struct radix_tree_node));
+			if (!*slot)
+				return -ENOMEM;
+			if (parent)
+				parent->count++;
+		}
+		parent = *slot;
+		slot = &parent->slots[radix_tree_offset(index, height)];
+	}
+
+	if (*slot)
+		return -EEXIST;
+	*slot = item;
+	parent->count++;
+	return 0;
+}
+
+void *radix_tree_lookup(struct radix_tree_root *root, uint32_t index)
+{
+	if (!root->height || index > radix_tree_maxindex(root->height))
+		return NULL;
+
+	struct radix_tree_node *node = root->rnode;
+	for (uint32_t height = root->height; height > 1 && node; --height)
+		node = node->slots[radix_tree_offset(index, height)];
+	return node ? node->slots[index & RADIX_TREE_MAP_MASK] : NULL;
+}
+
+// nodes which become empty are freed from the bottom up
+void *radix_tree_delete(struct radix_tree_root *root, uint32_t index)
+{
+	if (!root->height || index > radix_tree_maxindex(root->height))
+		return NULL;
+
+	struct radix_tree_node *path[RADIX_TREE_MAX_HEIGHT];
+	struct radix_tree_node *node = root->rnode;
+	for (uint32_t height = root->height; height > 0; --height)
+	{
+		if (!node)
+			return NULL;
+		path[height - 1] = node;
+		if (height > 1)
+			node = node->slots[radix_tree_offset(index, height)];
+	}
+
+	void *item = path[0]->slots[index & RADIX_TREE_MAP_MASK];
+	if (!item)
+		return NULL;
+
+	path[0]->slots[index & RADIX_TREE_MAP_MASK] = NULL;
+	for (uint32_t level = 0; level < root->height; ++level)
+	{
+		if (--path[level]->count)
+			break;
+		kfree(path[level]);
+		if (level + 1 < root->height)
+			path[level + 1]->slots[radix_tree_offset(index, level + 2)] = NULL;
+		else
+			radix_tree_init(root);
+	}
+	return item;
+}
+
+static uint32_t radix_tree_gang_node(struct radix_tree_node *node, uint32_t height, uint32_t base,
+									 uint32_t first_index, void **results, uint32_t max_items)
+{
+	uint32_t found = 0;
+	uint32_t shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+	uint32_t offset = first_index > base ? (first_index - base) >> shift : 0;
+	for (; offset < RADIX_TREE_MAP_SIZE && found < max_items; ++offset)
+	{
+		void *slot = node->slots[offset];
+		if (!slot)
+			continue;
+
+		uint32_t slot_base = base + (offset << shift);
+		if (height == 1)
+			results[found++] = slot;
+		else
+			found += radix_tree_gang_node(slot, height - 1, slot_base, first_index, results + found, max_items - found);
+	}
+	return found;
+}
+
+// items from first_index on in index order, returns how many were found
+uint32_t radix_tree_gang_lookup(struct radix_tree_root *root, void **results, uint32_t first_index, uint32_t max_items)
+{
+	if (!root->height || first_index > radix_tree_maxindex(root->height))
+		return 0;
+	return radix_tree_gang_node(root->rnode, root->height, 0, first_index, results, max_items);
+}
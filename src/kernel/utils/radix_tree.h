@@ -0,0 +1,37 @@
+#ifndef UTILS_RADIX_TREE_H
+#define UTILS_RADIX_TREE_H
+
+#include <stdint.h>
+
+// each level consumes 6 bits of the index, 6 levels cover 32-bit indices
+#define RADIX_TREE_MAP_SHIFT 6
+#define RADIX_TREE_MAP_SIZE (1 << RADIX_TREE_MAP_SHIFT)
+#define RADIX_TREE_MAP_MASK (RADIX_TREE_MAP_SIZE - 1)
+#define RADIX_TREE_MAX_HEIGHT 6
+
+struct radix_tree_node
+{
+	// used slots, the node is freed when it drops to zero
+	uint32_t count;
+	void *slots[RADIX_TREE_MAP_SIZE];
+};
+
+struct radix_tree_root
+{
+	// 0 is an empty tree, the tree grows at the top when an index does not fit
+	uint32_t height;
+	struct radix_tree_node *rnode;
+};
+
+#define RADIX_TREE_INIT() \
+	{                     \
+		0, NULL           \
+	}
+
+void radix_tree_init(struct radix_tree_root *root);
+int radix_tree_insert(struct radix_tree_root *root, uint32_t index, void *item);
+void *radix_tree_lookup(struct radix_tree_root *root, uint32_t index);
+void *radix_tree_delete(struct radix_tree_root *root, uint32_t index);
+uint32_t radix_tree_gang_lookup(struct radix_tree_root *root, void **results, uint32_t first_index, uint32_t max_items);
+
+#endif
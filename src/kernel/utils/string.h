@@ -41,6 +41,7 @@ int32_t strlsplat(const char *s1, int32_t pos, char **sf, char **sl);
 char *skip_spaces(const char *str);
 
 void *memcpy(void *dest, const void *src, size_t len);
+void *memmove(void *dest, const void *src, size_t len);
 void *memset(void *dest, char val, size_t len);
 int memcmp(const void *vl, const void *vr, size_t n);
 
@@ -0,0 +1,16 @@
+#include <utils/string.h>
+
+// memcpy copies forward -> it is used unless dest overlaps the end of src
+void *memmove(void *dstpp, const void *srcpp, size_t len)
+{
+	unsigned long int dstp = (long int)dstpp;
+	unsigned long int srcp = (long int)srcpp;
+
+	// unsigned compare, dest before src is a huge difference
+	if (dstp - srcp >= len)
+		return memcpy(dstpp, srcpp, len);
+
+	while (len--)
+		((unsigned char *)dstp)[len] = ((const unsigned char *)srcp)[len];
+	return dstpp;
+}
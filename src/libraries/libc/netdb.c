@@ -0,0 +1,12 @@
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+
+_syscall2(dns_lookup, const char *, uint32_t *);
+int dns_lookup(const char *name, uint32_t *ip)
+{
+	int ret = syscall_dns_lookup(name, ip);
+	if (ret < 0)
+		return errno = -ret, -1;
+	return 0;
+}
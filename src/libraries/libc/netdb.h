@@ -0,0 +1,9 @@
+#ifndef _LIBC_NETDB_H
+#define _LIBC_NETDB_H 1
+
+#include <stdint.h>
+
+// resolve name to ipv4 address (host order) via kernel's resolver cache
+int dns_lookup(const char *name, uint32_t *ip);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef _LIBC_NETINET_TCP_H
+#define _LIBC_NETINET_TCP_H 1
+
+/* User-settable options (used with setsockopt). */
+#define TCP_NODELAY 1 /* Don't delay send to coalesce packets  */
+#define TCP_CORK 3	  /* Never send partially complete segments */
+#define TCP_CONGESTION 13 /* Congestion control algorithm */
+
+#endif
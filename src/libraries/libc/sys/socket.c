@@ -19,14 +19,50 @@ int connect(int sockfd, struct sockaddr *addr, unsigned int addrlen)
 	return syscall_connect(sockfd, addr, addrlen);
 }
 
+_syscall2(listen, int, int);
+int listen(int sockfd, int backlog)
+{
+	return syscall_listen(sockfd, backlog);
+}
+
+_syscall3(accept, int, struct sockaddr *, unsigned int *);
+int accept(int sockfd, struct sockaddr *addr, unsigned int *addrlen)
+{
+	return syscall_accept(sockfd, addr, addrlen);
+}
+
 _syscall3(send, int, void *, size_t);
 int send(int sockfd, void *msg, size_t len)
 {
 	return syscall_send(sockfd, msg, len);
 }
 
-_syscall3(recv, int, void *, size_t);
-int recv(int sockfd, void *msg, size_t len)
+_syscall4(recv, int, void *, size_t, int);
+int recv(int sockfd, void *msg, size_t len, int flags)
+{
+	return syscall_recv(sockfd, msg, len, flags);
+}
+
+_syscall4(sendmmsg, int, struct mmsghdr *, unsigned int, int);
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	return syscall_sendmmsg(sockfd, msgvec, vlen, flags);
+}
+
+_syscall4(recvmmsg, int, struct mmsghdr *, unsigned int, int);
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	return syscall_recvmmsg(sockfd, msgvec, vlen, flags);
+}
+
+_syscall5(setsockopt, int, int, int, void *, unsigned int);
+int setsockopt(int sockfd, int level, int optname, void *optval, unsigned int optlen)
+{
+	return syscall_setsockopt(sockfd, level, optname, optval, optlen);
+}
+
+_syscall5(getsockopt, int, int, int, void *, unsigned int *);
+int getsockopt(int sockfd, int level, int optname, void *optval, unsigned int *optlen)
 {
-	return syscall_recv(sockfd, msg, len);
+	return syscall_getsockopt(sockfd, level, optname, optval, optlen);
 }
@@ -10,6 +10,19 @@
 #define AF_PACKET 17 /* Packet family		*/
 #define PF_PACKET AF_PACKET
 
+/* Setsockoptions(2) level. */
+#define SOL_SOCKET 1
+#define SOL_TCP 6
+
+/* For setsockopt(2) */
+#define SO_MAX_PACING_RATE 47
+
+/* Flags we can use with send/ and recv. */
+#define MSG_PEEK 0x02
+#define MSG_DONTWAIT 0x40 /* Nonblocking io		 */
+#define MSG_WAITALL 0x100 /* Wait for a full request */
+#define MSG_WAITFORONE 0x10000 /* recvmmsg(): block until 1+ packets avail */
+
 #ifndef __socklen_t_defined
 typedef __socklen_t socklen_t;
 #define __socklen_t_defined
@@ -28,6 +41,27 @@ enum
 
 typedef unsigned short sa_family_t;
 
+struct iovec
+{
+	void *iov_base;
+	size_t iov_len;
+};
+
+struct msghdr
+{
+	void *msg_name; /* optional address */
+	socklen_t msg_namelen;
+	struct iovec *msg_iov; /* scatter/gather array */
+	size_t msg_iovlen;
+	int msg_flags;
+};
+
+struct mmsghdr
+{
+	struct msghdr msg_hdr;
+	unsigned int msg_len; /* number of bytes transmitted */
+};
+
 struct sockaddr
 {
 	sa_family_t sa_family; /* address family, AF_xxx	*/
@@ -111,7 +145,13 @@ enum socket_type
 int socket(int family, enum socket_type type, int protocal);
 int bind(int sockfd, struct sockaddr *addr, unsigned int addrlen);
 int connect(int sockfd, struct sockaddr *addr, unsigned int addrlen);
+int listen(int sockfd, int backlog);
+int accept(int sockfd, struct sockaddr *addr, unsigned int *addrlen);
 int send(int sockfd, void *msg, size_t len);
-int recv(int sockfd, void *msg, size_t len);
+int recv(int sockfd, void *msg, size_t len, int flags);
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int setsockopt(int sockfd, int level, int optname, void *optval, unsigned int optlen);
+int getsockopt(int sockfd, int level, int optname, void *optval, unsigned int *optlen);
 
 #endif
@@ -135,6 +135,24 @@ int ftruncate(int fd, off_t length)
 	return syscall_ftruncate(fd, length);
 }
 
+_syscall0(sync);
+void sync()
+{
+	syscall_sync();
+}
+
+_syscall1(fsync, int);
+int fsync(int fd)
+{
+	SYSCALL_RETURN(syscall_fsync(fd));
+}
+
+_syscall1(fdatasync, int);
+int fdatasync(int fd)
+{
+	SYSCALL_RETURN(syscall_fdatasync(fd));
+}
+
 _syscall2(truncate, const char *, off_t);
 int truncate(const char *name, off_t length)
 {
@@ -79,6 +79,7 @@
 #define __NR_getuid 24
 #define __NR_alarm 27
 #define __NR_access 33
+#define __NR_sync 36
 #define __NR_kill 37
 #define __NR_dup 41
 #define __NR_pipe 42
@@ -113,11 +114,13 @@
 #define __NR_listen 105
 #define __NR_stat 106
 #define __NR_fstat 108
+#define __NR_fsync 118
 #define __NR_sigprocmask 126
 #define __NR_fchdir 133
 #define __NR_getpgid 132
 #define __NR_getdents 141
 #define __NR_getsid 147
+#define __NR_fdatasync 148
 #define __NR_nanosleep 162
 #define __NR_poll 168
 #define __NR_clock_gettime 265
@@ -129,6 +132,10 @@
 #define __NR_waitid 284
 #define __NR_unlinkat 301
 #define __NR_faccessat 307
+#define __NR_recvmmsg 337
+#define __NR_sendmmsg 345
+#define __NR_getsockopt 365
+#define __NR_setsockopt 366
 #define __NR_sendto 369
 // TODO: MQ 2020-09-05 Use ioctl-FIODGNAME to get pts name
 #define __NR_getptsname 370
@@ -136,6 +143,7 @@
 #define __NR_dprintf 512
 #define __NR_dprintln 513
 #define __NR_posix_spawn 514
+#define __NR_dns_lookup 515
 
 #define _syscall0(name)                           \
 	static inline int32_t syscall_##name()        \
@@ -211,6 +219,9 @@ int sbrk(intptr_t increment);
 int pipe(int *fildes);
 int truncate(const char *name, off_t length);
 int ftruncate(int fd, off_t length);
+void sync();
+int fsync(int fd);
+int fdatasync(int fd);
 int getpid();
 int getuid();
 int setuid(uid_t uid);
@@ -1,4 +1,6 @@
 #include <libgui/bmp.h>
+#include <libgui/pixel.h>
+#include <stdlib.h>
 
 static void bmp_bi_bitfields_draw(
 	struct graphic *dgraph,
@@ -10,18 +12,21 @@ static void bmp_bi_bitfields_draw(
 	uint32_t row_size = dip_header->image_size_bytes / dip_header->height_px;
 	char *bmp_data = (char *)bmp_header + bmp_header->data_offset;
 	uint8_t bytes_per_pixel = dip_header->bits_per_pixel / 8;
+	// each row is converted to premultiplied pixels and blended over graphic at once
+	uint32_t *row = calloc(dip_header->width_px, sizeof(uint32_t));
 	for (int32_t y = dip_header->height_px - 1; y >= 0; --y)
 	{
 		char *ibuf = dgraph->buf + (py + dip_header->height_px - y - 1) * dgraph->width * 4 + px * 4;
-		char *iwin = bmp_data + y * row_size;
+		uint8_t *iwin = (uint8_t *)bmp_data + y * row_size;
 		for (int32_t x = 0; x < dip_header->width_px; ++x)
 		{
 			uint8_t alpha = bytes_per_pixel == 4 ? iwin[3] : 255;
-			set_pixel(ibuf, iwin[0], iwin[1], iwin[2], alpha);
+			row[x] = pixel_premultiply(iwin[0], iwin[1], iwin[2], alpha);
 			iwin += bytes_per_pixel;
-			ibuf += 4;
 		}
+		pixel_over((uint32_t *)ibuf, row, dip_header->width_px);
 	}
+	free(row);
 }
 
 void bmp_draw(struct graphic *dgraph, char *bmph, int32_t px, int32_t py)
@@ -40,3 +45,24 @@ void bmp_draw(struct graphic *dgraph, char *bmph, int32_t px, int32_t py)
 		break;
 	}
 }
+
+// bmp is stretched over the whole graphic
+void bmp_draw_scaled(struct graphic *dgraph, char *bmph)
+{
+	struct dip_bitmapcoreheader *dip_header = (struct dip_bitmapcoreheader *)(bmph + 0xE);
+	if (dip_header->width_px == dgraph->width && dip_header->height_px == dgraph->height)
+	{
+		bmp_draw(dgraph, bmph, 0, 0);
+		return;
+	}
+
+	struct graphic graphic = {
+		.width = dip_header->width_px,
+		.height = dip_header->height_px,
+	};
+	graphic.buf = calloc(graphic.width * graphic.height * 4, sizeof(char));
+	bmp_draw(&graphic, bmph, 0, 0);
+	pixel_scale((uint32_t *)dgraph->buf, dgraph->width * 4, dgraph->width, dgraph->height,
+				(uint32_t *)graphic.buf, graphic.width * 4, graphic.width, graphic.height);
+	free(graphic.buf);
+}
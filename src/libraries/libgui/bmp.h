@@ -127,5 +127,6 @@ struct dip_bitmapv5header  // 124 bytes, for a total offset of 138 bytes
 };
 
 void bmp_draw(struct graphic *dgraph, char *bmph, int32_t px, int32_t py);
+void bmp_draw_scaled(struct graphic *dgraph, char *bmph);
 
 #endif
@@ -2,6 +2,7 @@
 #include <libgui/bmp.h>
 #include <libgui/layout.h>
 #include <libgui/msgui.h>
+#include <libgui/pixel.h>
 #include <libgui/psf.h>
 #include <math.h>
 #include <mqueue.h>
@@ -74,9 +75,10 @@ void gui_draw_retangle(struct window *win, int x, int y, unsigned int width, uns
 {
 	int py = min_t(int, y + height, win->graphic.height);
 	int px = min_t(int, x + width, win->graphic.width);
+	if (px <= x)
+		return;
 	for (int i = y; i < py; i += 1)
-		for (int j = x; j < px; j += 1)
-			*(uint32_t *)(win->graphic.buf + (i * win->graphic.width + j) * 4) = bg;
+		pixel_fill((uint32_t *)(win->graphic.buf + (i * win->graphic.width + x) * 4), bg, px - x);
 }
 
 static void gui_create_window(struct window *parent, struct window *win, int32_t x, int32_t y, uint32_t width, uint32_t height, bool transparent, struct ui_style *style)
@@ -161,12 +163,17 @@ void gui_create_block(struct window *parent, struct ui_block *block, int32_t x,
 	gui_create_window(parent, &block->window, x, y, width, height, transparent, style);
 }
 
-void gui_render(struct window *win)
+// only the changed part of window is recomposited by window server
+void gui_render_rect(struct window *win, int32_t x, int32_t y, uint32_t width, uint32_t height)
 {
 	struct msgui *msgui = calloc(1, sizeof(struct msgui));
 	msgui->type = MSGUI_RENDER;
 	struct msgui_render *msgrender = (struct msgui_render *)msgui->data;
 	memcpy(msgrender->sender, win->name, WINDOW_NAME_LENGTH);
+	msgrender->x = x;
+	msgrender->y = y;
+	msgrender->width = width;
+	msgrender->height = height;
 
 	int32_t sfd = mq_open(WINDOW_SERVER_QUEUE, O_WRONLY, &(struct mq_attr){
 															 .mq_msgsize = sizeof(struct msgui),
@@ -177,6 +184,11 @@ void gui_render(struct window *win)
 	free(msgui);
 }
 
+void gui_render(struct window *win)
+{
+	gui_render_rect(win, 0, 0, 0, 0);
+}
+
 void gui_focus(struct window *win)
 {
 	struct msgui *msgui = calloc(1, sizeof(struct msgui));
@@ -226,15 +238,7 @@ char *load_bmp(char *path)
 
 void set_background_color(struct window *win, uint32_t bg)
 {
-	for (uint32_t i = 0; i < win->graphic.height; ++i)
-	{
-		char *ibuf = win->graphic.buf + i * win->graphic.width * 4;
-		for (uint32_t j = 0; j < win->graphic.width; ++j)
-		{
-			(*(uint32_t *)ibuf) = bg;
-			ibuf += 4;
-		}
-	}
+	pixel_fill((uint32_t *)win->graphic.buf, bg, win->graphic.width * win->graphic.height);
 }
 
 void close_window(struct window *btn_win)
@@ -16,6 +16,7 @@ typedef void (*EVENT_HANDLER)(struct window *win);
 
 struct graphic
 {
+	// premultiplied pixels, see libgui/pixel.h
 	char *buf;
 	int32_t x, y;
 	uint16_t width, height;
@@ -99,26 +100,10 @@ void gui_create_input(struct window *parent, struct ui_input *input, int32_t x,
 void gui_create_button(struct window *parent, struct ui_button *button, int32_t x, int32_t y, uint32_t width, uint32_t height, bool transparent, struct ui_style *style);
 void gui_create_block(struct window *parent, struct ui_block *block, int32_t x, int32_t y, uint32_t width, uint32_t height, bool transparent, struct ui_style *style);
 void gui_render(struct window *win);
+void gui_render_rect(struct window *win, int32_t x, int32_t y, uint32_t width, uint32_t height);
 struct window *init_window(int32_t x, int32_t y, uint32_t width, uint32_t height);
 void init_fonts();
 char *load_bmp(char *path);
 void enter_event_loop(struct window *win, void (*event_callback)(struct xevent *evt), int *fds, unsigned int nfds, void (*fds_callback)(struct pollfd *, unsigned int));
 
-static __inline void set_pixel(char *pixel_dest, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha_raw)
-{
-	uint8_t red_dest = pixel_dest[0];
-	uint8_t green_dest = pixel_dest[1];
-	uint8_t blue_dest = pixel_dest[2];
-	uint8_t alpha_raw_dest = pixel_dest[3];
-
-	float alpha = alpha_raw / (float)255;
-	float alpha_dest = alpha_raw_dest / (float)255;
-
-	float adj = (1 - alpha) * alpha_dest;
-	pixel_dest[0] = red * alpha + adj * red_dest;
-	pixel_dest[1] = green * alpha + adj * green_dest;
-	pixel_dest[2] = blue * alpha + adj * blue_dest;
-	pixel_dest[3] = (alpha + adj) * 255;
-}
-
 #endif
@@ -22,9 +22,12 @@ struct msgui_focus
 	char sender[WINDOW_NAME_LENGTH];
 };
 
+// damaged area relative to the window, zero width or height means the whole window
 struct msgui_render
 {
 	char sender[WINDOW_NAME_LENGTH];
+	int32_t x, y;
+	uint32_t width, height;
 };
 
 struct msgui_close
@@ -0,0 +1,356 @@
+#include <libgui/pixel.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#define CPUID_FEAT_EDX_MMX (1 << 23)
+#define CPUID_FEAT_EDX_SSE2 (1 << 26)
+
+struct pixel_ops
+{
+	void (*copy)(uint32_t *dst, const uint32_t *src, uint32_t count);
+	void (*over)(uint32_t *dst, const uint32_t *src, uint32_t count);
+	void (*fill)(uint32_t *dst, uint32_t color, uint32_t count);
+};
+
+// 16-bit lanes, x / 255 is computed as (x + 128 + ((x + 128) >> 8)) >> 8
+static const uint16_t pixel_round[8] __attribute__((aligned(16))) = {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80};
+static const uint16_t pixel_mask[8] __attribute__((aligned(16))) = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+static const struct pixel_ops *pixel_ops;
+
+// two channels per multiplication, each one is in its own 16-bit lane
+static uint32_t pixel_over_one(uint32_t s, uint32_t d)
+{
+	uint32_t ia = 255 - (s >> 24);
+	uint32_t rb = (d & 0x00ff00ff) * ia + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+	uint32_t ag = ((d >> 8) & 0x00ff00ff) * ia + 0x00800080;
+	ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+	return s + rb + ag;
+}
+
+static void pixel_copy_generic(uint32_t *dst, const uint32_t *src, uint32_t count)
+{
+	memcpy(dst, src, count * 4);
+}
+
+static void pixel_over_generic(uint32_t *dst, const uint32_t *src, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t alpha = src[i] >> 24;
+		if (alpha == 0xff)
+			dst[i] = src[i];
+		else if (alpha)
+			dst[i] = pixel_over_one(src[i], dst[i]);
+	}
+}
+
+static void pixel_fill_generic(uint32_t *dst, uint32_t color, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; ++i)
+		dst[i] = color;
+}
+
+// mmx/xmm registers are never used by compiled code (no -mmmx/-msse) -> they are not listed as clobbered
+
+static void pixel_copy_mmx(uint32_t *dst, const uint32_t *src, uint32_t count)
+{
+	uint32_t blocks = count / 8;
+	if (blocks)
+	{
+		__asm__ __volatile__(
+			"1:							\n"
+			"movq 0(%[src]), %%mm0		\n"
+			"movq 8(%[src]), %%mm1		\n"
+			"movq 16(%[src]), %%mm2		\n"
+			"movq 24(%[src]), %%mm3		\n"
+			"movq %%mm0, 0(%[dst])		\n"
+			"movq %%mm1, 8(%[dst])		\n"
+			"movq %%mm2, 16(%[dst])		\n"
+			"movq %%mm3, 24(%[dst])		\n"
+			"add $32, %[src]			\n"
+			"add $32, %[dst]			\n"
+			"dec %[blocks]				\n"
+			"jnz 1b						\n"
+			"emms						\n"
+			: [dst] "+r"(dst), [src] "+r"(src), [blocks] "+r"(blocks)
+			:
+			: "memory", "cc");
+	}
+	pixel_copy_generic(dst, src, count % 8);
+}
+
+// two pixels per iteration, alpha of each pixel is broadcast into its four 16-bit lanes
+static void pixel_over_mmx(uint32_t *dst, const uint32_t *src, uint32_t count)
+{
+	uint32_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		uint32_t alpha_and = src[i] & src[i + 1];
+		uint32_t alpha_or = src[i] | src[i + 1];
+		if ((alpha_and >> 24) == 0xff)
+		{
+			dst[i] = src[i];
+			dst[i + 1] = src[i + 1];
+			continue;
+		}
+		if (!(alpha_or >> 24))
+			continue;
+
+		__asm__ __volatile__(
+			"movq (%[src]), %%mm0		\n"
+			"movq (%[dst]), %%mm1		\n"
+			"movq (%[round]), %%mm5		\n"
+			"movq (%[mask]), %%mm6		\n"
+			"pxor %%mm7, %%mm7			\n"
+			"movq %%mm1, %%mm2			\n"
+			"punpcklbw %%mm7, %%mm1		\n"
+			"punpckhbw %%mm7, %%mm2		\n"
+			"movq %%mm0, %%mm3			\n"
+			"punpcklbw %%mm7, %%mm3		\n"
+			"psrlq $48, %%mm3			\n"
+			"punpcklwd %%mm3, %%mm3		\n"
+			"punpckldq %%mm3, %%mm3		\n"
+			"pxor %%mm6, %%mm3			\n"
+			"pmullw %%mm3, %%mm1		\n"
+			"paddw %%mm5, %%mm1			\n"
+			"movq %%mm1, %%mm4			\n"
+			"psrlw $8, %%mm4			\n"
+			"paddw %%mm4, %%mm1			\n"
+			"psrlw $8, %%mm1			\n"
+			"movq %%mm0, %%mm3			\n"
+			"punpckhbw %%mm7, %%mm3		\n"
+			"psrlq $48, %%mm3			\n"
+			"punpcklwd %%mm3, %%mm3		\n"
+			"punpckldq %%mm3, %%mm3		\n"
+			"pxor %%mm6, %%mm3			\n"
+			"pmullw %%mm3, %%mm2		\n"
+			"paddw %%mm5, %%mm2			\n"
+			"movq %%mm2, %%mm4			\n"
+			"psrlw $8, %%mm4			\n"
+			"paddw %%mm4, %%mm2			\n"
+			"psrlw $8, %%mm2			\n"
+			"packuswb %%mm2, %%mm1		\n"
+			"paddusb %%mm0, %%mm1		\n"
+			"movq %%mm1, (%[dst])		\n"
+			:
+			: [dst] "r"(dst + i), [src] "r"(src + i), [round] "r"(pixel_round), [mask] "r"(pixel_mask)
+			: "memory");
+	}
+	__asm__ __volatile__("emms");
+	pixel_over_generic(dst + i, src + i, count - i);
+}
+
+static void pixel_fill_mmx(uint32_t *dst, uint32_t color, uint32_t count)
+{
+	uint32_t blocks = count / 8;
+	if (blocks)
+	{
+		__asm__ __volatile__(
+			"movd %[color], %%mm0		\n"
+			"punpckldq %%mm0, %%mm0		\n"
+			"1:							\n"
+			"movq %%mm0, 0(%[dst])		\n"
+			"movq %%mm0, 8(%[dst])		\n"
+			"movq %%mm0, 16(%[dst])		\n"
+			"movq %%mm0, 24(%[dst])		\n"
+			"add $32, %[dst]			\n"
+			"dec %[blocks]				\n"
+			"jnz 1b						\n"
+			"emms						\n"
+			: [dst] "+r"(dst), [blocks] "+r"(blocks)
+			: [color] "r"(color)
+			: "memory", "cc");
+	}
+	pixel_fill_generic(dst, color, count % 8);
+}
+
+static void pixel_copy_sse2(uint32_t *dst, const uint32_t *src, uint32_t count)
+{
+	uint32_t blocks = count / 16;
+	if (blocks)
+	{
+		__asm__ __volatile__(
+			"1:							\n"
+			"movdqu 0(%[src]), %%xmm0	\n"
+			"movdqu 16(%[src]), %%xmm1	\n"
+			"movdqu 32(%[src]), %%xmm2	\n"
+			"movdqu 48(%[src]), %%xmm3	\n"
+			"movdqu %%xmm0, 0(%[dst])	\n"
+			"movdqu %%xmm1, 16(%[dst])	\n"
+			"movdqu %%xmm2, 32(%[dst])	\n"
+			"movdqu %%xmm3, 48(%[dst])	\n"
+			"add $64, %[src]			\n"
+			"add $64, %[dst]			\n"
+			"dec %[blocks]				\n"
+			"jnz 1b						\n"
+			: [dst] "+r"(dst), [src] "+r"(src), [blocks] "+r"(blocks)
+			:
+			: "memory", "cc");
+	}
+	pixel_copy_generic(dst, src, count % 16);
+}
+
+// four pixels per iteration, they are unpacked into two registers of 16-bit lanes
+static void pixel_over_sse2(uint32_t *dst, const uint32_t *src, uint32_t count)
+{
+	uint32_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		uint32_t alpha_and = src[i] & src[i + 1] & src[i + 2] & src[i + 3];
+		uint32_t alpha_or = src[i] | src[i + 1] | src[i + 2] | src[i + 3];
+		if ((alpha_and >> 24) == 0xff)
+		{
+			memcpy(dst + i, src + i, 16);
+			continue;
+		}
+		if (!(alpha_or >> 24))
+			continue;
+
+		__asm__ __volatile__(
+			"movdqu (%[src]), %%xmm0		\n"
+			"movdqu (%[dst]), %%xmm1		\n"
+			"movdqa (%[round]), %%xmm5		\n"
+			"movdqa (%[mask]), %%xmm6		\n"
+			"pxor %%xmm7, %%xmm7			\n"
+			"movdqa %%xmm1, %%xmm2			\n"
+			"punpcklbw %%xmm7, %%xmm1		\n"
+			"punpckhbw %%xmm7, %%xmm2		\n"
+			"movdqa %%xmm0, %%xmm3			\n"
+			"punpcklbw %%xmm7, %%xmm3		\n"
+			"pshuflw $0xff, %%xmm3, %%xmm4	\n"
+			"pshufhw $0xff, %%xmm4, %%xmm4	\n"
+			"pxor %%xmm6, %%xmm4			\n"
+			"pmullw %%xmm4, %%xmm1			\n"
+			"paddw %%xmm5, %%xmm1			\n"
+			"movdqa %%xmm1, %%xmm4			\n"
+			"psrlw $8, %%xmm4				\n"
+			"paddw %%xmm4, %%xmm1			\n"
+			"psrlw $8, %%xmm1				\n"
+			"movdqa %%xmm0, %%xmm3			\n"
+			"punpckhbw %%xmm7, %%xmm3		\n"
+			"pshuflw $0xff, %%xmm3, %%xmm4	\n"
+			"pshufhw $0xff, %%xmm4, %%xmm4	\n"
+			"pxor %%xmm6, %%xmm4			\n"
+			"pmullw %%xmm4, %%xmm2			\n"
+			"paddw %%xmm5, %%xmm2			\n"
+			"movdqa %%xmm2, %%xmm4			\n"
+			"psrlw $8, %%xmm4				\n"
+			"paddw %%xmm4, %%xmm2			\n"
+			"psrlw $8, %%xmm2				\n"
+			"packuswb %%xmm2, %%xmm1		\n"
+			"paddusb %%xmm0, %%xmm1			\n"
+			"movdqu %%xmm1, (%[dst])		\n"
+			:
+			: [dst] "r"(dst + i), [src] "r"(src + i), [round] "r"(pixel_round), [mask] "r"(pixel_mask)
+			: "memory");
+	}
+	pixel_over_generic(dst + i, src + i, count - i);
+}
+
+static void pixel_fill_sse2(uint32_t *dst, uint32_t color, uint32_t count)
+{
+	uint32_t blocks = count / 16;
+	if (blocks)
+	{
+		__asm__ __volatile__(
+			"movd %[color], %%xmm0		\n"
+			"pshufd $0, %%xmm0, %%xmm0	\n"
+			"1:							\n"
+			"movdqu %%xmm0, 0(%[dst])	\n"
+			"movdqu %%xmm0, 16(%[dst])	\n"
+			"movdqu %%xmm0, 32(%[dst])	\n"
+			"movdqu %%xmm0, 48(%[dst])	\n"
+			"add $64, %[dst]			\n"
+			"dec %[blocks]				\n"
+			"jnz 1b						\n"
+			: [dst] "+r"(dst), [blocks] "+r"(blocks)
+			: [color] "r"(color)
+			: "memory", "cc");
+	}
+	pixel_fill_generic(dst, color, count % 16);
+}
+
+static const struct pixel_ops pixel_generic_ops = {
+	.copy = pixel_copy_generic,
+	.over = pixel_over_generic,
+	.fill = pixel_fill_generic,
+};
+
+static const struct pixel_ops pixel_mmx_ops = {
+	.copy = pixel_copy_mmx,
+	.over = pixel_over_mmx,
+	.fill = pixel_fill_mmx,
+};
+
+static const struct pixel_ops pixel_sse2_ops = {
+	.copy = pixel_copy_sse2,
+	.over = pixel_over_sse2,
+	.fill = pixel_fill_sse2,
+};
+
+static const struct pixel_ops *pixel_get_ops()
+{
+	if (pixel_ops)
+		return pixel_ops;
+
+	uint32_t eax, edx;
+	__asm__ __volatile__("cpuid"
+						 : "=a"(eax), "=d"(edx)
+						 : "a"(1)
+						 : "ecx", "ebx");
+
+	if (edx & CPUID_FEAT_EDX_SSE2)
+		pixel_ops = &pixel_sse2_ops;
+	else if (edx & CPUID_FEAT_EDX_MMX)
+		pixel_ops = &pixel_mmx_ops;
+	else
+		pixel_ops = &pixel_generic_ops;
+	return pixel_ops;
+}
+
+void pixel_copy(uint32_t *dst, const uint32_t *src, uint32_t count)
+{
+	pixel_get_ops()->copy(dst, src, count);
+}
+
+void pixel_over(uint32_t *dst, const uint32_t *src, uint32_t count)
+{
+	pixel_get_ops()->over(dst, src, count);
+}
+
+void pixel_fill(uint32_t *dst, uint32_t color, uint32_t count)
+{
+	pixel_get_ops()->fill(dst, color, count);
+}
+
+// source is sampled at the center of each destination pixel (16.16 fixed point)
+// destination rows which map to the same source row are copied from the previous one
+void pixel_scale(uint32_t *dst, uint32_t dst_pitch, uint32_t dst_width, uint32_t dst_height,
+				 const uint32_t *src, uint32_t src_pitch, uint32_t src_width, uint32_t src_height)
+{
+	if (!dst_width || !dst_height || !src_width || !src_height)
+		return;
+
+	uint32_t step_x = (src_width << 16) / dst_width;
+	uint32_t step_y = (src_height << 16) / dst_height;
+	const uint32_t *prev_srow = NULL;
+	uint32_t *prev_drow = NULL;
+
+	for (uint32_t y = 0, fy = step_y >> 1; y < dst_height; ++y, fy += step_y)
+	{
+		const uint32_t *srow = (const uint32_t *)((const char *)src + (fy >> 16) * src_pitch);
+		uint32_t *drow = (uint32_t *)((char *)dst + y * dst_pitch);
+		if (srow == prev_srow)
+			pixel_copy(drow, prev_drow, dst_width);
+		else
+		{
+			for (uint32_t x = 0, fx = step_x >> 1; x < dst_width; ++x, fx += step_x)
+				drow[x] = srow[fx >> 16];
+		}
+		prev_srow = srow;
+		prev_drow = drow;
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef LIBGUI_PIXEL_H
+#define LIBGUI_PIXEL_H
+
+#include <stdint.h>
+
+// pixels are 0xAARRGGBB with premultiplied alpha (each color channel <= alpha)
+// sse2 or mmx variant is picked on the first call if cpu supports it
+
+static __inline uint32_t pixel_premultiply(uint8_t blue, uint8_t green, uint8_t red, uint8_t alpha)
+{
+	// x / 255 rounded = (x + 128 + ((x + 128) >> 8)) >> 8
+	uint32_t b = blue * alpha + 128, g = green * alpha + 128, r = red * alpha + 128;
+	b = (b + (b >> 8)) >> 8;
+	g = (g + (g >> 8)) >> 8;
+	r = (r + (r >> 8)) >> 8;
+	return ((uint32_t)alpha << 24) | (r << 16) | (g << 8) | b;
+}
+
+void pixel_copy(uint32_t *dst, const uint32_t *src, uint32_t count);
+// dst = src + dst * (255 - src alpha) / 255
+void pixel_over(uint32_t *dst, const uint32_t *src, uint32_t count);
+void pixel_fill(uint32_t *dst, uint32_t color, uint32_t count);
+// nearest neighbour, pitches are in bytes
+void pixel_scale(uint32_t *dst, uint32_t dst_pitch, uint32_t dst_width, uint32_t dst_height,
+				 const uint32_t *src, uint32_t src_pitch, uint32_t src_width, uint32_t src_height);
+
+#endif
@@ -7,6 +7,35 @@
 static uint16_t *unicode;
 static char *psf_start;
 
+// glyphs are rasterized once per (fg, bg) pair into 32-bpp tiles, drawing only copies their rows
+struct psf_glyph_cache
+{
+	uint32_t fg, bg;
+	// indexed by glyph, allocated on first use
+	uint32_t **tiles;
+};
+
+static struct psf_glyph_cache glyph_caches[PSF_CACHE_COLORS];
+static uint32_t next_glyph_cache;
+
+static void psf_free_glyph_cache(struct psf_glyph_cache *cache)
+{
+	if (!cache->tiles)
+		return;
+
+	for (uint32_t i = 0; i < get_current_font()->numglyph; ++i)
+		free(cache->tiles[i]);
+	free(cache->tiles);
+	cache->tiles = NULL;
+}
+
+static void psf_reset_glyph_caches()
+{
+	for (uint32_t i = 0; i < PSF_CACHE_COLORS; ++i)
+		psf_free_glyph_cache(&glyph_caches[i]);
+	next_glyph_cache = 0;
+}
+
 struct psf_t *get_current_font()
 {
 	return (struct psf_t *)psf_start;
@@ -14,6 +43,7 @@ struct psf_t *get_current_font()
 
 void psf_init(char *buff, size_t size)
 {
+	psf_reset_glyph_caches();
 	psf_start = buff;
 
 	uint16_t glyph = 0;
@@ -74,50 +104,96 @@ void psf_init(char *buff, size_t size)
 	}
 }
 
+// the least recently added pair is dropped when all caches are used
+static struct psf_glyph_cache *psf_get_glyph_cache(uint32_t fg, uint32_t bg)
+{
+	for (uint32_t i = 0; i < PSF_CACHE_COLORS; ++i)
+	{
+		struct psf_glyph_cache *cache = &glyph_caches[i];
+		if (cache->tiles && cache->fg == fg && cache->bg == bg)
+			return cache;
+	}
+
+	struct psf_glyph_cache *cache = &glyph_caches[next_glyph_cache];
+	next_glyph_cache = (next_glyph_cache + 1) % PSF_CACHE_COLORS;
+
+	psf_free_glyph_cache(cache);
+	cache->fg = fg;
+	cache->bg = bg;
+	cache->tiles = calloc(get_current_font()->numglyph, sizeof(uint32_t *));
+	return cache;
+}
+
+static uint32_t *psf_get_tile(struct psf_glyph_cache *cache, uint32_t c)
+{
+	struct psf_t *font = (struct psf_t *)psf_start;
+	/* unicode translation */
+	if (unicode != NULL && c < USHRT_MAX)
+		c = unicode[c];
+	/* If there's no glyph for a given character, we'll display the first glyph. */
+	uint32_t glyph = c < font->numglyph ? c : 0;
+	if (cache->tiles[glyph])
+		return cache->tiles[glyph];
+
+	uint32_t *tile = calloc(font->width * font->height, sizeof(uint32_t));
+	uint32_t bytesperline = div_ceil(font->width, 8);
+	unsigned char *bitmap = (unsigned char *)psf_start + font->headersize + glyph * font->bytesperglyph;
+	for (uint32_t y = 0; y < font->height; y++)
+	{
+		for (uint32_t x = 0; x < font->width; x++)
+			tile[y * font->width + x] = bitmap[x / 8] & (0x80 >> (x % 8)) ? cache->fg : cache->bg;
+		bitmap += bytesperline;
+	}
+	cache->tiles[glyph] = tile;
+	return tile;
+}
+
+// cx, cy are in pixels
 void psf_putchar(
 	/* note that this is int, not char as it's a unicode character */
 	uint32_t c,
-	/* cursor position on screen, in characters not in pixels */
 	uint32_t cx, uint32_t cy,
 	/* foreground and background colors, say 0xFFFFFF and 0x000000 */
 	uint32_t fg, uint32_t bg, char *fb, uint32_t scanline)
 {
-	/* cast the address to PSF header struct */
 	struct psf_t *font = (struct psf_t *)psf_start;
-	/* we need to know how many bytes encode one row */
-	int bytesperline = div_ceil(font->width, 8);
-	/* unicode translation */
-	if (unicode != NULL)
+	uint32_t *tile = psf_get_tile(psf_get_glyph_cache(fg, bg), c);
+	char *line = fb + cy * scanline + cx * 4;
+	for (uint32_t y = 0; y < font->height; y++)
 	{
-		c = unicode[c];
+		memcpy(line, tile + y * font->width, font->width * 4);
+		line += scanline;
 	}
-	/* get the glyph for the character. If there's no
-       glyph for a given character, we'll display the first glyph. */
-	unsigned char *glyph =
-		(unsigned char *)psf_start +
-		font->headersize +
-		(c > 0 && c < font->numglyph ? c : 0) * font->bytesperglyph;
-	/* calculate the upper left corner on screen where we want to display.
-       we only do this once, and adjust the offset later. This is faster. */
-	int offs = cy * scanline + cx * 4;
-	/* finally display pixels according to the bitmap */
-	uint32_t x, y, line, mask;
-	for (y = 0; y < font->height; y++)
+}
+
+// tiles of a chunk of characters are looked up first, then each screen row is written left to right
+void psf_nputs(
+	const char *s, size_t n,
+	uint32_t cx, uint32_t cy,
+	uint32_t fg, uint32_t bg, char *fb, uint32_t scanline)
+{
+	struct psf_t *font = (struct psf_t *)psf_start;
+	struct psf_glyph_cache *cache = psf_get_glyph_cache(fg, bg);
+	uint32_t *tiles[PSF_PUTS_CHUNK];
+	uint32_t row_size = font->width * 4;
+
+	for (size_t start = 0; start < n; start += PSF_PUTS_CHUNK)
 	{
-		/* save the starting position of the line */
-		line = offs;
-		mask = 1 << (font->width - 1);
-		/* display a row */
-		for (x = 0; x < font->width; x++)
+		size_t count = min_t(size_t, n - start, PSF_PUTS_CHUNK);
+		for (size_t i = 0; i < count; i++)
+			tiles[i] = psf_get_tile(cache, (uint8_t)s[start + i]);
+
+		char *line = fb + cy * scanline + (cx + start * font->width) * 4;
+		for (uint32_t y = 0; y < font->height; y++)
 		{
-			*((uint32_t *)(fb + line)) = ((int)*glyph) & (mask) ? fg : bg;
-			/* adjust to the next pixel */
-			mask >>= 1;
-			line += 4;
+			char *span = line;
+			for (size_t i = 0; i < count; i++)
+			{
+				memcpy(span, tiles[i] + y * font->width, row_size);
+				span += row_size;
+			}
+			line += scanline;
 		}
-		/* adjust to the next line */
-		glyph += bytesperline;
-		offs += scanline;
 	}
 }
 
@@ -126,7 +202,5 @@ void psf_puts(
 	uint32_t cx, uint32_t cy,
 	uint32_t fg, uint32_t bg, char *fb, uint32_t scanline)
 {
-	struct psf_t *font = (struct psf_t *)psf_start;
-	for (uint32_t i = 0, length = strlen(s); i < length; i++)
-		psf_putchar(s[i], cx + i * font->width, cy, fg, bg, fb, scanline);
+	psf_nputs(s, strlen(s), cx, cy, fg, bg, fb, scanline);
 }
@@ -6,6 +6,9 @@
 
 #define PSF_FONT_MAGIC 0x864ab572
 #define PSF_HAS_UNICODE_TABLE 0x01
+// rasterized glyphs are kept for this many (fg, bg) pairs
+#define PSF_CACHE_COLORS 4
+#define PSF_PUTS_CHUNK 64
 
 struct psf_t
 {
@@ -25,6 +28,10 @@ void psf_putchar(
 	uint32_t c,
 	uint32_t cx, uint32_t cy,
 	uint32_t fg, uint32_t bg, char *fb, uint32_t scanline);
+void psf_nputs(
+	const char *s, size_t n,
+	uint32_t cx, uint32_t cy,
+	uint32_t fg, uint32_t bg, char *fb, uint32_t scanline);
 void psf_puts(
 	const char *s,
 	uint32_t cx, uint32_t cy,